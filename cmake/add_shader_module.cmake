@@ -14,7 +14,7 @@ function(add_shader_modules TARGET)
         file(GLOB_RECURSE common_glsl ${current_dir}/common/*.glsl)
         add_custom_command(
             OUTPUT ${spv_output_file}
-            COMMAND ${GLSLC} -g -O0 -o ${spv_output_file} ${input_file}
+            COMMAND ${GLSLC} -g -O0 --target-env=vulkan1.1 -o ${spv_output_file} ${input_file}
             MAIN_DEPENDENCY ${input_file}
             IMPLICIT_DEPENDS C ${input_file}
             # FIXME: this is bad but for our purposes is good enough, this 
@@ -0,0 +1,342 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BINNING_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BINNING_SSE2
+#endif
+
+#include "maths.h"
+#include "types.h"
+
+#include "bvh_binning.h"
+
+TriangleInfos triangle_infos_new(usize count) {
+  TriangleInfos self = {
+      .index = malloc(sizeof(u32) * count),
+  };
+  for (u32 k = 0; k < 3; ++k) {
+    self.min[k] = malloc(sizeof(f32) * count);
+    self.max[k] = malloc(sizeof(f32) * count);
+    self.centroid[k] = malloc(sizeof(f32) * count);
+  }
+
+  return self;
+}
+
+void triangle_infos_destroy(TriangleInfos *self) {
+  for (u32 k = 0; k < 3; ++k) {
+    free(self->min[k]);
+    free(self->max[k]);
+    free(self->centroid[k]);
+  }
+  free(self->index);
+}
+
+static inline void triangle_infos_swap(TriangleInfos *self, u32 a, u32 b) {
+#define SWAP(arr)                                                              \
+  do {                                                                         \
+    __typeof__(arr[0]) tmp = arr[a];                                           \
+    arr[a] = arr[b];                                                           \
+    arr[b] = tmp;                                                              \
+  } while (false)
+
+  for (u32 k = 0; k < 3; ++k) {
+    SWAP(self->min[k]);
+    SWAP(self->max[k]);
+    SWAP(self->centroid[k]);
+  }
+  SWAP(self->index);
+
+#undef SWAP
+}
+
+f32 range_min(const f32 *values, u32 start, u32 end) {
+  f32 ret = INFINITY;
+  u32 i = start;
+#if defined(BINNING_AVX2)
+  __m256 acc = _mm256_set1_ps(INFINITY);
+  for (; i + 8 <= end; i += 8) {
+    acc = _mm256_min_ps(acc, _mm256_loadu_ps(values + i));
+  }
+  f32 lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for (u32 j = 0; j < 8; ++j) {
+    ret = min(ret, lanes[j]);
+  }
+#elif defined(BINNING_SSE2)
+  __m128 acc = _mm_set1_ps(INFINITY);
+  for (; i + 4 <= end; i += 4) {
+    acc = _mm_min_ps(acc, _mm_loadu_ps(values + i));
+  }
+  f32 lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  for (u32 j = 0; j < 4; ++j) {
+    ret = min(ret, lanes[j]);
+  }
+#endif
+  for (; i < end; ++i) {
+    ret = min(ret, values[i]);
+  }
+
+  return ret;
+}
+
+f32 range_max(const f32 *values, u32 start, u32 end) {
+  f32 ret = -INFINITY;
+  u32 i = start;
+#if defined(BINNING_AVX2)
+  __m256 acc = _mm256_set1_ps(-INFINITY);
+  for (; i + 8 <= end; i += 8) {
+    acc = _mm256_max_ps(acc, _mm256_loadu_ps(values + i));
+  }
+  f32 lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for (u32 j = 0; j < 8; ++j) {
+    ret = max(ret, lanes[j]);
+  }
+#elif defined(BINNING_SSE2)
+  __m128 acc = _mm_set1_ps(-INFINITY);
+  for (; i + 4 <= end; i += 4) {
+    acc = _mm_max_ps(acc, _mm_loadu_ps(values + i));
+  }
+  f32 lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  for (u32 j = 0; j < 4; ++j) {
+    ret = max(ret, lanes[j]);
+  }
+#endif
+  for (; i < end; ++i) {
+    ret = max(ret, values[i]);
+  }
+
+  return ret;
+}
+
+RangeBounds triangle_infos_range_bounds(const TriangleInfos *self, u32 start,
+                                        u32 end) {
+  RangeBounds ret;
+  for (u32 k = 0; k < 3; ++k) {
+    ret.bounds.min.v[k] = range_min(self->min[k], start, end);
+    ret.bounds.max.v[k] = range_max(self->max[k], start, end);
+    ret.centroid_bounds.min.v[k] = range_min(self->centroid[k], start, end);
+    ret.centroid_bounds.max.v[k] = range_max(self->centroid[k], start, end);
+  }
+
+  return ret;
+}
+
+static inline void bin_one(const TriangleInfos *self, u32 i, u32 dim,
+                           f32 centroid_min, f32 scale, Bins *bins) {
+  u32 b = bucket_index(self->centroid[dim][i], centroid_min, scale);
+  bins->bounds[b] =
+      aabb_union(bins->bounds[b], triangle_infos_get_bounds(self, i));
+  ++bins->count[b];
+}
+
+#if defined(BINNING_AVX2) || defined(BINNING_SSE2)
+
+#if defined(BINNING_AVX2)
+#define LANES 8
+typedef __m256 vf;
+typedef __m256i vi;
+#define vf_set1 _mm256_set1_ps
+#define vf_load _mm256_loadu_ps
+#define vf_store _mm256_storeu_ps
+#define vf_min _mm256_min_ps
+#define vf_max _mm256_max_ps
+#define vf_sub _mm256_sub_ps
+#define vf_mul _mm256_mul_ps
+#define vf_to_vi _mm256_cvttps_epi32
+#define vi_store(p, v) _mm256_storeu_si256((vi *)(p), v)
+#define vi_set1 _mm256_set1_epi32
+#define vi_eq(a, b) _mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))
+#define vf_select(mask, a, b) _mm256_blendv_ps(b, a, mask)
+#define vf_movemask _mm256_movemask_ps
+#else
+#define LANES 4
+typedef __m128 vf;
+typedef __m128i vi;
+#define vf_set1 _mm_set1_ps
+#define vf_load _mm_loadu_ps
+#define vf_store _mm_storeu_ps
+#define vf_min _mm_min_ps
+#define vf_max _mm_max_ps
+#define vf_sub _mm_sub_ps
+#define vf_mul _mm_mul_ps
+#define vf_to_vi _mm_cvttps_epi32
+#define vi_store(p, v) _mm_storeu_si128((vi *)(p), v)
+#define vi_set1 _mm_set1_epi32
+#define vi_eq(a, b) _mm_castsi128_ps(_mm_cmpeq_epi32(a, b))
+// no blendv before sse4.1
+#define vf_select(mask, a, b)                                                  \
+  _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+#define vf_movemask _mm_movemask_ps
+#endif
+
+/// Each batch of `LANES` triangles is binned one distinct bucket at a time,
+/// lanes belonging to the bucket are merged into a per bucket accumulator with
+/// masked min/max. Neighbouring triangles in an obj are usually close to each
+/// other so a batch typically only touches one or two buckets.
+void triangle_infos_bin(const TriangleInfos *self, u32 start, u32 end, u32 dim,
+                        f32 centroid_min, f32 scale, Bins *bins) {
+  for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+    bins->bounds[b] = aabb_empty();
+    bins->count[b] = 0;
+  }
+
+  const vf inf = vf_set1(INFINITY);
+  const vf neg_inf = vf_set1(-INFINITY);
+  const vf v_centroid_min = vf_set1(centroid_min);
+  const vf v_scale = vf_set1(scale);
+  const vf v_last_bucket = vf_set1((f32)(BUCKET_COUNT - 1));
+
+  vf acc_min[3][BUCKET_COUNT];
+  vf acc_max[3][BUCKET_COUNT];
+  for (u32 k = 0; k < 3; ++k) {
+    for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+      acc_min[k][b] = inf;
+      acc_max[k][b] = neg_inf;
+    }
+  }
+
+  u32 i = start;
+  for (; i + LANES <= end; i += LANES) {
+    vf c = vf_load(self->centroid[dim] + i);
+    vi buckets = vf_to_vi(
+        vf_min(vf_mul(vf_sub(c, v_centroid_min), v_scale), v_last_bucket));
+    u32 lane_buckets[LANES];
+    vi_store(lane_buckets, buckets);
+
+    vf lo[3];
+    vf hi[3];
+    for (u32 k = 0; k < 3; ++k) {
+      lo[k] = vf_load(self->min[k] + i);
+      hi[k] = vf_load(self->max[k] + i);
+    }
+
+    u32 remaining = (1u << LANES) - 1;
+    while (remaining) {
+      u32 b = lane_buckets[__builtin_ctz(remaining)];
+      vf mask = vi_eq(buckets, vi_set1(b));
+      u32 lanes = vf_movemask(mask);
+
+      for (u32 k = 0; k < 3; ++k) {
+        acc_min[k][b] = vf_min(acc_min[k][b], vf_select(mask, lo[k], inf));
+        acc_max[k][b] = vf_max(acc_max[k][b], vf_select(mask, hi[k], neg_inf));
+      }
+      bins->count[b] += __builtin_popcount(lanes);
+      remaining &= ~lanes;
+    }
+  }
+
+  for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+    if (bins->count[b] == 0) {
+      continue;
+    }
+    for (u32 k = 0; k < 3; ++k) {
+      f32 lo[LANES];
+      f32 hi[LANES];
+      vf_store(lo, acc_min[k][b]);
+      vf_store(hi, acc_max[k][b]);
+      for (u32 j = 0; j < LANES; ++j) {
+        bins->bounds[b].min.v[k] = min(bins->bounds[b].min.v[k], lo[j]);
+        bins->bounds[b].max.v[k] = max(bins->bounds[b].max.v[k], hi[j]);
+      }
+    }
+  }
+
+  for (; i < end; ++i) {
+    bin_one(self, i, dim, centroid_min, scale, bins);
+  }
+}
+
+#else
+
+void triangle_infos_bin(const TriangleInfos *self, u32 start, u32 end, u32 dim,
+                        f32 centroid_min, f32 scale, Bins *bins) {
+  for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+    bins->bounds[b] = aabb_empty();
+    bins->count[b] = 0;
+  }
+
+  for (u32 i = start; i < end; ++i) {
+    bin_one(self, i, dim, centroid_min, scale, bins);
+  }
+}
+
+#endif
+
+u32 bins_find_best_split(const Bins *bins, Aabb bounds, f32 *cost) {
+  // cost of everything up to and including bucket `i` being on the left
+  f32 left_cost[BUCKET_COUNT - 1];
+  Aabb acc = aabb_empty();
+  u32 count = 0;
+  for (u32 i = 0; i < BUCKET_COUNT - 1; ++i) {
+    acc = aabb_union(acc, bins->bounds[i]);
+    count += bins->count[i];
+    left_cost[i] = count ? (f32)count * aabb_surface_area(acc) : 0.0f;
+  }
+
+  f32 inv_area = 1.0f / aabb_surface_area(bounds);
+  f32 min_cost = INFINITY;
+  u32 min_idx = 0;
+  acc = aabb_empty();
+  count = 0;
+  for (u32 i = BUCKET_COUNT - 1; i > 0; --i) {
+    acc = aabb_union(acc, bins->bounds[i]);
+    count += bins->count[i];
+    f32 right_cost = count ? (f32)count * aabb_surface_area(acc) : 0.0f;
+
+    f32 split_cost = 1.0f + (left_cost[i - 1] + right_cost) * inv_area;
+    if (split_cost <= min_cost) {
+      min_cost = split_cost;
+      min_idx = i - 1;
+    }
+  }
+
+  *cost = min_cost;
+  return min_idx;
+}
+
+u32 triangle_infos_partition(TriangleInfos *self, u32 start, u32 end,
+                             void *context,
+                             bool (*predicate)(void *, const TriangleInfos *,
+                                               u32)) {
+  u32 first = start;
+  u32 last = end;
+  while (true) {
+    while (first < last && predicate(context, self, first)) {
+      ++first;
+    }
+    while (first < last && !predicate(context, self, last - 1)) {
+      --last;
+    }
+    if (first >= last) {
+      break;
+    }
+    triangle_infos_swap(self, first, last - 1);
+    ++first;
+    --last;
+  }
+
+  return first;
+}
+
+bool partition_by_centroid_fn(void *ctx, const TriangleInfos *infos, u32 i) {
+  PartitionByCentroidContext *info = ctx;
+
+  return infos->centroid[info->dim][i] < info->mid;
+}
+
+bool partition_by_bucket_fn(void *ctx, const TriangleInfos *infos, u32 i) {
+  PartitionByBucketContext *info = ctx;
+  u32 b = bucket_index(infos->centroid[info->dim][i], info->centroid_min,
+                       info->scale);
+  assert(b < BUCKET_COUNT);
+  return b <= info->min_idx;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "maths.h"
+#include "types.h"
+
+static const u32 BUCKET_COUNT = 12;
+
+/// Per triangle data used while building the bvh, stored as a structure of
+/// arrays so the binning kernels can load a full simd register of a single
+/// component at a time. Entry `i` of every array describes the same triangle.
+typedef struct {
+  f32 *min[3];
+  f32 *max[3];
+  f32 *centroid[3];
+  /// index of the triangle in the index buffer
+  u32 *index;
+} TriangleInfos;
+
+TriangleInfos triangle_infos_new(usize count);
+void triangle_infos_destroy(TriangleInfos *self);
+
+static inline void triangle_infos_set(TriangleInfos *self, u32 i, Aabb bounds,
+                                      u32 index) {
+  vec3 centroid = aabb_centroid(bounds);
+  for (u32 k = 0; k < 3; ++k) {
+    self->min[k][i] = bounds.min.v[k];
+    self->max[k][i] = bounds.max.v[k];
+    self->centroid[k][i] = centroid.v[k];
+  }
+  self->index[i] = index;
+}
+
+static inline Aabb triangle_infos_get_bounds(const TriangleInfos *self,
+                                             u32 i) {
+  return (Aabb){
+      .min = vec3New(self->min[0][i], self->min[1][i], self->min[2][i]),
+      .max = vec3New(self->max[0][i], self->max[1][i], self->max[2][i]),
+  };
+}
+
+typedef struct {
+  Aabb bounds;
+  Aabb centroid_bounds;
+} RangeBounds;
+
+/// Bounds of the triangles and of their centroids over `[start, end)`.
+RangeBounds triangle_infos_range_bounds(const TriangleInfos *self, u32 start,
+                                        u32 end);
+
+/// Maps a centroid coordinate to a bucket, `scale` is
+/// `BUCKET_COUNT / centroid extent`. Every binning path computes the bucket
+/// exactly like this so partitioning agrees with the binned costs.
+static inline u32 bucket_index(f32 centroid, f32 centroid_min, f32 scale) {
+  return (u32)min((centroid - centroid_min) * scale, (f32)(BUCKET_COUNT - 1));
+}
+
+typedef struct {
+  Aabb bounds[BUCKET_COUNT];
+  u32 count[BUCKET_COUNT];
+} Bins;
+
+/// Bins the triangles in `[start, end)` along `dim`. Uses avx2 or sse2 when the
+/// compiler targets them and falls back to scalar code otherwise.
+void triangle_infos_bin(const TriangleInfos *self, u32 start, u32 end, u32 dim,
+                        f32 centroid_min, f32 scale, Bins *bins);
+
+/// Evaluates the sah cost of splitting after each of the first
+/// `BUCKET_COUNT - 1` buckets with a prefix and a suffix sweep. Returns the
+/// index of the cheapest split and writes its cost to `cost`.
+u32 bins_find_best_split(const Bins *bins, Aabb bounds, f32 *cost);
+
+/// Moves every triangle for which `predicate` is true to the front of
+/// `[start, end)`, returns the index of the first triangle for which it is
+/// false.
+u32 triangle_infos_partition(TriangleInfos *self, u32 start, u32 end,
+                             void *context,
+                             bool (*predicate)(void *, const TriangleInfos *,
+                                               u32));
+
+typedef struct {
+  u32 dim;
+  f32 mid;
+} PartitionByCentroidContext;
+
+/// Partition predicate for triangles with a centroid below `mid` along `dim`.
+bool partition_by_centroid_fn(void *ctx, const TriangleInfos *infos, u32 i);
+
+typedef struct {
+  u32 dim;
+  u32 min_idx;
+  f32 centroid_min;
+  f32 scale;
+} PartitionByBucketContext;
+
+/// Partition predicate for triangles binned at or before bucket `min_idx`.
+bool partition_by_bucket_fn(void *ctx, const TriangleInfos *infos, u32 i);
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN64
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "types.h"
+
+#include "bvh_cache.h"
+
+/// Bump whenever the layout of the file or of any of the cached structs
+/// changes.
+static const u32 BVH_CACHE_VERSION = 4;
+static const u32 BVH_CACHE_MAGIC = 0x4856424d; // "MBVH"
+
+/// Sections start at multiples of this so the wide nodes stay cache line
+/// aligned in the mapping.
+static const u64 SECTION_ALIGNMENT = 64;
+
+typedef struct {
+  u32 magic;
+  u32 version;
+  u64 key;
+  u32 vertex_count;
+  u32 index_count;
+  u32 bvh_node_count;
+  u32 wide_bvh_node_count;
+  u64 vertices_offset;
+  u64 indices_offset;
+  u64 bvh_nodes_offset;
+  u64 wide_bvh_nodes_offset;
+  u64 triangles_offset;
+  u64 file_size;
+} BvhCacheHeader;
+
+static const u64 HASH_PRIME_1 = 0x9e3779b185ebca87;
+static const u64 HASH_PRIME_2 = 0xc2b2ae3d27d4eb4f;
+
+static inline u64 hash_round(u64 hash, u64 word) {
+  hash += word * HASH_PRIME_2;
+  hash = (hash << 31) | (hash >> 33);
+  return hash * HASH_PRIME_1;
+}
+
+/// xxhash style single lane hash, a word at a time.
+static u64 hash_bytes(u64 hash, const void *data, usize size) {
+  const u8 *bytes = data;
+  usize i = 0;
+  for (; i + 8 <= size; i += 8) {
+    u64 word;
+    memcpy(&word, bytes + i, 8);
+    hash = hash_round(hash, word);
+  }
+  u64 tail = 0;
+  memcpy(&tail, bytes + i, size - i);
+  hash = hash_round(hash, tail ^ size);
+
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME_2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+u64 bvh_cache_key(const Vertex *vertices, u32 vertex_count, const u32 *indices,
+                  u32 index_count, BvhBuildSettings settings) {
+  // `thread_count` and `cache_directory` don't change the result, optimized
+  // trees aren't cached since the optimizer depends on both
+  struct {
+    u32 version;
+    u32 builder;
+    u32 max_leaf_triangles;
+    f32 spatial_split_budget;
+    u32 wide;
+  } key_settings = {
+      .version = BVH_CACHE_VERSION,
+      .builder = settings.builder,
+      .max_leaf_triangles = settings.max_leaf_triangles,
+      .spatial_split_budget = settings.spatial_split_budget,
+      .wide = settings.wide,
+  };
+
+  u64 hash = hash_bytes(0, &key_settings, sizeof(key_settings));
+  hash = hash_bytes(hash, vertices, sizeof(Vertex) * vertex_count);
+  hash = hash_bytes(hash, indices, sizeof(u32) * index_count);
+
+  return hash;
+}
+
+static void cache_path(char *path, usize size, const char *directory,
+                       u64 key) {
+  snprintf(path, size, "%s/%016llx.bvh", directory, (unsigned long long)key);
+}
+
+static void *map_file(const char *path, usize *size) {
+#ifdef _WIN64
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return NULL;
+  }
+
+  LARGE_INTEGER file_size;
+  GetFileSizeEx(file, &file_size);
+  HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (!mapping) {
+    return NULL;
+  }
+
+  void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  *size = (usize)file_size.QuadPart;
+
+  return data;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  *size = sb.st_size;
+
+  return data;
+#endif
+}
+
+static void unmap_file(void *data, usize size) {
+#ifdef _WIN64
+  UnmapViewOfFile(data);
+#else
+  munmap(data, size);
+#endif
+}
+
+/// Whether `count` elements of `stride` bytes at `offset` lie inside a mapping
+/// of `size` bytes, starting on a section boundary.
+static bool section_valid(u64 offset, u64 count, u64 stride, usize size) {
+  return offset % SECTION_ALIGNMENT == 0 && offset <= size &&
+         count * stride <= size - offset;
+}
+
+bool bvh_cache_load(const char *directory, u64 key, TriangleMesh *mesh) {
+  char path[1024];
+  cache_path(path, sizeof(path), directory, key);
+
+  usize size;
+  u8 *data = map_file(path, &size);
+  if (!data) {
+    return false;
+  }
+
+  BvhCacheHeader header;
+  if (size < sizeof(header)) {
+    goto invalid;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != BVH_CACHE_MAGIC || header.version != BVH_CACHE_VERSION ||
+      header.key != key || header.file_size != size) {
+    goto invalid;
+  }
+  // a corrupt file of the right size must not send pointers past the mapping
+  if (header.index_count % 3 != 0 ||
+      !section_valid(header.vertices_offset, header.vertex_count,
+                     sizeof(Vertex), size) ||
+      !section_valid(header.indices_offset, header.index_count, sizeof(u32),
+                     size) ||
+      !section_valid(header.bvh_nodes_offset, header.bvh_node_count,
+                     sizeof(BvhNode), size) ||
+      !section_valid(header.wide_bvh_nodes_offset, header.wide_bvh_node_count,
+                     sizeof(WideBvhNode), size) ||
+      !section_valid(header.triangles_offset, header.index_count / 3,
+                     sizeof(LeafTriangle), size)) {
+    goto invalid;
+  }
+
+  *mesh = (TriangleMesh){
+      .vertex_count = header.vertex_count,
+      .vertices = (Vertex *)(data + header.vertices_offset),
+      .index_count = header.index_count,
+      .indices = (u32 *)(data + header.indices_offset),
+      .triangles = (LeafTriangle *)(data + header.triangles_offset),
+      .bvh_node_count = header.bvh_node_count,
+      .bvh_nodes = (BvhNode *)(data + header.bvh_nodes_offset),
+      .wide_bvh_node_count = header.wide_bvh_node_count,
+      .wide_bvh_nodes =
+          header.wide_bvh_node_count
+              ? (WideBvhNode *)(data + header.wide_bvh_nodes_offset)
+              : NULL,
+      .mapping = data,
+      .mapping_size = size,
+  };
+
+  return true;
+
+invalid:
+  warnln("ignoring invalid bvh cache file %s", path);
+  unmap_file(data, size);
+  return false;
+}
+
+static u64 align_offset(u64 offset) {
+  return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT *
+         SECTION_ALIGNMENT;
+}
+
+static void write_section(FILE *file, u64 offset, const void *data,
+                          usize size) {
+  static const u8 zeros[SECTION_ALIGNMENT] = {0};
+  u64 padding = offset - (u64)ftell(file);
+  fwrite(zeros, 1, padding, file);
+  fwrite(data, 1, size, file);
+}
+
+/// Creates `directory` unless it already exists.
+static bool create_directory(const char *directory) {
+#ifdef _WIN64
+  return CreateDirectoryA(directory, NULL) ||
+         GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+  return mkdir(directory, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+void bvh_cache_store(const char *directory, u64 key, const TriangleMesh *mesh) {
+  if (!create_directory(directory)) {
+    warnln("could not create bvh cache directory %s", directory);
+    return;
+  }
+
+  BvhCacheHeader header = {
+      .magic = BVH_CACHE_MAGIC,
+      .version = BVH_CACHE_VERSION,
+      .key = key,
+      .vertex_count = mesh->vertex_count,
+      .index_count = mesh->index_count,
+      .bvh_node_count = mesh->bvh_node_count,
+      .wide_bvh_node_count = mesh->wide_bvh_node_count,
+  };
+  header.vertices_offset = align_offset(sizeof(header));
+  header.indices_offset = align_offset(header.vertices_offset +
+                                       sizeof(Vertex) * mesh->vertex_count);
+  header.bvh_nodes_offset =
+      align_offset(header.indices_offset + sizeof(u32) * mesh->index_count);
+  header.wide_bvh_nodes_offset = align_offset(
+      header.bvh_nodes_offset + sizeof(BvhNode) * mesh->bvh_node_count);
+  header.triangles_offset =
+      align_offset(header.wide_bvh_nodes_offset +
+                   sizeof(WideBvhNode) * mesh->wide_bvh_node_count);
+  header.file_size = header.triangles_offset +
+                     sizeof(LeafTriangle) * (mesh->index_count / 3);
+
+  // written under a temporary name so a half written file is never loaded
+  char path[1024];
+  char tmp_path[1040];
+  cache_path(path, sizeof(path), directory, key);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (!file) {
+    warnln("could not write bvh cache file %s", tmp_path);
+    return;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  write_section(file, header.vertices_offset, mesh->vertices,
+                sizeof(Vertex) * mesh->vertex_count);
+  write_section(file, header.indices_offset, mesh->indices,
+                sizeof(u32) * mesh->index_count);
+  write_section(file, header.bvh_nodes_offset, mesh->bvh_nodes,
+                sizeof(BvhNode) * mesh->bvh_node_count);
+  write_section(file, header.wide_bvh_nodes_offset, mesh->wide_bvh_nodes,
+                sizeof(WideBvhNode) * mesh->wide_bvh_node_count);
+  write_section(file, header.triangles_offset, mesh->triangles,
+                sizeof(LeafTriangle) * (mesh->index_count / 3));
+
+  bool ok = ftell(file) == (long)header.file_size;
+  ok &= fclose(file) == 0;
+  if (!ok || rename(tmp_path, path) != 0) {
+    warnln("could not write bvh cache file %s", path);
+    remove(tmp_path);
+    return;
+  }
+
+  infoln("wrote bvh cache file %s", path);
+}
+
+void bvh_cache_unmap(TriangleMesh *mesh) {
+  unmap_file(mesh->mapping, mesh->mapping_size);
+  mesh->mapping = NULL;
+}
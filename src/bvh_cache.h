@@ -0,0 +1,19 @@
+#pragma once
+
+#include "trimesh.h"
+#include "types.h"
+
+/// Hash of the mesh data and of every build setting that changes the built
+/// bvh, identifies the cache file.
+u64 bvh_cache_key(const Vertex *vertices, u32 vertex_count, const u32 *indices,
+                  u32 index_count, BvhBuildSettings settings);
+
+/// Memory maps the cache file for `key` from `directory` if there is a valid
+/// one. The arrays of `mesh` then point straight into the mapping (and are
+/// uploaded from there), `trimesh_destroy` unmaps it.
+bool bvh_cache_load(const char *directory, u64 key, TriangleMesh *mesh);
+
+/// Writes the built `mesh` to the cache file for `key` in `directory`.
+void bvh_cache_store(const char *directory, u64 key, const TriangleMesh *mesh);
+
+void bvh_cache_unmap(TriangleMesh *mesh);
@@ -0,0 +1,360 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_timer.h"
+#include "log.h"
+#include "maths.h"
+#include "threadpool.h"
+#include "types.h"
+
+#include "bvh_optimize.h"
+
+static const u32 TREELET_LEAVES = 7;
+/// 2^TREELET_LEAVES
+static const u32 TREELET_SUBSETS = 128;
+
+/// Passes stop once they improve the sah cost by less than this fraction.
+static const f32 MIN_PASS_IMPROVEMENT = 1e-3f;
+
+typedef struct {
+  BvhNode *nodes;
+  /// `area * traversal cost + cost of the children` of every node, in the
+  /// same units as the build heuristic
+  f32 *costs;
+  u64 deadline;
+} OptimizeContext;
+
+static f32 node_area(BvhNode node) {
+  return aabb_surface_area(aabb_new(node.min, node.max));
+}
+
+static f32 leaf_cost(BvhNode node) {
+  return node_area(node) * (f32)bvh_node_triangle_count(node);
+}
+
+static f32 compute_costs(const BvhNode *nodes, f32 *costs, u32 node_idx) {
+  BvhNode node = nodes[node_idx];
+  if (bvh_node_is_leaf(node)) {
+    costs[node_idx] = leaf_cost(node);
+  } else {
+    costs[node_idx] = node_area(node) + compute_costs(nodes, costs, node.l) +
+                      compute_costs(nodes, costs, node.r);
+  }
+
+  return costs[node_idx];
+}
+
+f32 bvh_sah_cost(const BvhNode *nodes, u32 node_count, u32 root) {
+  // the inverted bounds of an empty bvh have no meaningful area
+  if (bvh_node_is_leaf(nodes[root]) &&
+      bvh_node_triangle_count(nodes[root]) == 0) {
+    return 0.0f;
+  }
+
+  f32 *costs = malloc(sizeof(f32) * node_count);
+  f32 cost = compute_costs(nodes, costs, root) / node_area(nodes[root]);
+  free(costs);
+
+  return cost;
+}
+
+typedef struct {
+  u32 leaves[TREELET_LEAVES];
+  u32 leaf_count;
+  /// the root is always the first internal node
+  u32 internal[TREELET_LEAVES - 1];
+  u32 internal_count;
+
+  Aabb subset_bounds[TREELET_SUBSETS];
+  f32 subset_cost[TREELET_SUBSETS];
+  u8 subset_split[TREELET_SUBSETS];
+} Treelet;
+
+/// Grows a treelet under `root` by repeatedly opening its biggest internal
+/// leaf, bigger nodes are where a better topology saves the most.
+static void form_treelet(const OptimizeContext *ctx, u32 root,
+                         Treelet *treelet) {
+  BvhNode node = ctx->nodes[root];
+  treelet->leaves[0] = node.l;
+  treelet->leaves[1] = node.r;
+  treelet->leaf_count = 2;
+  treelet->internal[0] = root;
+  treelet->internal_count = 1;
+
+  while (treelet->leaf_count < TREELET_LEAVES) {
+    u32 best = TREELET_LEAVES;
+    f32 best_area = -INFINITY;
+    for (u32 i = 0; i < treelet->leaf_count; ++i) {
+      BvhNode leaf = ctx->nodes[treelet->leaves[i]];
+      if (!bvh_node_is_leaf(leaf) && node_area(leaf) > best_area) {
+        best = i;
+        best_area = node_area(leaf);
+      }
+    }
+    if (best == TREELET_LEAVES) {
+      break;
+    }
+
+    BvhNode opened = ctx->nodes[treelet->leaves[best]];
+    treelet->internal[treelet->internal_count++] = treelet->leaves[best];
+    treelet->leaves[best] = opened.l;
+    treelet->leaves[treelet->leaf_count++] = opened.r;
+  }
+}
+
+/// Finds the cheapest topology over every subset of the treelet leaves,
+/// smallest subsets first.
+static void optimize_treelet(const OptimizeContext *ctx, Treelet *treelet) {
+  u32 full = (1u << treelet->leaf_count) - 1;
+  for (u32 s = 1; s <= full; ++s) {
+    Aabb bounds = aabb_empty();
+    for (u32 i = 0; i < treelet->leaf_count; ++i) {
+      if (s & (1u << i)) {
+        BvhNode leaf = ctx->nodes[treelet->leaves[i]];
+        bounds = aabb_union(bounds, aabb_new(leaf.min, leaf.max));
+      }
+    }
+    treelet->subset_bounds[s] = bounds;
+  }
+
+  for (u32 s = 1; s <= full; ++s) {
+    if ((s & (s - 1)) == 0) {
+      treelet->subset_cost[s] = ctx->costs[treelet->leaves[__builtin_ctz(s)]];
+      continue;
+    }
+
+    // every partition is visited twice with the sides swapped, only look at
+    // the ones where the lowest leaf is on the left
+    u32 lowest = s & -s;
+    f32 best_cost = INFINITY;
+    u32 best_split = 0;
+    for (u32 p = (s - 1) & s; p; p = (p - 1) & s) {
+      if (!(p & lowest)) {
+        continue;
+      }
+      f32 cost = treelet->subset_cost[p] + treelet->subset_cost[s ^ p];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_split = p;
+      }
+    }
+
+    treelet->subset_cost[s] =
+        aabb_surface_area(treelet->subset_bounds[s]) + best_cost;
+    treelet->subset_split[s] = best_split;
+  }
+}
+
+/// Rewires the treelet's internal nodes to the topology found for subset `s`,
+/// returns the node standing for `s`.
+static u32 rebuild_treelet(OptimizeContext *ctx, const Treelet *treelet, u32 s,
+                           u32 *next_internal) {
+  if ((s & (s - 1)) == 0) {
+    return treelet->leaves[__builtin_ctz(s)];
+  }
+
+  u32 node_idx = treelet->internal[(*next_internal)++];
+  u32 p = treelet->subset_split[s];
+  u32 l = rebuild_treelet(ctx, treelet, p, next_internal);
+  u32 r = rebuild_treelet(ctx, treelet, s ^ p, next_internal);
+
+  Aabb bounds = treelet->subset_bounds[s];
+  ctx->nodes[node_idx] = (BvhNode){
+      .min = bounds.min,
+      .l = l,
+      .max = bounds.max,
+      .r = r,
+  };
+  ctx->costs[node_idx] = treelet->subset_cost[s];
+
+  return node_idx;
+}
+
+static void optimize_node(OptimizeContext *ctx, u32 node_idx) {
+  BvhNode node = ctx->nodes[node_idx];
+  if (bvh_node_is_leaf(node)) {
+    return;
+  }
+  // the children might have been restructured since the costs were computed
+  ctx->costs[node_idx] =
+      node_area(node) + ctx->costs[node.l] + ctx->costs[node.r];
+
+  Treelet treelet;
+  form_treelet(ctx, node_idx, &treelet);
+  if (treelet.leaf_count < 3) {
+    return;
+  }
+
+  optimize_treelet(ctx, &treelet);
+  u32 full = (1u << treelet.leaf_count) - 1;
+  if (treelet.subset_cost[full] < ctx->costs[node_idx] * (1.0f - 1e-6f)) {
+    u32 next_internal = 0;
+    rebuild_treelet(ctx, &treelet, full, &next_internal);
+  }
+}
+
+typedef struct {
+  OptimizeContext *ctx;
+  /// the subtree occupies `[first, root]`
+  u32 first;
+  u32 root;
+} OptimizeJob;
+
+/// Children come before their parents in post order so a single sweep over
+/// the subtree's nodes is bottom up. Restructuring only moves nodes around
+/// inside the treelet, which is entirely below the node being optimized.
+void optimize_subtree_job(void *data) {
+  OptimizeJob *job = data;
+  for (u32 i = job->first; i <= job->root; ++i) {
+    if ((i & 255) == 0 && SDL_GetPerformanceCounter() > job->ctx->deadline) {
+      break;
+    }
+    optimize_node(job->ctx, i);
+  }
+}
+
+static u32 subtree_sizes(const BvhNode *nodes, u32 *sizes, u32 node_idx) {
+  BvhNode node = nodes[node_idx];
+  sizes[node_idx] = 1;
+  if (!bvh_node_is_leaf(node)) {
+    sizes[node_idx] += subtree_sizes(nodes, sizes, node.l) +
+                       subtree_sizes(nodes, sizes, node.r);
+  }
+
+  return sizes[node_idx];
+}
+
+/// Splits the tree into subtrees of at most `max_size` nodes, the nodes above
+/// them are collected into `top` in post order.
+static void collect_jobs(OptimizeContext *ctx, const u32 *sizes, u32 node_idx,
+                         u32 max_size, OptimizeJob *jobs, u32 *job_count,
+                         u32 *top, u32 *top_count) {
+  if (sizes[node_idx] <= max_size) {
+    jobs[(*job_count)++] = (OptimizeJob){
+        .ctx = ctx,
+        .first = node_idx + 1 - sizes[node_idx],
+        .root = node_idx,
+    };
+    return;
+  }
+
+  BvhNode node = ctx->nodes[node_idx];
+  collect_jobs(ctx, sizes, node.l, max_size, jobs, job_count, top, top_count);
+  collect_jobs(ctx, sizes, node.r, max_size, jobs, job_count, top, top_count);
+  top[(*top_count)++] = node_idx;
+}
+
+static u32 relayout(const BvhNode *nodes, BvhNode *out, u32 node_idx,
+                    u32 *out_count) {
+  BvhNode node = nodes[node_idx];
+  if (!bvh_node_is_leaf(node)) {
+    node.l = relayout(nodes, out, node.l, out_count);
+    node.r = relayout(nodes, out, node.r, out_count);
+  }
+  out[*out_count] = node;
+
+  return (*out_count)++;
+}
+
+void bvh_optimize(BvhNode *nodes, u32 node_count, ThreadPool *pool,
+                  u32 time_budget_ms) {
+  u64 start = SDL_GetPerformanceCounter();
+  u64 frequency = SDL_GetPerformanceFrequency();
+
+  u64 deadline = start + frequency * time_budget_ms / 1000;
+  OptimizeContext ctx = {
+      .nodes = nodes,
+      .costs = malloc(sizeof(f32) * node_count),
+  };
+  u32 *sizes = malloc(sizeof(u32) * node_count);
+  u32 *top = malloc(sizeof(u32) * node_count);
+  OptimizeJob *jobs = malloc(sizeof(OptimizeJob) * node_count);
+  BvhNode *scratch = malloc(sizeof(BvhNode) * node_count);
+
+  u32 root = node_count - 1;
+  f32 root_area = node_area(nodes[root]);
+  u64 walk_start = SDL_GetPerformanceCounter();
+  f32 initial_cost = compute_costs(nodes, ctx.costs, root) / root_area;
+  f32 cost = initial_cost;
+  // the relayout after a pass walks the whole tree like `compute_costs` and
+  // copies it back, stop optimizing early enough to leave time for both
+  u64 relayout_ticks = 2 * (SDL_GetPerformanceCounter() - walk_start);
+  ctx.deadline = deadline > relayout_ticks ? deadline - relayout_ticks : 0;
+
+  u32 jobs_per_thread = 8;
+  u32 max_job_size =
+      max(node_count / ((pool ? pool->thread_count : 1) * jobs_per_thread),
+          1024u);
+
+  u32 pass_count = 0;
+  u64 pass_ticks = 0;
+  bool out_of_time = false;
+  while (true) {
+    // don't start a pass that won't fit in what's left of the budget if it
+    // takes as long as the last one
+    u64 pass_start = SDL_GetPerformanceCounter();
+    if (pass_start + pass_ticks >= deadline) {
+      break;
+    }
+
+    subtree_sizes(nodes, sizes, root);
+    u32 job_count = 0;
+    u32 top_count = 0;
+    collect_jobs(&ctx, sizes, root, max_job_size, jobs, &job_count, top,
+                 &top_count);
+
+    for (u32 i = 0; i < job_count; ++i) {
+      if (pool) {
+        threadpool_push(pool, optimize_subtree_job, &jobs[i]);
+      } else {
+        optimize_subtree_job(&jobs[i]);
+      }
+    }
+    if (pool) {
+      threadpool_wait(pool);
+    }
+    for (u32 i = 0; i < top_count; ++i) {
+      if (SDL_GetPerformanceCounter() > ctx.deadline) {
+        break;
+      }
+      optimize_node(&ctx, top[i]);
+    }
+
+    // treelets reuse internal nodes wherever they were, put them back into
+    // post order so subtrees are contiguous again
+    u32 out_count = 0;
+    relayout(nodes, scratch, root, &out_count);
+    memcpy(nodes, scratch, sizeof(BvhNode) * node_count);
+    ++pass_count;
+
+    // the cost only decides whether to go on
+    if (SDL_GetPerformanceCounter() > ctx.deadline) {
+      out_of_time = true;
+      break;
+    }
+    f32 new_cost = compute_costs(nodes, ctx.costs, root) / root_area;
+    bool converged = new_cost > cost * (1.0f - MIN_PASS_IMPROVEMENT);
+    cost = new_cost;
+    if (converged) {
+      break;
+    }
+    pass_ticks = SDL_GetPerformanceCounter() - pass_start;
+  }
+
+  free(scratch);
+  free(jobs);
+  free(top);
+  free(sizes);
+  free(ctx.costs);
+
+  f64 ms = (f64)(SDL_GetPerformanceCounter() - start) * 1000.0 / (f64)frequency;
+  if (out_of_time) {
+    infoln("optimized bvh in %.2fms (%u passes, out of time), sah cost was "
+           "%.2f",
+           ms, pass_count, initial_cost);
+  } else {
+    infoln("optimized bvh in %.2fms (%u passes), sah cost %.2f -> %.2f", ms,
+           pass_count, initial_cost, cost);
+  }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "threadpool.h"
+#include "trimesh.h"
+#include "types.h"
+
+/// Sah cost of the binary bvh rooted at `root` in `nodes`, with the traversal
+/// and intersection costs both set to 1 like in the builders. Works for any
+/// layout, the finished cpu trees have their root first.
+f32 bvh_sah_cost(const BvhNode *nodes, u32 node_count, u32 root);
+
+/// Restructures treelets of up to 7 leaves to their optimal topology (Karras
+/// and Aila 2013) until the sah cost stops improving or `time_budget_ms` runs
+/// out. A pass only starts if one as long as the last still fits in the budget.
+/// Subtrees are optimized in parallel on `pool` (which can be NULL), then the
+/// nodes above them on the calling thread. The nodes keep their post order
+/// layout and count, leaves are never merged or split.
+void bvh_optimize(BvhNode *nodes, u32 node_count, ThreadPool *pool,
+                  u32 time_budget_ms);
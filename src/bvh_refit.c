@@ -0,0 +1,86 @@
+#include <stdlib.h>
+
+#include "maths.h"
+#include "trimesh.h"
+#include "types.h"
+#include "wide_bvh.h"
+
+#include "bvh_refit.h"
+
+/// Bounds of the `count` triangles starting at `first`, padded like the
+/// builders pad them.
+static Aabb triangles_bounds(const Vertex *vertices, const u32 *indices,
+                             u32 first, u32 count) {
+  Aabb bounds = aabb_empty();
+  for (u32 i = first * 3; i < (first + count) * 3; ++i) {
+    bounds = aabb_expand(bounds, vertices[indices[i]].position);
+  }
+
+  return (Aabb){
+      .min = vec3Subtract(bounds.min, vec3New(1e-5, 1e-5, 1e-5)),
+      .max = vec3Add(bounds.max, vec3New(1e-5, 1e-5, 1e-5)),
+  };
+}
+
+static void refit_internal_node(BvhNode *nodes, u32 i) {
+  BvhNode l = nodes[nodes[i].l];
+  BvhNode r = nodes[nodes[i].r];
+  nodes[i].min = vec3Min(l.min, r.min);
+  nodes[i].max = vec3Max(l.max, r.max);
+}
+
+void bvh_refit(BvhNode *nodes, u32 node_count, const Vertex *vertices,
+               const u32 *indices) {
+  for (u32 i = node_count; i-- > 0;) {
+    if (bvh_node_is_leaf(nodes[i])) {
+      Aabb bounds = triangles_bounds(vertices, indices, nodes[i].l,
+                                     bvh_node_triangle_count(nodes[i]));
+      nodes[i].min = bounds.min;
+      nodes[i].max = bounds.max;
+    } else {
+      refit_internal_node(nodes, i);
+    }
+  }
+}
+
+void bvh_refit_bounds(BvhNode *nodes, u32 node_count, const Aabb *bounds) {
+  for (u32 i = node_count; i-- > 0;) {
+    if (bvh_node_is_leaf(nodes[i])) {
+      // the empty leaf of a bvh over no bounds stays empty
+      if (bvh_node_triangle_count(nodes[i]) == 0) {
+        continue;
+      }
+      nodes[i].min = bounds[nodes[i].l].min;
+      nodes[i].max = bounds[nodes[i].l].max;
+    } else {
+      refit_internal_node(nodes, i);
+    }
+  }
+}
+
+void wide_bvh_refit(WideBvhNode *nodes, u32 node_count, const Vertex *vertices,
+                    const u32 *indices) {
+  // exact bounds of every node, the quantized ones are too loose to build on
+  Aabb *node_bounds = malloc(sizeof(Aabb) * node_count);
+
+  for (u32 i = node_count; i-- > 0;) {
+    WideBvhNode *node = &nodes[i];
+
+    Aabb child_bounds[WIDE_BVH_WIDTH];
+    Aabb bounds = aabb_empty();
+    for (u32 c = 0; c < node->child_count; ++c) {
+      if (node->triangle_count[c] != 0) {
+        child_bounds[c] = triangles_bounds(vertices, indices, node->children[c],
+                                           node->triangle_count[c]);
+      } else {
+        child_bounds[c] = node_bounds[node->children[c]];
+      }
+      bounds = aabb_union(bounds, child_bounds[c]);
+    }
+
+    wide_bvh_node_quantize(node, bounds, child_bounds);
+    node_bounds[i] = bounds;
+  }
+
+  free(node_bounds);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "maths.h"
+#include "trimesh.h"
+#include "types.h"
+
+/// A refit tree is rebuilt once its sah cost grows past this multiple of the
+/// cost it had when it was built.
+static const f32 REFIT_REBUILD_RATIO = 1.5f;
+
+/// Recomputes the bounds of every node of the binary depth first bvh in `nodes`
+/// from the triangles they cover, keeping the topology. Children always come
+/// after their parents depth first so this is a single backwards pass over the
+/// nodes.
+void bvh_refit(BvhNode *nodes, u32 node_count, const Vertex *vertices,
+               const u32 *indices);
+
+/// Like `bvh_refit` for a bvh built by `bvh_build_over_bounds`, the leaf over
+/// box `i` gets `bounds[i]`.
+void bvh_refit_bounds(BvhNode *nodes, u32 node_count, const Aabb *bounds);
+
+/// Recomputes and requantizes the child bounds of every node of the depth first
+/// wide bvh in `nodes`, keeping the topology.
+void wide_bvh_refit(WideBvhNode *nodes, u32 node_count, const Vertex *vertices,
+                    const u32 *indices);
@@ -0,0 +1,93 @@
+#include <stdio.h>
+
+#include "bvh_optimize.h"
+#include "log.h"
+#include "maths.h"
+#include "types.h"
+
+#include "bvh_stats.h"
+
+static Aabb node_bounds(BvhNode node) { return aabb_new(node.min, node.max); }
+
+static void accumulate_stats(const BvhNode *nodes, u32 node_idx, u32 depth,
+                             BvhStats *stats, f32 *depth_sum,
+                             f32 *overlap_area) {
+  BvhNode node = nodes[node_idx];
+  stats->max_depth = max(stats->max_depth, depth);
+
+  if (bvh_node_is_leaf(node)) {
+    u32 triangle_count = bvh_node_triangle_count(node);
+    ++stats->leaf_count;
+    stats->triangle_count += triangle_count;
+    *depth_sum += (f32)depth;
+
+    u32 bucket = min(max(triangle_count, 1u), BVH_STATS_HISTOGRAM_SIZE) - 1;
+    ++stats->leaf_histogram[bucket];
+    return;
+  }
+
+  Aabb overlap = aabb_intersection(node_bounds(nodes[node.l]),
+                                   node_bounds(nodes[node.r]));
+  if (!aabb_is_empty(overlap)) {
+    *overlap_area += aabb_surface_area(overlap);
+  }
+
+  accumulate_stats(nodes, node.l, depth + 1, stats, depth_sum, overlap_area);
+  accumulate_stats(nodes, node.r, depth + 1, stats, depth_sum, overlap_area);
+}
+
+BvhStats bvh_stats_compute(const BvhNode *nodes, u32 node_count, u32 root) {
+  BvhStats stats = {
+      .node_count = node_count,
+      .sah_cost = bvh_sah_cost(nodes, node_count, root),
+      .node_bytes = node_count * sizeof(BvhNode),
+  };
+
+  f32 depth_sum = 0.0f;
+  f32 overlap_area = 0.0f;
+  accumulate_stats(nodes, root, 0, &stats, &depth_sum, &overlap_area);
+
+  stats.average_depth = depth_sum / (f32)stats.leaf_count;
+  f32 root_area = aabb_surface_area(node_bounds(nodes[root]));
+  stats.sibling_overlap = root_area > 0.0f ? overlap_area / root_area : 0.0f;
+
+  return stats;
+}
+
+BvhStats bvh_stats_compute_mesh(const TriangleMesh *mesh) {
+  if (!mesh->bvh_nodes) {
+    return (BvhStats){0};
+  }
+
+  BvhStats stats = bvh_stats_compute(mesh->bvh_nodes, mesh->bvh_node_count, 0);
+  stats.node_bytes += mesh->wide_bvh_node_count * sizeof(WideBvhNode);
+
+  return stats;
+}
+
+void bvh_stats_log(const BvhStats *self, const char *name) {
+  infoln("%s: sah %.2f, %u nodes (%.2f KiB), %u leaves over %u triangles, "
+         "depth max %u avg %.2f, sibling overlap %.3f",
+         name, self->sah_cost, self->node_count,
+         (f64)self->node_bytes / 1024.0, self->leaf_count,
+         self->triangle_count, self->max_depth, self->average_depth,
+         self->sibling_overlap);
+
+  // only up to the biggest leaf, most trees have small leaves
+  u32 used_buckets = 0;
+  for (u32 i = 0; i < BVH_STATS_HISTOGRAM_SIZE; ++i) {
+    if (self->leaf_histogram[i] != 0) {
+      used_buckets = i + 1;
+    }
+  }
+
+  char histogram[256];
+  histogram[0] = '\0';
+  usize length = 0;
+  for (u32 i = 0; i < used_buckets; ++i) {
+    length += snprintf(histogram + length, sizeof(histogram) - length,
+                       i + 1 == BVH_STATS_HISTOGRAM_SIZE ? " %u+:%u" : " %u:%u",
+                       i + 1, self->leaf_histogram[i]);
+  }
+  infoln("%s: leaf sizes%s", name, histogram);
+}
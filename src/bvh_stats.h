@@ -0,0 +1,41 @@
+#pragma once
+
+#include "trimesh.h"
+#include "types.h"
+
+/// Leaves with more triangles than this all land in the last bucket of
+/// `BvhStats.leaf_histogram`.
+static const u32 BVH_STATS_HISTOGRAM_SIZE = 16;
+
+/// Quality and memory statistics of a binary bvh, used to compare builder
+/// settings.
+typedef struct {
+  u32 node_count;
+  u32 leaf_count;
+  /// triangles referenced by the leaves, more than the mesh has if the sbvh
+  /// builder split some of them
+  u32 triangle_count;
+  /// see `bvh_sah_cost`
+  f32 sah_cost;
+  u32 max_depth;
+  /// of the leaves, the root is at depth 0
+  f32 average_depth;
+  /// `leaf_histogram[i]` is the number of leaves with `i + 1` triangles
+  u32 leaf_histogram[BVH_STATS_HISTOGRAM_SIZE];
+  /// surface area of the overlap of every pair of siblings relative to the
+  /// root, roughly how many extra nodes a random ray visits because siblings
+  /// overlap
+  f32 sibling_overlap;
+  /// memory taken by the nodes that get uploaded, including the wide nodes
+  usize node_bytes;
+} BvhStats;
+
+/// Statistics of the binary bvh rooted at `root` in `nodes`.
+BvhStats bvh_stats_compute(const BvhNode *nodes, u32 node_count, u32 root);
+
+/// Statistics of the bvh of a mesh built on the cpu, the gpu builder leaves no
+/// nodes on the cpu so its meshes get zeroed statistics.
+BvhStats bvh_stats_compute_mesh(const TriangleMesh *mesh);
+
+/// Logs `self` as a couple of lines, `name` says which tree it belongs to.
+void bvh_stats_log(const BvhStats *self, const char *name);
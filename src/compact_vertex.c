@@ -0,0 +1,64 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "maths.h"
+#include "types.h"
+
+#include "compact_vertex.h"
+
+static const f32 POSITION_STEPS = 65535.0f;
+static const f32 NORMAL_STEPS = 32767.0f;
+
+static f32 sign_not_zero(f32 x) { return x >= 0.0f ? 1.0f : -1.0f; }
+
+/// Projects `n` onto the octahedron and folds the lower half over the upper
+/// one, the inverse is `octahedral_decode` in `common/compact_vertex.glsl`.
+static void octahedral_encode(vec3 n, f32 *u, f32 *v) {
+  f32 l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  if (l1 == 0.0f) {
+    *u = 0.0f;
+    *v = 0.0f;
+    return;
+  }
+
+  f32 x = n.x / l1;
+  f32 y = n.y / l1;
+  if (n.z < 0.0f) {
+    f32 folded_x = (1.0f - fabsf(y)) * sign_not_zero(x);
+    y = (1.0f - fabsf(x)) * sign_not_zero(y);
+    x = folded_x;
+  }
+
+  *u = x;
+  *v = y;
+}
+
+CompactVertex compact_vertex_encode(Vertex vertex, Aabb bounds) {
+  CompactVertex compact = {0};
+
+  for (u32 k = 0; k < 3; ++k) {
+    f32 extent = bounds.max.v[k] - bounds.min.v[k];
+    f32 t = extent > 0.0f ? (vertex.position.v[k] - bounds.min.v[k]) / extent
+                          : 0.0f;
+    compact.position[k] = (u16)roundf(clamp(t, 0.0f, 1.0f) * POSITION_STEPS);
+  }
+
+  f32 normal[2];
+  octahedral_encode(vertex.normal, &normal[0], &normal[1]);
+  for (u32 k = 0; k < 2; ++k) {
+    compact.normal[k] =
+        (i16)roundf(clamp(normal[k], -1.0f, 1.0f) * NORMAL_STEPS);
+  }
+
+  return compact;
+}
+
+CompactVertex *compact_vertices_new(const Vertex *vertices, u32 count,
+                                    Aabb bounds) {
+  CompactVertex *compact = malloc(sizeof(CompactVertex) * count);
+  for (u32 i = 0; i < count; ++i) {
+    compact[i] = compact_vertex_encode(vertices[i], bounds);
+  }
+
+  return compact;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "maths.h"
+#include "trimesh.h"
+#include "types.h"
+
+/// How the vertex buffer stores vertices on the gpu, the cpu side always keeps
+/// full `Vertex`s so the bvhs can be refit.
+typedef enum : u32 {
+  /// `Vertex`s as they are, 32 bytes each
+  VERTEX_FORMAT_FULL = 0,
+  /// `CompactVertex`s, 12 bytes each
+  VERTEX_FORMAT_COMPACT = 1,
+} VertexFormat;
+
+static const u32 VERTEX_FORMAT_COUNT = 2;
+
+/// A `Vertex` packed for the gpu. `position` is quantized to 16 bits per axis
+/// over the bounds of its object and decodes to
+/// `position_origin + position / 65535 * position_scale` (see `GpuInstance`),
+/// the 4th component is unused so the position is a single 4 component vertex
+/// attribute. `normal` is octahedral encoded as 2 snorms. The object index is
+/// dropped, it lives in the `LeafTriangle`s.
+typedef struct {
+  u16 position[4];
+  i16 normal[2];
+} CompactVertex;
+
+/// Packs `vertex` whose object spans `bounds`.
+CompactVertex compact_vertex_encode(Vertex vertex, Aabb bounds);
+
+/// Packs `count` vertices of an object spanning `bounds` into a new array.
+CompactVertex *compact_vertices_new(const Vertex *vertices, u32 count,
+                                    Aabb bounds);
@@ -0,0 +1,856 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CPU_TRACER_SSE2
+#endif
+
+#include "SDL_timer.h"
+#include "ccVector.h"
+#include "envlight.h"
+#include "log.h"
+#include "maths.h"
+#include "scene.h"
+#include "threadpool.h"
+#include "trimesh.h"
+#include "types.h"
+#include "wide_bvh.h"
+
+#include "cpu_tracer.h"
+
+// the same as `common/constants.glsl`
+static const f32 INV_PI = 0.3183098861837907f;
+static const f32 EPSILON = 1e-5f;
+static const f32 FLOAT_MAX = 3.402823466e+38f;
+
+/// entries of a traversal stack kept on the c stack, enough for the usual
+/// trees, deeper ones move the stack to the heap
+#define TRAVERSAL_STACK_SIZE 128
+
+typedef struct {
+  vec3 o;
+  vec3 d;
+} Ray;
+
+typedef struct {
+  f32 t;
+  /// the index of the instance in `SceneGeometry.instances` like the object
+  /// id of the gpu
+  u32 instance;
+  /// relative to the triangles of the instance's blas
+  u32 triangle;
+} Hit;
+
+typedef struct {
+  vec3 position;
+  vec3 normal;
+  Material material;
+} SurfaceInteraction;
+
+/// see `init_random` and `rand_2d` in `common/random.glsl`
+typedef struct {
+  u32 v[4];
+} Rng;
+
+/// what `create_ray` computes from the push constants, once per frame
+typedef struct {
+  mat4x4 inv_projection;
+  mat4x4 inv_view;
+  /// the inverse of the view rotated 90 degrees around z, builds the basis
+  /// of the heart shaped lens
+  mat4x4 inv_rotated_view;
+  vec3 eye;
+  f32 lens_radius;
+  f32 focal_dist;
+} CameraRays;
+
+typedef struct {
+  const CpuTracer *tracer;
+  const CameraRays *camera;
+  u32 width;
+  u32 height;
+  u32 samples;
+  u32 x0;
+  u32 y0;
+  u32 x1;
+  u32 y1;
+  vec4 *film;
+} TileJob;
+
+static inline vec3 vec4_xyz(vec4 v) { return vec3New(v.x, v.y, v.z); }
+
+static inline vec4 mat4x4_apply(const mat4x4 m, vec4 v) {
+  vec4 r;
+  for (u32 i = 0; i < 4; ++i) {
+    r.v[i] = m[0].v[i] * v.x + m[1].v[i] * v.y + m[2].v[i] * v.z +
+             m[3].v[i] * v.w;
+  }
+
+  return r;
+}
+
+/// `mat3(m) * v` in glsl
+static inline vec3 mat4x4_apply_direction(const mat4x4 m, vec3 v) {
+  return vec4_xyz(mat4x4_apply(m, vec4New(v.x, v.y, v.z, 0.0f)));
+}
+
+/// `transpose(mat3(m)) * v` in glsl
+static inline vec3 mat4x4_apply_transposed(const mat4x4 m, vec3 v) {
+  return vec3New(vec3DotProduct(vec4_xyz(m[0]), v),
+                 vec3DotProduct(vec4_xyz(m[1]), v),
+                 vec3DotProduct(vec4_xyz(m[2]), v));
+}
+
+/// `a * b` of column major matrices
+static void mat4x4_multiply(mat4x4 out, const mat4x4 a, const mat4x4 b) {
+  for (u32 c = 0; c < 4; ++c) {
+    out[c] = mat4x4_apply(a, b[c]);
+  }
+}
+
+/// Inverts any invertible column major matrix with gauss jordan elimination,
+/// unlike `mat4x4AffineInverse` it handles projections.
+static void mat4x4_inverse(mat4x4 out, const mat4x4 m) {
+  // row `r` of `m` followed by row `r` of the identity
+  f32 a[4][8];
+  for (u32 r = 0; r < 4; ++r) {
+    for (u32 c = 0; c < 4; ++c) {
+      a[r][c] = m[c].v[r];
+      a[r][c + 4] = r == c ? 1.0f : 0.0f;
+    }
+  }
+
+  for (u32 c = 0; c < 4; ++c) {
+    u32 pivot = c;
+    for (u32 r = c + 1; r < 4; ++r) {
+      if (fabsf(a[r][c]) > fabsf(a[pivot][c])) {
+        pivot = r;
+      }
+    }
+    for (u32 k = 0; k < 8; ++k) {
+      f32 tmp = a[c][k];
+      a[c][k] = a[pivot][k];
+      a[pivot][k] = tmp;
+    }
+
+    f32 inv = a[c][c] != 0.0f ? 1.0f / a[c][c] : 0.0f;
+    for (u32 k = 0; k < 8; ++k) {
+      a[c][k] *= inv;
+    }
+    for (u32 r = 0; r < 4; ++r) {
+      if (r == c) {
+        continue;
+      }
+      f32 f = a[r][c];
+      for (u32 k = 0; k < 8; ++k) {
+        a[r][k] -= f * a[c][k];
+      }
+    }
+  }
+
+  for (u32 c = 0; c < 4; ++c) {
+    out[c] = vec4New(a[0][c + 4], a[1][c + 4], a[2][c + 4], a[3][c + 4]);
+  }
+}
+
+static inline void pcg_4d(u32 v[4]) {
+  for (u32 i = 0; i < 4; ++i) {
+    v[i] = v[i] * 1664525u + 1013904223u;
+  }
+  for (u32 round = 0; round < 2; ++round) {
+    // v += v.yzxy * v.wxyz;
+    u32 a[4] = {v[1] * v[3], v[2] * v[0], v[0] * v[1], v[1] * v[2]};
+    for (u32 i = 0; i < 4; ++i) {
+      v[i] += a[i];
+    }
+    if (round == 0) {
+      for (u32 i = 0; i < 4; ++i) {
+        v[i] ^= v[i] >> 16u;
+      }
+    }
+  }
+}
+
+static inline Rng rng_new(u32 x, u32 y, u32 frame) {
+  return (Rng){.v = {x, y, frame, x + y}};
+}
+
+static inline vec2 rand_2d(Rng *rng) {
+  pcg_4d(rng->v);
+  return vec2New((f32)rng->v[0] / (f32)0xffffffffu,
+                 (f32)rng->v[1] / (f32)0xffffffffu);
+}
+
+static inline f32 luminance(vec3 c) {
+  return 0.212671f * c.x + 0.715160f * c.y + 0.072169f * c.z;
+}
+
+/// the nearest texel to `uv`, clamped to the edge like `vec3_sampler`
+static inline u32 texel_index(u32 width, u32 height, f32 u, f32 v) {
+  f32 x = fminf(fmaxf(floorf(u * (f32)width), 0.0f), (f32)(width - 1));
+  f32 y = fminf(fmaxf(floorf(v * (f32)height), 0.0f), (f32)(height - 1));
+  return (u32)y * width + (u32)x;
+}
+
+static vec3 escaped_ray_color(const EnvironmentLight *envlight, vec3 d) {
+  f32 u = 0.5f + atan2f(d.z, d.x) / (PI * 2.0f);
+  f32 v = 0.5f - asinf(clamp(d.y, -1.0f, 1.0f)) * INV_PI;
+  return vec4_xyz(envlight->light_data[texel_index(
+      envlight->width, envlight->height, u, v)]);
+}
+
+static vec2 square_to_heartish(vec2 u) {
+  // `square_to_disk`
+  f32 r = sqrtf(u.x);
+  f32 theta = 2.0f * PI * u.y;
+  vec2 ret = vec2New(r * sinf(theta), r * cosf(theta));
+
+  ret.x = (ret.x + sqrtf(fabsf(sinf(ret.y)))) * 0.5f;
+  return ret;
+}
+
+static CameraRays camera_rays_new(const CpuCamera *camera) {
+  CameraRays self = {
+      .lens_radius = camera->lens_radius,
+      .focal_dist = camera->focal_dist,
+  };
+  mat4x4_inverse(self.inv_projection, camera->projection_matrix);
+  mat4x4_inverse(self.inv_view, camera->view_matrix);
+
+  f32 theta = PI / 2.0f;
+  mat4x4 rotator_z = {
+      vec4New(cosf(theta), -sinf(theta), 0.0f, 0.0f),
+      vec4New(sinf(theta), cosf(theta), 0.0f, 0.0f),
+      vec4New(0.0f, 0.0f, 1.0f, 0.0f),
+      vec4New(0.0f, 0.0f, 0.0f, 1.0f),
+  };
+  mat4x4 rotated_view;
+  mat4x4_multiply(rotated_view, rotator_z, camera->view_matrix);
+  mat4x4_inverse(self.inv_rotated_view, rotated_view);
+
+  // `-view_matrix[3].xyz * mat3(view_matrix)`
+  self.eye = mat4x4_apply_transposed(
+      camera->view_matrix, vec3Negate(vec4_xyz(camera->view_matrix[3])));
+
+  return self;
+}
+
+/// `create_ray` with the stylized heart shaped lens, `defocus` is false for
+/// the pinhole rays that stand in for the rasterized first bounce
+static Ray camera_ray(const CameraRays *camera, vec2 uv, vec2 sample2,
+                      bool defocus) {
+  uv = vec2New(uv.x * 2.0f - 1.0f, uv.y * 2.0f - 1.0f);
+  vec3 view = vec4_xyz(
+      mat4x4_apply(camera->inv_projection, vec4New(uv.x, uv.y, -1.0f, 1.0f)));
+  vec3 dir = vec3Normalize(mat4x4_apply_direction(camera->inv_view, view));
+
+  Ray ray = {.o = vec3New(0.0f, 0.0f, 0.0f), .d = dir};
+
+  if (defocus && camera->lens_radius > 0.0f) {
+    vec3 view_perp = vec4_xyz(mat4x4_apply(camera->inv_projection,
+                                           vec4New(1.0f, uv.y, -uv.x, 1.0f)));
+    vec3 s = vec3Normalize(
+        mat4x4_apply_direction(camera->inv_rotated_view, view_perp));
+    vec3 t = vec3CrossProduct(s, dir);
+
+    vec3 focus = vec3Multiply(dir, camera->focal_dist);
+    vec2 offset = square_to_heartish(sample2);
+
+    ray.o = vec3Multiply(
+        vec3Add(vec3Multiply(s, offset.x), vec3Multiply(t, offset.y)),
+        camera->lens_radius);
+    ray.d = vec3Negate(vec3Normalize(vec3Subtract(ray.o, focus)));
+  }
+
+  ray.o = vec3Add(ray.o, camera->eye);
+
+  return ray;
+}
+
+/// Möller–Trumbore like `ray_triangle_intersection`, -1 on a miss
+static inline f32 ray_triangle_intersection(Ray ray,
+                                            const LeafTriangle *triangle) {
+  const f32 DET_EPSILON = 1e-7f;
+  vec3 h = vec3CrossProduct(ray.d, triangle->e2);
+  f32 a = vec3DotProduct(triangle->e1, h);
+
+  if (-DET_EPSILON < a && a < DET_EPSILON) {
+    return -1.0f;
+  }
+
+  f32 f = 1.0f / a;
+  vec3 s = vec3Subtract(ray.o, triangle->v0);
+  f32 u = f * vec3DotProduct(s, h);
+
+  if (u < 0.0f || u > 1.0f) {
+    return -1.0f;
+  }
+
+  vec3 q = vec3CrossProduct(s, triangle->e1);
+  f32 v = f * vec3DotProduct(ray.d, q);
+
+  if (v < 0.0f || u + v > 1.0f) {
+    return -1.0f;
+  }
+
+  f32 t = f * vec3DotProduct(triangle->e2, q);
+  return t < EPSILON ? -1.0f : t;
+}
+
+static inline vec3 reciprocal(vec3 d) {
+  return vec3New(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+}
+
+/// like `ray_aabb_intersection`
+static inline f32 ray_aabb_intersection(Ray ray, vec3 inv_d, vec3 aabb_min,
+                                        vec3 aabb_max, f32 t_max) {
+  f32 near = 0.0f;
+  f32 far = t_max;
+  for (u32 k = 0; k < 3; ++k) {
+    f32 t0 = (aabb_min.v[k] - ray.o.v[k]) * inv_d.v[k];
+    f32 t1 = (aabb_max.v[k] - ray.o.v[k]) * inv_d.v[k];
+    near = fmaxf(near, fminf(t0, t1));
+    far = fminf(far, fmaxf(t0, t1));
+  }
+
+  return near <= far ? near : FLOAT_MAX;
+}
+
+/// Tests the ray against every child of `node` at once, returns a mask of the
+/// children it enters before `t_max` and writes their entry distances to
+/// `near`.
+static inline u32 ray_wide_node_intersection(Ray ray, vec3 inv_d,
+                                             const CpuWideNode *node,
+                                             f32 t_max,
+                                             f32 near[WIDE_BVH_WIDTH]) {
+#if defined(CPU_TRACER_SSE2)
+  __m128 t_near = _mm_setzero_ps();
+  __m128 t_far = _mm_set1_ps(t_max);
+  for (u32 k = 0; k < 3; ++k) {
+    __m128 origin = _mm_set1_ps(ray.o.v[k]);
+    __m128 inv = _mm_set1_ps(inv_d.v[k]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->min[k]), origin), inv);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->max[k]), origin), inv);
+    t_near = _mm_max_ps(t_near, _mm_min_ps(t0, t1));
+    t_far = _mm_min_ps(t_far, _mm_max_ps(t0, t1));
+  }
+  _mm_storeu_ps(near, t_near);
+  u32 mask = (u32)_mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+  u32 mask = 0;
+  for (u32 i = 0; i < WIDE_BVH_WIDTH; ++i) {
+    near[i] = ray_aabb_intersection(
+        ray, inv_d,
+        vec3New(node->min[0][i], node->min[1][i], node->min[2][i]),
+        vec3New(node->max[0][i], node->max[1][i], node->max[2][i]), t_max);
+    mask |= (near[i] != FLOAT_MAX) << i;
+  }
+#endif
+
+  return mask & ((1u << node->child_count) - 1);
+}
+
+typedef struct {
+  u32 node;
+  /// where the ray enters the node
+  f32 t;
+} StackEntry;
+
+/// The nodes a traversal has left to visit, in `local` until a deep tree
+/// fills it, then on the heap where it keeps growing.
+typedef struct {
+  StackEntry *entries;
+  u32 size;
+  u32 capacity;
+  StackEntry local[TRAVERSAL_STACK_SIZE];
+} TraversalStack;
+
+static inline void traversal_stack_init(TraversalStack *self) {
+  self->entries = self->local;
+  self->size = 0;
+  self->capacity = TRAVERSAL_STACK_SIZE;
+}
+
+static inline void traversal_stack_free(TraversalStack *self) {
+  if (self->entries != self->local) {
+    free(self->entries);
+  }
+}
+
+/// Makes room for `count` more entries.
+static inline void traversal_stack_reserve(TraversalStack *self, u32 count) {
+  if (self->size + count <= self->capacity) {
+    return;
+  }
+
+  u32 capacity = max(self->capacity * 2, self->size + count);
+  if (self->entries == self->local) {
+    self->entries = malloc(sizeof(StackEntry) * capacity);
+    memcpy(self->entries, self->local, sizeof(StackEntry) * self->size);
+  } else {
+    self->entries = realloc(self->entries, sizeof(StackEntry) * capacity);
+  }
+  self->capacity = capacity;
+}
+
+/// Walks the blas of `instance`, keeping the closest hit in `hit`. With
+/// `any_hit` it returns as soon as anything is hit.
+static bool ray_blas_intersect(const CpuTracer *self, Ray ray, u32 instance,
+                               bool any_hit, Hit *hit) {
+  const GpuInstance *gpu_instance = &self->geometry->instances[instance];
+  u32 object = self->instance_objects[instance];
+  const TriangleMesh *blas = &self->geometry->blases[object];
+  const CpuWideNode *nodes = self->blas_nodes + self->blas_node_offsets[object];
+
+  // the direction is not normalized so distances are the same in both spaces
+  ray = (Ray){
+      .o = mat4x4TransformPoint(gpu_instance->world_to_object, ray.o),
+      .d = mat4x4_apply_direction(gpu_instance->world_to_object, ray.d),
+  };
+  vec3 inv_d = reciprocal(ray.d);
+
+  bool found = false;
+  TraversalStack stack;
+  traversal_stack_init(&stack);
+  stack.entries[stack.size++] = (StackEntry){.node = 0, .t = 0.0f};
+  while (stack.size != 0) {
+    StackEntry entry = stack.entries[--stack.size];
+    if (entry.t >= hit->t) {
+      continue;
+    }
+
+    const CpuWideNode *node = &nodes[entry.node];
+    f32 near[WIDE_BVH_WIDTH];
+    u32 mask = ray_wide_node_intersection(ray, inv_d, node, hit->t, near);
+
+    // leaves first so a hit in them can cull the internal children
+    StackEntry internal[WIDE_BVH_WIDTH];
+    u32 internal_count = 0;
+    for (u32 i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      if (!(mask & (1u << i))) {
+        continue;
+      }
+
+      if (node->triangle_count[i] == 0) {
+        internal[internal_count++] =
+            (StackEntry){.node = node->children[i], .t = near[i]};
+        continue;
+      }
+
+      u32 first = node->children[i];
+      for (u32 j = first; j < first + node->triangle_count[i]; ++j) {
+        f32 t = ray_triangle_intersection(ray, &blas->triangles[j]);
+        if (0.0f < t && t < hit->t) {
+          *hit = (Hit){.t = t, .instance = instance, .triangle = j};
+          found = true;
+          if (any_hit) {
+            traversal_stack_free(&stack);
+            return true;
+          }
+        }
+      }
+    }
+
+    // pushed farthest first so the nearest child is visited next
+    for (u32 i = 1; i < internal_count; ++i) {
+      for (u32 j = i; j > 0 && internal[j - 1].t < internal[j].t; --j) {
+        StackEntry tmp = internal[j];
+        internal[j] = internal[j - 1];
+        internal[j - 1] = tmp;
+      }
+    }
+    traversal_stack_reserve(&stack, internal_count);
+    for (u32 i = 0; i < internal_count; ++i) {
+      stack.entries[stack.size++] = internal[i];
+    }
+  }
+
+  traversal_stack_free(&stack);
+  return found;
+}
+
+/// Walks the tlas and the blases of the instances it reaches like
+/// `ray_scene_intersect`, the closest hit before `hit->t` ends up in `hit`.
+/// With `any_hit` it only finds out whether there is any, like
+/// `ray_scene_occluded`.
+static bool ray_scene_intersect(const CpuTracer *self, Ray ray, bool any_hit,
+                                Hit *hit) {
+  const SceneGeometry *geometry = self->geometry;
+  // the tlas of a scene without instances is a leaf over none, rays still
+  // enter its infinite empty bounds
+  if (geometry->instance_count == 0) {
+    return false;
+  }
+
+  vec3 inv_d = reciprocal(ray.d);
+
+  // like the gpu the root is tested first
+  BvhNode root = geometry->tlas_nodes[0];
+  f32 t_root = ray_aabb_intersection(ray, inv_d, root.min, root.max, hit->t);
+  if (t_root == FLOAT_MAX) {
+    return false;
+  }
+
+  bool found = false;
+  TraversalStack stack;
+  traversal_stack_init(&stack);
+  stack.entries[stack.size++] = (StackEntry){.node = 0, .t = t_root};
+  while (stack.size != 0) {
+    StackEntry entry = stack.entries[--stack.size];
+    if (entry.t >= hit->t) {
+      continue;
+    }
+
+    BvhNode node = geometry->tlas_nodes[entry.node];
+    if (bvh_node_is_leaf(node)) {
+      if (ray_blas_intersect(self, ray, node.l, any_hit, hit)) {
+        found = true;
+        if (any_hit) {
+          traversal_stack_free(&stack);
+          return true;
+        }
+      }
+      continue;
+    }
+
+    BvhNode left = geometry->tlas_nodes[node.l];
+    BvhNode right = geometry->tlas_nodes[node.r];
+    f32 t_left =
+        ray_aabb_intersection(ray, inv_d, left.min, left.max, hit->t);
+    f32 t_right =
+        ray_aabb_intersection(ray, inv_d, right.min, right.max, hit->t);
+
+    StackEntry near = {.node = node.l, .t = t_left};
+    StackEntry far = {.node = node.r, .t = t_right};
+    if (t_right < t_left) {
+      StackEntry tmp = near;
+      near = far;
+      far = tmp;
+    }
+
+    traversal_stack_reserve(&stack, 2);
+    if (far.t != FLOAT_MAX) {
+      stack.entries[stack.size++] = far;
+    }
+    if (near.t != FLOAT_MAX) {
+      stack.entries[stack.size++] = near;
+    }
+  }
+
+  traversal_stack_free(&stack);
+  return found;
+}
+
+/// `get_surface_interaction`, the normal is interpolated like
+/// `get_face_normal`
+static SurfaceInteraction surface_interaction(const CpuTracer *self, Ray ray,
+                                              Hit hit) {
+  const GpuInstance *instance = &self->geometry->instances[hit.instance];
+  const TriangleMesh *blas =
+      &self->geometry->blases[self->instance_objects[hit.instance]];
+  const LeafTriangle *triangle = &blas->triangles[hit.triangle];
+
+  vec3 position = vec3Add(ray.o, vec3Multiply(ray.d, hit.t));
+
+  vec3 p = mat4x4TransformPoint(instance->world_to_object, position);
+  vec3 p0 = triangle->v0;
+  vec3 p1 = vec3Add(p0, triangle->e1);
+  vec3 p2 = vec3Add(p0, triangle->e2);
+  vec3 f0 = vec3Subtract(p0, p);
+  vec3 f1 = vec3Subtract(p1, p);
+  vec3 f2 = vec3Subtract(p2, p);
+
+  f32 det = vec3Length(
+      vec3CrossProduct(vec3Subtract(p0, p1), vec3Subtract(p0, p2)));
+  f32 b[3] = {
+      vec3Length(vec3CrossProduct(f1, f2)) / det,
+      vec3Length(vec3CrossProduct(f2, f0)) / det,
+      vec3Length(vec3CrossProduct(f0, f1)) / det,
+  };
+
+  vec3 n = vec3New(0.0f, 0.0f, 0.0f);
+  for (u32 k = 0; k < 3; ++k) {
+    vec3 vertex_normal =
+        blas->vertices[blas->indices[hit.triangle * 3 + k]].normal;
+    n = vec3Add(n, vec3Multiply(vertex_normal, b[k]));
+  }
+
+  return (SurfaceInteraction){
+      .position = position,
+      .normal = vec3Normalize(
+          mat4x4_apply_transposed(instance->world_to_object, n)),
+      .material = self->materials[instance->material],
+  };
+}
+
+static Ray spawn_ray(const SurfaceInteraction *si, vec3 dir) {
+  // `face_forward`
+  if (vec3DotProduct(dir, si->normal) < 0.0f) {
+    dir = vec3Negate(dir);
+  }
+
+  return (Ray){
+      .o = vec3Add(si->position, vec3Multiply(si->normal, EPSILON)),
+      .d = vec3Normalize(dir),
+  };
+}
+
+/// `frame_to_world(new_frame(n), v)`
+static vec3 frame_to_world(vec3 n, vec3 v) {
+  f32 sign = n.z < 0.0f ? -1.0f : 1.0f;
+  f32 a = 1.0f / -(sign + n.z);
+  f32 b = n.x * n.y * a;
+  vec3 s = vec3Normalize(
+      vec3New(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x));
+  vec3 t = vec3Normalize(vec3New(b, sign + n.y * n.y * a, -n.y));
+
+  return vec3Add(vec3Add(vec3Multiply(n, v.z), vec3Multiply(t, v.y)),
+                 vec3Multiply(s, v.x));
+}
+
+static vec3 square_to_uniform_hemisphere(vec2 u) {
+  f32 z = u.x;
+  f32 r = sqrtf(fmaxf(0.0f, 1.0f - z * z));
+  f32 phi = 2.0f * PI * u.y;
+  return vec3New(r * cosf(phi), r * sinf(phi), z);
+}
+
+/// `direct_light_sample`, importance samples the environment
+static vec3 direct_light_sample(const CpuTracer *self,
+                                const SurfaceInteraction *si, Rng *rng) {
+  const EnvironmentLight *envlight = self->envlight;
+  vec3 contributed = vec3New(0.0f, 0.0f, 0.0f);
+
+  for (u32 i = 0; i < CPU_TRACER_LIGHT_SAMPLES; ++i) {
+    // `sample_light`
+    vec2 random = rand_2d(rng);
+    f32 v = envlight->marginal_inverse[texel_index(1, envlight->height, 0.5f,
+                                                   random.y)];
+    f32 u = envlight->cdf_conditional_inverse[texel_index(
+        envlight->width, envlight->height, random.x, v)];
+    f32 theta = PI * v;
+    f32 phi = 2.0f * PI * (0.5f + u);
+    vec3 wi = vec3New(sinf(theta) * cosf(phi), cosf(theta),
+                      sinf(theta) * sinf(phi));
+    if (sinf(theta) == 0.0f) {
+      continue;
+    }
+    vec3 color = escaped_ray_color(envlight, wi);
+    f32 pdf = (luminance(color) / envlight->image_average) /
+              (2.0f * PI * sinf(theta));
+
+    f32 cos_theta = vec3DotProduct(wi, si->normal);
+    if (cos_theta <= 0.0f || pdf <= 0.0f) {
+      continue;
+    }
+
+    Hit hit = {.t = FLOAT_MAX};
+    if (!ray_scene_intersect(self, spawn_ray(si, wi), true, &hit)) {
+      f32 f = cos_theta * INV_PI / pdf;
+      contributed = vec3Add(
+          contributed,
+          vec3New(si->material.albedo.x * color.x * f,
+                  si->material.albedo.y * color.y * f,
+                  si->material.albedo.z * color.z * f));
+    }
+  }
+
+  return vec3Multiply(contributed, 1.0f / CPU_TRACER_LIGHT_SAMPLES);
+}
+
+/// One path through the pixel at `uv` like `pathtrace.frag`, the first bounce
+/// is traced through the pixel center where the gpu rasterizes it.
+static vec3 trace_path(const CpuTracer *self, const CameraRays *camera,
+                       vec2 uv, Rng *rng) {
+  Ray ray = camera_ray(camera, uv, vec2New(0.0f, 0.0f), false);
+  Hit hit = {.t = FLOAT_MAX};
+  if (!ray_scene_intersect(self, ray, false, &hit)) {
+    vec3 color = vec3New(0.0f, 0.0f, 0.0f);
+    for (u32 i = 0; i < CPU_TRACER_ESCAPED_RAY_SAMPLES; ++i) {
+      Ray escaped = camera_ray(camera, uv, rand_2d(rng), true);
+      color = vec3Add(color, escaped_ray_color(self->envlight, escaped.d));
+    }
+    return vec3Multiply(color, 1.0f / CPU_TRACER_ESCAPED_RAY_SAMPLES);
+  }
+
+  vec3 contributed = vec3New(0.0f, 0.0f, 0.0f);
+  vec3 reflectance = vec3New(1.0f, 1.0f, 1.0f);
+  SurfaceInteraction si = surface_interaction(self, ray, hit);
+  for (u32 bounce = 0;; ++bounce) {
+    vec3 direct = direct_light_sample(self, &si, rng);
+    contributed = vec3Add(contributed, vec3New(reflectance.x * direct.x,
+                                               reflectance.y * direct.y,
+                                               reflectance.z * direct.z));
+
+    vec3 wi = frame_to_world(si.normal,
+                             square_to_uniform_hemisphere(rand_2d(rng)));
+    // lambertian over the uniform hemisphere pdf of 1 / 2pi
+    f32 weight = fabsf(vec3DotProduct(wi, si.normal)) * INV_PI /
+                 (INV_PI * 0.5f);
+    reflectance = vec3New(reflectance.x * si.material.albedo.x * weight,
+                          reflectance.y * si.material.albedo.y * weight,
+                          reflectance.z * si.material.albedo.z * weight);
+    ray = spawn_ray(&si, wi);
+
+    if (bounce + 1 == CPU_TRACER_MAX_BOUNCES) {
+      break;
+    }
+
+    hit = (Hit){.t = FLOAT_MAX};
+    if (!ray_scene_intersect(self, ray, false, &hit)) {
+      vec3 color = escaped_ray_color(self->envlight, ray.d);
+      contributed = vec3Add(contributed, vec3New(reflectance.x * color.x,
+                                                 reflectance.y * color.y,
+                                                 reflectance.z * color.z));
+      break;
+    }
+    si = surface_interaction(self, ray, hit);
+  }
+
+  return contributed;
+}
+
+static void trace_tile_job(void *context) {
+  TileJob *job = context;
+
+  for (u32 y = job->y0; y < job->y1; ++y) {
+    for (u32 x = job->x0; x < job->x1; ++x) {
+      // the gpu flips the viewport, the top row looks up
+      vec2 uv = vec2New(((f32)x + 0.5f) / (f32)job->width,
+                        1.0f - ((f32)y + 0.5f) / (f32)job->height);
+
+      vec3 film = vec3New(0.0f, 0.0f, 0.0f);
+      for (u32 sample = 0; sample < job->samples; ++sample) {
+        Rng rng = rng_new(x, y, sample + 1);
+        film = vec3Add(film, trace_path(job->tracer, job->camera, uv, &rng));
+      }
+      film = vec3Multiply(film, 1.0f / (f32)job->samples);
+
+      job->film[y * job->width + x] = vec4New(film.x, film.y, film.z, 1.0f);
+    }
+  }
+}
+
+/// decodes the quantized child bounds like `wide_bvh_child_bounds`
+static CpuWideNode cpu_wide_node_decode(const WideBvhNode *node) {
+  CpuWideNode ret = {.child_count = node->child_count};
+  for (u32 k = 0; k < 3; ++k) {
+    u32 scale_bits = (u32)node->exponent[k] << 23;
+    f32 scale;
+    memcpy(&scale, &scale_bits, sizeof(f32));
+    for (u32 i = 0; i < WIDE_BVH_WIDTH; ++i) {
+      ret.min[k][i] = node->origin.v[k] + (f32)node->lo[k][i] * scale;
+      ret.max[k][i] = node->origin.v[k] + (f32)node->hi[k][i] * scale;
+    }
+  }
+  for (u32 i = 0; i < WIDE_BVH_WIDTH; ++i) {
+    ret.children[i] = node->children[i];
+    ret.triangle_count[i] = node->triangle_count[i];
+  }
+
+  return ret;
+}
+
+CpuTracer *cpu_tracer_new(const SceneGeometry *geometry,
+                          const Material *materials,
+                          const EnvironmentLight *envlight) {
+  CpuTracer *self = calloc(1, sizeof(CpuTracer));
+  self->geometry = geometry;
+  self->materials = materials;
+  self->envlight = envlight;
+
+  self->instance_objects = malloc(sizeof(u32) * geometry->instance_count);
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    for (u32 j = geometry->object_first_instance[i];
+         j < geometry->object_first_instance[i + 1]; ++j) {
+      self->instance_objects[j] = i;
+    }
+  }
+
+  self->blas_node_offsets = malloc(sizeof(u32) * geometry->object_count);
+  u32 node_count = 0;
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    const TriangleMesh *blas = &geometry->blases[i];
+    if (!blas->bvh_nodes) {
+      fatalln("object %u has no cpu built bvh, the cpu tracer can't trace "
+              "lbvh blases",
+              i);
+    }
+
+    const WideBvhNode *wide_nodes = blas->wide_bvh_nodes;
+    u32 wide_node_count = blas->wide_bvh_node_count;
+    WideBvhNode *collapsed = NULL;
+    if (!wide_nodes) {
+      collapsed = wide_bvh_collapse(blas->bvh_nodes, blas->bvh_node_count,
+                                    &wide_node_count);
+      wide_nodes = collapsed;
+    }
+
+    self->blas_node_offsets[i] = node_count;
+    node_count += wide_node_count;
+    self->blas_nodes =
+        realloc(self->blas_nodes, sizeof(CpuWideNode) * node_count);
+    for (u32 j = 0; j < wide_node_count; ++j) {
+      self->blas_nodes[self->blas_node_offsets[i] + j] =
+          cpu_wide_node_decode(&wide_nodes[j]);
+    }
+
+    free(collapsed);
+  }
+
+  return self;
+}
+
+void cpu_tracer_destroy(CpuTracer *self) {
+  if (!self) {
+    return;
+  }
+
+  free(self->instance_objects);
+  free(self->blas_node_offsets);
+  free(self->blas_nodes);
+  free(self);
+}
+
+void cpu_tracer_render(CpuTracer *self, const CpuCamera *camera, u32 width,
+                       u32 height, u32 samples, vec4 *film) {
+  u64 render_start = SDL_GetPerformanceCounter();
+
+  CameraRays camera_rays = camera_rays_new(camera);
+
+  u32 tiles_x = (width + CPU_TRACER_TILE_SIZE - 1) / CPU_TRACER_TILE_SIZE;
+  u32 tiles_y = (height + CPU_TRACER_TILE_SIZE - 1) / CPU_TRACER_TILE_SIZE;
+  u32 job_count = tiles_x * tiles_y;
+  TileJob *jobs = malloc(sizeof(TileJob) * job_count);
+
+  ThreadPool pool = threadpool_new(self->thread_count);
+  for (u32 i = 0; i < job_count; ++i) {
+    u32 x0 = (i % tiles_x) * CPU_TRACER_TILE_SIZE;
+    u32 y0 = (i / tiles_x) * CPU_TRACER_TILE_SIZE;
+    jobs[i] = (TileJob){
+        .tracer = self,
+        .camera = &camera_rays,
+        .width = width,
+        .height = height,
+        .samples = samples,
+        .x0 = x0,
+        .y0 = y0,
+        .x1 = min(x0 + CPU_TRACER_TILE_SIZE, width),
+        .y1 = min(y0 + CPU_TRACER_TILE_SIZE, height),
+        .film = film,
+    };
+    threadpool_push(&pool, trace_tile_job, &jobs[i]);
+  }
+  threadpool_wait(&pool);
+  u32 thread_count = pool.thread_count;
+  threadpool_destroy(&pool);
+  free(jobs);
+
+  f64 render_ms = (f64)(SDL_GetPerformanceCounter() - render_start) *
+                  1000.0 / (f64)SDL_GetPerformanceFrequency();
+  infoln("traced %u samples of %ux%u pixels on the cpu in %.2fms using %u "
+         "threads",
+         samples, width, height, render_ms, thread_count);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ccVector.h"
+
+#include "envlight.h"
+#include "scene.h"
+#include "trimesh.h"
+#include "types.h"
+
+// must match `src/shaders/common/constants.glsl`, like `WAVEFRONT_MAX_BOUNCES`
+static const u32 CPU_TRACER_MAX_BOUNCES = 5;
+static const u32 CPU_TRACER_LIGHT_SAMPLES = 1;
+static const u32 CPU_TRACER_ESCAPED_RAY_SAMPLES = 5;
+
+/// the side length of the square tiles the frame is split into, each tile is a
+/// job on the thread pool
+static const u32 CPU_TRACER_TILE_SIZE = 32;
+
+/// A `WideBvhNode` with its child bounds decoded to floats and stored per axis
+/// so a ray is tested against all of the children at once with simd.
+typedef struct {
+  f32 min[3][WIDE_BVH_WIDTH];
+  f32 max[3][WIDE_BVH_WIDTH];
+  /// the index of a wide node of the same blas, or the first triangle of a
+  /// leaf
+  u32 children[WIDE_BVH_WIDTH];
+  /// 0 for internal children
+  u32 triangle_count[WIDE_BVH_WIDTH];
+  u32 child_count;
+} CpuWideNode;
+
+typedef struct {
+  mat4x4 view_matrix;
+  mat4x4 projection_matrix;
+  /// only the environment is defocused since the gpu rasterizes the first
+  /// bounce, see `create_ray` in `common/scene.glsl`
+  f32 lens_radius;
+  f32 focal_dist;
+} CpuCamera;
+
+/// Traces the same paths as `pathtrace.frag` on the cpu, as a reference for
+/// the gpu trace modes and to render without a vulkan device. Reads the two
+/// level bvh of a `SceneGeometry` directly: the tlas as is and every blas as
+/// `CpuWideNode`s, collapsed from the binary nodes if the scene wasn't built
+/// wide. Frames are split into tiles traced in parallel on a `ThreadPool`.
+///
+/// Random numbers come from the same pcg hash as the gpu but not the blue
+/// noise, so the images converge to the same result without matching sample
+/// for sample.
+typedef struct CpuTracer_t {
+  /// borrowed, must outlive the tracer
+  const SceneGeometry *geometry;
+  const Material *materials;
+  const EnvironmentLight *envlight;
+
+  /// the object of every instance, `GpuInstance` only knows its offsets
+  u32 *instance_objects;
+
+  /// the nodes of blas `i` start at `blas_node_offsets[i]`
+  CpuWideNode *blas_nodes;
+  u32 *blas_node_offsets;
+
+  /// 0 uses one thread per logical core
+  u32 thread_count;
+} CpuTracer;
+
+/// `geometry` must have been built by a cpu builder, lbvh blases only exist on
+/// the gpu. Blases that weren't built wide can't have leaves over more than
+/// `WIDE_BVH_MAX_LEAF_TRIANGLES` triangles.
+CpuTracer *cpu_tracer_new(const SceneGeometry *geometry,
+                          const Material *materials,
+                          const EnvironmentLight *envlight);
+void cpu_tracer_destroy(CpuTracer *self);
+
+/// Traces `samples` paths through every pixel and writes their mean to `film`,
+/// `width * height` texels from the top left like the accumulation of the
+/// renderer.
+void cpu_tracer_render(CpuTracer *self, const CpuCamera *camera, u32 width,
+                       u32 height, u32 samples, vec4 *film);
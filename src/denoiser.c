@@ -0,0 +1,293 @@
+#include <stdlib.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "log.h"
+#include "maths.h"
+#include "renderer.h"
+#include "types.h"
+
+#include "denoiser.h"
+
+#include "shaders/embed/denoise_comp_spv.h"
+
+// the accumulation, position, normal, object id and moments are sampled, the
+// two ping pong images are storage images
+static const u32 DENOISER_SAMPLED_BINDING_COUNT = 5;
+static const u32 DENOISER_BINDING_COUNT = 7;
+// must match `local_size_x` and `local_size_y` of `denoise.comp`
+static const u32 DENOISER_GROUP_SIZE = 8;
+
+Denoiser *denoiser_new(Renderer *renderer) {
+  Denoiser *self = calloc(1, sizeof(Denoiser));
+  self->enabled = false;
+  self->iterations = 5;
+  self->normal_phi = 128.0f;
+  self->position_phi = 0.1f;
+  self->luminance_phi = 4.0f;
+
+  VkDescriptorSetLayoutBinding bindings[DENOISER_BINDING_COUNT];
+  for (u32 i = 0; i < DENOISER_BINDING_COUNT; ++i) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = i < DENOISER_SAMPLED_BINDING_COUNT
+                              ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                              : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+  }
+  VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = DENOISER_BINDING_COUNT,
+      .pBindings = bindings,
+  };
+  ASSURE_VK(vkCreateDescriptorSetLayout(renderer->device,
+                                        &descriptor_set_layout_create_info,
+                                        NULL, &self->descriptor_set_layout));
+
+  const u32 pool_size_count = 2;
+  VkDescriptorPoolSize pool_sizes[pool_size_count] = {
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+       2 * DENOISER_SAMPLED_BINDING_COUNT},
+      {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+       2 * (DENOISER_BINDING_COUNT - DENOISER_SAMPLED_BINDING_COUNT)},
+  };
+  VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = 2,
+      .poolSizeCount = pool_size_count,
+      .pPoolSizes = pool_sizes,
+  };
+  ASSURE_VK(vkCreateDescriptorPool(renderer->device,
+                                   &descriptor_pool_create_info, NULL,
+                                   &self->descriptor_pool));
+
+  VkDescriptorSetLayout set_layouts[2] = {
+      self->descriptor_set_layout,
+      self->descriptor_set_layout,
+  };
+  VkDescriptorSetAllocateInfo descriptor_set_alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = self->descriptor_pool,
+      .descriptorSetCount = 2,
+      .pSetLayouts = set_layouts,
+  };
+  ASSURE_VK(vkAllocateDescriptorSets(
+      renderer->device, &descriptor_set_alloc_info, self->descriptor_sets));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = &self->descriptor_set_layout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges =
+          &(VkPushConstantRange){
+              .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+              .offset = 0,
+              .size = sizeof(DenoisePushConstants),
+          },
+  };
+  ASSURE_VK(vkCreatePipelineLayout(renderer->device,
+                                   &pipeline_layout_create_info, NULL,
+                                   &self->pipeline_layout));
+
+  VkShaderModule shader = create_shader_module(
+      renderer->device, denoise_comp_spv_data, denoise_comp_spv_size);
+  VkComputePipelineCreateInfo pipeline_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage =
+          (VkPipelineShaderStageCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+              .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+              .module = shader,
+              .pName = "main",
+          },
+      .layout = self->pipeline_layout,
+  };
+  ASSURE_VK(vkCreateComputePipelines(renderer->device, VK_NULL_HANDLE, 1,
+                                     &pipeline_create_info, NULL,
+                                     &self->pipeline));
+  vkDestroyShaderModule(renderer->device, shader, NULL);
+
+  return self;
+}
+
+void denoiser_destroy_images(Renderer *renderer, Denoiser *self) {
+  for (u32 i = 0; i < 2; ++i) {
+    if (self->images[i].image != VK_NULL_HANDLE) {
+      destroy_framebuffer_attachment(renderer, &self->images[i]);
+      self->images[i] = (FramebufferAttachment){0};
+    }
+  }
+}
+
+void denoiser_destroy(Renderer *renderer, Denoiser *self) {
+  if (!self) {
+    return;
+  }
+
+  denoiser_destroy_images(renderer, self);
+
+  vkDestroyPipeline(renderer->device, self->pipeline, NULL);
+  vkDestroyPipelineLayout(renderer->device, self->pipeline_layout, NULL);
+  vkDestroyDescriptorPool(renderer->device, self->descriptor_pool, NULL);
+  vkDestroyDescriptorSetLayout(renderer->device, self->descriptor_set_layout,
+                               NULL);
+
+  free(self);
+}
+
+void denoiser_resize(Renderer *renderer, Denoiser *self) {
+  vkDeviceWaitIdle(renderer->device);
+  denoiser_destroy_images(renderer, self);
+
+  // the images are only ever used in the general layout
+  VkCommandBuffer cmdbuffer = begin_immediate_submit(renderer);
+  VkImageMemoryBarrier image_memory_barriers[2];
+  for (u32 i = 0; i < 2; ++i) {
+    self->images[i] = create_framebuffer_attachment(
+        renderer, VK_FORMAT_R32G32B32A32_SFLOAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+    image_memory_barriers[i] = (VkImageMemoryBarrier){
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = self->images[i].image,
+        .subresourceRange =
+            (VkImageSubresourceRange){
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .srcAccessMask = 0,
+        .dstAccessMask = 0,
+    };
+  }
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, NULL, 0, NULL,
+                       2, image_memory_barriers);
+  end_immediate_submit(renderer, cmdbuffer);
+
+  VkDescriptorImageInfo sampled_infos[DENOISER_SAMPLED_BINDING_COUNT] = {
+      {
+          .imageView = renderer->trace_accumulation_attachment.view,
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+          .sampler = renderer->vec3_sampler,
+      },
+      {
+          .imageView = renderer->position_attachment.view,
+          .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          .sampler = renderer->vec3_sampler,
+      },
+      {
+          .imageView = renderer->normal_attachment.view,
+          .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          .sampler = renderer->vec3_sampler,
+      },
+      {
+          .imageView = renderer->object_index_attachment.view,
+          .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+          .sampler = renderer->vec3_sampler,
+      },
+      {
+          .imageView = renderer->trace_moments_attachment.view,
+          .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+          .sampler = renderer->vec3_sampler,
+      },
+  };
+
+  for (u32 set = 0; set < 2; ++set) {
+    VkDescriptorImageInfo storage_infos[2] = {
+        {
+            .imageView = self->images[1 - set].view,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        },
+        {
+            .imageView = self->images[set].view,
+            .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        },
+    };
+
+    VkWriteDescriptorSet writes[DENOISER_BINDING_COUNT];
+    for (u32 i = 0; i < DENOISER_BINDING_COUNT; ++i) {
+      bool sampled = i < DENOISER_SAMPLED_BINDING_COUNT;
+      writes[i] = (VkWriteDescriptorSet){
+          .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+          .dstSet = self->descriptor_sets[set],
+          .dstBinding = i,
+          .descriptorType = sampled ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
+                                    : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+          .descriptorCount = 1,
+          .pImageInfo =
+              sampled ? &sampled_infos[i]
+                      : &storage_infos[i - DENOISER_SAMPLED_BINDING_COUNT],
+      };
+    }
+    vkUpdateDescriptorSets(renderer->device, DENOISER_BINDING_COUNT, writes, 0,
+                           NULL);
+  }
+}
+
+VkImageView denoiser_output(Denoiser *self) { return self->images[0].view; }
+
+void denoiser_record(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                     Denoiser *self) {
+  VkExtent2D extent = renderer->physical_device_info.swapchain_extent;
+  u32 iterations = clamp(self->iterations, 1u, DENOISER_MAX_ITERATIONS);
+
+  // the trace render pass wrote the accumulation and the g-buffers, the
+  // previous frame's present pass may still be sampling the output
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(cmdbuffer,
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0,
+                       NULL, 0, NULL);
+
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE, self->pipeline);
+  for (u32 i = 0; i < iterations; ++i) {
+    // counted back from the last iteration so that it writes `images[0]`
+    u32 set = (iterations - 1 - i) % 2;
+    vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            self->pipeline_layout, 0, 1,
+                            &self->descriptor_sets[set], 0, NULL);
+
+    DenoisePushConstants push_constants = {
+        .iteration = i,
+        .normal_phi = self->normal_phi,
+        .position_phi = self->position_phi,
+        .luminance_phi = self->luminance_phi,
+    };
+    vkCmdPushConstants(cmdbuffer, self->pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(DenoisePushConstants), &push_constants);
+
+    vkCmdDispatch(cmdbuffer,
+                  (extent.width + DENOISER_GROUP_SIZE - 1) /
+                      DENOISER_GROUP_SIZE,
+                  (extent.height + DENOISER_GROUP_SIZE - 1) /
+                      DENOISER_GROUP_SIZE,
+                  1);
+
+    bool last = i + 1 == iterations;
+    barrier = (VkMemoryBarrier){
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                         (last ? 0 : VK_ACCESS_SHADER_WRITE_BIT),
+    };
+    vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         last ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                              : VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, NULL, 0, NULL);
+  }
+}
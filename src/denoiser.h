@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vulkan/vulkan_core.h>
+
+#include "renderer.h"
+#include "types.h"
+
+/// the most iterations `denoiser_record` runs, the taps of the last one are
+/// 2^(n - 1) pixels apart
+static const u32 DENOISER_MAX_ITERATIONS = 6;
+
+/// must match `PushConstants` in `shaders/denoise.comp`
+typedef struct {
+  u32 iteration;
+  /// how sharply differences in the first bounce normals stop the filter
+  f32 normal_phi;
+  /// the squared world space distance at which the weight of a tap falls to
+  /// 1/e
+  f32 position_phi;
+  /// how many standard deviations of luminance a tap may be away from the
+  /// pixel
+  f32 luminance_phi;
+} DenoisePushConstants;
+
+/// An edge-avoiding a-trous wavelet filter over the accumulation, after
+/// Dammertz et al. 2010 with the variance guided luminance weights of SVGF.
+/// Each iteration blurs with a 5x5 b3 spline kernel whose taps spread twice as
+/// far as the last, weighted down across differences in the first bounce
+/// position, normal and object id and by how far their luminance is from the
+/// pixel's relative to its standard error. The error comes from the moments of
+/// the accumulation and is filtered along, so the filter backs off as the
+/// accumulation converges. `present.frag` shows the result in place of the
+/// accumulation.
+typedef struct Denoiser_t {
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+  /// set i writes `images[i]` and reads the other one
+  VkDescriptorSet descriptor_sets[2];
+  VkPipelineLayout pipeline_layout;
+  VkPipeline pipeline;
+
+  bool enabled;
+  u32 iterations;
+  f32 normal_phi;
+  f32 position_phi;
+  f32 luminance_phi;
+
+  /// ping pong targets of the iterations, the last one always writes the
+  /// first image
+  FramebufferAttachment images[2];
+} Denoiser;
+
+Denoiser *denoiser_new(Renderer *renderer);
+void denoiser_destroy(Renderer *renderer, Denoiser *self);
+
+/// (Re)creates the images for the swapchain extent and points the descriptor
+/// sets at them and the renderer's attachments, called whenever those are
+/// recreated.
+void denoiser_resize(Renderer *renderer, Denoiser *self);
+
+/// The view of the denoised image, valid until the next `denoiser_resize`.
+VkImageView denoiser_output(Denoiser *self);
+
+/// Filters the accumulation, recorded after the trace render pass. Leaves the
+/// output ready to be sampled by fragment shaders.
+void denoiser_record(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                     Denoiser *self);
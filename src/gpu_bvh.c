@@ -0,0 +1,374 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "SDL_timer.h"
+#include "ccVector.h"
+#include <vulkan/vulkan_core.h>
+
+#include "gpu_bvh.h"
+#include "log.h"
+#include "maths.h"
+#include "renderer.h"
+#include "trimesh.h"
+#include "types.h"
+
+#include "shaders/embed/lbvh_bounds_comp_spv.h"
+#include "shaders/embed/lbvh_hierarchy_comp_spv.h"
+#include "shaders/embed/lbvh_morton_comp_spv.h"
+#include "shaders/embed/lbvh_radix_count_comp_spv.h"
+#include "shaders/embed/lbvh_radix_scan_comp_spv.h"
+#include "shaders/embed/lbvh_radix_scatter_comp_spv.h"
+
+// must match `src/shaders/common/lbvh.glsl`
+typedef struct {
+  vec4 scene_min;
+  vec4 scene_inv_extent;
+  u32 triangle_count;
+  u32 shift;
+  u32 group_count;
+  u32 in_offset;
+  u32 out_offset;
+  /// where the blas being built lives in the shared buffers, see
+  /// `BlasOffsets`
+  u32 triangle_offset;
+  u32 node_offset;
+} LbvhPushConstants;
+
+static const u32 LBVH_BINDING_COUNT = 7;
+static const u32 LBVH_GROUP_SIZE = 256;
+// radix sort parameters, must match `src/shaders/common/lbvh.glsl`
+static const u32 RADIX_BITS = 4;
+static const u32 RADIX_SIZE = 16;
+static const u32 RADIX_BLOCK = 2048;
+// minimum guaranteed `maxComputeWorkGroupCount`
+static const u32 MAX_GROUP_COUNT_X = 65535;
+
+VkPipeline create_lbvh_pipeline(Renderer *renderer, GpuBvhBuilder *self,
+                                const unsigned char *spv, usize spv_len) {
+  VkShaderModule shader = create_shader_module(renderer->device, spv, spv_len);
+
+  VkComputePipelineCreateInfo pipeline_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage =
+          (VkPipelineShaderStageCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+              .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+              .module = shader,
+              .pName = "main",
+          },
+      .layout = self->pipeline_layout,
+  };
+
+  VkPipeline pipeline;
+  ASSURE_VK(vkCreateComputePipelines(renderer->device, VK_NULL_HANDLE, 1,
+                                     &pipeline_create_info, NULL, &pipeline));
+
+  vkDestroyShaderModule(renderer->device, shader, NULL);
+
+  return pipeline;
+}
+
+GpuBvhBuilder gpu_bvh_builder_new(Renderer *renderer) {
+  GpuBvhBuilder self = {0};
+
+  VkDescriptorSetLayoutBinding bindings[LBVH_BINDING_COUNT];
+  for (u32 i = 0; i < LBVH_BINDING_COUNT; ++i) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+  }
+  VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = LBVH_BINDING_COUNT,
+      .pBindings = bindings,
+  };
+  ASSURE_VK(vkCreateDescriptorSetLayout(renderer->device,
+                                        &descriptor_set_layout_create_info,
+                                        NULL, &self.descriptor_set_layout));
+
+  VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = 1,
+      .poolSizeCount = 1,
+      .pPoolSizes =
+          &(VkDescriptorPoolSize){
+              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+              LBVH_BINDING_COUNT,
+          },
+  };
+  ASSURE_VK(vkCreateDescriptorPool(renderer->device,
+                                   &descriptor_pool_create_info, NULL,
+                                   &self.descriptor_pool));
+
+  VkDescriptorSetAllocateInfo descriptor_set_alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = self.descriptor_pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = &self.descriptor_set_layout,
+  };
+  ASSURE_VK(vkAllocateDescriptorSets(
+      renderer->device, &descriptor_set_alloc_info, &self.descriptor_set));
+
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = &self.descriptor_set_layout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges =
+          &(VkPushConstantRange){
+              .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+              .offset = 0,
+              .size = sizeof(LbvhPushConstants),
+          },
+  };
+  ASSURE_VK(vkCreatePipelineLayout(renderer->device,
+                                   &pipeline_layout_create_info, NULL,
+                                   &self.pipeline_layout));
+
+  self.morton_pipeline = create_lbvh_pipeline(
+      renderer, &self, lbvh_morton_comp_spv_data, lbvh_morton_comp_spv_size);
+  self.radix_count_pipeline =
+      create_lbvh_pipeline(renderer, &self, lbvh_radix_count_comp_spv_data,
+                           lbvh_radix_count_comp_spv_size);
+  self.radix_scan_pipeline =
+      create_lbvh_pipeline(renderer, &self, lbvh_radix_scan_comp_spv_data,
+                           lbvh_radix_scan_comp_spv_size);
+  self.radix_scatter_pipeline =
+      create_lbvh_pipeline(renderer, &self, lbvh_radix_scatter_comp_spv_data,
+                           lbvh_radix_scatter_comp_spv_size);
+  self.hierarchy_pipeline =
+      create_lbvh_pipeline(renderer, &self, lbvh_hierarchy_comp_spv_data,
+                           lbvh_hierarchy_comp_spv_size);
+  self.bounds_pipeline = create_lbvh_pipeline(
+      renderer, &self, lbvh_bounds_comp_spv_data, lbvh_bounds_comp_spv_size);
+
+  return self;
+}
+
+void gpu_bvh_builder_destroy(Renderer *renderer, GpuBvhBuilder *self) {
+  if (self->pipeline_layout == VK_NULL_HANDLE) {
+    return;
+  }
+
+  vkDestroyPipeline(renderer->device, self->morton_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->radix_count_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->radix_scan_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->radix_scatter_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->hierarchy_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->bounds_pipeline, NULL);
+  vkDestroyPipelineLayout(renderer->device, self->pipeline_layout, NULL);
+  vkDestroyDescriptorPool(renderer->device, self->descriptor_pool, NULL);
+  vkDestroyDescriptorSetLayout(renderer->device, self->descriptor_set_layout,
+                               NULL);
+}
+
+/// Makes every compute write visible to the next dispatch (or transfer).
+void lbvh_barrier(VkCommandBuffer cmdbuffer) {
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask =
+          VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(
+      cmdbuffer,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+/// One invocation per element, spilling over into y for large meshes.
+void lbvh_dispatch(VkCommandBuffer cmdbuffer, u32 count) {
+  u32 group_count = (count + LBVH_GROUP_SIZE - 1) / LBVH_GROUP_SIZE;
+  u32 x = min(group_count, MAX_GROUP_COUNT_X);
+  u32 y = (group_count + x - 1) / x;
+  vkCmdDispatch(cmdbuffer, x, y, 1);
+}
+
+/// Records the build of a single blas, the scratch buffers bound to the
+/// builder's descriptor set are reused by every blas.
+void gpu_bvh_record_blas(VkCommandBuffer cmdbuffer, GpuBvhBuilder *self,
+                         const TriangleMesh *blas, BlasOffsets offsets,
+                         Buffer flag_buffer) {
+  u32 triangle_count = blas->index_count / 3;
+  u32 radix_group_count = (triangle_count + RADIX_BLOCK - 1) / RADIX_BLOCK;
+
+  // morton codes are relative to the bounds of the object, this is the only
+  // pass over the geometry on the cpu.
+  Aabb bounds = aabb_empty();
+  for (u32 i = 0; i < blas->vertex_count; ++i) {
+    bounds = aabb_expand(bounds, blas->vertices[i].position);
+  }
+  vec3 extent = vec3Subtract(bounds.max, bounds.min);
+
+  LbvhPushConstants push_constants = {
+      .scene_min = (vec4){.xyz = bounds.min},
+      .triangle_count = triangle_count,
+      .group_count = radix_group_count,
+      .triangle_offset = offsets.triangle_offset,
+      .node_offset = offsets.node_offset,
+  };
+  for (u32 k = 0; k < 3; ++k) {
+    push_constants.scene_inv_extent.v[k] =
+        extent.v[k] > 0.0f ? 1.0f / extent.v[k] : 0.0f;
+  }
+
+  vkCmdFillBuffer(cmdbuffer, flag_buffer.handle, 0, VK_WHOLE_SIZE, 0);
+  lbvh_barrier(cmdbuffer);
+
+  vkCmdPushConstants(cmdbuffer, self->pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(LbvhPushConstants),
+                     &push_constants);
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    self->morton_pipeline);
+  lbvh_dispatch(cmdbuffer, triangle_count);
+  lbvh_barrier(cmdbuffer);
+
+  // 32 bit keys in 4 bit digits is an even number of passes, so the sorted
+  // keys end up back in the first half
+  for (u32 shift = 0; shift < 32; shift += RADIX_BITS) {
+    bool even = (shift / RADIX_BITS) % 2 == 0;
+    push_constants.shift = shift;
+    push_constants.in_offset = even ? 0 : triangle_count;
+    push_constants.out_offset = even ? triangle_count : 0;
+    vkCmdPushConstants(cmdbuffer, self->pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(LbvhPushConstants), &push_constants);
+
+    vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      self->radix_count_pipeline);
+    vkCmdDispatch(cmdbuffer, radix_group_count, 1, 1);
+    lbvh_barrier(cmdbuffer);
+
+    vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      self->radix_scan_pipeline);
+    vkCmdDispatch(cmdbuffer, 1, 1, 1);
+    lbvh_barrier(cmdbuffer);
+
+    vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      self->radix_scatter_pipeline);
+    vkCmdDispatch(cmdbuffer, radix_group_count, 1, 1);
+    lbvh_barrier(cmdbuffer);
+  }
+
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    self->hierarchy_pipeline);
+  lbvh_dispatch(cmdbuffer, triangle_count);
+  lbvh_barrier(cmdbuffer);
+
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                    self->bounds_pipeline);
+  lbvh_dispatch(cmdbuffer, triangle_count);
+  // the next blas reuses the scratch buffers
+  lbvh_barrier(cmdbuffer);
+}
+
+void gpu_bvh_build(Renderer *renderer, GpuBvhBuilder *self,
+                   const SceneGeometry *geometry, const bool *objects) {
+  u64 build_start = SDL_GetPerformanceCounter();
+
+  // scratch buffers are shared by every blas so they are sized for the biggest
+  u32 max_triangle_count = 1;
+  u32 built_triangle_count = 0;
+  u32 built_count = 0;
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    if (objects && !objects[i]) {
+      continue;
+    }
+    u32 triangle_count = geometry->blases[i].index_count / 3;
+    max_triangle_count = max(max_triangle_count, triangle_count);
+    built_triangle_count += triangle_count;
+    ++built_count;
+  }
+  u32 max_radix_group_count =
+      (max_triangle_count + RADIX_BLOCK - 1) / RADIX_BLOCK;
+
+  if (!objects) {
+    destroy_buffer(renderer, &renderer->bvh_buffer);
+    renderer->bvh_buffer = create_device_buffer(
+        renderer, geometry->node_count * sizeof(BvhNode),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+  }
+
+  // keys and values hold both halves of the radix sort's ping pong buffers
+  Buffer key_buffer =
+      create_device_buffer(renderer, 2 * max_triangle_count * sizeof(u32),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  Buffer value_buffer =
+      create_device_buffer(renderer, 2 * max_triangle_count * sizeof(u32),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  Buffer histogram_buffer = create_device_buffer(
+      renderer, RADIX_SIZE * max_radix_group_count * sizeof(u32),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  // one visit counter per internal node, at least one element so the buffer
+  // is valid for single triangle meshes
+  u32 flag_count = max(max_triangle_count - 1, 1u);
+  Buffer flag_buffer = create_device_buffer(
+      renderer, flag_count * sizeof(u32),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+  // the triangle buffer rather than the vertex buffer so the builder does not
+  // depend on the vertex format
+  VkBuffer buffers[LBVH_BINDING_COUNT] = {
+      renderer->triangle_buffer.handle, key_buffer.handle,
+      value_buffer.handle,              histogram_buffer.handle,
+      renderer->bvh_buffer.handle,      renderer->bvh_parent_buffer.handle,
+      flag_buffer.handle,
+  };
+  VkDescriptorBufferInfo buffer_infos[LBVH_BINDING_COUNT];
+  VkWriteDescriptorSet writes[LBVH_BINDING_COUNT];
+  for (u32 i = 0; i < LBVH_BINDING_COUNT; ++i) {
+    buffer_infos[i] = (VkDescriptorBufferInfo){
+        .buffer = buffers[i],
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+    writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = self->descriptor_set,
+        .dstBinding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .pBufferInfo = &buffer_infos[i],
+    };
+  }
+  vkUpdateDescriptorSets(renderer->device, LBVH_BINDING_COUNT, writes, 0, NULL);
+
+  VkCommandBuffer cmdbuffer = begin_immediate_submit(renderer);
+  vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          self->pipeline_layout, 0, 1, &self->descriptor_set, 0,
+                          NULL);
+
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    if (objects && !objects[i]) {
+      continue;
+    }
+    gpu_bvh_record_blas(cmdbuffer, self, &geometry->blases[i],
+                        geometry->blas_offsets[i], flag_buffer);
+  }
+
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0,
+                       NULL, 0, NULL);
+
+  end_immediate_submit(renderer, cmdbuffer);
+
+  destroy_buffer(renderer, &key_buffer);
+  destroy_buffer(renderer, &value_buffer);
+  destroy_buffer(renderer, &histogram_buffer);
+  destroy_buffer(renderer, &flag_buffer);
+
+  f64 build_ms = (f64)(SDL_GetPerformanceCounter() - build_start) * 1000.0 /
+                 (f64)SDL_GetPerformanceFrequency();
+  if (!objects) {
+    infoln("built %u lbvhs on the gpu over %u triangles (%u nodes) in %.2fms",
+           built_count, built_triangle_count, geometry->node_count, build_ms);
+  }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vulkan/vulkan_core.h>
+
+#include "scene.h"
+#include "trimesh.h"
+#include "types.h"
+
+typedef struct Renderer_t Renderer;
+
+/// Compute pipelines for building a linear bvh (morton codes, radix sort,
+/// Karras' hierarchy and bottom up bounds) directly into the bvh buffer. The
+/// output uses the same node layout as the cpu builder so the path tracer does
+/// not need to know which builder was used.
+typedef struct {
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_set;
+  VkPipelineLayout pipeline_layout;
+  VkPipeline morton_pipeline;
+  VkPipeline radix_count_pipeline;
+  VkPipeline radix_scan_pipeline;
+  VkPipeline radix_scatter_pipeline;
+  VkPipeline hierarchy_pipeline;
+  VkPipeline bounds_pipeline;
+} GpuBvhBuilder;
+
+GpuBvhBuilder gpu_bvh_builder_new(Renderer *renderer);
+void gpu_bvh_builder_destroy(Renderer *renderer, GpuBvhBuilder *self);
+
+/// Builds the blas of every object in `geometry` from the already uploaded
+/// vertex and index buffers into `renderer->bvh_buffer` at the object's
+/// `BlasOffsets`, the buffer is (re)created as a device local buffer. Their
+/// parents go to `renderer->bvh_parent_buffer` at the same offsets. If
+/// `objects` is not NULL only the objects it flags are rebuilt in place, which
+/// is how blases built on the gpu are updated after their vertices moved.
+/// Blocks until the build has finished.
+void gpu_bvh_build(Renderer *renderer, GpuBvhBuilder *self,
+                   const SceneGeometry *geometry, const bool *objects);
@@ -11,6 +11,7 @@
 #include "ccVector.h"
 #include "stb_image_write.h"
 
+#include "cpu_tracer.h"
 #include "envlight.h"
 #include "loader.h"
 #include "log.h"
@@ -23,10 +24,41 @@
 #define CIMGUI_DEFINE_ENUMS_AND_STRUCTS
 #include "cimgui.h"
 
+/// where frames are saved to, `.png` files get the presented frame and
+/// anything else the accumulation as an hdr
+const char *output_path = "out.hdr";
+
 void image_save_callback(u32 width, u32 height, vec4 *data) {
-  if (!stbi_write_hdr("out.hdr", width, height, 4, (f32 *)data)) {
+  if (!stbi_write_hdr(output_path, width, height, 4, (f32 *)data)) {
+    errorln("could not write image");
+  }
+}
+
+/// converts a frame from BGRA to RGB, the result must be freed
+u8 *swizzle_bgra_to_rgb(u32 width, u32 height, u8 *data) {
+  const u32 channels = 3;
+  u8 *swizzled_data = malloc(width * height * sizeof(u8) * channels);
+  for (u32 i = 0; i < width; ++i) {
+    for (u32 j = 0; j < height; ++j) {
+      for (u32 k = 0; k < channels; ++k) {
+        swizzled_data[(i + j * width) * channels + k] =
+            data[(i + j * width) * 4 + (channels - 1 - k)];
+      }
+    }
+  }
+
+  return swizzled_data;
+}
+
+void png_save_callback(u32 width, u32 height, u8 *data) {
+  const u32 channels = 3;
+  u8 *swizzled_data = swizzle_bgra_to_rgb(width, height, data);
+  if (!stbi_write_png(output_path, width, height, channels, swizzled_data,
+                      width * sizeof(u8) * channels)) {
     errorln("could not write image");
   }
+
+  free(swizzled_data);
 }
 
 typedef struct {
@@ -62,17 +94,8 @@ void write_png_data_to_userdata(void *context, void *data, int size) {
 }
 
 void set_clipboard_callback(u32 width, u32 height, u8 *data) {
-  // convert from BGRA to RGB
   const u32 channels = 3;
-  u8 *swizzled_data = malloc(width * height * sizeof(u8) * channels);
-  for (u32 i = 0; i < width; ++i) {
-    for (u32 j = 0; j < height; ++j) {
-      for (u32 k = 0; k < channels; ++k) {
-        swizzled_data[(i + j * width) * channels + k] =
-            data[(i + j * width) * 4 + (channels - 1 - k)];
-      }
-    }
-  }
+  u8 *swizzled_data = swizzle_bgra_to_rgb(width, height, data);
 
   ClipboardUserdata *ctx = malloc(sizeof(ClipboardUserdata));
   int res = stbi_write_png_to_func(write_png_data_to_userdata, ctx, width,
@@ -90,7 +113,289 @@ void set_clipboard_callback(u32 width, u32 height, u8 *data) {
   free(swizzled_data);
 }
 
+typedef struct {
+  const char *path;
+  Material material;
+} ObjectOption;
+
+static const u32 MAX_OBJECT_OPTIONS = 64;
+
+/// what the command line asks for, see `print_usage`
+typedef struct {
+  bool headless;
+  /// traces on the cpu instead, also without a window
+  bool cpu;
+  u32 width;
+  u32 height;
+  u32 samples;
+  u32 object_count;
+  ObjectOption objects[MAX_OBJECT_OPTIONS];
+  const char *envlight_path;
+  /// NULL leaves the bvh cache off, see `BvhBuildSettings`
+  const char *bvh_cache_directory;
+  bool camera_set;
+  vec3 eye;
+  vec3 target;
+  /// 0 keeps the renderer's default
+  f32 fov;
+} Options;
+
+void print_usage(const char *program) {
+  printf("usage: %s [options]\n"
+         "  --headless             render without a window and exit when "
+         "done\n"
+         "  --cpu                  like --headless but path traced on the "
+         "cpu\n"
+         "  --object path[:r,g,b]  add an obj with an albedo, repeatable, "
+         "replaces\n"
+         "                         the default scene\n"
+         "  --envlight path        the environment map\n"
+         "  --bvh-cache directory  cache built bvhs in the directory\n"
+         "  --eye x,y,z            the camera position\n"
+         "  --target x,y,z         the point the camera looks at\n"
+         "  --fov degrees          the vertical field of view\n"
+         "  --width n              the headless frame width (1280)\n"
+         "  --height n             the headless frame height (720)\n"
+         "  --spp n                the headless sample count (256)\n"
+         "  --out path             where frames are saved, .png or .hdr "
+         "(out.hdr)\n",
+         program);
+}
+
+bool parse_vec3(const char *str, vec3 *v) {
+  return sscanf(str, "%f,%f,%f", &v->x, &v->y, &v->z) == 3;
+}
+
+/// `path[:r,g,b]`, the albedo defaults to a light grey
+bool parse_object(char *str, ObjectOption *object) {
+  object->path = str;
+  object->material = (Material){.albedo = vec3New(0.8, 0.8, 0.8)};
+
+  char *separator = strrchr(str, ':');
+  if (separator && parse_vec3(separator + 1, &object->material.albedo)) {
+    *separator = '\0';
+  }
+
+  return object->path[0] != '\0';
+}
+
+/// exits on anything it doesn't understand
+Options parse_options(int argc, char **argv) {
+  Options options = {
+      .width = 1280,
+      .height = 720,
+      .samples = 256,
+  };
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    bool valid = true;
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      print_usage(argv[0]);
+      exit(0);
+    } else if (strcmp(arg, "--headless") == 0) {
+      options.headless = true;
+      continue;
+    } else if (strcmp(arg, "--cpu") == 0) {
+      options.cpu = true;
+      continue;
+    } else if (!value) {
+      valid = false;
+    } else if (strcmp(arg, "--object") == 0) {
+      valid = options.object_count < MAX_OBJECT_OPTIONS &&
+              parse_object(value, &options.objects[options.object_count++]);
+    } else if (strcmp(arg, "--envlight") == 0) {
+      options.envlight_path = value;
+    } else if (strcmp(arg, "--bvh-cache") == 0) {
+      options.bvh_cache_directory = value;
+    } else if (strcmp(arg, "--eye") == 0) {
+      valid = parse_vec3(value, &options.eye);
+      options.camera_set = true;
+    } else if (strcmp(arg, "--target") == 0) {
+      valid = parse_vec3(value, &options.target);
+      options.camera_set = true;
+    } else if (strcmp(arg, "--fov") == 0) {
+      valid = sscanf(value, "%f", &options.fov) == 1 && options.fov > 0.0;
+    } else if (strcmp(arg, "--width") == 0) {
+      valid = sscanf(value, "%u", &options.width) == 1 && options.width > 0;
+    } else if (strcmp(arg, "--height") == 0) {
+      valid = sscanf(value, "%u", &options.height) == 1 && options.height > 0;
+    } else if (strcmp(arg, "--spp") == 0) {
+      valid = sscanf(value, "%u", &options.samples) == 1 && options.samples > 0;
+    } else if (strcmp(arg, "--out") == 0) {
+      output_path = value;
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      errorln("invalid argument `%s`", arg);
+      print_usage(argv[0]);
+      exit(1);
+    }
+    ++i;
+  }
+
+  return options;
+}
+
+/// the objects and environment map from the command line, or the default
+/// scene if there are none
+Scene build_scene(const Options *options) {
+  Scene scene = scene_new();
+  scene.bvh_settings.cache_directory = options->bvh_cache_directory;
+  if (options->object_count == 0) {
+    // scene_add_object(&scene, "assets/models/lucy.obj",
+    //                  (Material){.albedo = vec3New(0.84, 0.9, 0.6)});
+    // scene_add_object(&scene, "assets/models/suzanne.obj",
+    //                  (Material){.albedo = vec3New(0.6, 0.84, 0.9)});
+    scene_add_object(&scene, "assets/models/xyzrgb_dragon.obj",
+                     (Material){.albedo = vec3New(0.84, 0.6, 0.9)});
+    scene_add_object(&scene, "assets/models/ground.obj",
+                     (Material){.albedo = vec3New(0.2, 0.2, 0.2)});
+  }
+  for (u32 i = 0; i < options->object_count; ++i) {
+    scene_add_object(&scene, options->objects[i].path,
+                     options->objects[i].material);
+  }
+
+  if (options->envlight_path) {
+    scene_set_envlight(&scene, options->envlight_path);
+  } else {
+    // scene_set_envlight(&scene, "assets/hdris/sunset_jhbcentral_4k.hdr");
+    // scene_set_envlight(&scene, "assets/hdris/satara_night_4k.hdr");
+    scene_set_envlight(&scene, "assets/hdris/studio_garden_4k.hdr");
+  }
+
+  return scene;
+}
+
+bool has_extension(const char *path, const char *extension) {
+  const char *dot = strrchr(path, '.');
+  return dot && strcmp(dot, extension) == 0;
+}
+
+/// renders the requested number of samples offscreen, saves them to
+/// `output_path` and exits, no window or display is needed
+int render_headless(const Options *options) {
+  Renderer renderer =
+      renderer_create_headless(options->width, options->height);
+
+  Scene scene = build_scene(options);
+  renderer_set_scene(&renderer, &scene);
+
+  if (options->fov > 0.0) {
+    renderer.camera_fov = options->fov;
+    renderer_set_or_update_camera(&renderer);
+  }
+  vec3 eye = vec3New(0.0, 1.0, -2.5);
+  vec3 target = vec3New(0.0, 1.0, 0.0);
+  if (options->camera_set) {
+    eye = options->eye;
+    target = options->target;
+  }
+  mat4x4LookAt(renderer.camera_view, eye, target, vec3New(0.0, 1.0, 0.0));
+
+  infoln("rendering %u samples at %ux%u", options->samples, options->width,
+         options->height);
+  while (renderer.accumulated_frames < options->samples) {
+    renderer_update(&renderer);
+  }
+
+  if (has_extension(output_path, ".png")) {
+    renderer_read_frame(&renderer, png_save_callback);
+  } else {
+    renderer_read_frame_hdr(&renderer, image_save_callback);
+  }
+  infoln("saved %s", output_path);
+
+  renderer_destroy(&renderer);
+  scene_destroy(&scene);
+
+  return 0;
+}
+
+/// `tonemap_aces` and the gamma of `present.frag`
+u8 tonemap_channel(f32 x) {
+  x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+  x = powf(max(x, 0.0f), 1.0f / 2.2f);
+  return (u8)(clamp(x, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+/// like `render_headless` but traced by a `CpuTracer`, needs no vulkan device
+int render_cpu(const Options *options) {
+  Scene scene = build_scene(options);
+  if (scene.bvh_settings.builder == BVH_BUILDER_GPU_LBVH) {
+    warnln("the cpu tracer can't trace lbvh blases, building them with sah");
+    scene.bvh_settings.builder = BVH_BUILDER_CPU_SAH;
+  }
+  // the tracer walks wide nodes either way, building them also keeps the
+  // leaves small enough for them
+  scene.bvh_settings.wide = true;
+  SceneGeometry geometry = scene_build_geometry(&scene);
+
+  // the same camera as `render_headless`, see `renderer_create`
+  CpuCamera camera = {
+      .lens_radius = 0.5,
+      .focal_dist = 20.0,
+  };
+  f32 fov = options->fov > 0.0 ? options->fov : 80.0;
+  mat4x4Perspective(camera.projection_matrix, fov * (M_PI / 180.0),
+                    (f32)options->width / (f32)options->height, 0.001, 1000.0);
+  vec3 eye = vec3New(0.0, 1.0, -2.5);
+  vec3 target = vec3New(0.0, 1.0, 0.0);
+  if (options->camera_set) {
+    eye = options->eye;
+    target = options->target;
+  }
+  mat4x4LookAt(camera.view_matrix, eye, target, vec3New(0.0, 1.0, 0.0));
+
+  CpuTracer *tracer =
+      cpu_tracer_new(&geometry, scene.materials, &scene.envlight);
+  vec4 *film = malloc(sizeof(vec4) * options->width * options->height);
+  infoln("rendering %u samples at %ux%u on the cpu", options->samples,
+         options->width, options->height);
+  cpu_tracer_render(tracer, &camera, options->width, options->height,
+                    options->samples, film);
+
+  if (has_extension(output_path, ".png")) {
+    const u32 channels = 3;
+    u32 texel_count = options->width * options->height;
+    u8 *data = malloc(sizeof(u8) * texel_count * channels);
+    for (u32 i = 0; i < texel_count; ++i) {
+      data[i * channels + 0] = tonemap_channel(film[i].x);
+      data[i * channels + 1] = tonemap_channel(film[i].y);
+      data[i * channels + 2] = tonemap_channel(film[i].z);
+    }
+    if (!stbi_write_png(output_path, options->width, options->height,
+                        channels, data, options->width * channels)) {
+      errorln("could not write image");
+    }
+    free(data);
+  } else {
+    image_save_callback(options->width, options->height, film);
+  }
+  infoln("saved %s", output_path);
+
+  free(film);
+  cpu_tracer_destroy(tracer);
+  scene_geometry_destroy(&geometry);
+  scene_destroy(&scene);
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+  if (options.cpu) {
+    return render_cpu(&options);
+  }
+  if (options.headless) {
+    return render_headless(&options);
+  }
+
   if (SDL_Init(SDL_INIT_VIDEO) == 1) {
     errorln("Failed to init SDL");
     exit(1);
@@ -107,26 +412,24 @@ int main(int argc, char **argv) {
 
   Renderer renderer = renderer_create(window);
 
-  Scene scene = scene_new();
-  // scene_add_object(&scene, "assets/models/lucy.obj",
-  //                  (Material){.albedo = vec3New(0.84, 0.9, 0.6)});
-  // scene_add_object(&scene, "assets/models/suzanne.obj",
-  //                  (Material){.albedo = vec3New(0.6, 0.84, 0.9)});
-  scene_add_object(&scene, "assets/models/xyzrgb_dragon.obj",
-                   (Material){.albedo = vec3New(0.84, 0.6, 0.9)});
-  scene_add_object(&scene, "assets/models/ground.obj",
-                   (Material){.albedo = vec3New(0.2, 0.2, 0.2)});
-  // scene_set_envlight(&scene, "assets/hdris/sunset_jhbcentral_4k.hdr");
-  // scene_set_envlight(&scene, "assets/hdris/satara_night_4k.hdr");
-  scene_set_envlight(&scene, "assets/hdris/studio_garden_4k.hdr");
-
+  Scene scene = build_scene(&options);
   renderer_set_scene(&renderer, &scene);
 
+  if (options.fov > 0.0) {
+    renderer.camera_fov = options.fov;
+    renderer_set_or_update_camera(&renderer);
+  }
+
   SDL_Event event;
   bool running = true;
 
   vec3 center = vec3New(0.0, 1.0, 0.0);
   vec3 eye = vec3Add(center, vec3New(0.0, -1.0, -2.5));
+  // the camera orbits the center, `eye` is relative to it
+  if (options.camera_set) {
+    center = options.target;
+    eye = vec3Subtract(options.eye, options.target);
+  }
   // vec3 center = vec3New(0.0, 2.0, 0.0);
   // vec3 eye = vec3Add(center, vec3New(7.0, 2.5, -7.0));
   const vec3 up = vec3New(0.0, 1.0, 0.0);
@@ -193,8 +496,8 @@ int main(int argc, char **argv) {
 
       if (camera_updated) {
         camera_updated = false;
+        // the renderer notices the move and reprojects the accumulation
         mat4x4LookAt(renderer.camera_view, vec3Add(eye, center), center, up);
-        renderer.accumulated_frames = 0;
       }
     }
 
@@ -15,14 +15,10 @@ static const f32 PI = 3.14159265358979323846;
   (((_sgn_val) > 0.0) ? 1.0 : ((_sgn_val) < 0.0) ? -1.0 : 0.0)
 
 #define min(_min_val_0, _min_val_1)                                            \
-  (((_min_val_0) < (_min_val_1))                                               \
-       ? (_min_val_0)                                                          \
-       : (_min_val_1)
+  (((_min_val_0) < (_min_val_1)) ? (_min_val_0) : (_min_val_1))
 
 #define max(_max_val_0, _max_val_1)                                            \
-  (((_max_val_0) < (_max_val_1))                                               \
-       ? (_max_val_0)                                                          \
-       : (_max_val_1)
+  (((_max_val_0) > (_max_val_1)) ? (_max_val_0) : (_max_val_1))
 
 // NOTE: using the same style as ccvector for consistency
 static inline vec3 vec3Min(vec3 a, vec3 b) {
@@ -45,6 +41,14 @@ static inline Aabb aabb_new(vec3 min, vec3 max) {
   };
 }
 
+/// An inverted box that any union or expansion will overwrite.
+static inline Aabb aabb_empty() {
+  return (Aabb){
+      .min = vec3New(INFINITY, INFINITY, INFINITY),
+      .max = vec3New(-INFINITY, -INFINITY, -INFINITY),
+  };
+}
+
 static inline Aabb aabb_from_vec3(vec3 p) {
   return (Aabb){
       .min = vec3Subtract(p, vec3New(1e-6, 1e-6, 1e-6)),
@@ -71,6 +75,18 @@ static inline Aabb aabb_expand(Aabb self, vec3 p) {
   };
 }
 
+static inline Aabb aabb_intersection(Aabb self, Aabb other) {
+  return (Aabb){
+      .min = vec3Max(self.min, other.min),
+      .max = vec3Min(self.max, other.max),
+  };
+}
+
+static inline bool aabb_is_empty(Aabb self) {
+  return self.min.x > self.max.x || self.min.y > self.max.y ||
+         self.min.z > self.max.z;
+}
+
 static inline vec3 aabb_centroid(Aabb self) {
   return vec3Multiply(vec3Add(self.min, self.max), 0.5f);
 }
@@ -90,4 +106,62 @@ static inline f32 aabb_surface_area(Aabb self) {
   vec3 d = vec3Subtract(self.max, self.min);
 
   return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
-}
\ No newline at end of file
+}
+
+/// Transforms the point `p` by the column major affine matrix `m`.
+static inline vec3 mat4x4TransformPoint(const mat4x4 m, vec3 p) {
+  vec3 r;
+  for (u32 i = 0; i < 3; ++i) {
+    r.v[i] = m[0].v[i] * p.x + m[1].v[i] * p.y + m[2].v[i] * p.z + m[3].v[i];
+  }
+
+  return r;
+}
+
+/// Inverts the column major affine matrix `m`, the last row is assumed to be
+/// `0 0 0 1`.
+static inline void mat4x4AffineInverse(mat4x4 out, const mat4x4 m) {
+  // `a[r][c]` is row `r` column `c` of the upper 3x3
+  f32 a[3][3];
+  for (u32 r = 0; r < 3; ++r) {
+    for (u32 c = 0; c < 3; ++c) {
+      a[r][c] = m[c].v[r];
+    }
+  }
+
+  f32 inv[3][3] = {
+      {a[1][1] * a[2][2] - a[1][2] * a[2][1],
+       a[0][2] * a[2][1] - a[0][1] * a[2][2],
+       a[0][1] * a[1][2] - a[0][2] * a[1][1]},
+      {a[1][2] * a[2][0] - a[1][0] * a[2][2],
+       a[0][0] * a[2][2] - a[0][2] * a[2][0],
+       a[0][2] * a[1][0] - a[0][0] * a[1][2]},
+      {a[1][0] * a[2][1] - a[1][1] * a[2][0],
+       a[0][1] * a[2][0] - a[0][0] * a[2][1],
+       a[0][0] * a[1][1] - a[0][1] * a[1][0]},
+  };
+  f32 det = a[0][0] * inv[0][0] + a[0][1] * inv[1][0] + a[0][2] * inv[2][0];
+  f32 inv_det = det != 0.0f ? 1.0f / det : 0.0f;
+
+  for (u32 c = 0; c < 3; ++c) {
+    out[c] = vec4New(inv[0][c] * inv_det, inv[1][c] * inv_det,
+                     inv[2][c] * inv_det, 0.0f);
+  }
+  out[3] = vec4New(0.0f, 0.0f, 0.0f, 1.0f);
+
+  vec3 t = mat4x4TransformPoint(out, vec3New(m[3].x, m[3].y, m[3].z));
+  out[3] = vec4New(-t.x, -t.y, -t.z, 1.0f);
+}
+
+/// Bounds of `self` after transforming it by `m`.
+static inline Aabb aabb_transform(Aabb self, const mat4x4 m) {
+  Aabb r = aabb_empty();
+  for (u32 i = 0; i < 8; ++i) {
+    vec3 corner = vec3New(i & 1 ? self.max.x : self.min.x,
+                          i & 2 ? self.max.y : self.min.y,
+                          i & 4 ? self.max.z : self.min.z);
+    r = aabb_expand(r, mat4x4TransformPoint(m, corner));
+  }
+
+  return r;
+}
@@ -1,3 +1,4 @@
+#include <float.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,13 +12,20 @@
 #define CIMGUI_DEFINE_ENUMS_AND_STRUCTS
 #include "cimgui.h"
 
+#include "compact_vertex.h"
+#include "denoiser.h"
+#include "gpu_bvh.h"
 #include "imgui_renderer.h"
 #include "log.h"
 #include "maths.h"
 #include "renderer.h"
+#include "reprojection.h"
 #include "scene.h"
+#include "tiles.h"
 #include "trimesh.h"
 #include "types.h"
+#include "wavefront.h"
+#include "wide_bvh.h"
 
 #include "embed/blue_noise/rgba_1024x1024_png.h"
 
@@ -76,13 +84,30 @@ vulkan_debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
   return VK_FALSE;
 }
 
-static const u32 REQUIRED_DEVICE_EXTENSION_COUNT = 2;
+/// only needed to present, a headless renderer requires none of them
+static const u32 REQUIRED_DEVICE_EXTENSION_COUNT = 1;
 static const char *REQUIRED_DEVICE_EXTENSIONS[REQUIRED_DEVICE_EXTENSION_COUNT] =
     {
         VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-        "VK_KHR_portability_subset",
 };
 
+/// only exposed by portability implementations like moltenvk, which must
+/// have it enabled
+static const char *PORTABILITY_SUBSET_EXTENSION_NAME =
+    "VK_KHR_portability_subset";
+
+bool extension_supported(u32 extension_count,
+                         const VkExtensionProperties *extension_props,
+                         const char *name) {
+  for (u32 i = 0; i < extension_count; ++i) {
+    if (strcmp(name, extension_props[i].extensionName) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 void find_swapchain_extent(SDL_Window *window,
                            PhysicalDeviceInfo *device_info) {
   if (device_info->surface_capabilities.currentExtent.width != UINT32_MAX) {
@@ -110,8 +135,11 @@ const VkFormat ACCEPTABLE_DEPTH_FORMATS[ACCEPTABLE_DEPTH_FORMAT_COUNT] = {
     VK_FORMAT_D24_UNORM_S8_UINT,
 };
 
+/// `surface` is `VK_NULL_HANDLE` for a headless renderer, which needs neither
+/// present support nor the swapchain extension.
 PhysicalDeviceInfo get_physical_device(VkInstance instance, SDL_Window *window,
                                        VkSurfaceKHR surface) {
+  bool headless = surface == VK_NULL_HANDLE;
   u32 device_count;
   vkEnumeratePhysicalDevices(instance, &device_count, NULL);
   VkPhysicalDevice *devices = malloc(device_count * sizeof(VkPhysicalDevice));
@@ -143,32 +171,30 @@ PhysicalDeviceInfo get_physical_device(VkInstance instance, SDL_Window *window,
     vkEnumerateDeviceExtensionProperties(device_info.device, NULL,
                                          &extension_count, extension_props);
 
-    bool found_extension[REQUIRED_DEVICE_EXTENSION_COUNT] = {0};
-    for (u32 i = 0; i < REQUIRED_DEVICE_EXTENSION_COUNT; ++i) {
-      for (u32 j = 0; j < extension_count; ++j) {
-        if (strcmp(REQUIRED_DEVICE_EXTENSIONS[i],
-                   extension_props[j].extensionName) == 0) {
-          found_extension[i] = true;
-          break;
-        }
-      }
-    }
-
     bool found_all_required_extensions = true;
-    for (u32 i = 0; i < REQUIRED_DEVICE_EXTENSION_COUNT; ++i) {
-      if (!found_extension[i]) {
+    for (u32 i = 0; i < REQUIRED_DEVICE_EXTENSION_COUNT && !headless; ++i) {
+      if (!extension_supported(extension_count, extension_props,
+                               REQUIRED_DEVICE_EXTENSIONS[i])) {
         found_all_required_extensions = false;
         break;
       }
     }
+    device_info.portability_subset = extension_supported(
+        extension_count, extension_props, PORTABILITY_SUBSET_EXTENSION_NAME);
 
     if (!found_all_required_extensions) {
       free(extension_props);
       continue;
     }
 
-    // find surface format
-    {
+    // find surface format, the offscreen image takes the format the swapchain
+    // usually has so frames read back the same
+    if (headless) {
+      device_info.surface_format = (VkSurfaceFormatKHR){
+          .format = VK_FORMAT_B8G8R8A8_UNORM,
+          .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
+      };
+    } else {
       vkGetPhysicalDeviceSurfaceCapabilitiesKHR(
           device_info.device, surface, &device_info.surface_capabilities);
       u32 format_count;
@@ -213,19 +239,21 @@ PhysicalDeviceInfo get_physical_device(VkInstance instance, SDL_Window *window,
     }
 
     // find present mode
-    u32 present_mode_count;
-    vkGetPhysicalDeviceSurfacePresentModesKHR(device_info.device, surface,
-                                              &present_mode_count, NULL);
-    if (present_mode_count == 0) {
-      continue;
-    }
-    VkPresentModeKHR *present_modes =
-        malloc(present_mode_count * sizeof(VkPresentModeKHR));
-    vkGetPhysicalDeviceSurfacePresentModesKHR(
-        device_info.device, surface, &present_mode_count, present_modes);
+    u32 present_mode_count = 0;
+    VkPresentModeKHR *present_modes = NULL;
     device_info.present_mode = VK_PRESENT_MODE_FIFO_KHR;
-    for (u32 i = 0; i < present_mode_count; ++i) {
-      device_info.present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+    if (!headless) {
+      vkGetPhysicalDeviceSurfacePresentModesKHR(device_info.device, surface,
+                                                &present_mode_count, NULL);
+      if (present_mode_count == 0) {
+        continue;
+      }
+      present_modes = malloc(present_mode_count * sizeof(VkPresentModeKHR));
+      vkGetPhysicalDeviceSurfacePresentModesKHR(
+          device_info.device, surface, &present_mode_count, present_modes);
+      for (u32 i = 0; i < present_mode_count; ++i) {
+        device_info.present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+      }
     }
 
     // get queue families
@@ -244,6 +272,9 @@ PhysicalDeviceInfo get_physical_device(VkInstance instance, SDL_Window *window,
         device_info.graphics_family_index = i;
       }
 
+      if (headless) {
+        continue;
+      }
       VkBool32 presentSupport = false;
       vkGetPhysicalDeviceSurfaceSupportKHR(device_info.device, i, surface,
                                            &presentSupport);
@@ -252,8 +283,12 @@ PhysicalDeviceInfo get_physical_device(VkInstance instance, SDL_Window *window,
       }
     }
 
-    // get extent
-    find_swapchain_extent(window, &device_info);
+    // get extent, the caller picks it without a window
+    if (headless) {
+      device_info.present_family_index = device_info.graphics_family_index;
+    } else {
+      find_swapchain_extent(window, &device_info);
+    }
 
     free(present_modes);
     free(queue_families);
@@ -352,10 +387,8 @@ create_framebuffer_attachment(Renderer *renderer, VkFormat format,
                    &fba.memory);
   vkBindImageMemory(renderer->device, fba.image, fba.memory, 0);
 
-  VkImageAspectFlags aspect_mask = 0;
-  if (usage & VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT) {
-    aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
-  } else if (usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+  VkImageAspectFlags aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT;
+  if (usage & VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT) {
     aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT;
     if (format >= VK_FORMAT_D16_UNORM_S8_UINT) {
       aspect_mask |= VK_IMAGE_ASPECT_STENCIL_BIT;
@@ -464,6 +497,36 @@ Buffer create_buffer(Renderer *self, u32 size, void *data,
   };
 }
 
+Buffer create_device_buffer(Renderer *self, u32 size,
+                            VkBufferUsageFlags usage) {
+  VkBufferCreateInfo create_info = (VkBufferCreateInfo){
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+  };
+  VkBuffer buffer;
+  ASSURE_VK(vkCreateBuffer(self->device, &create_info, NULL, &buffer));
+
+  VkMemoryRequirements mem_reqs;
+  vkGetBufferMemoryRequirements(self->device, buffer, &mem_reqs);
+
+  VkMemoryAllocateInfo allocate_info = (VkMemoryAllocateInfo){
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = mem_reqs.size,
+      .memoryTypeIndex = find_memory_type(self, mem_reqs.memoryTypeBits,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT),
+  };
+  VkDeviceMemory memory;
+  ASSURE_VK(vkAllocateMemory(self->device, &allocate_info, NULL, &memory));
+  vkBindBufferMemory(self->device, buffer, memory, 0);
+
+  return (Buffer){
+      .handle = buffer,
+      .memory = memory,
+  };
+}
+
 void destroy_buffer(Renderer *self, Buffer *buffer) {
   if (buffer->handle != VK_NULL_HANDLE) {
     vkDestroyBuffer(self->device, buffer->handle, NULL);
@@ -634,7 +697,7 @@ void destroy_image(Renderer *self, Image *image) {
   }
 }
 
-void create_swapchain(Renderer *self) {
+void create_swapchain_images(Renderer *self) {
   VkSwapchainCreateInfoKHR swapchain_create_info = (VkSwapchainCreateInfoKHR){
       .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
       .surface = self->surface,
@@ -712,23 +775,55 @@ void create_swapchain(Renderer *self) {
     ASSURE_VK(vkCreateImageView(self->device, &swapchain_image_view_create_info,
                                 NULL, &self->swapchain_image_views[i]));
   }
+}
+
+/// the single image a headless renderer presents to, it is read back like a
+/// swapchain image
+void create_offscreen_image(Renderer *self) {
+  self->offscreen_attachment = create_framebuffer_attachment(
+      self, self->physical_device_info.surface_format.format,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+
+  self->swapchain_image_count = 1;
+  if (!self->swapchain_images) {
+    self->swapchain_images = malloc(sizeof(VkImage));
+  }
+  if (!self->swapchain_image_views) {
+    self->swapchain_image_views = malloc(sizeof(VkImageView));
+  }
+  self->swapchain_images[0] = self->offscreen_attachment.image;
+  self->swapchain_image_views[0] = self->offscreen_attachment.view;
+}
+
+/// Creates the images presented to and every attachment sized to them.
+void create_swapchain(Renderer *self) {
+  if (self->headless) {
+    create_offscreen_image(self);
+  } else {
+    create_swapchain_images(self);
+  }
 
   self->depth_attachment = create_framebuffer_attachment(
       self, self->physical_device_info.depth_format,
       VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT);
 
+  // the g-buffers, the accumulation and the moments are copied into the
+  // history of `Reprojection`
   self->normal_attachment = create_framebuffer_attachment(
       self, VK_FORMAT_R32G32B32A32_SFLOAT,
       VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT);
+          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+          VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
   self->position_attachment = create_framebuffer_attachment(
       self, VK_FORMAT_R32G32B32A32_SFLOAT,
       VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT);
+          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+          VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
   self->object_index_attachment = create_framebuffer_attachment(
       self, VK_FORMAT_R32_UINT,
       VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
-          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT);
+          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+          VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
 
   self->trace_output_attachment = create_framebuffer_attachment(
       self, VK_FORMAT_R32G32B32A32_SFLOAT,
@@ -739,31 +834,44 @@ void create_swapchain(Renderer *self) {
       VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
           VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
           VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+  self->trace_moments_attachment = create_framebuffer_attachment(
+      self, VK_FORMAT_R32G32B32A32_SFLOAT,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+          VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+          VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
 
-  // transition the trace accumulation attachment
+  // transition the trace accumulation and moments attachments, they are
+  // loaded every frame
   {
     VkCommandBuffer cmdbuffer = begin_immediate_submit(self);
-    VkImageMemoryBarrier image_memory_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = self->trace_accumulation_attachment.image,
-        .subresourceRange =
-            (VkImageSubresourceRange){
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .baseMipLevel = 0,
-                .levelCount = 1,
-                .baseArrayLayer = 0,
-                .layerCount = 1,
-            },
-        .srcAccessMask = 0,
-        .dstAccessMask = 0,
+    VkImage images[] = {
+        self->trace_accumulation_attachment.image,
+        self->trace_moments_attachment.image,
     };
+    VkImageMemoryBarrier image_memory_barriers[2];
+    for (u32 i = 0; i < 2; ++i) {
+      image_memory_barriers[i] = (VkImageMemoryBarrier){
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = images[i],
+          .subresourceRange =
+              (VkImageSubresourceRange){
+                  .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                  .baseMipLevel = 0,
+                  .levelCount = 1,
+                  .baseArrayLayer = 0,
+                  .layerCount = 1,
+              },
+          .srcAccessMask = 0,
+          .dstAccessMask = 0,
+      };
+    }
     vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
                          VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, NULL, 0, NULL,
-                         1, &image_memory_barrier);
+                         2, image_memory_barriers);
     end_immediate_submit(self, cmdbuffer);
   }
 }
@@ -781,7 +889,7 @@ void create_framebuffers(Renderer *self) {
   for (u32 i = 0; i < self->swapchain_image_count; i++) {
     // trace framebuffer
     {
-      const u32 attachment_count = 6;
+      const u32 attachment_count = 7;
       VkImageView attachments[attachment_count] = {
           self->trace_output_attachment.view,
           self->position_attachment.view,
@@ -789,6 +897,7 @@ void create_framebuffers(Renderer *self) {
           self->object_index_attachment.view,
           self->trace_accumulation_attachment.view,
           self->depth_attachment.view,
+          self->trace_moments_attachment.view,
       };
 
       VkFramebufferCreateInfo framebuffer_create_info =
@@ -847,27 +956,27 @@ void renderer_set_or_update_camera(Renderer *self) {
 
 typedef struct {
   mat4x4 camera_matrix;
+  /// whether the normals are octahedral encoded, see `CompactVertex`
+  u32 compact_vertices;
 } FirstBouncePushConstants;
 
-typedef struct {
-  mat4x4 view_matrix;
-  mat4x4 projection_matrix;
-  u32 vertex_count;
-  u32 index_count;
-  u32 node_count;
-  u32 object_count;
-  u32 frame;
-  f32 env_focal_dist;
-  f32 env_lens_radius;
-  f32 environment_map_pdf_scale;
-} PathTracePushConstants;
-
 typedef struct {
   u32 mode;
+  /// whether the accumulation mode shows the `Denoiser` output
+  u32 denoised;
 } PresentPushConstants;
 
 typedef struct {
+  /// the view projection of the history, see `Reprojection`
+  mat4x4 previous_camera_matrix;
   u32 frame;
+  /// the same as `PathTracePushConstants`, the converged pixels keep their
+  /// accumulation
+  f32 adaptive_threshold;
+  u32 adaptive_min_samples;
+  /// whether the accumulation continues from the reprojected history
+  u32 reproject;
+  u32 history_cap;
 } AccumulatePushConstants;
 
 const u32 VALIDATION_LAYER_COUNT = 1;
@@ -875,13 +984,17 @@ const char *VALIDATION_LAYERS[VALIDATION_LAYER_COUNT] = {
     "VK_LAYER_KHRONOS_validation",
 };
 
-Renderer renderer_create(SDL_Window *window) {
+/// `window` is NULL for a headless renderer, which renders at `extent`
+/// instead of the size of the window.
+Renderer renderer_init(SDL_Window *window, VkExtent2D extent) {
   Renderer renderer = {0};
+  renderer.headless = window == NULL;
 
   bool enable_validation_layers = true;
   { // create instance & debug stuffs
-    unsigned int extension_count;
-    if (!SDL_Vulkan_GetInstanceExtensions(&extension_count, NULL)) {
+    unsigned int extension_count = 0;
+    if (!renderer.headless &&
+        !SDL_Vulkan_GetInstanceExtensions(&extension_count, NULL)) {
       errorln("failed to get number of vulkan instance extensions from SDL");
       exit(1);
     }
@@ -889,19 +1002,40 @@ Renderer renderer_create(SDL_Window *window) {
     const char **extensions = (const char **)malloc(
         (extension_count + extra_extensions) * sizeof(const char *));
 
-    if (!SDL_Vulkan_GetInstanceExtensions(&extension_count, extensions)) {
+    if (!renderer.headless &&
+        !SDL_Vulkan_GetInstanceExtensions(&extension_count, extensions)) {
       errorln("failed to get vulkan instance extensions from SDL");
       exit(1);
     }
 
-    extensions[extension_count] = VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME;
-    extensions[extension_count + 1] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
-    extension_count += extra_extensions;
+    // not every loader has the portability enumeration, it only matters to
+    // moltenvk
+    u32 available_extension_count;
+    ASSURE_VK(vkEnumerateInstanceExtensionProperties(
+        NULL, &available_extension_count, NULL));
+    VkExtensionProperties *available_extensions =
+        malloc(available_extension_count * sizeof(VkExtensionProperties));
+    ASSURE_VK(vkEnumerateInstanceExtensionProperties(
+        NULL, &available_extension_count, available_extensions));
+
+    bool portability_enumeration = extension_supported(
+        available_extension_count, available_extensions,
+        VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
+    if (portability_enumeration) {
+      extensions[extension_count++] =
+          VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME;
+    }
 
     if (!assure_validation_layer_support(1, VALIDATION_LAYERS)) {
       warnln("could not get all validation layers requested.\n");
       enable_validation_layers = false;
     }
+    // the debug messenger is only created along with the validation layers,
+    // which bring the debug utils with them
+    if (enable_validation_layers) {
+      extensions[extension_count++] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
+    }
+    free(available_extensions);
 
     VkDebugUtilsMessengerCreateInfoEXT debug_utils_create_info = {
         .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
@@ -916,8 +1050,11 @@ Renderer renderer_create(SDL_Window *window) {
 
     VkInstanceCreateInfo create_info = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-        .pNext = (void *)&debug_utils_create_info,
-        .flags = VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR,
+        .pNext = enable_validation_layers ? (void *)&debug_utils_create_info
+                                          : NULL,
+        .flags = portability_enumeration
+                     ? VK_INSTANCE_CREATE_ENUMERATE_PORTABILITY_BIT_KHR
+                     : 0,
         .enabledExtensionCount = extension_count,
         .ppEnabledExtensionNames = extensions,
         .pApplicationInfo =
@@ -957,11 +1094,16 @@ Renderer renderer_create(SDL_Window *window) {
   }
 
   // create surface
-  SDL_Vulkan_CreateSurface(window, renderer.instance, &renderer.surface);
+  if (!renderer.headless) {
+    SDL_Vulkan_CreateSurface(window, renderer.instance, &renderer.surface);
+  }
 
   { // create device & queues
     renderer.physical_device_info =
         get_physical_device(renderer.instance, window, renderer.surface);
+    if (renderer.headless) {
+      renderer.physical_device_info.swapchain_extent = extent;
+    }
 
     // create logical device
     f32 queue_priority = 1.0;
@@ -998,11 +1140,16 @@ Renderer renderer_create(SDL_Window *window) {
     }
 
     VkPhysicalDeviceFeatures enabled_features = {};
-    const u32 device_extension_count = REQUIRED_DEVICE_EXTENSION_COUNT;
-    const char **device_extensions =
-        (const char **)malloc(device_extension_count * sizeof(const char *));
+    u32 device_extension_count =
+        renderer.headless ? 0 : REQUIRED_DEVICE_EXTENSION_COUNT;
+    const char **device_extensions = (const char **)malloc(
+        (REQUIRED_DEVICE_EXTENSION_COUNT + 1) * sizeof(const char *));
     memcpy(device_extensions, REQUIRED_DEVICE_EXTENSIONS,
-           REQUIRED_DEVICE_EXTENSION_COUNT * sizeof(const char *));
+           device_extension_count * sizeof(const char *));
+    if (renderer.physical_device_info.portability_subset) {
+      device_extensions[device_extension_count++] =
+          PORTABILITY_SUBSET_EXTENSION_NAME;
+    }
 
     VkDeviceCreateInfo device_create_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
@@ -1045,7 +1192,7 @@ Renderer renderer_create(SDL_Window *window) {
                                   NULL, &renderer.command_pool));
   }
 
-  { // create swapchain
+  { // create swapchain, a headless renderer has a single offscreen image
     renderer.swapchain_image_count =
         renderer.physical_device_info.surface_capabilities.minImageCount + 1;
     if (renderer.physical_device_info.surface_capabilities.maxImageCount != 0 &&
@@ -1127,6 +1274,17 @@ Renderer renderer_create(SDL_Window *window) {
         .finalLayout = VK_IMAGE_LAYOUT_GENERAL,
     };
 
+    VkAttachmentDescription moments_attachment_desc = {
+        .format = renderer.trace_moments_attachment.format,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .finalLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
     VkAttachmentDescription depth_attachment_desc = {
         .format = renderer.physical_device_info.depth_format,
         .samples = VK_SAMPLE_COUNT_1_BIT,
@@ -1156,24 +1314,33 @@ Renderer renderer_create(SDL_Window *window) {
         trace_subpass_attachment_refs[trace_attachment_count] = {
             {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
         };
+    // the moments of the previous frames tell which pixels are converged
+    const u32 trace_input_attachment_count = 4;
     VkAttachmentReference
-        trace_subpass_input_attachment_refs[first_bounce_attachment_count] = {
+        trace_subpass_input_attachment_refs[trace_input_attachment_count] = {
             {1, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // position
             {2, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // normal
             {3, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // object index
+            {6, VK_IMAGE_LAYOUT_GENERAL},                  // moments
         };
 
-    const u32 accumulate_attachment_count = 1;
+    const u32 accumulate_attachment_count = 2;
     VkAttachmentReference
-        accumulate_subpass_attachment_refs[trace_attachment_count] = {
+        accumulate_subpass_attachment_refs[accumulate_attachment_count] = {
             {4, VK_IMAGE_LAYOUT_GENERAL},
+            {6, VK_IMAGE_LAYOUT_GENERAL},
         };
 
-    const u32 accumulate_input_attachment_count = 2;
+    // the first bounce tells where to reproject the accumulation from
+    const u32 accumulate_input_attachment_count = 6;
     VkAttachmentReference
         accumulate_input_attachment_refs[accumulate_input_attachment_count] = {
             {0, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // frame
             {4, VK_IMAGE_LAYOUT_GENERAL},                  // accumulation
+            {6, VK_IMAGE_LAYOUT_GENERAL},                  // moments
+            {1, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // position
+            {2, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // normal
+            {3, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL}, // object index
         };
     const u32 subpass_desc_count = 3;
     VkSubpassDescription subpass_descs[subpass_desc_count] = {
@@ -1185,7 +1352,7 @@ Renderer renderer_create(SDL_Window *window) {
         },
         (VkSubpassDescription){
             .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-            .inputAttachmentCount = first_bounce_attachment_count,
+            .inputAttachmentCount = trace_input_attachment_count,
             .pInputAttachments = trace_subpass_input_attachment_refs,
             .colorAttachmentCount = trace_attachment_count,
             .pColorAttachments = trace_subpass_attachment_refs,
@@ -1199,7 +1366,7 @@ Renderer renderer_create(SDL_Window *window) {
         },
     };
 
-    const u32 render_pass_dependency_count = 4;
+    const u32 render_pass_dependency_count = 5;
     VkSubpassDependency render_pass_dependencies[render_pass_dependency_count] =
         {
             {
@@ -1230,6 +1397,15 @@ Renderer renderer_create(SDL_Window *window) {
                 .dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT,
                 .dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT,
             },
+            {
+                .srcSubpass = 0,
+                .dstSubpass = 2,
+                .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                .dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                .dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT,
+                .dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT,
+            },
             {
                 .srcSubpass = 2,
                 .dstSubpass = VK_SUBPASS_EXTERNAL,
@@ -1242,11 +1418,12 @@ Renderer renderer_create(SDL_Window *window) {
             },
         };
 
-    const u32 attachment_desc_count = 6;
+    const u32 attachment_desc_count = 7;
     VkAttachmentDescription attachment_descs[attachment_desc_count] = {
         color_attachment_desc,        position_attachment_desc,
         normal_attachment_desc,       object_index_attachment_desc,
         accumulation_attachment_desc, depth_attachment_desc,
+        moments_attachment_desc,
     };
     VkRenderPassCreateInfo render_pass_create_info = (VkRenderPassCreateInfo){
         .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -1334,7 +1511,9 @@ Renderer renderer_create(SDL_Window *window) {
                                  NULL, &renderer.present_render_pass));
   }
 
-  { // create attachments and gui renderpass
+  // the gui is drawn straight onto the swapchain image before it is
+  // presented
+  if (!renderer.headless) { // create attachments and gui renderpass
 
     VkAttachmentDescription swapchain_attachment_desc = {
         .format = renderer.physical_device_info.surface_format.format,
@@ -1431,9 +1610,9 @@ Renderer renderer_create(SDL_Window *window) {
   { // create descriptor pool
     const u32 pool_sizes_len = 3;
     VkDescriptorPoolSize pool_sizes[pool_sizes_len] = {
-        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 9},
-        {VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 5},
-        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 15},
+        {VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 10},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8},
     };
 
     VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
@@ -1495,13 +1674,21 @@ Renderer renderer_create(SDL_Window *window) {
         renderer.device, &first_bounce_shader_pipeline_layout_create_info, NULL,
         &renderer.first_bounce_pipeline_layout));
 
-    VkVertexInputBindingDescription first_bounce_vertex_input_binding_desc =
-        (VkVertexInputBindingDescription){
-            .binding = 0,
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
-            .stride = sizeof(Vertex),
+    const u32 first_bounce_vertex_input_binding_desc_count = 2;
+    VkVertexInputBindingDescription first_bounce_vertex_input_binding_descs
+        [first_bounce_vertex_input_binding_desc_count] = {
+            (VkVertexInputBindingDescription){
+                .binding = 0,
+                .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+                .stride = sizeof(Vertex),
+            },
+            (VkVertexInputBindingDescription){
+                .binding = 1,
+                .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+                .stride = sizeof(GpuInstance),
+            },
         };
-    const u32 first_bounce_vertex_input_attr_desc_count = 2;
+    const u32 first_bounce_vertex_input_attr_desc_count = 11;
     VkVertexInputAttributeDescription first_bounce_vertex_input_attr_descs
         [first_bounce_vertex_input_attr_desc_count] = {
             (VkVertexInputAttributeDescription){
@@ -1518,7 +1705,114 @@ Renderer renderer_create(SDL_Window *window) {
                 .format = VK_FORMAT_R32G32B32_SFLOAT,
                 .offset = offsetof(Vertex, normal),
             },
+            // the columns of `GpuInstance.object_to_world`
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 2,
+                .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                .offset = offsetof(GpuInstance, object_to_world[0]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 3,
+                .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                .offset = offsetof(GpuInstance, object_to_world[1]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 4,
+                .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                .offset = offsetof(GpuInstance, object_to_world[2]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 5,
+                .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                .offset = offsetof(GpuInstance, object_to_world[3]),
+            },
+            // the upper 3x3 of `GpuInstance.world_to_object` for the normals
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 6,
+                .format = VK_FORMAT_R32G32B32_SFLOAT,
+                .offset = offsetof(GpuInstance, world_to_object[0]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 7,
+                .format = VK_FORMAT_R32G32B32_SFLOAT,
+                .offset = offsetof(GpuInstance, world_to_object[1]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 8,
+                .format = VK_FORMAT_R32G32B32_SFLOAT,
+                .offset = offsetof(GpuInstance, world_to_object[2]),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 9,
+                .format = VK_FORMAT_R32G32B32_SFLOAT,
+                .offset = offsetof(GpuInstance, position_origin),
+            },
+            (VkVertexInputAttributeDescription){
+                .binding = 1,
+                .location = 10,
+                .format = VK_FORMAT_R32G32B32_SFLOAT,
+                .offset = offsetof(GpuInstance, position_scale),
+            },
+        };
+
+    // the compact pipeline only swaps out the per vertex attributes, the
+    // shader decodes both formats
+    VkVertexInputBindingDescription compact_vertex_input_binding_descs
+        [first_bounce_vertex_input_binding_desc_count];
+    memcpy(compact_vertex_input_binding_descs,
+           first_bounce_vertex_input_binding_descs,
+           sizeof(compact_vertex_input_binding_descs));
+    compact_vertex_input_binding_descs[0].stride = sizeof(CompactVertex);
+
+    VkVertexInputAttributeDescription compact_vertex_input_attr_descs
+        [first_bounce_vertex_input_attr_desc_count];
+    memcpy(compact_vertex_input_attr_descs,
+           first_bounce_vertex_input_attr_descs,
+           sizeof(compact_vertex_input_attr_descs));
+    compact_vertex_input_attr_descs[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+    compact_vertex_input_attr_descs[0].offset =
+        offsetof(CompactVertex, position);
+    compact_vertex_input_attr_descs[1].format = VK_FORMAT_R16G16_SNORM;
+    compact_vertex_input_attr_descs[1].offset = offsetof(CompactVertex, normal);
+
+    VkPipelineVertexInputStateCreateInfo
+        first_bounce_vertex_input_states[VERTEX_FORMAT_COUNT] = {
+            [VERTEX_FORMAT_FULL] =
+                (VkPipelineVertexInputStateCreateInfo){
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+                    .vertexBindingDescriptionCount =
+                        first_bounce_vertex_input_binding_desc_count,
+                    .pVertexBindingDescriptions =
+                        first_bounce_vertex_input_binding_descs,
+                    .vertexAttributeDescriptionCount =
+                        first_bounce_vertex_input_attr_desc_count,
+                    .pVertexAttributeDescriptions =
+                        first_bounce_vertex_input_attr_descs,
+                },
+            [VERTEX_FORMAT_COMPACT] =
+                (VkPipelineVertexInputStateCreateInfo){
+                    .sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+                    .vertexBindingDescriptionCount =
+                        first_bounce_vertex_input_binding_desc_count,
+                    .pVertexBindingDescriptions =
+                        compact_vertex_input_binding_descs,
+                    .vertexAttributeDescriptionCount =
+                        first_bounce_vertex_input_attr_desc_count,
+                    .pVertexAttributeDescriptions =
+                        compact_vertex_input_attr_descs,
+                },
         };
+
     const u32 blend_attachment_states_count = 3;
     VkPipelineColorBlendAttachmentState
         blend_attachment_states[blend_attachment_states_count] = {
@@ -1550,17 +1844,7 @@ Renderer renderer_create(SDL_Window *window) {
             .renderPass = renderer.trace_render_pass,
             .subpass = 0,
             .pVertexInputState =
-                &(VkPipelineVertexInputStateCreateInfo){
-                    .sType =
-                        VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-                    .vertexBindingDescriptionCount = 1,
-                    .pVertexBindingDescriptions =
-                        &first_bounce_vertex_input_binding_desc,
-                    .vertexAttributeDescriptionCount =
-                        first_bounce_vertex_input_attr_desc_count,
-                    .pVertexAttributeDescriptions =
-                        first_bounce_vertex_input_attr_descs,
-                },
+                &first_bounce_vertex_input_states[VERTEX_FORMAT_FULL],
             .pInputAssemblyState =
                 &(VkPipelineInputAssemblyStateCreateInfo){
                     .sType =
@@ -1621,16 +1905,26 @@ Renderer renderer_create(SDL_Window *window) {
                 },
         };
 
-    vkCreateGraphicsPipelines(renderer.device, VK_NULL_HANDLE, 1,
-                              &first_bounce_pipeline_create_info, NULL,
-                              &renderer.first_bounce_pipeline);
+    VkGraphicsPipelineCreateInfo
+        first_bounce_pipeline_create_infos[VERTEX_FORMAT_COUNT];
+    for (u32 i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+      first_bounce_pipeline_create_infos[i] = first_bounce_pipeline_create_info;
+      first_bounce_pipeline_create_infos[i].pVertexInputState =
+          &first_bounce_vertex_input_states[i];
+    }
+
+    vkCreateGraphicsPipelines(renderer.device, VK_NULL_HANDLE,
+                              VERTEX_FORMAT_COUNT,
+                              first_bounce_pipeline_create_infos, NULL,
+                              renderer.first_bounce_pipelines);
 
     vkDestroyShaderModule(renderer.device, first_bounce_frag_shader, NULL);
     vkDestroyShaderModule(renderer.device, first_bounce_vert_shader, NULL);
   }
 
   { // path trace pipeline
-    const u32 binding_count = 11;
+    const u32 binding_count = 16;
+    // the scene bindings are shared with the wavefront kernels
     VkDescriptorSetLayoutBinding bindings[binding_count] = {
         {
             .binding = 0,
@@ -1654,48 +1948,90 @@ Renderer renderer_create(SDL_Window *window) {
             .binding = 3,
             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 4,
             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 5,
             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 6,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 7,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 8,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 9,
             .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
             .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
         },
         {
             .binding = 10,
             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 1,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 11,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 12,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 13,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 14,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags =
+                VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        },
+        {
+            .binding = 15,
+            .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+            .descriptorCount = 1,
             .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
         },
     };
@@ -1842,30 +2178,59 @@ Renderer renderer_create(SDL_Window *window) {
                 },
         };
 
-    vkCreateGraphicsPipelines(renderer.device, VK_NULL_HANDLE, 1,
-                              &trace_pipeline_create_info, NULL,
-                              &renderer.trace_pipeline);
+    // `TO_VISIT_LEN` in common/scene.glsl
+    VkSpecializationMapEntry trace_specialization_entry = {
+        .constantID = 0,
+        .offset = 0,
+        .size = sizeof(u32),
+    };
+    VkSpecializationInfo trace_specialization_infos[BVH_TRAVERSAL_COUNT];
+    VkPipelineShaderStageCreateInfo
+        trace_traversal_stage_create_infos[BVH_TRAVERSAL_COUNT][2];
+    VkGraphicsPipelineCreateInfo
+        trace_pipeline_create_infos[BVH_TRAVERSAL_COUNT];
+    for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; ++i) {
+      trace_specialization_infos[i] = (VkSpecializationInfo){
+          .mapEntryCount = 1,
+          .pMapEntries = &trace_specialization_entry,
+          .dataSize = sizeof(u32),
+          .pData = &BVH_TRAVERSAL_STACK_LENGTHS[i],
+      };
+      trace_traversal_stage_create_infos[i][0] =
+          trace_shader_stage_create_infos[0];
+      trace_traversal_stage_create_infos[i][1] =
+          trace_shader_stage_create_infos[1];
+      trace_traversal_stage_create_infos[i][1].pSpecializationInfo =
+          &trace_specialization_infos[i];
+      trace_pipeline_create_infos[i] = trace_pipeline_create_info;
+      trace_pipeline_create_infos[i].pStages =
+          trace_traversal_stage_create_infos[i];
+    }
+
+    vkCreateGraphicsPipelines(renderer.device, VK_NULL_HANDLE,
+                              BVH_TRAVERSAL_COUNT, trace_pipeline_create_infos,
+                              NULL, renderer.trace_pipelines);
 
     vkDestroyShaderModule(renderer.device, trace_frag_shader, NULL);
     vkDestroyShaderModule(renderer.device, trace_vert_shader, NULL);
   }
 
   { // accumulate pipeline
-    const u32 binding_count = 2;
-    VkDescriptorSetLayoutBinding bindings[binding_count] = {
-        {
-            .binding = 0,
-            .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
-            .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-        },
-        {
-            .binding = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
-            .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-        },
-    };
+    // the input attachments, then the history of `Reprojection`
+    const u32 input_attachment_binding_count = 6;
+    const u32 binding_count =
+        input_attachment_binding_count + REPROJECTION_HISTORY_COUNT;
+    VkDescriptorSetLayoutBinding bindings[binding_count];
+    for (u32 i = 0; i < binding_count; ++i) {
+      bindings[i] = (VkDescriptorSetLayoutBinding){
+          .binding = i,
+          .descriptorType = i < input_attachment_binding_count
+                                ? VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT
+                                : VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+      };
+    }
     VkDescriptorSetLayoutCreateInfo
         accumulate_descriptor_set_layout_create_info = {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
@@ -2003,14 +2368,24 @@ Renderer renderer_create(SDL_Window *window) {
                         VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
                     .logicOpEnable = VK_FALSE,
                     // .logicOp = VK_LOGIC_OP_COPY,
-                    .attachmentCount = 1,
+                    .attachmentCount = 2,
+                    // the accumulation and the moments
                     .pAttachments =
-                        &(VkPipelineColorBlendAttachmentState){
-                            .colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-                                              VK_COLOR_COMPONENT_G_BIT |
-                                              VK_COLOR_COMPONENT_B_BIT |
-                                              VK_COLOR_COMPONENT_A_BIT,
-                            .blendEnable = VK_FALSE,
+                        (VkPipelineColorBlendAttachmentState[]){
+                            {
+                                .colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+                                                  VK_COLOR_COMPONENT_G_BIT |
+                                                  VK_COLOR_COMPONENT_B_BIT |
+                                                  VK_COLOR_COMPONENT_A_BIT,
+                                .blendEnable = VK_FALSE,
+                            },
+                            {
+                                .colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+                                                  VK_COLOR_COMPONENT_G_BIT |
+                                                  VK_COLOR_COMPONENT_B_BIT |
+                                                  VK_COLOR_COMPONENT_A_BIT,
+                                .blendEnable = VK_FALSE,
+                            },
                         },
                 },
             .pDynamicState =
@@ -2031,7 +2406,7 @@ Renderer renderer_create(SDL_Window *window) {
   }
 
   { // present pipeline
-    const u32 binding_count = 5;
+    const u32 binding_count = 6;
     VkDescriptorSetLayoutBinding bindings[binding_count] = {
         {
             .binding = 0,
@@ -2063,6 +2438,12 @@ Renderer renderer_create(SDL_Window *window) {
             .descriptorCount = 1,
             .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
         },
+        {
+            .binding = 5,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        },
     };
     VkDescriptorSetLayoutCreateInfo present_descriptor_set_layout_create_info =
         {
@@ -2212,6 +2593,11 @@ Renderer renderer_create(SDL_Window *window) {
 
   create_framebuffers(&renderer);
 
+  renderer.denoiser = denoiser_new(&renderer);
+  denoiser_resize(&renderer, renderer.denoiser);
+  renderer.reprojection = reprojection_new();
+  reprojection_resize(&renderer, renderer.reprojection);
+
   { // create syncronization primitives and per frame data
     for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
       VkSemaphoreCreateInfo semaphore_create_info = (VkSemaphoreCreateInfo){
@@ -2240,6 +2626,49 @@ Renderer renderer_create(SDL_Window *window) {
     }
   }
 
+  { // trace pass timestamps for the tile scheduler
+    renderer.tiles = tile_scheduler_new();
+
+    u32 queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        renderer.physical_device_info.device, &queue_family_count, NULL);
+    VkQueueFamilyProperties *queue_families =
+        malloc(queue_family_count * sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        renderer.physical_device_info.device, &queue_family_count,
+        queue_families);
+    u32 timestamp_valid_bits =
+        queue_families[renderer.physical_device_info.graphics_family_index]
+            .timestampValidBits;
+    free(queue_families);
+
+    VkPhysicalDeviceProperties device_props;
+    vkGetPhysicalDeviceProperties(renderer.physical_device_info.device,
+                                  &device_props);
+    renderer.timestamp_period = device_props.limits.timestampPeriod;
+    renderer.timestamp_mask = timestamp_valid_bits >= 64
+                                  ? UINT64_MAX
+                                  : (1ull << timestamp_valid_bits) - 1;
+
+    if (timestamp_valid_bits == 0) {
+      warnln("the graphics queue has no timestamps, every frame traces all "
+             "tiles");
+    } else {
+      VkQueryPoolCreateInfo query_pool_create_info = {
+          .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+          .queryType = VK_QUERY_TYPE_TIMESTAMP,
+          .queryCount = 2 * MAX_FRAMES_IN_FLIGHT,
+      };
+      ASSURE_VK(vkCreateQueryPool(renderer.device, &query_pool_create_info,
+                                  NULL, &renderer.timestamp_query_pool));
+    }
+  }
+
+  { // adaptive sampling
+    renderer.adaptive_threshold = 0.01f;
+    renderer.adaptive_min_samples = 32;
+  }
+
   { // init camera
     mat4x4LookAt(renderer.camera_view, vec3New(0.0f, 0.0f, 1.0f),
                  vec3New(0.0f, 0.0f, 0.0f), vec3New(0.0f, 1.0f, 0.0f));
@@ -2272,19 +2701,47 @@ Renderer renderer_create(SDL_Window *window) {
   }
 
   renderer.present_mode = PRESENT_MODE_ACCUMULATION;
+  renderer.bvh_traversal = BVH_TRAVERSAL_SHORT_STACK;
 
-  renderer.imgui_impl = init_imgui_render_impl(&renderer, window);
+  if (!renderer.headless) {
+    renderer.imgui_impl = init_imgui_render_impl(&renderer, window);
+  } else {
+    // the tiles keep the gui responsive, a headless renderer is better off
+    // with whole frames so every frame is a sample of every pixel
+    renderer.tiles.enabled = false;
+  }
 
   return renderer;
 }
 
-void destroy_framebuffer_attachment(Renderer *renderer,
+Renderer renderer_create(SDL_Window *window) {
+  return renderer_init(window, (VkExtent2D){0});
+}
+
+Renderer renderer_create_headless(u32 width, u32 height) {
+  return renderer_init(NULL, (VkExtent2D){.width = width, .height = height});
+}
+
+void destroy_framebuffer_attachment(Renderer *renderer,
                                     FramebufferAttachment *fba) {
   vkDestroyImageView(renderer->device, fba->view, NULL);
   vkDestroyImage(renderer->device, fba->image, NULL);
   vkFreeMemory(renderer->device, fba->memory, NULL);
 }
 
+void destroy_swapchain_images(Renderer *self) {
+  if (self->headless) {
+    destroy_framebuffer_attachment(self, &self->offscreen_attachment);
+    return;
+  }
+
+  for (u32 i = 0; i < self->swapchain_image_count; i++) {
+    vkDestroyImageView(self->device, self->swapchain_image_views[i], NULL);
+  }
+
+  vkDestroySwapchainKHR(self->device, self->swapchain, NULL);
+}
+
 // NOTE: this isn't actually totally compliant because the present format (for
 // example) could have changed and we don't account for that. practically this
 // is Fine but not actually. shrug its late and i'm sleepy lol.
@@ -2299,21 +2756,20 @@ void recreate_swapchain(Renderer *self) {
   destroy_framebuffer_attachment(self, &self->object_index_attachment);
   destroy_framebuffer_attachment(self, &self->trace_output_attachment);
   destroy_framebuffer_attachment(self, &self->trace_accumulation_attachment);
+  destroy_framebuffer_attachment(self, &self->trace_moments_attachment);
 
   for (u32 i = 0; i < self->swapchain_image_count; i++) {
     vkDestroyFramebuffer(self->device, self->swapchain_framebuffers[i], NULL);
     vkDestroyFramebuffer(self->device, self->trace_framebuffers[i], NULL);
   }
 
-  for (u32 i = 0; i < self->swapchain_image_count; i++) {
-    vkDestroyImageView(self->device, self->swapchain_image_views[i], NULL);
-  }
-
-  vkDestroySwapchainKHR(self->device, self->swapchain, NULL);
+  destroy_swapchain_images(self);
   create_swapchain(self);
   create_framebuffers(self);
+  denoiser_resize(self, self->denoiser);
+  reprojection_resize(self, self->reprojection);
 
-  const u32 trace_input_descriptor_set_writes_count = 10;
+  const u32 trace_input_descriptor_set_writes_count = 11;
   VkWriteDescriptorSet trace_input_descriptor_set_writes
       [trace_input_descriptor_set_writes_count] = {
           {
@@ -2450,11 +2906,24 @@ void recreate_swapchain(Renderer *self) {
                       .sampler = self->vec3_sampler,
                   },
           },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->trace_descriptor_set,
+              .dstBinding = 15,
+              .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = self->trace_moments_attachment.view,
+                      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
       };
   vkUpdateDescriptorSets(self->device, trace_input_descriptor_set_writes_count,
                          trace_input_descriptor_set_writes, 0, NULL);
 
-  const u32 accumulate_sampler_descriptor_set_writes_count = 2;
+  const u32 accumulate_sampler_descriptor_set_writes_count = 6;
   VkWriteDescriptorSet accumulate_sampler_descriptor_set_writes
       [accumulate_sampler_descriptor_set_writes_count] = {
           {
@@ -2485,13 +2954,91 @@ void recreate_swapchain(Renderer *self) {
                       .sampler = self->vec3_sampler,
                   },
           },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->accumulate_descriptor_set,
+              .dstBinding = 2,
+              .dstArrayElement = 0,
+              .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = self->trace_moments_attachment.view,
+                      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->accumulate_descriptor_set,
+              .dstBinding = 3,
+              .dstArrayElement = 0,
+              .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = self->position_attachment.view,
+                      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->accumulate_descriptor_set,
+              .dstBinding = 4,
+              .dstArrayElement = 0,
+              .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = self->normal_attachment.view,
+                      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->accumulate_descriptor_set,
+              .dstBinding = 5,
+              .dstArrayElement = 0,
+              .descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = self->object_index_attachment.view,
+                      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
       };
 
   vkUpdateDescriptorSets(self->device,
                          accumulate_sampler_descriptor_set_writes_count,
                          accumulate_sampler_descriptor_set_writes, 0, NULL);
 
-  const u32 present_sampler_descriptor_set_writes_count = 5;
+  // the history of `Reprojection` follows the input attachments
+  VkDescriptorImageInfo history_infos[REPROJECTION_HISTORY_COUNT];
+  VkWriteDescriptorSet history_writes[REPROJECTION_HISTORY_COUNT];
+  for (u32 i = 0; i < REPROJECTION_HISTORY_COUNT; ++i) {
+    history_infos[i] = (VkDescriptorImageInfo){
+        .imageView = self->reprojection->history[i].view,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .sampler = self->vec3_sampler,
+    };
+    history_writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = self->accumulate_descriptor_set,
+        .dstBinding = accumulate_sampler_descriptor_set_writes_count + i,
+        .dstArrayElement = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .pImageInfo = &history_infos[i],
+    };
+  }
+  vkUpdateDescriptorSets(self->device, REPROJECTION_HISTORY_COUNT,
+                         history_writes, 0, NULL);
+
+  const u32 present_sampler_descriptor_set_writes_count = 6;
   VkWriteDescriptorSet present_sampler_descriptor_set_writes
       [present_sampler_descriptor_set_writes_count] = {
           {
@@ -2564,6 +3111,20 @@ void recreate_swapchain(Renderer *self) {
                       .sampler = self->vec3_sampler,
                   },
           },
+          {
+              .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              .dstSet = self->present_descriptor_set,
+              .dstBinding = 5,
+              .dstArrayElement = 0,
+              .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+              .descriptorCount = 1,
+              .pImageInfo =
+                  &(VkDescriptorImageInfo){
+                      .imageView = denoiser_output(self->denoiser),
+                      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+                      .sampler = self->vec3_sampler,
+                  },
+          },
       };
 
   vkUpdateDescriptorSets(self->device,
@@ -2585,7 +3146,9 @@ void renderer_resize(Renderer *self, u32 width, u32 height) {
 void renderer_destroy(Renderer *self) {
   vkDeviceWaitIdle(self->device);
 
-  imgui_renderer_destroy(self, &self->imgui_impl);
+  if (!self->headless) {
+    imgui_renderer_destroy(self, &self->imgui_impl);
+  }
 
   destroy_image(self, &self->blue_noise);
 
@@ -2596,7 +3159,20 @@ void renderer_destroy(Renderer *self) {
   destroy_buffer(self, &self->material_buffer);
   destroy_buffer(self, &self->vertex_buffer);
   destroy_buffer(self, &self->index_buffer);
+  destroy_buffer(self, &self->triangle_buffer);
   destroy_buffer(self, &self->bvh_buffer);
+  destroy_buffer(self, &self->bvh_parent_buffer);
+  destroy_buffer(self, &self->instance_buffer);
+  destroy_buffer(self, &self->tlas_buffer);
+  scene_geometry_destroy(&self->geometry);
+
+  gpu_bvh_builder_destroy(self, &self->gpu_bvh_builder);
+  wavefront_destroy(self, self->wavefront);
+  denoiser_destroy(self, self->denoiser);
+  reprojection_destroy(self, self->reprojection);
+  if (self->timestamp_query_pool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(self->device, self->timestamp_query_pool, NULL);
+  }
 
   for (usize i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
     PerFrameData *frame = &self->frame_data[i];
@@ -2617,13 +3193,16 @@ void renderer_destroy(Renderer *self) {
   destroy_framebuffer_attachment(self, &self->position_attachment);
   destroy_framebuffer_attachment(self, &self->trace_output_attachment);
   destroy_framebuffer_attachment(self, &self->trace_accumulation_attachment);
+  destroy_framebuffer_attachment(self, &self->trace_moments_attachment);
 
   for (u32 i = 0; i < self->swapchain_image_count; i++) {
     vkDestroyFramebuffer(self->device, self->swapchain_framebuffers[i], NULL);
     vkDestroyFramebuffer(self->device, self->trace_framebuffers[i], NULL);
   }
 
-  vkDestroyPipeline(self->device, self->trace_pipeline, NULL);
+  for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; ++i) {
+    vkDestroyPipeline(self->device, self->trace_pipelines[i], NULL);
+  }
   vkDestroyPipelineLayout(self->device, self->trace_pipeline_layout, NULL);
   vkDestroyDescriptorSetLayout(self->device, self->trace_descriptor_set_layout,
                                NULL);
@@ -2639,7 +3218,9 @@ void renderer_destroy(Renderer *self) {
   vkDestroyDescriptorSetLayout(self->device,
                                self->present_descriptor_set_layout, NULL);
 
-  vkDestroyPipeline(self->device, self->first_bounce_pipeline, NULL);
+  for (u32 i = 0; i < VERTEX_FORMAT_COUNT; ++i) {
+    vkDestroyPipeline(self->device, self->first_bounce_pipelines[i], NULL);
+  }
   vkDestroyPipelineLayout(self->device, self->first_bounce_pipeline_layout,
                           NULL);
 
@@ -2651,14 +3232,12 @@ void renderer_destroy(Renderer *self) {
 
   vkDestroyCommandPool(self->device, self->command_pool, NULL);
 
-  for (u32 i = 0; i < self->swapchain_image_count; i++) {
-    vkDestroyImageView(self->device, self->swapchain_image_views[i], NULL);
-  }
-
-  vkDestroySwapchainKHR(self->device, self->swapchain, NULL);
+  destroy_swapchain_images(self);
 
   vkDestroyDevice(self->device, NULL);
-  vkDestroySurfaceKHR(self->instance, self->surface, NULL);
+  if (self->surface != VK_NULL_HANDLE) {
+    vkDestroySurfaceKHR(self->instance, self->surface, NULL);
+  }
 
   if (self->debug_messenger != VK_NULL_HANDLE) {
     PFN_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessengerEXT =
@@ -2721,47 +3300,312 @@ void renderer_set_envlight(Renderer *self, EnvironmentLight *envlight) {
                          });
 }
 
+/// Host visible buffer holding `part_count` arrays back to back.
+Buffer create_buffer_from_parts(Renderer *self, u32 part_count, void **parts,
+                                const u32 *part_sizes,
+                                VkBufferUsageFlags usage) {
+  u32 size = 0;
+  for (u32 i = 0; i < part_count; ++i) {
+    size += part_sizes[i];
+  }
+
+  Buffer buffer = create_buffer(self, size, NULL, usage);
+
+  u8 *mapped_mem;
+  vkMapMemory(self->device, buffer.memory, 0, size, 0, (void **)&mapped_mem);
+  for (u32 i = 0; i < part_count; ++i) {
+    memcpy(mapped_mem, parts[i], part_sizes[i]);
+    mapped_mem += part_sizes[i];
+  }
+  vkUnmapMemory(self->device, buffer.memory);
+
+  return buffer;
+}
+
+/// The vertices of `object` in the format of the vertex buffer as a new array,
+/// `size` is set to its size in bytes.
+void *encode_vertex_buffer_part(const SceneGeometry *geometry, u32 object,
+                                u32 *size) {
+  const TriangleMesh *blas = &geometry->blases[object];
+  if (geometry->vertex_format == VERTEX_FORMAT_COMPACT) {
+    *size = blas->vertex_count * sizeof(CompactVertex);
+    return compact_vertices_new(blas->vertices, blas->vertex_count,
+                                geometry->object_bounds[object]);
+  }
+
+  *size = blas->vertex_count * sizeof(Vertex);
+  Vertex *vertices = malloc(*size);
+  memcpy(vertices, blas->vertices, *size);
+  return vertices;
+}
+
+/// The parent buffer's contents as a new array, the parents of every blas built
+/// on the cpu at their `node_offset` followed by the tlas parents. The entries
+/// of the blases built on the gpu are filled in by `gpu_bvh_build`.
+u32 *bvh_parents_new(const SceneGeometry *geometry) {
+  u32 *parents = calloc(geometry->node_count + geometry->tlas_node_count,
+                        sizeof(u32));
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    const TriangleMesh *blas = &geometry->blases[i];
+    u32 *blas_parents = parents + geometry->blas_offsets[i].node_offset;
+    if (geometry->wide && blas->wide_bvh_nodes) {
+      wide_bvh_parents(blas->wide_bvh_nodes, blas->wide_bvh_node_count,
+                       blas_parents);
+    } else if (!geometry->wide && blas->bvh_nodes) {
+      bvh_parents(blas->bvh_nodes, blas->bvh_node_count, blas_parents);
+    }
+  }
+  bvh_parents(geometry->tlas_nodes, geometry->tlas_node_count,
+              parents + geometry->node_count);
+
+  return parents;
+}
+
 void renderer_set_scene(Renderer *self, Scene *scene) {
   vkDeviceWaitIdle(self->device);
 
+  self->scene = scene;
+
   renderer_set_envlight(self, &scene->envlight);
 
-  self->mesh = scene_create_unified_mesh(scene);
+  scene_geometry_destroy(&self->geometry);
+  self->geometry = scene_build_geometry(scene);
+  SceneGeometry *geometry = &self->geometry;
 
   destroy_buffer(self, &self->vertex_buffer);
   destroy_buffer(self, &self->index_buffer);
+  destroy_buffer(self, &self->triangle_buffer);
   destroy_buffer(self, &self->bvh_buffer);
-
-  self->vertex_buffer = create_buffer(
-      self, self->mesh.vertex_count * sizeof(Vertex), self->mesh.vertices,
+  destroy_buffer(self, &self->bvh_parent_buffer);
+  destroy_buffer(self, &self->instance_buffer);
+  destroy_buffer(self, &self->tlas_buffer);
+
+  u32 object_count = geometry->object_count;
+  void **parts = malloc(sizeof(void *) * object_count);
+  u32 *part_sizes = malloc(sizeof(u32) * object_count);
+
+  usize vertex_buffer_size = 0;
+  for (u32 i = 0; i < object_count; ++i) {
+    parts[i] = encode_vertex_buffer_part(geometry, i, &part_sizes[i]);
+    vertex_buffer_size += part_sizes[i];
+  }
+  self->vertex_buffer = create_buffer_from_parts(
+      self, object_count, parts, part_sizes,
       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  for (u32 i = 0; i < object_count; ++i) {
+    free(parts[i]);
+  }
+  infoln("uploaded %u %s vertices (%.2f MiB)", geometry->vertex_count,
+         geometry->vertex_format == VERTEX_FORMAT_COMPACT ? "compact" : "full",
+         (f64)vertex_buffer_size / (1024.0 * 1024.0));
 
-  self->index_buffer = create_buffer(
-      self, self->mesh.index_count * sizeof(u32), self->mesh.indices,
+  for (u32 i = 0; i < object_count; ++i) {
+    parts[i] = geometry->blases[i].indices;
+    part_sizes[i] = geometry->blases[i].index_count * sizeof(u32);
+  }
+  self->index_buffer = create_buffer_from_parts(
+      self, object_count, parts, part_sizes,
       VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
-  self->bvh_buffer =
-      create_buffer(self, self->mesh.bvh_node_count * sizeof(BvhNode),
-                    self->mesh.bvh_nodes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  for (u32 i = 0; i < object_count; ++i) {
+    parts[i] = geometry->blases[i].triangles;
+    part_sizes[i] = geometry->blases[i].index_count / 3 * sizeof(LeafTriangle);
+  }
+  self->triangle_buffer =
+      create_buffer_from_parts(self, object_count, parts, part_sizes,
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+  u32 *parents = bvh_parents_new(geometry);
+  self->bvh_parent_buffer = create_buffer(
+      self, (geometry->node_count + geometry->tlas_node_count) * sizeof(u32),
+      parents, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  free(parents);
+
+  if (scene->bvh_settings.builder == BVH_BUILDER_GPU_LBVH) {
+    if (self->gpu_bvh_builder.pipeline_layout == VK_NULL_HANDLE) {
+      self->gpu_bvh_builder = gpu_bvh_builder_new(self);
+    }
+    gpu_bvh_build(self, &self->gpu_bvh_builder, geometry, NULL);
+  } else {
+    for (u32 i = 0; i < object_count; ++i) {
+      TriangleMesh *blas = &geometry->blases[i];
+      if (geometry->wide) {
+        parts[i] = blas->wide_bvh_nodes;
+        part_sizes[i] = blas->wide_bvh_node_count * sizeof(WideBvhNode);
+      } else {
+        parts[i] = blas->bvh_nodes;
+        part_sizes[i] = blas->bvh_node_count * sizeof(BvhNode);
+      }
+    }
+    self->bvh_buffer =
+        create_buffer_from_parts(self, object_count, parts, part_sizes,
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  }
+
+  free(parts);
+  free(part_sizes);
+
+  // zero sized buffers are invalid, the traversals never read the placeholder
+  // instance of a scene without any since its tlas is empty
+  u32 instance_count = geometry->instance_count;
+  self->instance_buffer = create_buffer(
+      self, max(instance_count, 1) * sizeof(GpuInstance),
+      instance_count != 0 ? geometry->instances : NULL,
+      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  self->tlas_buffer = create_buffer(
+      self, geometry->tlas_node_count * sizeof(BvhNode), geometry->tlas_nodes,
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
   self->materials = scene->materials;
-  self->material_count = scene->object_count;
+  self->material_count = scene->material_count;
 
   renderer_set_or_update_materials(self);
-  VkWriteDescriptorSet material_desc_set_write = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = self->trace_descriptor_set,
-      .dstBinding = 10,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-      .descriptorCount = 1,
-      .pBufferInfo =
-          &(VkDescriptorBufferInfo){
-              .buffer = self->material_buffer.handle,
-              .offset = 0,
-              .range = VK_WHOLE_SIZE,
-          },
+
+  const u32 scene_buffer_count = 8;
+  const u32 scene_buffer_bindings[scene_buffer_count] = {3,  4,  5,  10,
+                                                         11, 12, 13, 14};
+  const VkBuffer scene_buffers[scene_buffer_count] = {
+      self->vertex_buffer.handle,   self->index_buffer.handle,
+      self->bvh_buffer.handle,      self->material_buffer.handle,
+      self->instance_buffer.handle, self->tlas_buffer.handle,
+      self->triangle_buffer.handle, self->bvh_parent_buffer.handle,
   };
-  vkUpdateDescriptorSets(self->device, 1, &material_desc_set_write, 0, NULL);
+  VkDescriptorBufferInfo scene_buffer_infos[scene_buffer_count];
+  VkWriteDescriptorSet scene_desc_set_writes[scene_buffer_count];
+  for (u32 i = 0; i < scene_buffer_count; ++i) {
+    scene_buffer_infos[i] = (VkDescriptorBufferInfo){
+        .buffer = scene_buffers[i],
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+    scene_desc_set_writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = self->trace_descriptor_set,
+        .dstBinding = scene_buffer_bindings[i],
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .pBufferInfo = &scene_buffer_infos[i],
+    };
+  }
+  vkUpdateDescriptorSets(self->device, scene_buffer_count,
+                         scene_desc_set_writes, 0, NULL);
+}
+
+/// Copies `size` bytes of `data` to `offset` in a host visible buffer.
+void write_buffer(Renderer *self, Buffer *buffer, u32 offset, u32 size,
+                  const void *data) {
+  void *mapped_mem = NULL;
+  vkMapMemory(self->device, buffer->memory, offset, size, 0, &mapped_mem);
+  memcpy(mapped_mem, data, size);
+  vkUnmapMemory(self->device, buffer->memory);
+}
+
+void renderer_update_scene(Renderer *self, Scene *scene) {
+  if (!scene_geometry_refit(&self->geometry, scene)) {
+    renderer_set_scene(self, scene);
+    return;
+  }
+
+  // the previous frames may still be reading the buffers that get overwritten,
+  // this is only called before the current frame's fence is reset
+  VkFence fences[MAX_FRAMES_IN_FLIGHT];
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    fences[i] = self->frame_data[i].in_flight;
+  }
+  vkWaitForFences(self->device, MAX_FRAMES_IN_FLIGHT, fences, VK_TRUE,
+                  UINT64_MAX);
+
+  SceneGeometry *geometry = &self->geometry;
+  bool rebuild_on_gpu = scene->bvh_settings.builder == BVH_BUILDER_GPU_LBVH;
+  bool blases_moved = false;
+  for (u32 i = 0; i < geometry->object_count; ++i) {
+    if (!scene->dirty_objects[i]) {
+      continue;
+    }
+    blases_moved = true;
+
+    TriangleMesh *blas = &geometry->blases[i];
+    BlasOffsets offsets = geometry->blas_offsets[i];
+    // the compact vertices are requantized to the refit bounds
+    u32 vertices_size = 0;
+    void *vertices = encode_vertex_buffer_part(geometry, i, &vertices_size);
+    u32 vertex_size = geometry->vertex_format == VERTEX_FORMAT_COMPACT
+                          ? sizeof(CompactVertex)
+                          : sizeof(Vertex);
+    write_buffer(self, &self->vertex_buffer,
+                 offsets.vertex_offset * vertex_size, vertices_size, vertices);
+    free(vertices);
+    write_buffer(self, &self->triangle_buffer,
+                 offsets.triangle_offset * sizeof(LeafTriangle),
+                 blas->index_count / 3 * sizeof(LeafTriangle),
+                 blas->triangles);
+
+    if (rebuild_on_gpu) {
+      continue;
+    }
+    if (geometry->wide) {
+      write_buffer(self, &self->bvh_buffer,
+                   offsets.node_offset * sizeof(WideBvhNode),
+                   blas->wide_bvh_node_count * sizeof(WideBvhNode),
+                   blas->wide_bvh_nodes);
+    } else {
+      write_buffer(self, &self->bvh_buffer,
+                   offsets.node_offset * sizeof(BvhNode),
+                   blas->bvh_node_count * sizeof(BvhNode), blas->bvh_nodes);
+    }
+  }
+
+  // lbvhs are not refit, the moved blases are rebuilt in place instead
+  if (rebuild_on_gpu && blases_moved) {
+    gpu_bvh_build(self, &self->gpu_bvh_builder, geometry, scene->dirty_objects);
+  }
+
+  if (geometry->instance_count != 0) {
+    write_buffer(self, &self->instance_buffer, 0,
+                 geometry->instance_count * sizeof(GpuInstance),
+                 geometry->instances);
+  }
+  write_buffer(self, &self->tlas_buffer, 0,
+               geometry->tlas_node_count * sizeof(BvhNode),
+               geometry->tlas_nodes);
+  // the tlas is rebuilt rather than refit once it got too slow, the blas
+  // parents only change with their lbvhs which write them on the gpu
+  u32 *tlas_parents = malloc(geometry->tlas_node_count * sizeof(u32));
+  bvh_parents(geometry->tlas_nodes, geometry->tlas_node_count, tlas_parents);
+  write_buffer(self, &self->bvh_parent_buffer,
+               geometry->node_count * sizeof(u32),
+               geometry->tlas_node_count * sizeof(u32), tlas_parents);
+  free(tlas_parents);
+
+  scene_clear_dirty(scene);
+  self->accumulated_frames = 0;
+}
+
+void draw_bvh_stats_gui(const char *name, const BvhStats *stats) {
+  if (!igTreeNodeEx_Str(name, 0)) {
+    return;
+  }
+
+  if (stats->node_count == 0) {
+    igText("built on the gpu, no statistics");
+  } else {
+    igText("sah cost: %.2f", stats->sah_cost);
+    igText("nodes: %u (%.2f KiB)", stats->node_count,
+           (f64)stats->node_bytes / 1024.0);
+    igText("leaves: %u over %u triangles", stats->leaf_count,
+           stats->triangle_count);
+    igText("depth: max %u, avg %.2f", stats->max_depth, stats->average_depth);
+    igText("sibling overlap: %.3f", stats->sibling_overlap);
+
+    f32 histogram[BVH_STATS_HISTOGRAM_SIZE];
+    for (u32 i = 0; i < BVH_STATS_HISTOGRAM_SIZE; i++) {
+      histogram[i] = (f32)stats->leaf_histogram[i];
+    }
+    igPlotHistogram_FloatPtr("leaf sizes", histogram, BVH_STATS_HISTOGRAM_SIZE,
+                             0, NULL, 0.0f, FLT_MAX, (ImVec2){0, 60},
+                             sizeof(f32));
+  }
+  igTreePop();
 }
 
 void renderer_draw_gui(Renderer *self) {
@@ -2771,6 +3615,46 @@ void renderer_draw_gui(Renderer *self) {
            igGetIO()->Framerate);
     igText("Accumulated frames: %u", self->accumulated_frames);
 
+    // raising the threshold keeps the converged pixels, lowering it picks
+    // them back up
+    igSliderFloat("adaptive threshold", &self->adaptive_threshold, 0.0, 0.1,
+                  "%.4f", 0);
+    igSliderInt("adaptive min samples", (i32 *)&self->adaptive_min_samples, 1,
+                256, "%d", 0);
+
+    // the denoiser only changes what is shown, the accumulation carries on
+    igCheckbox("denoise", &self->denoiser->enabled);
+    if (self->denoiser->enabled) {
+      igSliderInt("denoise iterations", (i32 *)&self->denoiser->iterations, 1,
+                  DENOISER_MAX_ITERATIONS, "%d", 0);
+      igSliderFloat("normal phi", &self->denoiser->normal_phi, 1.0, 256.0,
+                    "%.0f", 0);
+      igSliderFloat("position phi", &self->denoiser->position_phi, 0.001, 1.0,
+                    "%.3f", 0);
+      igSliderFloat("luminance phi", &self->denoiser->luminance_phi, 0.1, 16.0,
+                    "%.1f", 0);
+    }
+
+    // turning it off restarts the accumulation on the next camera move
+    igCheckbox("reproject", &self->reprojection->enabled);
+    if (self->reprojection->enabled) {
+      igSliderInt("history cap", (i32 *)&self->reprojection->history_cap, 1,
+                  1024, "%d", 0);
+    }
+
+    if (igCheckbox("tiled", &self->tiles.enabled)) {
+      self->accumulated_frames = 0;
+    }
+    if (self->tiles.enabled) {
+      igSliderFloat("frame budget", &self->tiles.budget_ms, 1.0, 100.0,
+                    "%.1fms", 0);
+      igText("%u/%u tiles per frame, %.3f ms/tile",
+             min(self->tiles.tiles_per_frame,
+                 tile_count(self->physical_device_info.swapchain_extent)),
+             tile_count(self->physical_device_info.swapchain_extent),
+             self->tiles.tile_ms);
+    }
+
     const u32 num_items = 5;
     const char *items[num_items] = {"position", "normal", "object id", "color",
                                     "accumulation"};
@@ -2785,6 +3669,21 @@ void renderer_draw_gui(Renderer *self) {
       }
       igEndCombo();
     }
+
+    const char *trace_modes[TRACE_MODE_COUNT] = {"megakernel", "wavefront",
+                                                "persistent threads"};
+    if (igBeginCombo("trace mode", trace_modes[self->trace_mode], 0)) {
+      for (u32 i = 0; i < TRACE_MODE_COUNT; i++) {
+        bool selected = (self->trace_mode == i);
+        if (igSelectable_Bool(trace_modes[i], selected, 0, (ImVec2){0, 0})) {
+          self->trace_mode = i;
+          self->accumulated_frames = 0;
+        }
+        if (selected)
+          igSetItemDefaultFocus();
+      }
+      igEndCombo();
+    }
   }
   if (igCollapsingHeader_BoolPtr("Camera", NULL,
                                  ImGuiTreeNodeFlags_CollapsingHeader)) {
@@ -2824,24 +3723,122 @@ void renderer_draw_gui(Renderer *self) {
       renderer_set_or_update_materials(self);
     }
   }
+
+  if (self->geometry.blas_stats &&
+      igCollapsingHeader_BoolPtr("Bvh", NULL,
+                                 ImGuiTreeNodeFlags_CollapsingHeader)) {
+    const char *traversals[BVH_TRAVERSAL_COUNT] = {"full stack", "short stack",
+                                                   "parent links"};
+    if (igBeginCombo("traversal", traversals[self->bvh_traversal], 0)) {
+      for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; i++) {
+        bool selected = (self->bvh_traversal == i);
+        if (igSelectable_Bool(traversals[i], selected, 0, (ImVec2){0, 0})) {
+          self->bvh_traversal = i;
+          self->accumulated_frames = 0;
+        }
+        if (selected)
+          igSetItemDefaultFocus();
+      }
+      igEndCombo();
+    }
+
+    draw_bvh_stats_gui("tlas", &self->geometry.tlas_stats);
+    for (u32 i = 0; i < self->geometry.object_count; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "object %u", i);
+      draw_bvh_stats_gui(name, &self->geometry.blas_stats[i]);
+    }
+  }
+
+  if (self->scene &&
+      igTreeNodeEx_Str("Instances", ImGuiTreeNodeFlags_Framed)) {
+    Scene *scene = self->scene;
+    for (u32 i = 0; i < scene->instance_count; i++) {
+      igPushID_Ptr(&scene->instances[i]);
+      if (igTreeNodeEx_StrStr("instance", ImGuiTreeNodeFlags_CollapsingHeader,
+                              "instance %u (object %u)", i,
+                              scene->instances[i].object)) {
+        mat4x4 transform;
+        memcpy(transform, scene->instances[i].transform, sizeof(mat4x4));
+        if (igDragFloat3("translation", transform[3].v, 0.01f, 0.0f, 0.0f,
+                         "%.3f", 0)) {
+          scene_set_instance_transform(scene, i, transform);
+        }
+      }
+      igPopID();
+    }
+    igTreePop();
+  }
 }
 
 void renderer_update(Renderer *self) {
-  imgui_renderer_begin(self);
-  PerFrameData *frame = &self->frame_data[self->frame % MAX_FRAMES_IN_FLIGHT];
+  if (self->scene && scene_is_dirty(self->scene)) {
+    renderer_update_scene(self, self->scene);
+  }
+
+  if (!self->headless) {
+    imgui_renderer_begin(self);
+  }
+  u32 frame_slot = self->frame % MAX_FRAMES_IN_FLIGHT;
+  PerFrameData *frame = &self->frame_data[frame_slot];
   ++self->frame;
-  ++self->accumulated_frames;
+
+  mat4x4 camera_matrix;
+  mat4x4MultiplyMatrix(camera_matrix, self->camera_view,
+                       self->camera_projection);
+
+  // a camera move either carries the accumulation over into the new view or
+  // starts it over
+  Reprojection *reprojection = self->reprojection;
+  bool camera_moved = memcmp(camera_matrix, reprojection->camera_matrix,
+                             sizeof(mat4x4)) != 0;
+  bool reproject = camera_moved && reprojection->enabled &&
+                   reprojection->has_frame && self->accumulated_frames != 0;
+  if (camera_moved && !reproject) {
+    self->accumulated_frames = 0;
+  }
+
+  // a pixel's sample only counts once every tile got one, a reset of the
+  // accumulation restarts the sweep. every pixel has to be reprojected at once
+  // so those frames aren't tiled.
+  VkExtent2D extent = self->physical_device_info.swapchain_extent;
+  if (self->accumulated_frames == 0) {
+    tile_scheduler_restart(&self->tiles);
+  }
+  bool tiled = self->tiles.enabled &&
+               self->trace_mode == TRACE_MODE_MEGAKERNEL && !reproject;
+  TileRange tiles = tile_scheduler_next(&self->tiles, extent, tiled);
+  if (tiles.first == 0) {
+    ++self->accumulated_frames;
+  }
 
   vkWaitForFences(self->device, 1, &frame->in_flight, VK_TRUE, UINT64_MAX);
 
-  u32 image_index;
-  VkResult acquire_image_result = vkAcquireNextImageKHR(
-      self->device, self->swapchain, UINT64_MAX, frame->image_available,
-      VK_NULL_HANDLE, &image_index);
+  if (frame->traced_tiles != 0) {
+    u64 timestamps[2];
+    VkResult query_result = vkGetQueryPoolResults(
+        self->device, self->timestamp_query_pool, 2 * frame_slot, 2,
+        sizeof(timestamps), timestamps, sizeof(u64), VK_QUERY_RESULT_64_BIT);
+    if (query_result == VK_SUCCESS) {
+      u64 ticks = (timestamps[1] - timestamps[0]) & self->timestamp_mask;
+      f64 gpu_ms = (f64)ticks * self->timestamp_period / 1e6;
+      tile_scheduler_record_time(&self->tiles, frame->traced_tiles,
+                                 tile_count(extent), gpu_ms);
+    }
+    frame->traced_tiles = 0;
+  }
 
-  if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
-    recreate_swapchain(self);
-    return;
+  // a headless renderer always renders into its one offscreen image
+  u32 image_index = 0;
+  if (!self->headless) {
+    VkResult acquire_image_result = vkAcquireNextImageKHR(
+        self->device, self->swapchain, UINT64_MAX, frame->image_available,
+        VK_NULL_HANDLE, &image_index);
+
+    if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
+      recreate_swapchain(self);
+      return;
+    }
   }
 
   vkResetFences(self->device, 1, &frame->in_flight);
@@ -2854,7 +3851,56 @@ void renderer_update(Renderer *self) {
   };
   ASSURE_VK(vkBeginCommandBuffer(cmdbuffer, &cmdbuffer_begin_info));
 
-  const u32 render_pass_clear_value_count = 6;
+  if (reproject) {
+    reprojection_record_history(cmdbuffer, self, reprojection);
+  }
+
+  // only the megakernel's tiles are timed, the wavefront modes trace whole
+  // frames
+  bool timed = self->timestamp_query_pool != VK_NULL_HANDLE &&
+               self->trace_mode == TRACE_MODE_MEGAKERNEL;
+  // queries can't be reset inside the render pass
+  if (timed) {
+    vkCmdResetQueryPool(cmdbuffer, self->timestamp_query_pool,
+                        2 * frame_slot, 2);
+  }
+
+  // the moments of the first sample of a pixel are left over from before the
+  // accumulation was reset, those of a reprojected frame belong to other
+  // pixels until `accumulate.frag` moved them
+  f32 adaptive_threshold = self->accumulated_frames > 1 && !reproject
+                               ? self->adaptive_threshold
+                               : 0.0f;
+
+  PathTracePushConstants path_trace_push_constants = {
+      .index_count = self->geometry.index_count,
+      .vertex_count = self->geometry.vertex_count,
+      .tlas_node_count = self->geometry.tlas_node_count,
+      .tlas_parent_offset = self->geometry.node_count,
+      .wide_bvh = self->geometry.wide,
+      .compact_vertices = self->geometry.vertex_format == VERTEX_FORMAT_COMPACT,
+      .frame = self->frame,
+      .object_count = self->material_count,
+      .env_focal_dist = self->camera_focal_dist,
+      .env_lens_radius = self->camera_lens_radius,
+      .environment_map_pdf_scale = self->envlight->image_average,
+      .adaptive_threshold = adaptive_threshold,
+      .adaptive_min_samples = self->adaptive_min_samples,
+  };
+  memcpy(path_trace_push_constants.view_matrix, self->camera_view,
+         sizeof(mat4x4));
+  memcpy(path_trace_push_constants.projection_matrix, self->camera_projection,
+         sizeof(mat4x4));
+
+  if (self->trace_mode != TRACE_MODE_MEGAKERNEL) {
+    if (!self->wavefront) {
+      self->wavefront = wavefront_new(self);
+    }
+    wavefront_record(cmdbuffer, self, self->wavefront,
+                     path_trace_push_constants);
+  }
+
+  const u32 render_pass_clear_value_count = 7;
   VkClearValue render_pass_clear_values[render_pass_clear_value_count] = {
       (VkClearValue){
           .color = (VkClearColorValue){0.0f, 0.0f, 0.0f, 1.0f},
@@ -2870,6 +3916,7 @@ void renderer_update(Renderer *self) {
       },
       (VkClearValue){}, // unused
       (VkClearValue){.depthStencil = (VkClearDepthStencilValue){1.0f, 0}},
+      (VkClearValue){}, // unused
   };
   VkRenderPassBeginInfo render_pass_begin_info = (VkRenderPassBeginInfo){
       .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -2888,7 +3935,7 @@ void renderer_update(Renderer *self) {
                        VK_SUBPASS_CONTENTS_INLINE);
 
   vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    self->first_bounce_pipeline);
+                    self->first_bounce_pipelines[self->geometry.vertex_format]);
 
   VkViewport viewport = {
       .x = 0,
@@ -2907,10 +3954,10 @@ void renderer_update(Renderer *self) {
   vkCmdSetViewport(cmdbuffer, 0, 1, &viewport);
   vkCmdSetScissor(cmdbuffer, 0, 1, &scissor);
 
-  mat4x4 camera_matrix;
-  mat4x4MultiplyMatrix(camera_matrix, self->camera_view,
-                       self->camera_projection);
-  FirstBouncePushConstants first_bounce_push_constants = {};
+  FirstBouncePushConstants first_bounce_push_constants = {
+      .compact_vertices =
+          self->geometry.vertex_format == VERTEX_FORMAT_COMPACT,
+  };
   memcpy(first_bounce_push_constants.camera_matrix, camera_matrix,
          sizeof(mat4x4));
 
@@ -2918,46 +3965,62 @@ void renderer_update(Renderer *self) {
       cmdbuffer, self->first_bounce_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT,
       0, sizeof(FirstBouncePushConstants), &first_bounce_push_constants);
 
-  VkBuffer buffers[] = {self->vertex_buffer.handle};
-  VkDeviceSize offsets[] = {0};
-  vkCmdBindVertexBuffers(cmdbuffer, 0, 1, buffers, offsets);
+  VkBuffer buffers[] = {self->vertex_buffer.handle,
+                        self->instance_buffer.handle};
+  VkDeviceSize offsets[] = {0, 0};
+  vkCmdBindVertexBuffers(cmdbuffer, 0, 2, buffers, offsets);
 
   if (self->index_buffer.handle != VK_NULL_HANDLE) {
     vkCmdBindIndexBuffer(cmdbuffer, self->index_buffer.handle, 0,
                          VK_INDEX_TYPE_UINT32);
-    vkCmdDrawIndexed(cmdbuffer, self->mesh.index_count, 1, 0, 0, 0);
-  } else {
-    vkCmdDraw(cmdbuffer, self->mesh.vertex_count, 1, 0, 0);
+
+    // one instanced draw per object, `gl_InstanceIndex` is the index of the
+    // instance in the instance buffer and ends up in the object id attachment
+    SceneGeometry *geometry = &self->geometry;
+    for (u32 i = 0; i < geometry->object_count; ++i) {
+      u32 first_instance = geometry->object_first_instance[i];
+      u32 instance_count =
+          geometry->object_first_instance[i + 1] - first_instance;
+      if (instance_count == 0) {
+        continue;
+      }
+
+      BlasOffsets blas = geometry->blas_offsets[i];
+      vkCmdDrawIndexed(cmdbuffer, geometry->blases[i].index_count,
+                       instance_count, blas.triangle_offset * 3,
+                       (i32)blas.vertex_offset, first_instance);
+    }
   }
 
   vkCmdNextSubpass(cmdbuffer, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          self->trace_pipeline_layout, 0, 1,
-                          &self->trace_descriptor_set, 0, NULL);
+  if (self->trace_mode != TRACE_MODE_MEGAKERNEL) {
+    wavefront_record_resolve(cmdbuffer, self, self->wavefront,
+                             path_trace_push_constants);
+  } else {
+    // once the raster pass and the history copy are done, so only the tiles
+    // are timed and not the fixed cost of every frame
+    if (timed) {
+      vkCmdWriteTimestamp(cmdbuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                          self->timestamp_query_pool, 2 * frame_slot);
+    }
+    vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            self->trace_pipeline_layout, 0, 1,
+                            &self->trace_descriptor_set, 0, NULL);
 
-  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    self->trace_pipeline);
+    vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      self->trace_pipelines[self->bvh_traversal]);
 
-  PathTracePushConstants path_trace_push_constants = {
-      .index_count = self->mesh.index_count,
-      .vertex_count = self->mesh.vertex_count,
-      .node_count = self->mesh.bvh_node_count,
-      .frame = self->frame,
-      .object_count = self->material_count,
-      .env_focal_dist = self->camera_focal_dist,
-      .env_lens_radius = self->camera_lens_radius,
-      .environment_map_pdf_scale = self->envlight->image_average,
-  };
-  memcpy(path_trace_push_constants.view_matrix, self->camera_view,
-         sizeof(mat4x4));
-  memcpy(path_trace_push_constants.projection_matrix, self->camera_projection,
-         sizeof(mat4x4));
+    vkCmdPushConstants(
+        cmdbuffer, self->trace_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT,
+        0, sizeof(PathTracePushConstants), &path_trace_push_constants);
 
-  vkCmdPushConstants(
-      cmdbuffer, self->trace_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
-      sizeof(PathTracePushConstants), &path_trace_push_constants);
-
-  vkCmdDraw(cmdbuffer, 3, 1, 0, 0);
+    tile_draw(cmdbuffer, extent, tiles);
+  }
+  if (timed) {
+    vkCmdWriteTimestamp(cmdbuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        self->timestamp_query_pool, 2 * frame_slot + 1);
+    frame->traced_tiles = tiles.count;
+  }
 
   vkCmdNextSubpass(cmdbuffer, VK_SUBPASS_CONTENTS_INLINE);
   vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -2965,7 +4028,13 @@ void renderer_update(Renderer *self) {
                           &self->accumulate_descriptor_set, 0, NULL);
   AccumulatePushConstants accumulate_push_constants = {
       .frame = self->accumulated_frames,
+      .adaptive_threshold = adaptive_threshold,
+      .adaptive_min_samples = self->adaptive_min_samples,
+      .reproject = reproject,
+      .history_cap = reprojection->history_cap,
   };
+  memcpy(accumulate_push_constants.previous_camera_matrix,
+         reprojection->camera_matrix, sizeof(mat4x4));
 
   vkCmdPushConstants(
       cmdbuffer, self->accumulate_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT,
@@ -2974,9 +4043,18 @@ void renderer_update(Renderer *self) {
   vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
                     self->accumulate_pipeline);
 
-  vkCmdDraw(cmdbuffer, 3, 1, 0, 0);
+  // only the traced tiles get a new sample
+  tile_draw(cmdbuffer, extent, tiles);
 
   vkCmdEndRenderPass(cmdbuffer);
+  reprojection_end_frame(reprojection, camera_matrix);
+
+  // only the accumulation is shown denoised
+  bool denoised = self->denoiser->enabled &&
+                  self->present_mode == PRESENT_MODE_ACCUMULATION;
+  if (denoised) {
+    denoiser_record(cmdbuffer, self, self->denoiser);
+  }
 
   const u32 present_render_pass_clear_value_count = 1;
   VkClearValue
@@ -3011,6 +4089,7 @@ void renderer_update(Renderer *self) {
 
   PresentPushConstants present_push_constants = {
       .mode = self->present_mode,
+      .denoised = denoised,
   };
   vkCmdPushConstants(cmdbuffer, self->present_pipeline_layout,
                      VK_SHADER_STAGE_FRAGMENT_BIT, 0,
@@ -3041,26 +4120,28 @@ void renderer_update(Renderer *self) {
               },
       });
 
-  VkRenderPassBeginInfo gui_render_pass_begin_info = {
-      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-      .renderPass = self->gui_render_pass,
-      .framebuffer = self->swapchain_framebuffers[image_index],
-      .renderArea =
-          (VkRect2D){
-              .offset.x = 0,
-              .offset.y = 0,
-              .extent = self->physical_device_info.swapchain_extent,
-          },
-  };
-  vkCmdBeginRenderPass(cmdbuffer, &gui_render_pass_begin_info,
-                       VK_SUBPASS_CONTENTS_INLINE);
+  if (!self->headless) {
+    VkRenderPassBeginInfo gui_render_pass_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = self->gui_render_pass,
+        .framebuffer = self->swapchain_framebuffers[image_index],
+        .renderArea =
+            (VkRect2D){
+                .offset.x = 0,
+                .offset.y = 0,
+                .extent = self->physical_device_info.swapchain_extent,
+            },
+    };
+    vkCmdBeginRenderPass(cmdbuffer, &gui_render_pass_begin_info,
+                         VK_SUBPASS_CONTENTS_INLINE);
 
-  renderer_draw_gui(self);
+    renderer_draw_gui(self);
 
-  imgui_renderer_end();
-  imgui_renderer_update(cmdbuffer);
+    imgui_renderer_end();
+    imgui_renderer_update(cmdbuffer);
 
-  vkCmdEndRenderPass(cmdbuffer);
+    vkCmdEndRenderPass(cmdbuffer);
+  }
 
   ASSURE_VK(vkEndCommandBuffer(cmdbuffer));
 
@@ -3078,10 +4159,19 @@ void renderer_update(Renderer *self) {
       .signalSemaphoreCount = 1,
       .pSignalSemaphores = signal_semaphore,
   };
+  // nothing was acquired and nothing is presented
+  if (self->headless) {
+    submit_info.waitSemaphoreCount = 0;
+    submit_info.signalSemaphoreCount = 0;
+  }
 
   ASSURE_VK(
       vkQueueSubmit(self->graphics_queue, 1, &submit_info, frame->in_flight));
 
+  if (self->headless) {
+    return;
+  }
+
   VkPresentInfoKHR present_info = {
       .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
       .waitSemaphoreCount = 1,
@@ -3096,6 +4186,9 @@ void renderer_update(Renderer *self) {
 }
 
 void renderer_read_frame(Renderer *self, ReadFrameCallback callback) {
+  // the last frame may still be copying into the buffer
+  vkDeviceWaitIdle(self->device);
+
   u8 *data = NULL;
   vkMapMemory(self->device, self->fully_rendered_image_buffer.memory, 0,
               VK_WHOLE_SIZE, 0, (void **)&data);
@@ -3107,7 +4200,8 @@ void renderer_read_frame(Renderer *self, ReadFrameCallback callback) {
 }
 
 void renderer_read_frame_hdr(Renderer *self, ReadFrameHdrCallback callback) {
-  //   vkDeviceWaitIdle(self->device);
+  // the copy has to see the accumulation of the last frame
+  vkDeviceWaitIdle(self->device);
   const u32 transfer_buffer_size =
       self->physical_device_info.swapchain_extent.width *
       self->physical_device_info.swapchain_extent.height * sizeof(vec4);
@@ -6,10 +6,13 @@
 #include <stdlib.h>
 #include <vulkan/vulkan_core.h>
 
+#include "compact_vertex.h"
 #include "envlight.h"
+#include "gpu_bvh.h"
 #include "imgui_renderer.h"
 #include "log.h"
 #include "scene.h"
+#include "tiles.h"
 #include "trimesh.h"
 #include "types.h"
 
@@ -24,6 +27,9 @@ typedef struct {
   VkSurfaceFormatKHR surface_format;
   VkExtent2D swapchain_extent;
   VkFormat depth_format;
+  /// whether the device is a portability implementation, which then has to
+  /// have `VK_KHR_portability_subset` enabled
+  bool portability_subset;
 } PhysicalDeviceInfo;
 
 typedef struct {
@@ -32,6 +38,9 @@ typedef struct {
   VkFence in_flight;
   VkCommandBuffer command_buffer;
   VkFramebuffer present_framebuffer;
+  /// how many tiles the frame traced, 0 while its timestamps hold nothing to
+  /// read back
+  u32 traced_tiles;
 } PerFrameData;
 
 typedef struct {
@@ -60,6 +69,75 @@ typedef enum : u32 {
   PRESENT_MODE_ACCUMULATION = 4,
 } PresentMode;
 
+/// How the path tracer walks the bvhs, each is its own pipeline. The
+/// traversals keep the nodes left to visit on a ring buffer that overwrites
+/// its oldest entries once it is full, which are the ones closest to the root.
+/// When it runs empty they find the overwritten nodes again by climbing the
+/// parent links. The shorter the stack the fewer registers a traversal needs
+/// but the more often it climbs.
+typedef enum : u32 {
+  /// 64 entries, deep enough that it practically never climbs
+  BVH_TRAVERSAL_FULL_STACK = 0,
+  /// 8 entries
+  BVH_TRAVERSAL_SHORT_STACK = 1,
+  /// a single entry, close to a stackless traversal
+  BVH_TRAVERSAL_PARENT_LINKS = 2,
+} BvhTraversal;
+
+static const u32 BVH_TRAVERSAL_COUNT = 3;
+
+/// the traversal stack length of each `BvhTraversal`
+static const u32 BVH_TRAVERSAL_STACK_LENGTHS[BVH_TRAVERSAL_COUNT] = {64, 8, 1};
+
+/// How the paths of a frame are traced, all converge to the same image.
+typedef enum : u32 {
+  /// every path in a single fragment shader invocation, `pathtrace.frag`
+  TRACE_MODE_MEGAKERNEL = 0,
+  /// one bounce of every path at a time through compute kernels, see
+  /// `Wavefront`
+  TRACE_MODE_WAVEFRONT = 1,
+  /// the wavefront kernels, but closest hits are found by persistent
+  /// workgroups whose lanes take new paths as soon as they are done, see
+  /// `wavefront_extend_persistent.comp`
+  TRACE_MODE_PERSISTENT = 2,
+} TraceMode;
+
+static const u32 TRACE_MODE_COUNT = 3;
+
+/// must match `PushConstants` in `common/scene.glsl`
+typedef struct {
+  mat4x4 view_matrix;
+  mat4x4 projection_matrix;
+  u32 vertex_count;
+  u32 index_count;
+  /// the tlas root is the first node
+  u32 tlas_node_count;
+  /// where the tlas parents start in the parent buffer
+  u32 tlas_parent_offset;
+  /// whether the bvh buffer holds `WideBvhNode`s or `BvhNode`s
+  u32 wide_bvh;
+  /// whether the vertex buffer holds `CompactVertex`s or `Vertex`s
+  u32 compact_vertices;
+  u32 object_count;
+  u32 frame;
+  f32 env_focal_dist;
+  f32 env_lens_radius;
+  f32 environment_map_pdf_scale;
+  /// see `pixel_converged` in `common/adaptive.glsl`, 0 traces every pixel
+  f32 adaptive_threshold;
+  u32 adaptive_min_samples;
+  /// only used by the wavefront kernels, see `Wavefront`
+  u32 width;
+  u32 height;
+  u32 first_pixel;
+  u32 sample_idx;
+  u32 bounce;
+} PathTracePushConstants;
+
+typedef struct Wavefront_t Wavefront;
+typedef struct Denoiser_t Denoiser;
+typedef struct Reprojection_t Reprojection;
+
 typedef struct Renderer_t {
   // direct vulkan stuffs
   VkInstance instance;
@@ -74,6 +152,11 @@ typedef struct Renderer_t {
   u32 swapchain_image_count;
   VkImage *swapchain_images;
   VkImageView *swapchain_image_views;
+  /// there is no surface, swapchain or gui, the frames are rendered into
+  /// `offscreen_attachment` which stands in for the single swapchain image,
+  /// see `renderer_create_headless`
+  bool headless;
+  FramebufferAttachment offscreen_attachment;
 
   FramebufferAttachment depth_attachment;
   FramebufferAttachment position_attachment;
@@ -81,6 +164,9 @@ typedef struct Renderer_t {
   FramebufferAttachment object_index_attachment;
   FramebufferAttachment trace_output_attachment;
   FramebufferAttachment trace_accumulation_attachment;
+  /// per pixel mean luminance, mean squared luminance and sample count of the
+  /// accumulation, see `accumulate.frag`
+  FramebufferAttachment trace_moments_attachment;
 
   VkSampler vec3_sampler;
 
@@ -90,15 +176,24 @@ typedef struct Renderer_t {
 
   VkRenderPass trace_render_pass;
   VkPipelineLayout first_bounce_pipeline_layout;
-  VkPipeline first_bounce_pipeline;
+  /// one per `VertexFormat`, they only differ in their vertex attributes
+  VkPipeline first_bounce_pipelines[VERTEX_FORMAT_COUNT];
   VkDescriptorSetLayout trace_descriptor_set_layout;
   VkDescriptorSet trace_descriptor_set;
   VkPipelineLayout trace_pipeline_layout;
-  VkPipeline trace_pipeline;
+  /// one per `BvhTraversal`, they only differ in the traversal stack length
+  VkPipeline trace_pipelines[BVH_TRAVERSAL_COUNT];
+  TraceMode trace_mode;
+  /// created the first time the wavefront trace mode is used
+  Wavefront *wavefront;
   VkDescriptorSetLayout accumulate_descriptor_set_layout;
   VkDescriptorSet accumulate_descriptor_set;
   VkPipelineLayout accumulate_pipeline_layout;
   VkPipeline accumulate_pipeline;
+  /// carries the accumulation over camera moves, see `Reprojection`
+  Reprojection *reprojection;
+  /// filters the accumulation before it is presented, see `Denoiser`
+  Denoiser *denoiser;
 
   VkRenderPass present_render_pass;
   VkDescriptorSetLayout present_descriptor_set_layout;
@@ -123,11 +218,40 @@ typedef struct Renderer_t {
   f32 camera_lens_radius;
   f32 camera_focal_dist;
   u32 accumulated_frames;
+  /// pixels whose relative standard error is below the threshold after at
+  /// least the minimum samples stop being traced, 0 disables it
+  f32 adaptive_threshold;
+  u32 adaptive_min_samples;
+  BvhTraversal bvh_traversal;
+  /// only used by the megakernel, the wavefront kernels already work in
+  /// chunks
+  TileScheduler tiles;
+  /// a start and an end timestamp of the trace pass per frame in flight,
+  /// `VK_NULL_HANDLE` if the graphics queue has no timestamps
+  VkQueryPool timestamp_query_pool;
+  /// nanoseconds per timestamp tick
+  f32 timestamp_period;
+  /// the valid bits of a timestamp, differences are taken modulo them so a
+  /// narrow counter that wraps doesn't give a huge time
+  u64 timestamp_mask;
 
-  TriangleMesh mesh;
+  /// the scene passed to `renderer_set_scene`, changes to it are picked up at
+  /// the start of the next frame
+  Scene *scene;
+  SceneGeometry geometry;
+  /// every blas back to back, see `BlasOffsets`
   Buffer vertex_buffer;
   Buffer index_buffer;
+  /// `LeafTriangle`s, what the traversal intersects
+  Buffer triangle_buffer;
   Buffer bvh_buffer;
+  /// the parent of every node in `bvh_buffer` at the same index followed by
+  /// the parents of the tlas nodes, see `bvh_parents`
+  Buffer bvh_parent_buffer;
+  /// `GpuInstance`s, also bound as a per instance vertex buffer
+  Buffer instance_buffer;
+  Buffer tlas_buffer;
+  GpuBvhBuilder gpu_bvh_builder;
 
   u32 material_count;
   Material *materials;
@@ -145,10 +269,21 @@ typedef struct Renderer_t {
 } Renderer;
 
 Renderer renderer_create(SDL_Window *window);
+/// Renders `width` by `height` frames into an offscreen image without a
+/// window, so without a surface, a present queue or the gui. The frames are
+/// read back through `renderer_read_frame` and `renderer_read_frame_hdr`.
+Renderer renderer_create_headless(u32 width, u32 height);
 void renderer_destroy(Renderer *self);
 void renderer_update(Renderer *self);
 void renderer_resize(Renderer *self, u32 width, u32 height);
+/// Rebuilds the projection after `camera_fov` changed and restarts the
+/// accumulation.
+void renderer_set_or_update_camera(Renderer *self);
 void renderer_set_scene(Renderer *self, Scene *scene);
+/// Uploads the changes to `scene` since it was last set or updated, refitting
+/// the acceleration structure in place. Falls back to `renderer_set_scene` if
+/// the refit blases got too slow to trace.
+void renderer_update_scene(Renderer *self, Scene *scene);
 
 // width, height, image data
 typedef void (*ReadFrameCallback)(u32, u32, u8 *);
@@ -157,6 +292,29 @@ void renderer_read_frame(Renderer *self, ReadFrameCallback callback);
 typedef void (*ReadFrameHdrCallback)(u32, u32, vec4 *);
 void renderer_read_frame_hdr(Renderer *self, ReadFrameHdrCallback callback);
 
+// lower level helpers, shared with the other modules that talk to vulkan
+// directly.
+
+/// host visible and coherent, `data` is copied in if not NULL.
+Buffer create_buffer(Renderer *self, u32 size, void *data,
+                     VkBufferUsageFlags usage);
+/// device local, the contents are undefined.
+Buffer create_device_buffer(Renderer *self, u32 size,
+                            VkBufferUsageFlags usage);
+void destroy_buffer(Renderer *self, Buffer *buffer);
+/// sized to the swapchain extent, in the undefined layout.
+FramebufferAttachment
+create_framebuffer_attachment(Renderer *renderer, VkFormat format,
+                              VkImageUsageFlagBits usage);
+void destroy_framebuffer_attachment(Renderer *renderer,
+                                    FramebufferAttachment *fba);
+VkShaderModule create_shader_module(VkDevice device, const unsigned char *spv,
+                                    usize spv_len);
+/// records into a one off command buffer, `end_immediate_submit` submits it
+/// and waits for the graphics queue to go idle.
+VkCommandBuffer begin_immediate_submit(Renderer *self);
+void end_immediate_submit(Renderer *self, VkCommandBuffer command_buffer);
+
 #define ASSURE_VK(expr)                                                        \
   {                                                                            \
     VkResult assure_vk_result = expr;                                          \
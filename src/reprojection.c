@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "renderer.h"
+#include "types.h"
+
+#include "reprojection.h"
+
+Reprojection *reprojection_new(void) {
+  Reprojection *self = calloc(1, sizeof(Reprojection));
+  self->enabled = true;
+  self->history_cap = 32;
+  self->has_frame = false;
+
+  return self;
+}
+
+void reprojection_destroy_history(Renderer *renderer, Reprojection *self) {
+  for (u32 i = 0; i < REPROJECTION_HISTORY_COUNT; ++i) {
+    if (self->history[i].image != VK_NULL_HANDLE) {
+      destroy_framebuffer_attachment(renderer, &self->history[i]);
+      self->history[i] = (FramebufferAttachment){0};
+    }
+  }
+}
+
+void reprojection_destroy(Renderer *renderer, Reprojection *self) {
+  if (!self) {
+    return;
+  }
+
+  reprojection_destroy_history(renderer, self);
+
+  free(self);
+}
+
+/// The attachments copied into the history, in `ReprojectionHistory` order.
+void reprojection_sources(Renderer *renderer,
+                          FramebufferAttachment *sources[]) {
+  sources[REPROJECTION_HISTORY_ACCUMULATION] =
+      &renderer->trace_accumulation_attachment;
+  sources[REPROJECTION_HISTORY_MOMENTS] = &renderer->trace_moments_attachment;
+  sources[REPROJECTION_HISTORY_POSITION] = &renderer->position_attachment;
+  sources[REPROJECTION_HISTORY_NORMAL] = &renderer->normal_attachment;
+  sources[REPROJECTION_HISTORY_OBJECT_INDEX] =
+      &renderer->object_index_attachment;
+}
+
+void reprojection_resize(Renderer *renderer, Reprojection *self) {
+  vkDeviceWaitIdle(renderer->device);
+  reprojection_destroy_history(renderer, self);
+  self->has_frame = false;
+
+  FramebufferAttachment *sources[REPROJECTION_HISTORY_COUNT];
+  reprojection_sources(renderer, sources);
+
+  // the history is only ever used in the general layout
+  VkCommandBuffer cmdbuffer = begin_immediate_submit(renderer);
+  VkImageMemoryBarrier image_memory_barriers[REPROJECTION_HISTORY_COUNT];
+  for (u32 i = 0; i < REPROJECTION_HISTORY_COUNT; ++i) {
+    self->history[i] = create_framebuffer_attachment(
+        renderer, sources[i]->format,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+    image_memory_barriers[i] = (VkImageMemoryBarrier){
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = self->history[i].image,
+        .subresourceRange =
+            (VkImageSubresourceRange){
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .srcAccessMask = 0,
+        .dstAccessMask = 0,
+    };
+  }
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0, 0, NULL, 0, NULL,
+                       REPROJECTION_HISTORY_COUNT, image_memory_barriers);
+  end_immediate_submit(renderer, cmdbuffer);
+}
+
+void reprojection_record_history(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                                 Reprojection *self) {
+  FramebufferAttachment *sources[REPROJECTION_HISTORY_COUNT];
+  reprojection_sources(renderer, sources);
+
+  // the accumulation and the moments stay in the general layout, the
+  // g-buffers are left read only by the trace render pass, which discards
+  // them again at its start
+  const u32 gbuffer_count = 3;
+  VkImageMemoryBarrier gbuffer_barriers[gbuffer_count];
+  for (u32 i = 0; i < gbuffer_count; ++i) {
+    gbuffer_barriers[i] = (VkImageMemoryBarrier){
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = sources[REPROJECTION_HISTORY_POSITION + i]->image,
+        .subresourceRange =
+            (VkImageSubresourceRange){
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+  }
+  // the last frame may still be reading the history in its accumulate pass
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask =
+          VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(cmdbuffer,
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, NULL,
+                       gbuffer_count, gbuffer_barriers);
+
+  VkExtent2D extent = renderer->physical_device_info.swapchain_extent;
+  VkImageCopy region = {
+      .srcSubresource =
+          (VkImageSubresourceLayers){
+              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+              .mipLevel = 0,
+              .baseArrayLayer = 0,
+              .layerCount = 1,
+          },
+      .srcOffset = {0, 0, 0},
+      .dstSubresource =
+          (VkImageSubresourceLayers){
+              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+              .mipLevel = 0,
+              .baseArrayLayer = 0,
+              .layerCount = 1,
+          },
+      .dstOffset = {0, 0, 0},
+      .extent = {extent.width, extent.height, 1},
+  };
+  for (u32 i = 0; i < REPROJECTION_HISTORY_COUNT; ++i) {
+    VkImageLayout layout = i < REPROJECTION_HISTORY_POSITION
+                               ? VK_IMAGE_LAYOUT_GENERAL
+                               : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    vkCmdCopyImage(cmdbuffer, sources[i]->image, layout,
+                   self->history[i].image, VK_IMAGE_LAYOUT_GENERAL, 1,
+                   &region);
+  }
+
+  // the trace render pass overwrites the sources and samples the history
+  barrier = (VkMemoryBarrier){
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       0, 1, &barrier, 0, NULL, 0, NULL);
+}
+
+void reprojection_end_frame(Reprojection *self, mat4x4 camera_matrix) {
+  memcpy(self->camera_matrix, camera_matrix, sizeof(mat4x4));
+  self->has_frame = true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vulkan/vulkan_core.h>
+
+#include "renderer.h"
+#include "types.h"
+
+/// The attachments of the last frame that `accumulate.frag` reprojects from,
+/// in the order of its history bindings.
+typedef enum : u32 {
+  REPROJECTION_HISTORY_ACCUMULATION = 0,
+  REPROJECTION_HISTORY_MOMENTS = 1,
+  REPROJECTION_HISTORY_POSITION = 2,
+  REPROJECTION_HISTORY_NORMAL = 3,
+  REPROJECTION_HISTORY_OBJECT_INDEX = 4,
+} ReprojectionHistory;
+
+static const u32 REPROJECTION_HISTORY_COUNT = 5;
+
+/// Keeps the accumulation when the camera moves. The frame before a move is
+/// copied into history images, then `accumulate.frag` finds where the first
+/// bounce of every pixel was in that frame through the previous view
+/// projection and continues from the accumulation and moments there. Taps of
+/// the history that hit another object or a differently facing or distant
+/// surface are rejected, so disoccluded pixels start over from a single
+/// sample. The sample count in the moments is the per pixel history length.
+typedef struct Reprojection_t {
+  bool enabled;
+  /// the most samples a reprojected pixel keeps, the fewer there are the
+  /// faster it forgets the blur of resampling and lighting that doesn't move
+  /// with the surface
+  u32 history_cap;
+
+  /// the view projection of the last recorded frame
+  mat4x4 camera_matrix;
+  /// whether there was a last frame at the current extent
+  bool has_frame;
+  FramebufferAttachment history[REPROJECTION_HISTORY_COUNT];
+} Reprojection;
+
+Reprojection *reprojection_new(void);
+void reprojection_destroy(Renderer *renderer, Reprojection *self);
+
+/// (Re)creates the history images for the swapchain extent, called whenever
+/// the attachments are recreated. Forgets the last frame.
+void reprojection_resize(Renderer *renderer, Reprojection *self);
+
+/// Copies the attachments of the last frame into the history, recorded
+/// before the trace render pass of a frame that reprojects.
+void reprojection_record_history(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                                 Reprojection *self);
+
+/// Remembers the view projection of a recorded frame.
+void reprojection_end_frame(Reprojection *self, mat4x4 camera_matrix);
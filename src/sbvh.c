@@ -0,0 +1,435 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "bvh_binning.h"
+#include "maths.h"
+#include "types.h"
+
+#include "sbvh.h"
+
+/// Spatial splits are only tried when the children of the best object split
+/// overlap by more than this fraction of the root's surface area, which keeps
+/// the builder from splitting triangles where it wouldn't help.
+static const f32 SPATIAL_SPLIT_ALPHA = 1e-5f;
+
+typedef struct {
+  const Vertex *vertices;
+  const u32 *indices;
+  u32 max_leaf_triangles;
+  f32 min_overlap_area;
+  /// how many more references spatial splits may create
+  u32 reference_budget;
+
+  u32 node_count;
+  u32 node_capacity;
+  BvhNode *nodes;
+  u32 reference_count;
+  u32 reference_capacity;
+  u32 *references;
+} SbvhContext;
+
+static u32 push_node(SbvhContext *ctx, BvhNode node) {
+  if (ctx->node_count == ctx->node_capacity) {
+    ctx->node_capacity *= 2;
+    ctx->nodes = realloc(ctx->nodes, sizeof(BvhNode) * ctx->node_capacity);
+  }
+  ctx->nodes[ctx->node_count] = node;
+
+  return ctx->node_count++;
+}
+
+static u32 push_reference(SbvhContext *ctx, u32 triangle) {
+  if (ctx->reference_count == ctx->reference_capacity) {
+    ctx->reference_capacity *= 2;
+    ctx->references =
+        realloc(ctx->references, sizeof(u32) * ctx->reference_capacity);
+  }
+  ctx->references[ctx->reference_count] = triangle;
+
+  return ctx->reference_count++;
+}
+
+static u32 push_leaf(SbvhContext *ctx, const TriangleInfos *infos, u32 start,
+                     u32 end, Aabb bounds) {
+  u32 first = ctx->reference_count;
+  for (u32 i = start; i < end; ++i) {
+    push_reference(ctx, infos->index[i]);
+  }
+
+  return push_node(ctx, (BvhNode){
+                            .min = bounds.min,
+                            .l = first,
+                            .max = bounds.max,
+                            .r = BVH_LEAF_BIT | (end - start),
+                        });
+}
+
+static f32 safe_surface_area(Aabb bounds) {
+  return aabb_is_empty(bounds) ? 0.0f : aabb_surface_area(bounds);
+}
+
+/// Bounds of the part of `triangle` that lies between `lo` and `hi` along
+/// `dim`, clamped to the current bounds of the reference.
+static Aabb clip_reference(const SbvhContext *ctx, u32 triangle, Aabb bounds,
+                           u32 dim, f32 lo, f32 hi) {
+  vec3 v[3];
+  for (u32 k = 0; k < 3; ++k) {
+    v[k] = ctx->vertices[ctx->indices[triangle * 3 + k]].position;
+  }
+
+  Aabb clipped = aabb_empty();
+  for (u32 k = 0; k < 3; ++k) {
+    vec3 a = v[k];
+    vec3 b = v[(k + 1) % 3];
+    f32 pa = a.v[dim];
+    f32 pb = b.v[dim];
+    if (lo <= pa && pa <= hi) {
+      clipped = aabb_expand(clipped, a);
+    }
+
+    f32 planes[2] = {lo, hi};
+    for (u32 p = 0; p < 2; ++p) {
+      f32 plane = planes[p];
+      if ((pa < plane && plane < pb) || (pb < plane && plane < pa)) {
+        vec3 point = vec3Add(
+            a, vec3Multiply(vec3Subtract(b, a), (plane - pa) / (pb - pa)));
+        point.v[dim] = plane;
+        clipped = aabb_expand(clipped, point);
+      }
+    }
+  }
+  if (aabb_is_empty(clipped)) {
+    return clipped;
+  }
+
+  clipped.min = vec3Subtract(clipped.min, vec3New(1e-5, 1e-5, 1e-5));
+  clipped.max = vec3Add(clipped.max, vec3New(1e-5, 1e-5, 1e-5));
+  return aabb_intersection(clipped, bounds);
+}
+
+typedef struct {
+  Aabb bounds[BUCKET_COUNT];
+  /// number of references starting and ending in each bin
+  u32 entry[BUCKET_COUNT];
+  u32 exit[BUCKET_COUNT];
+} SpatialBins;
+
+typedef struct {
+  f32 cost;
+  u32 dim;
+  f32 position;
+  u32 left_count;
+  u32 right_count;
+  Aabb left_bounds;
+  Aabb right_bounds;
+} SpatialSplit;
+
+static u32 spatial_bin_index(f32 x, f32 bounds_min, f32 scale) {
+  return (u32)clamp((x - bounds_min) * scale, 0.0f, (f32)(BUCKET_COUNT - 1));
+}
+
+/// Bins the references in `[start, end)` into equally sized slabs of `bounds`
+/// along `dim`, clipping every reference against each slab it touches.
+static SpatialSplit find_spatial_split(const SbvhContext *ctx,
+                                       const TriangleInfos *infos, u32 start,
+                                       u32 end, Aabb bounds, u32 dim) {
+  f32 extent = bounds.max.v[dim] - bounds.min.v[dim];
+  f32 scale = (f32)BUCKET_COUNT / extent;
+  f32 bin_width = extent / (f32)BUCKET_COUNT;
+
+  SpatialBins bins;
+  for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+    bins.bounds[b] = aabb_empty();
+    bins.entry[b] = 0;
+    bins.exit[b] = 0;
+  }
+
+  for (u32 i = start; i < end; ++i) {
+    Aabb reference = triangle_infos_get_bounds(infos, i);
+    u32 first =
+        spatial_bin_index(reference.min.v[dim], bounds.min.v[dim], scale);
+    u32 last =
+        spatial_bin_index(reference.max.v[dim], bounds.min.v[dim], scale);
+
+    if (first == last) {
+      bins.bounds[first] = aabb_union(bins.bounds[first], reference);
+    } else {
+      for (u32 b = first; b <= last; ++b) {
+        f32 lo = bounds.min.v[dim] + bin_width * (f32)b;
+        f32 hi = b == BUCKET_COUNT - 1 ? bounds.max.v[dim] : lo + bin_width;
+        Aabb clipped =
+            clip_reference(ctx, infos->index[i], reference, dim, lo, hi);
+        if (!aabb_is_empty(clipped)) {
+          bins.bounds[b] = aabb_union(bins.bounds[b], clipped);
+        }
+      }
+    }
+    ++bins.entry[first];
+    ++bins.exit[last];
+  }
+
+  // same prefix and suffix sweep as `bins_find_best_split`, except that
+  // references can be counted on both sides
+  Aabb left_bounds[BUCKET_COUNT - 1];
+  u32 left_count[BUCKET_COUNT - 1];
+  Aabb acc = aabb_empty();
+  u32 count = 0;
+  for (u32 i = 0; i < BUCKET_COUNT - 1; ++i) {
+    acc = aabb_union(acc, bins.bounds[i]);
+    count += bins.entry[i];
+    left_bounds[i] = acc;
+    left_count[i] = count;
+  }
+
+  f32 inv_area = 1.0f / aabb_surface_area(bounds);
+  SpatialSplit best = {.cost = INFINITY, .dim = dim};
+  acc = aabb_empty();
+  count = 0;
+  for (u32 i = BUCKET_COUNT - 1; i > 0; --i) {
+    acc = aabb_union(acc, bins.bounds[i]);
+    count += bins.exit[i];
+    if (left_count[i - 1] == 0 || count == 0) {
+      continue;
+    }
+
+    f32 cost = 1.0f + ((f32)left_count[i - 1] *
+                           safe_surface_area(left_bounds[i - 1]) +
+                       (f32)count * safe_surface_area(acc)) *
+                          inv_area;
+    if (cost <= best.cost) {
+      best = (SpatialSplit){
+          .cost = cost,
+          .dim = dim,
+          .position = bounds.min.v[dim] + bin_width * (f32)i,
+          .left_count = left_count[i - 1],
+          .right_count = count,
+          .left_bounds = left_bounds[i - 1],
+          .right_bounds = acc,
+      };
+    }
+  }
+
+  return best;
+}
+
+/// Distributes the references in `[start, end)` to `left` and `right`.
+/// Straddling references are split in two unless putting the whole reference
+/// on one side is cheaper ("reference unsplitting"). Returns false if either
+/// side ended up empty.
+static bool perform_spatial_split(const SbvhContext *ctx,
+                                  const TriangleInfos *infos, u32 start,
+                                  u32 end, SpatialSplit split,
+                                  TriangleInfos *left, u32 *left_count,
+                                  TriangleInfos *right, u32 *right_count) {
+  u32 dim = split.dim;
+  f32 n_left = (f32)split.left_count;
+  f32 n_right = (f32)split.right_count;
+  Aabb left_bounds = split.left_bounds;
+  Aabb right_bounds = split.right_bounds;
+
+  *left_count = 0;
+  *right_count = 0;
+  for (u32 i = start; i < end; ++i) {
+    Aabb reference = triangle_infos_get_bounds(infos, i);
+    u32 triangle = infos->index[i];
+
+    if (reference.max.v[dim] <= split.position) {
+      triangle_infos_set(left, (*left_count)++, reference, triangle);
+      continue;
+    }
+    if (reference.min.v[dim] >= split.position) {
+      triangle_infos_set(right, (*right_count)++, reference, triangle);
+      continue;
+    }
+
+    f32 split_cost = safe_surface_area(left_bounds) * n_left +
+                     safe_surface_area(right_bounds) * n_right;
+    Aabb left_union = aabb_union(left_bounds, reference);
+    Aabb right_union = aabb_union(right_bounds, reference);
+    f32 left_cost = safe_surface_area(left_union) * n_left +
+                    safe_surface_area(right_bounds) * (n_right - 1.0f);
+    f32 right_cost = safe_surface_area(left_bounds) * (n_left - 1.0f) +
+                     safe_surface_area(right_union) * n_right;
+
+    if (left_cost < split_cost && left_cost <= right_cost) {
+      triangle_infos_set(left, (*left_count)++, reference, triangle);
+      left_bounds = left_union;
+      n_right -= 1.0f;
+    } else if (right_cost < split_cost) {
+      triangle_infos_set(right, (*right_count)++, reference, triangle);
+      right_bounds = right_union;
+      n_left -= 1.0f;
+    } else {
+      Aabb l = clip_reference(ctx, triangle, reference, dim,
+                              reference.min.v[dim], split.position);
+      Aabb r = clip_reference(ctx, triangle, reference, dim, split.position,
+                              reference.max.v[dim]);
+      // numerical trouble can make the triangle miss one of the slabs, it is
+      // still fully covered by the other one then
+      if (aabb_is_empty(l)) {
+        triangle_infos_set(right, (*right_count)++, reference, triangle);
+      } else if (aabb_is_empty(r)) {
+        triangle_infos_set(left, (*left_count)++, reference, triangle);
+      } else {
+        triangle_infos_set(left, (*left_count)++, l, triangle);
+        triangle_infos_set(right, (*right_count)++, r, triangle);
+      }
+    }
+  }
+
+  return *left_count != 0 && *right_count != 0;
+}
+
+static u32 sbvh_split(SbvhContext *ctx, TriangleInfos *infos, u32 start,
+                      u32 end) {
+  u32 n_primitives = end - start;
+  RangeBounds range = triangle_infos_range_bounds(infos, start, end);
+  Aabb bounds = range.bounds;
+  Aabb centroid_bounds = range.centroid_bounds;
+
+  // object split, same as the regular builder
+  u32 dim = aabb_max_extent_idx(centroid_bounds);
+  f32 centroid_extent = centroid_bounds.max.v[dim] - centroid_bounds.min.v[dim];
+
+  bool can_be_leaf = n_primitives <= ctx->max_leaf_triangles;
+  if (n_primitives == 1 ||
+      (can_be_leaf && (n_primitives == 2 || centroid_extent <= 0.0f))) {
+    return push_leaf(ctx, infos, start, end, bounds);
+  }
+
+  f32 object_cost = INFINITY;
+  u32 object_idx = 0;
+  f32 scale = 0.0f;
+  Aabb overlap = aabb_empty();
+  if (centroid_extent > 0.0f) {
+    scale = (f32)BUCKET_COUNT / centroid_extent;
+    Bins bins;
+    triangle_infos_bin(infos, start, end, dim, centroid_bounds.min.v[dim],
+                       scale, &bins);
+    object_idx = bins_find_best_split(&bins, bounds, &object_cost);
+
+    Aabb left = aabb_empty();
+    Aabb right = aabb_empty();
+    for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+      if (b <= object_idx) {
+        left = aabb_union(left, bins.bounds[b]);
+      } else {
+        right = aabb_union(right, bins.bounds[b]);
+      }
+    }
+    overlap = aabb_intersection(left, right);
+  }
+
+  // spatial split, only worth it when the object split children overlap a lot
+  SpatialSplit spatial = {.cost = INFINITY};
+  u32 spatial_dim = aabb_max_extent_idx(bounds);
+  if (ctx->reference_budget > 0 &&
+      bounds.max.v[spatial_dim] > bounds.min.v[spatial_dim] &&
+      (centroid_extent <= 0.0f ||
+       safe_surface_area(overlap) > ctx->min_overlap_area)) {
+    spatial = find_spatial_split(ctx, infos, start, end, bounds, spatial_dim);
+    if (spatial.left_count + spatial.right_count - n_primitives >
+        ctx->reference_budget) {
+      spatial.cost = INFINITY;
+    }
+  }
+
+  // all three costs are infinite when neither split is possible, that must
+  // not turn more than `max_leaf_triangles` into a leaf
+  f32 leaf_cost = can_be_leaf ? (f32)n_primitives : INFINITY;
+  if (can_be_leaf && leaf_cost <= object_cost && leaf_cost <= spatial.cost) {
+    return push_leaf(ctx, infos, start, end, bounds);
+  }
+
+  if (spatial.cost < object_cost) {
+    TriangleInfos left = triangle_infos_new(n_primitives);
+    TriangleInfos right = triangle_infos_new(n_primitives);
+    u32 left_count;
+    u32 right_count;
+    if (perform_spatial_split(ctx, infos, start, end, spatial, &left,
+                              &left_count, &right, &right_count)) {
+      ctx->reference_budget -=
+          min(left_count + right_count - n_primitives, ctx->reference_budget);
+
+      u32 a = sbvh_split(ctx, &left, 0, left_count);
+      triangle_infos_destroy(&left);
+      u32 b = sbvh_split(ctx, &right, 0, right_count);
+      triangle_infos_destroy(&right);
+
+      return push_node(ctx, (BvhNode){
+                                .min = bounds.min,
+                                .l = a,
+                                .max = bounds.max,
+                                .r = b,
+                            });
+    }
+    triangle_infos_destroy(&left);
+    triangle_infos_destroy(&right);
+  }
+
+  u32 middle = start + n_primitives / 2;
+  if (object_cost < INFINITY) {
+    PartitionByBucketContext partition_ctx = {
+        .dim = dim,
+        .min_idx = object_idx,
+        .centroid_min = centroid_bounds.min.v[dim],
+        .scale = scale,
+    };
+    middle = triangle_infos_partition(infos, start, end, &partition_ctx,
+                                      partition_by_bucket_fn);
+    if (middle == start || middle == end) {
+      PartitionByCentroidContext centroid_ctx = {
+          .dim = dim,
+          .mid = (centroid_bounds.min.v[dim] + centroid_bounds.max.v[dim]) *
+                 0.5,
+      };
+      triangle_infos_partition(infos, start, end, &centroid_ctx,
+                               partition_by_centroid_fn);
+      middle = start + n_primitives / 2;
+    }
+  } else if (can_be_leaf) {
+    return push_leaf(ctx, infos, start, end, bounds);
+  }
+
+  u32 a = sbvh_split(ctx, infos, start, middle);
+  u32 b = sbvh_split(ctx, infos, middle, end);
+
+  return push_node(ctx, (BvhNode){
+                            .min = bounds.min,
+                            .l = a,
+                            .max = bounds.max,
+                            .r = b,
+                        });
+}
+
+Sbvh sbvh_build(const Vertex *vertices, const u32 *indices,
+                TriangleInfos *triangle_infos, u32 triangle_count,
+                BvhBuildSettings settings) {
+  RangeBounds root = triangle_infos_range_bounds(triangle_infos, 0,
+                                                 triangle_count);
+
+  SbvhContext ctx = {
+      .vertices = vertices,
+      .indices = indices,
+      .max_leaf_triangles = bvh_settings_max_leaf_triangles(settings),
+      .min_overlap_area =
+          SPATIAL_SPLIT_ALPHA * aabb_surface_area(root.bounds),
+      .reference_budget =
+          (u32)(max(settings.spatial_split_budget, 0.0f) * (f32)triangle_count),
+      .node_count = 0,
+      .node_capacity = triangle_count * 2,
+      .nodes = malloc(sizeof(BvhNode) * triangle_count * 2),
+      .reference_count = 0,
+      .reference_capacity = triangle_count,
+      .references = malloc(sizeof(u32) * triangle_count),
+  };
+
+  sbvh_split(&ctx, triangle_infos, 0, triangle_count);
+
+  return (Sbvh){
+      .node_count = ctx.node_count,
+      .nodes = realloc(ctx.nodes, sizeof(BvhNode) * ctx.node_count),
+      .reference_count = ctx.reference_count,
+      .references = ctx.references,
+  };
+}
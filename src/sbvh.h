@@ -0,0 +1,25 @@
+#pragma once
+
+#include "bvh_binning.h"
+#include "trimesh.h"
+#include "types.h"
+
+typedef struct {
+  u32 node_count;
+  /// laid out in post order like the regular cpu builder, leaves index into
+  /// `references`
+  BvhNode *nodes;
+  u32 reference_count;
+  /// triangle index of every reference in leaf order, a triangle that was
+  /// split is referenced by more than one leaf but at most once per leaf.
+  u32 *references;
+} Sbvh;
+
+/// Builds a spatial split bvh (Stich et al. 2009) over the triangles in
+/// `triangle_infos`. Each node chooses between a binned object split, a binned
+/// spatial split which clips the straddling triangles against the split plane,
+/// and a leaf by their sah cost. Spatial splits stop once they would create
+/// more than `settings.spatial_split_budget * triangle_count` extra references.
+Sbvh sbvh_build(const Vertex *vertices, const u32 *indices,
+                TriangleInfos *triangle_infos, u32 triangle_count,
+                BvhBuildSettings settings);
@@ -1,31 +1,85 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "SDL_timer.h"
+#include "bvh_refit.h"
+#include "bvh_stats.h"
 #include "envlight.h"
 #include "loader.h"
 #include "log.h"
+#include "maths.h"
 #include "scene.h"
 #include "trimesh.h"
 
 Scene scene_new() {
   return (Scene){
       .object_count = 0,
-      .materials = NULL,
       .meshes = NULL,
+      .material_count = 0,
+      .materials = NULL,
+      .instance_count = 0,
+      .instances = NULL,
+      .dirty_objects = NULL,
+      .instances_dirty = false,
       .envlight = envlight_new_blank_sky(),
+      .bvh_settings =
+          (BvhBuildSettings){
+              .builder = BVH_BUILDER_CPU_SAH,
+              .thread_count = 0,
+              .max_leaf_triangles = 8,
+              .spatial_split_budget = 0.3f,
+              .optimization_budget_ms = 0,
+              .wide = true,
+              .cache_directory = NULL,
+          },
+      .vertex_format = VERTEX_FORMAT_FULL,
   };
 }
 
-void scene_add_object(Scene *self, const char *path, Material material) {
+u32 scene_add_mesh(Scene *self, const char *path) {
   ObjMesh obj = load_obj(path);
-  self->materials =
-      realloc(self->materials, (self->object_count + 1) * sizeof(Material));
-  self->materials[self->object_count] = material;
-
   self->meshes =
       realloc(self->meshes, (self->object_count + 1) * sizeof(ObjMesh));
   self->meshes[self->object_count] = obj;
 
-  ++self->object_count;
+  self->dirty_objects =
+      realloc(self->dirty_objects, (self->object_count + 1) * sizeof(bool));
+  self->dirty_objects[self->object_count] = false;
+
+  return self->object_count++;
+}
+
+u32 scene_add_material(Scene *self, Material material) {
+  self->materials =
+      realloc(self->materials, (self->material_count + 1) * sizeof(Material));
+  self->materials[self->material_count] = material;
+
+  return self->material_count++;
+}
+
+void scene_add_instance(Scene *self, u32 object, const mat4x4 transform,
+                        u32 material) {
+  self->instances =
+      realloc(self->instances, (self->instance_count + 1) * sizeof(Instance));
+  Instance *instance = &self->instances[self->instance_count];
+  memcpy(instance->transform, transform, sizeof(mat4x4));
+  instance->object = object;
+  instance->material = material;
+
+  ++self->instance_count;
+}
+
+void scene_add_object(Scene *self, const char *path, Material material) {
+  const mat4x4 identity = {
+      {.x = 1.0f},
+      {.y = 1.0f},
+      {.z = 1.0f},
+      {.w = 1.0f},
+  };
+  u32 object = scene_add_mesh(self, path);
+  scene_add_instance(self, object, identity,
+                     scene_add_material(self, material));
 }
 
 void scene_set_envlight(Scene *self, const char *path) {
@@ -33,33 +87,245 @@ void scene_set_envlight(Scene *self, const char *path) {
   self->envlight = envlight_new_from_file(path);
 }
 
-TriangleMesh scene_create_unified_mesh(Scene *self) {
-  u32 total_vertices = 0;
-  u32 total_indices = 0;
+void scene_set_object_positions(Scene *self, u32 object,
+                                const vec3 *positions) {
+  ObjMesh *mesh = &self->meshes[object];
+  memcpy(mesh->positions, positions, sizeof(vec3) * mesh->vertex_count);
+  self->dirty_objects[object] = true;
+}
+
+void scene_set_instance_transform(Scene *self, u32 instance,
+                                  const mat4x4 transform) {
+  memcpy(self->instances[instance].transform, transform, sizeof(mat4x4));
+  self->instances_dirty = true;
+}
+
+bool scene_is_dirty(const Scene *self) {
   for (u32 i = 0; i < self->object_count; ++i) {
-    total_indices += self->meshes[i].index_count;
-    total_vertices += self->meshes[i].vertex_count;
+    if (self->dirty_objects[i]) {
+      return true;
+    }
   }
 
-  Vertex *vertices = malloc(sizeof(Vertex) * total_vertices);
-  u32 *indices = malloc(sizeof(u32) * total_indices);
+  return self->instances_dirty;
+}
 
-  u32 vertex_offset = 0;
-  u32 index_offset = 0;
-  for (u32 i = 0; i < self->object_count; ++i) {
-    for (usize j = 0; j < self->meshes[i].index_count; j++) {
-      indices[index_offset++] = self->meshes[i].indicies[j] + vertex_offset;
+void scene_clear_dirty(Scene *self) {
+  memset(self->dirty_objects, 0, sizeof(bool) * self->object_count);
+  self->instances_dirty = false;
+}
+
+/// Object space bounds of a blas, the gpu builder has no nodes on the cpu.
+Aabb blas_bounds(const TriangleMesh *blas) {
+  if (blas->bvh_nodes) {
+    BvhNode root = blas->bvh_nodes[0];
+    return (Aabb){.min = root.min, .max = root.max};
+  }
+
+  Aabb bounds = aabb_empty();
+  for (u32 i = 0; i < blas->vertex_count; ++i) {
+    bounds = aabb_expand(bounds, blas->vertices[i].position);
+  }
+
+  return bounds;
+}
+
+/// Writes the transforms of every instance to their slot in `self->instances`
+/// and their world space bounds to `instance_bounds`, indexed by slot.
+void update_instances(SceneGeometry *self, const Scene *scene,
+                      Aabb *instance_bounds) {
+  for (u32 i = 0; i < scene->instance_count; ++i) {
+    const Instance *instance = &scene->instances[i];
+    u32 slot = self->instance_slots[i];
+
+    GpuInstance *gpu_instance = &self->instances[slot];
+    *gpu_instance = (GpuInstance){
+        .blas = self->blas_offsets[instance->object],
+        .material = instance->material,
+        .position_scale = vec3New(1.0f, 1.0f, 1.0f),
+    };
+    if (self->vertex_format == VERTEX_FORMAT_COMPACT) {
+      Aabb bounds = self->object_bounds[instance->object];
+      gpu_instance->position_origin = bounds.min;
+      gpu_instance->position_scale = vec3Subtract(bounds.max, bounds.min);
     }
-    for (usize j = 0; j < self->meshes[i].vertex_count; j++) {
-      vertices[vertex_offset++] = (Vertex){
-          .position = self->meshes[i].positions[j],
+    memcpy(gpu_instance->object_to_world, instance->transform, sizeof(mat4x4));
+    mat4x4AffineInverse(gpu_instance->world_to_object, instance->transform);
+
+    instance_bounds[slot] = aabb_transform(
+        self->object_bounds[instance->object], instance->transform);
+  }
+}
+
+SceneGeometry scene_build_geometry(Scene *self) {
+  u64 build_start = SDL_GetPerformanceCounter();
+
+  SceneGeometry geometry = {
+      .object_count = self->object_count,
+      .blases = malloc(sizeof(TriangleMesh) * self->object_count),
+      .blas_offsets = malloc(sizeof(BlasOffsets) * self->object_count),
+      .wide = self->bvh_settings.wide &&
+              self->bvh_settings.builder != BVH_BUILDER_GPU_LBVH,
+      .vertex_format = self->vertex_format,
+      .instance_count = self->instance_count,
+      .instances = malloc(sizeof(GpuInstance) * self->instance_count),
+      .object_first_instance = calloc(self->object_count + 1, sizeof(u32)),
+      .instance_slots = malloc(sizeof(u32) * self->instance_count),
+      .object_bounds = malloc(sizeof(Aabb) * self->object_count),
+      .blas_build_costs = malloc(sizeof(f32) * self->object_count),
+      .blas_stats = malloc(sizeof(BvhStats) * self->object_count),
+  };
+
+  for (u32 i = 0; i < self->object_count; ++i) {
+    ObjMesh *mesh = &self->meshes[i];
+    Vertex *vertices = malloc(sizeof(Vertex) * mesh->vertex_count);
+    u32 *indices = malloc(sizeof(u32) * mesh->index_count);
+    memcpy(indices, mesh->indicies, sizeof(u32) * mesh->index_count);
+    for (usize j = 0; j < mesh->vertex_count; j++) {
+      vertices[j] = (Vertex){
+          .position = mesh->positions[j],
           .object_index = i,
-          .normal = self->meshes[i].normals[j],
+          .normal = mesh->normals[j],
       };
     }
+
+    TriangleMesh *blas = &geometry.blases[i];
+    *blas = trimesh_new(vertices, mesh->vertex_count, indices,
+                        mesh->index_count, self->bvh_settings);
+    u32 node_count =
+        geometry.wide ? blas->wide_bvh_node_count : blas->bvh_node_count;
+    // the cpu builders put the root first, the lbvh puts it last
+    u32 root = blas->bvh_nodes ? 0 : node_count - 1;
+
+    geometry.blas_offsets[i] = (BlasOffsets){
+        .vertex_offset = geometry.vertex_count,
+        .triangle_offset = geometry.index_count / 3,
+        .node_offset = geometry.node_count,
+        .root = root,
+    };
+    geometry.vertex_count += blas->vertex_count;
+    geometry.index_count += blas->index_count;
+    geometry.node_count += node_count;
+
+    geometry.object_bounds[i] = blas_bounds(blas);
+    geometry.blas_stats[i] = bvh_stats_compute_mesh(blas);
+    geometry.blas_build_costs[i] = geometry.blas_stats[i].sah_cost;
+    if (blas->bvh_nodes) {
+      char name[32];
+      snprintf(name, sizeof(name), "object %u", i);
+      bvh_stats_log(&geometry.blas_stats[i], name);
+    }
+  }
+
+  // counting sort by object so every object's instances are contiguous
+  for (u32 i = 0; i < self->instance_count; ++i) {
+    ++geometry.object_first_instance[self->instances[i].object + 1];
+  }
+  for (u32 i = 0; i < self->object_count; ++i) {
+    geometry.object_first_instance[i + 1] += geometry.object_first_instance[i];
+  }
+
+  u32 *next_instance = malloc(sizeof(u32) * self->object_count);
+  memcpy(next_instance, geometry.object_first_instance,
+         sizeof(u32) * self->object_count);
+  for (u32 i = 0; i < self->instance_count; ++i) {
+    geometry.instance_slots[i] = next_instance[self->instances[i].object]++;
+  }
+  free(next_instance);
+
+  Aabb *instance_bounds = malloc(sizeof(Aabb) * self->instance_count);
+  update_instances(&geometry, self, instance_bounds);
+  geometry.tlas_nodes = bvh_build_over_bounds(
+      instance_bounds, self->instance_count, &geometry.tlas_node_count);
+  geometry.tlas_stats =
+      bvh_stats_compute(geometry.tlas_nodes, geometry.tlas_node_count, 0);
+  geometry.tlas_build_cost = geometry.tlas_stats.sah_cost;
+  bvh_stats_log(&geometry.tlas_stats, "tlas");
+  free(instance_bounds);
+
+  scene_clear_dirty(self);
+
+  f64 build_ms = (f64)(SDL_GetPerformanceCounter() - build_start) * 1000.0 /
+                 (f64)SDL_GetPerformanceFrequency();
+  infoln("built scene geometry with %u objects (%u triangles) and %u "
+         "instances (%u tlas nodes) in %.2fms",
+         geometry.object_count, geometry.index_count / 3,
+         geometry.instance_count, geometry.tlas_node_count, build_ms);
+
+  return geometry;
+}
+
+bool scene_geometry_refit(SceneGeometry *self, Scene *scene) {
+  for (u32 i = 0; i < self->object_count; ++i) {
+    if (!scene->dirty_objects[i]) {
+      continue;
+    }
+
+    TriangleMesh *blas = &self->blases[i];
+    trimesh_make_owned(blas);
+    ObjMesh *mesh = &scene->meshes[i];
+    for (usize j = 0; j < mesh->vertex_count; j++) {
+      blas->vertices[j].position = mesh->positions[j];
+      blas->vertices[j].normal = mesh->normals[j];
+    }
+    trimesh_update_triangles(blas);
+
+    if (blas->bvh_nodes) {
+      bvh_refit(blas->bvh_nodes, blas->bvh_node_count, blas->vertices,
+                blas->indices);
+      self->blas_stats[i] = bvh_stats_compute_mesh(blas);
+      f32 cost = self->blas_stats[i].sah_cost;
+      if (cost > self->blas_build_costs[i] * REFIT_REBUILD_RATIO) {
+        infoln("refitting object %u raised its sah cost from %.2f to %.2f",
+               i, self->blas_build_costs[i], cost);
+        return false;
+      }
+
+      if (blas->wide_bvh_nodes) {
+        wide_bvh_refit(blas->wide_bvh_nodes, blas->wide_bvh_node_count,
+                       blas->vertices, blas->indices);
+      }
+    }
+
+    self->object_bounds[i] = blas_bounds(blas);
   }
 
-  return trimesh_new(vertices, total_vertices, indices, total_indices);
+  Aabb *instance_bounds = malloc(sizeof(Aabb) * self->instance_count);
+  update_instances(self, scene, instance_bounds);
+
+  bvh_refit_bounds(self->tlas_nodes, self->tlas_node_count, instance_bounds);
+  self->tlas_stats =
+      bvh_stats_compute(self->tlas_nodes, self->tlas_node_count, 0);
+  if (self->tlas_stats.sah_cost > self->tlas_build_cost * REFIT_REBUILD_RATIO) {
+    // one instance per leaf, so the rebuilt tlas has the same node count
+    free(self->tlas_nodes);
+    self->tlas_nodes = bvh_build_over_bounds(
+        instance_bounds, self->instance_count, &self->tlas_node_count);
+    self->tlas_stats =
+        bvh_stats_compute(self->tlas_nodes, self->tlas_node_count, 0);
+    self->tlas_build_cost = self->tlas_stats.sah_cost;
+  }
+
+  free(instance_bounds);
+
+  return true;
+}
+
+void scene_geometry_destroy(SceneGeometry *self) {
+  for (u32 i = 0; i < self->object_count; ++i) {
+    trimesh_destroy(self->blases[i]);
+  }
+
+  free(self->blases);
+  free(self->blas_offsets);
+  free(self->instances);
+  free(self->object_first_instance);
+  free(self->instance_slots);
+  free(self->tlas_nodes);
+  free(self->object_bounds);
+  free(self->blas_build_costs);
+  free(self->blas_stats);
+  *self = (SceneGeometry){0};
 }
 
 void scene_destroy(Scene *self) {
@@ -67,7 +333,9 @@ void scene_destroy(Scene *self) {
     destroy_obj(&self->meshes[i]);
   }
 
-  free(self->materials);
   free(self->meshes);
+  free(self->materials);
+  free(self->instances);
+  free(self->dirty_objects);
   envlight_destroy(&self->envlight);
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include "ccVector.h"
 
+#include "bvh_stats.h"
+#include "compact_vertex.h"
 #include "envlight.h"
 #include "loader.h"
 #include "trimesh.h"
@@ -12,17 +14,128 @@ typedef struct {
   u32 _pad0;
 } Material;
 
+/// A placement of an object in the scene, any number of instances can share
+/// the same object without duplicating its geometry.
+typedef struct {
+  /// object to world
+  mat4x4 transform;
+  u32 object;
+  u32 material;
+} Instance;
+
 typedef struct {
   u32 object_count;
-  Material *materials;
   ObjMesh *meshes;
+  u32 material_count;
+  Material *materials;
+  u32 instance_count;
+  Instance *instances;
+
+  /// set by `scene_set_object_positions` and `scene_set_instance_transform`,
+  /// the renderer refits the changed parts of the acceleration structure and
+  /// clears them.
+  bool *dirty_objects;
+  bool instances_dirty;
 
   EnvironmentLight envlight;
+
+  BvhBuildSettings bvh_settings;
+  /// how the renderer uploads the vertices, compact vertices take less than
+  /// half the memory but the rasterized first bounce loses some precision
+  VertexFormat vertex_format;
 } Scene;
 
+/// Where the bottom level bvh of an object lives in the concatenated vertex,
+/// index and bvh buffers. Indices, child nodes and leaf triangles stored in a
+/// blas are all relative to these offsets.
+typedef struct {
+  u32 vertex_offset;
+  u32 triangle_offset;
+  u32 node_offset;
+  /// the root node of the blas, relative to `node_offset`
+  u32 root;
+} BlasOffsets;
+
+/// gpu layout of an instance, see `Instance` in `common/scene.glsl`. Also read
+/// as per instance vertex attributes when rasterizing the first bounce.
+typedef struct {
+  mat4x4 object_to_world;
+  mat4x4 world_to_object;
+  BlasOffsets blas;
+  /// dequantizes the positions of `CompactVertex`s, the bounds of the object.
+  /// 0 and 1 for full vertices so the first bounce decodes both the same way.
+  vec3 position_origin;
+  u32 material;
+  vec3 position_scale;
+  u32 _pad0;
+} GpuInstance;
+
+/// The two level acceleration structure of a scene: an object space bottom
+/// level bvh (blas) per object and a top level bvh (tlas) over the world space
+/// bounds of the instances.
+typedef struct {
+  u32 object_count;
+  TriangleMesh *blases;
+  BlasOffsets *blas_offsets;
+  /// totals over every blas, the sizes of the concatenated buffers
+  u32 vertex_count;
+  u32 index_count;
+  u32 node_count;
+  /// whether the blases are traced as `WideBvhNode`s or `BvhNode`s
+  bool wide;
+  VertexFormat vertex_format;
+
+  u32 instance_count;
+  /// sorted by object, the instances of object `i` are
+  /// `[object_first_instance[i], object_first_instance[i + 1])`
+  GpuInstance *instances;
+  u32 *object_first_instance;
+
+  /// the index in `instances` of each of the scene's instances
+  u32 *instance_slots;
+
+  u32 tlas_node_count;
+  /// leaves hold a single instance, `l` is its index in `instances`
+  BvhNode *tlas_nodes;
+
+  /// object space bounds of every blas
+  Aabb *object_bounds;
+  /// sah cost of every tree when it was last built, refitting rebuilds a tree
+  /// once it degrades past `REFIT_REBUILD_RATIO` times this. 0 for blases that
+  /// are built on the gpu, they are always rebuilt.
+  f32 *blas_build_costs;
+  f32 tlas_build_cost;
+
+  /// kept up to date by refitting, zeroed for blases built on the gpu
+  BvhStats *blas_stats;
+  BvhStats tlas_stats;
+} SceneGeometry;
+
 Scene scene_new();
+/// Loads the mesh at `path` as a new object without placing it in the scene,
+/// returns the index of the object.
+u32 scene_add_mesh(Scene *self, const char *path);
+u32 scene_add_material(Scene *self, Material material);
+void scene_add_instance(Scene *self, u32 object, const mat4x4 transform,
+                        u32 material);
+/// Adds the mesh at `path` with its own material and a single untransformed
+/// instance.
 void scene_add_object(Scene *self, const char *path, Material material);
 void scene_set_envlight(Scene *self, const char *path);
-TriangleMesh scene_create_unified_mesh(Scene *self);
+/// Replaces the positions of every vertex of `object`, the topology stays the
+/// same.
+void scene_set_object_positions(Scene *self, u32 object, const vec3 *positions);
+void scene_set_instance_transform(Scene *self, u32 instance,
+                                  const mat4x4 transform);
+bool scene_is_dirty(const Scene *self);
+void scene_clear_dirty(Scene *self);
+/// Builds a blas per object and the tlas over every instance.
+SceneGeometry scene_build_geometry(Scene *self);
+/// Refits the blases of the dirty objects and the tlas to the current state of
+/// `scene` without changing the size or layout of any buffer, rebuilding the
+/// tlas in place when refitting degraded it too much. Returns false if a cpu
+/// built blas degraded too much, the geometry then has to be rebuilt.
+bool scene_geometry_refit(SceneGeometry *self, Scene *scene);
+void scene_geometry_destroy(SceneGeometry *self);
 
-void scene_destroy(Scene *self);
\ No newline at end of file
+void scene_destroy(Scene *self);
@@ -1,34 +1,148 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "./common/adaptive.glsl"
+#include "./common/constants.glsl"
 
 layout(input_attachment_index = 0,
        binding = 0) uniform subpassInput sampler_frame_sample;
 layout(input_attachment_index = 1,
        binding = 1) uniform subpassInput sampler_accumulation;
+layout(input_attachment_index = 2,
+       binding = 2) uniform subpassInput sampler_moments;
+layout(input_attachment_index = 3,
+       binding = 3) uniform subpassInput sampler_position;
+layout(input_attachment_index = 4,
+       binding = 4) uniform subpassInput sampler_normal;
+layout(input_attachment_index = 5,
+       binding = 5) uniform usubpassInput sampler_object_id;
+
+// the attachments of the frame before the camera moved, see `Reprojection`
+// in `src/reprojection.h`
+layout(binding = 6) uniform sampler2D history_accumulation;
+layout(binding = 7) uniform sampler2D history_moments;
+layout(binding = 8) uniform sampler2D history_position;
+layout(binding = 9) uniform sampler2D history_normal;
+layout(binding = 10) uniform usampler2D history_object_id;
 
 layout(location = 0) out vec4 col;
+// the mean luminance, the mean squared luminance and the sample count
+layout(location = 1) out vec4 moments;
 
-layout(push_constant) uniform PushConstants { uint frame; }
+layout(push_constant) uniform PushConstants {
+  // the view projection of the history
+  mat4 previous_camera_matrix;
+  uint frame;
+  float adaptive_threshold;
+  uint adaptive_min_samples;
+  // whether to continue from the history rather than the accumulation
+  uint reproject;
+  uint history_cap;
+}
 constants;
 
+// how closely a tap of the history has to face the same way as the pixel
+const float REPROJECTION_MIN_COS = 0.9;
+
 float luminance(vec3 c) {
   return 0.212671 * c.x + 0.715160 * c.y + 0.072169 * c.z;
 }
 
+// bilinearly gathers the accumulation and the moments of the history where
+// the first bounce of the pixel was before the camera moved, leaving out taps
+// of other surfaces. the moments are 0 if every tap was left out.
+void reproject(out vec3 accumulation, out vec4 previous_moments) {
+  vec3 position = subpassLoad(sampler_position).xyz;
+  vec3 normal = subpassLoad(sampler_normal).xyz;
+  uint object_id = subpassLoad(sampler_object_id).r;
+  // about two pixels of the surface around the pixel
+  float max_distance = 2.0 * length(fwidth(position)) + EPSILON;
+
+  accumulation = vec3(0.0);
+  previous_moments = vec4(0.0);
+  vec4 clip = constants.previous_camera_matrix * vec4(position, 1.0);
+  // the environment has no position to reproject
+  if (object_id == NULL_OBJECT_ID || clip.w <= 0.0) {
+    return;
+  }
+
+  // the viewport is flipped, see `renderer_update`
+  vec2 ndc = clip.xy / clip.w;
+  vec2 uv = vec2(ndc.x * 0.5 + 0.5, 0.5 - ndc.y * 0.5);
+  ivec2 size = textureSize(history_accumulation, 0);
+  vec2 p = uv * vec2(size) - 0.5;
+  ivec2 base = ivec2(floor(p));
+  vec2 f = p - vec2(base);
+
+  float weight_sum = 0.0;
+  for (int y = 0; y <= 1; ++y) {
+    for (int x = 0; x <= 1; ++x) {
+      ivec2 q = base + ivec2(x, y);
+      if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size)) ||
+          texelFetch(history_object_id, q, 0).r != object_id ||
+          dot(texelFetch(history_normal, q, 0).xyz, normal) <
+              REPROJECTION_MIN_COS ||
+          distance(texelFetch(history_position, q, 0).xyz, position) >
+              max_distance) {
+        continue;
+      }
+
+      float w = (x == 0 ? 1.0 - f.x : f.x) * (y == 0 ? 1.0 - f.y : f.y);
+      accumulation += w * texelFetch(history_accumulation, q, 0).rgb;
+      previous_moments += w * texelFetch(history_moments, q, 0);
+      weight_sum += w;
+    }
+  }
+
+  // a sliver of a tap is too noisy to continue from
+  if (weight_sum < 0.01) {
+    accumulation = vec3(0.0);
+    previous_moments = vec4(0.0);
+    return;
+  }
+  accumulation /= weight_sum;
+  previous_moments /= weight_sum;
+  previous_moments.z = min(previous_moments.z, float(constants.history_cap));
+}
+
 void main() {
   vec3 frame_sample = subpassLoad(sampler_frame_sample).xyz;
-  vec3 accumulation = subpassLoad(sampler_accumulation).xyz;
+  float l = luminance(frame_sample);
   if (constants.frame == 1) {
     col = vec4(frame_sample, 1.0);
+    moments = vec4(l, l * l, 1.0, 0.0);
     return;
   }
 
+  vec3 accumulation;
+  vec4 previous_moments;
+  if (constants.reproject != 0) {
+    reproject(accumulation, previous_moments);
+  } else {
+    accumulation = subpassLoad(sampler_accumulation).xyz;
+    previous_moments = subpassLoad(sampler_moments);
+  }
+
+  // `pathtrace.frag` didn't trace the pixel
+  if (pixel_converged(previous_moments, constants.adaptive_threshold,
+                      constants.adaptive_min_samples)) {
+    col = vec4(accumulation, 1.0);
+    moments = previous_moments;
+    return;
+  }
+
+  // the sample count is per pixel since converged pixels stop counting and
+  // reprojected ones keep their history, a rejected history starts over at 1
+  float n = previous_moments.z + 1.0;
+  moments = vec4(mix(previous_moments.xy, vec2(l, l * l), 1.0 / n), n, 0.0);
+
   // if (luminance(frame_sample) - luminance(accumulation) > 5.0 &&
   //     constants.frame > 20) {
   //   col = vec4(accumulation, 1.0);
   //   return;
   // }
 
-  col = vec4(mix(accumulation, frame_sample, vec3(1.0 / constants.frame)), 1.0);
+  col = vec4(mix(accumulation, frame_sample, vec3(1.0 / n)), 1.0);
 
   // if (constants.frame <= 32) {
   //   col =
@@ -37,4 +151,4 @@ void main() {
   // } else {
   //   col = vec4(accumulation, 1.0);
   // }
-}
\ No newline at end of file
+}
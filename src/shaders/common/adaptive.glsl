@@ -0,0 +1,22 @@
+#ifndef SHADER_COMMON_ADAPTIVE
+#define SHADER_COMMON_ADAPTIVE
+
+// adaptive sampling, shared by `accumulate.frag` and `pathtrace.frag` so both
+// agree on which pixels are done
+
+// `moments` holds the mean luminance, the mean squared luminance and the
+// sample count of a pixel. a pixel is converged once it has at least
+// `min_samples` and the standard error of its mean is below `threshold`
+// relative to the mean, a threshold of 0 never converges.
+bool pixel_converged(vec4 moments, float threshold, uint min_samples) {
+  float n = moments.z;
+  if (threshold <= 0.0 || n < float(min_samples)) {
+    return false;
+  }
+
+  float variance = max(moments.y - moments.x * moments.x, 0.0);
+  // the small absolute term keeps black pixels from never converging
+  return sqrt(variance / n) <= threshold * (moments.x + 1e-3);
+}
+
+#endif
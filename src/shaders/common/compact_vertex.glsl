@@ -0,0 +1,15 @@
+#ifndef SHADER_COMMON_COMPACT_VERTEX
+#define SHADER_COMMON_COMPACT_VERTEX
+
+// decoding of `CompactVertex`, see `src/compact_vertex.h`
+
+// inverse of `octahedral_encode` in `src/compact_vertex.c`, `e` is in [-1, 1]
+vec3 octahedral_decode(vec2 e) {
+  vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+  float t = max(-n.z, 0.0);
+  n.x += n.x >= 0.0 ? -t : t;
+  n.y += n.y >= 0.0 ? -t : t;
+  return normalize(n);
+}
+
+#endif
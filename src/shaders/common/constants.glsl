@@ -3,6 +3,10 @@
 
 // ✧₊♥˚: *♥✧₊˚:♡ config constants ♡:˚₊✧♥* :˚♥₊✧
 
+// the wavefront path tracer records its kernels per sample and bounce, keep
+// `RAY_SAMPLES`, `MAX_BOUNCES` and `LIGHT_SAMPLES` in sync with
+// `src/wavefront.h`
+
 /// number of rays per pixel per iteration
 const uint RAY_SAMPLES = 1u;
 
@@ -36,8 +40,14 @@ const bool SAMPLE_LIGHTS = true;
 
 const uint NULL_OBJECT_ID = 0xffffffffu;
 
+/// set in `r` of leaf bvh nodes, must match `src/trimesh.h`
+const uint BVH_LEAF_BIT = 0x80000000u;
+
 const float EPSILON = 1e-5;
 
+/// the largest finite float, returned by `ray_aabb_intersection` on a miss
+const float FLOAT_MAX = 3.402823466e+38;
+
 const float PI = 3.14159265359;
 const float INV_PI = 0.3183098861837907;
 
@@ -0,0 +1,97 @@
+#ifndef SHADER_COMMON_LBVH
+#define SHADER_COMMON_LBVH
+
+// shared declarations for the gpu lbvh builder (see `src/gpu_bvh.c`), every
+// kernel uses the same descriptor set and push constants.
+
+#include "./constants.glsl"
+
+// see `LeafTriangle` in `src/trimesh.h`, the triangles of a mesh built on the
+// gpu stay in the order of the index buffer
+struct LeafTriangle {
+  vec4 v0_original;
+  vec4 e1_object;
+  vec4 e2;
+};
+
+layout(set = 0, binding = 0) readonly buffer TriangleBuffer {
+  LeafTriangle triangles[];
+}
+triangle_buffer;
+
+// both halves of the ping pong buffers used by the radix sort, the sorted
+// result always ends up in the first half
+layout(set = 0, binding = 1) buffer KeyBuffer { uint keys[]; }
+key_buffer;
+
+layout(set = 0, binding = 2) buffer ValueBuffer { uint values[]; }
+value_buffer;
+
+layout(set = 0, binding = 3) buffer HistogramBuffer { uint histogram[]; }
+histogram_buffer;
+
+// `l` and `r` are the `w` component of `min_l` and `max_r` respectively, same
+// as in `scene.glsl`
+struct BvhNode {
+  vec4 min_l;
+  vec4 max_r;
+};
+
+layout(set = 0, binding = 4) coherent buffer BvhBuffer { BvhNode nodes[]; }
+bvh;
+
+// the renderer's parent buffer, the traversals climb it once their stack
+// overflowed. like the nodes the parents are at `constants.node_offset`.
+layout(set = 0, binding = 5) buffer ParentBuffer { uint parents[]; }
+parent_buffer;
+
+layout(set = 0, binding = 6) buffer FlagBuffer { uint flags[]; }
+flag_buffer;
+
+layout(push_constant) uniform PushConstants {
+  vec4 scene_min;
+  vec4 scene_inv_extent;
+  uint triangle_count;
+  uint shift;
+  uint group_count;
+  uint in_offset;
+  uint out_offset;
+  // where the blas being built lives in the shared buffers, nodes and
+  // triangles are written relative to these so the blas can be traced with
+  // the same offsets
+  uint triangle_offset;
+  uint node_offset;
+}
+constants;
+
+// radix sort parameters, must match `src/gpu_bvh.c`
+const uint RADIX_BITS = 4u;
+const uint RADIX_SIZE = 1u << RADIX_BITS;
+const uint RADIX_THREADS = 128u;
+const uint RADIX_ITEMS = 16u;
+const uint RADIX_BLOCK = RADIX_THREADS * RADIX_ITEMS;
+
+// dispatches over more than 65535 groups are split over the y dimension
+uint invocation_index() {
+  return gl_GlobalInvocationID.x +
+         gl_GlobalInvocationID.y * gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+}
+
+uint radix_digit(uint key) {
+  return (key >> constants.shift) & (RADIX_SIZE - 1u);
+}
+
+// `triangle` is relative to the blas being built
+void triangle_bounds(uint triangle, out vec3 lo, out vec3 hi) {
+  LeafTriangle leaf_triangle =
+      triangle_buffer.triangles[constants.triangle_offset + triangle];
+  vec3 v0 = leaf_triangle.v0_original.xyz;
+  vec3 v1 = v0 + leaf_triangle.e1_object.xyz;
+  vec3 v2 = v0 + leaf_triangle.e2.xyz;
+
+  // same padding as the cpu builder
+  lo = min(v0, min(v1, v2)) - vec3(1e-5);
+  hi = max(v0, max(v1, v2)) + vec3(1e-5);
+}
+
+#endif
@@ -0,0 +1,1171 @@
+#ifndef SHADER_COMMON_SCENE
+#define SHADER_COMMON_SCENE
+
+// the scene bindings of the trace descriptor set, the push constants and
+// everything needed to trace and shade paths through the scene. shared by
+// `pathtrace.frag` and the wavefront kernels (see `src/wavefront.h`).
+
+struct Vertex {
+  vec4 position_object_id;
+  vec3 normal;
+  uint _pad1;
+};
+
+layout(std140, set = 0, binding = 3) readonly buffer VertexBuffer {
+  Vertex vertices[];
+}
+vertex_buffer;
+
+// see `CompactVertex` in `src/compact_vertex.h`, the halves of each uint are
+// the 16 bit components in order
+struct CompactVertex {
+  uint position_xy;
+  uint position_zw;
+  uint normal;
+};
+
+// the same buffer as `vertex_buffer`, holds compact vertices when
+// `constants.compact_vertices` is set
+layout(std430, set = 0, binding = 3) readonly buffer CompactVertexBuffer {
+  CompactVertex vertices[];
+}
+compact_vertex_buffer;
+
+layout(set = 0, binding = 4) readonly buffer IndexBuffer { uint indices[]; }
+index_buffer;
+
+// `l` and `r` are the `w` component of `min_l` and `max_r` respectively, for
+// alignment reasons. leaves have `BVH_LEAF_BIT` set in `r`, see
+// `src/trimesh.h`. cpu built trees are laid out depth first so `l` is the next
+// node and descending into it mostly reads from a cache line that was already
+// fetched. `l` is still read rather than assumed since lbvh trees aren't laid
+// out that way, it comes in the same load as the bounds anyway.
+struct BvhNode {
+  vec4 min_l;
+  vec4 max_r;
+};
+
+layout(set = 0, binding = 5) readonly buffer BvhBuffer { BvhNode nodes[]; }
+bvh;
+
+// see `WideBvhNode` in `src/trimesh.h`. `origin_meta.w` packs the 3 exponents
+// and the child count, `lo` and `hi` hold one byte per child for each axis,
+// `lo.w` holds the triangle counts.
+struct WideBvhNode {
+  vec4 origin_meta;
+  uvec4 lo;
+  uvec4 hi;
+  uvec4 children;
+};
+
+// the same buffer as `bvh`, holds wide nodes when `constants.wide_bvh` is set
+layout(set = 0, binding = 5) readonly buffer WideBvhBuffer {
+  WideBvhNode nodes[];
+}
+wide_bvh;
+
+layout(set = 0, binding = 6) uniform sampler2D environment_map;
+layout(set = 0, binding = 7) uniform sampler2D environment_map_inv_cdf;
+layout(set = 0, binding = 8) uniform sampler2D environment_map_inv_marginal;
+
+layout(set = 0, binding = 9) uniform sampler2D blue_noise_tex;
+
+struct Material {
+  vec3 albedo;
+  uint _pad0;
+};
+
+layout(set = 0, binding = 10) readonly buffer MaterialsBuffer {
+  Material materials[];
+}
+material_buffer;
+
+// see `GpuInstance` in `src/scene.h`, the offsets locate the instance's blas in
+// the vertex, index and bvh buffers.
+struct Instance {
+  mat4 object_to_world;
+  mat4 world_to_object;
+  uint vertex_offset;
+  uint triangle_offset;
+  uint node_offset;
+  uint root;
+  // dequantize the positions of compact vertices
+  vec3 position_origin;
+  uint material;
+  vec3 position_scale;
+  uint _pad0;
+};
+
+layout(set = 0, binding = 11) readonly buffer InstanceBuffer {
+  Instance instances[];
+}
+instance_buffer;
+
+// leaves hold a single instance, `l` is its index in `instance_buffer`
+layout(set = 0, binding = 12) readonly buffer TlasBuffer { BvhNode nodes[]; }
+tlas;
+
+// see `LeafTriangle` in `src/trimesh.h`, `w` holds the original triangle index,
+// the object index and padding. in leaf order like the index buffer so
+// triangle `i` of an instance is at `instance.triangle_offset + i`.
+struct LeafTriangle {
+  vec4 v0_original;
+  vec4 e1_object;
+  vec4 e2;
+};
+
+layout(set = 0, binding = 13) readonly buffer TriangleBuffer {
+  LeafTriangle triangles[];
+}
+triangle_buffer;
+
+// the parent of every bvh node, the blas parents are at `node_offset` like the
+// nodes and the tlas parents at `constants.tlas_parent_offset`. only read once
+// a traversal stack overflowed.
+layout(set = 0, binding = 14) readonly buffer ParentBuffer { uint parents[]; }
+parent_buffer;
+
+// entries of the traversal stacks, see `BvhTraversal` in `src/renderer.h`. a
+// full stack overwrites its oldest entries, the ones closest to the root, and
+// the traversals climb the parent links to find them again.
+layout(constant_id = 0) const uint TO_VISIT_LEN = 64;
+
+layout(push_constant) uniform PushConstants {
+  mat4 view_matrix;
+  mat4 projection_matrix;
+  uint vertex_count;
+  uint index_count;
+  uint tlas_node_count;
+  uint tlas_parent_offset;
+  uint wide_bvh;
+  uint compact_vertices;
+  uint object_count;
+  uint frame;
+  float env_focal_dist;
+  float env_lens_radius;
+  float environment_map_pdf_scale;
+  // see `pixel_converged` in `adaptive.glsl`
+  float adaptive_threshold;
+  uint adaptive_min_samples;
+  // only used by the wavefront kernels, see `src/wavefront.h`
+  uint width;
+  uint height;
+  uint first_pixel;
+  uint sample_idx;
+  uint bounce;
+}
+constants;
+
+#include "./compact_vertex.glsl"
+#include "./constants.glsl"
+
+#ifdef CFG_BLUE_NOISE
+#define BLUE_NOISE
+#endif
+#include "./random.glsl"
+
+struct Ray {
+  vec3 o;
+  vec3 d;
+};
+
+vec2 square_to_uniform_disk_concentric(vec2 u) {
+  u = 2.0 * u - vec2(1.0);
+  if (u.x == 0.0 && u.y == 0.0) {
+    return vec2(0.0);
+  }
+
+  float r;
+  float theta;
+  if (abs(u.x) > abs(u.y)) {
+    r = u.x;
+    theta = PI / 4.0 * (u.y / u.x);
+  } else {
+    r = u.y;
+    theta = PI / 2.0 - PI / 4.0 * (u.x / u.y);
+  };
+
+  return r * vec2(cos(theta), sin(theta));
+}
+
+vec2 square_to_disk(vec2 u) {
+  float r = sqrt(u.x);
+  float theta = 2.0 * PI * u.y;
+
+  return r * vec2(sin(theta), cos(theta));
+}
+
+vec2 square_to_heartish(vec2 u) {
+  // return u;
+  vec2 ret = square_to_disk(u);
+  ret.x = (ret.x + sqrt(abs(sin(ret.y)))) * 0.5;
+  return ret;
+}
+
+struct Frame {
+  vec3 n;
+  vec3 s;
+  vec3 t;
+};
+
+Frame new_frame(vec3 n) {
+  float sign = n.z < 0.0 ? -1.0 : 1.0;
+  float a = 1.0 / -(sign + n.z);
+  float b = n.x * n.y * a;
+
+  return Frame(
+      n, normalize(vec3(1.0 + sign * n.x * n.x * a, sign * b, -sign * n.x)),
+      normalize(vec3(b, sign + n.y * n.y * a, -n.y)));
+}
+
+vec3 frame_to_local(Frame frame, vec3 v) {
+  return vec3(dot(v, frame.s), dot(v, frame.t), dot(v, frame.n));
+}
+
+vec3 frame_to_world(Frame frame, vec3 v) {
+  return frame.n * v.z + frame.t * v.y + frame.s * v.x;
+}
+
+Ray create_ray(vec2 uv, vec2 sample2) {
+  uv = (uv * 2.0 - 1.0);
+  vec4 ndsh = vec4(uv, -1.0, 1.0);
+  vec4 view = vec4((inverse(constants.projection_matrix) * ndsh).xyz, 0.0);
+  vec3 dir = normalize((inverse(constants.view_matrix) * view).xyz);
+
+  Ray ray = Ray(vec3(0.0), dir);
+
+  if (constants.env_lens_radius > 0.0) {
+#ifdef CFG_STYLIZE_HEART
+    // needs a more complicated, slower method to construct the onb to prevent
+    // weird discontinuities
+    float theta = PI / 2.0;
+    mat4 rotator_z = mat4(cos(theta), -sin(theta), 0, 0,  // format newline
+                          sin(theta), cos(theta), 0, 0,   //
+                          0, 0, 1, 0,                     //
+                          0, 0, 0, 1);
+
+    vec4 ndsh_perp =
+        vec4(1.0, uv.y, -uv.x, 1.0);  // ndsh * 90deg around the y axis
+    vec4 view_perp =
+        vec4((inverse(constants.projection_matrix) * ndsh_perp).xyz, 0.0);
+    vec3 s =
+        normalize((inverse(rotator_z * constants.view_matrix) * view_perp).xyz);
+
+    vec3 t = cross(s, dir);
+    Frame frame = Frame(dir, s, t);
+#else
+    Frame frame = new_frame(dir);
+#endif
+
+    vec3 focus = ray.o + ray.d * (constants.env_focal_dist / length(ray.d));
+
+#ifdef CFG_STYLIZE_HEART
+    vec2 offset = square_to_heartish(sample2);
+#else
+    vec2 offset = square_to_uniform_disk_concentric(sample2);
+#endif
+
+    ray.o =
+        (frame.s * offset.x + frame.t * offset.y) * constants.env_lens_radius;
+    ray.d = -normalize(ray.o - focus);
+  }
+
+  ray.o += -constants.view_matrix[3].xyz * mat3(constants.view_matrix);
+
+  return ray;
+}
+
+// `edge1` and `edge2` are `v1 - v0` and `v2 - v0`
+float ray_triangle_intersection(Ray ray, vec3 v0, vec3 edge1, vec3 edge2) {
+  const float EPSILON = 1e-7;
+  // Möller–Trumbore intersection
+  vec3 h = cross(ray.d, edge2);
+  float a = dot(edge1, h);
+
+  if (-EPSILON < a && a < EPSILON) {
+    return -1.0;
+  }
+
+  float f = 1.0 / a;
+  vec3 s = ray.o - v0;
+  float u = f * dot(s, h);
+
+  if (u < 0.0 || u > 1.0) return -1.0;
+
+  vec3 q = cross(s, edge1);
+  float v = f * dot(ray.d, q);
+
+  if (v < 0.0 || u + v > 1.0) {
+    return -1.0;
+  }
+
+  float t = f * dot(edge2, q);
+  if (t < EPSILON) {
+    return -1.0;
+  }
+
+  return t;
+}
+
+// distance along the ray to where it enters the box, clamped to the ray
+// origin, or `FLOAT_MAX` if it misses the box or only enters it past `t_max`.
+// `inv_d` is `1.0 / ray.d`, computed once per traversal.
+float ray_aabb_intersection(Ray ray, vec3 inv_d, vec3 aabb_min, vec3 aabb_max,
+                            float t_max) {
+  vec3 t_min = (aabb_min - ray.o) * inv_d;
+  vec3 t_max3 = (aabb_max - ray.o) * inv_d;
+  vec3 t0 = min(t_min, t_max3);
+  vec3 t1 = max(t_min, t_max3);
+  float near = max(max(t0.x, t0.y), max(t0.z, 0.0));
+  float far = min(min(t1.x, t1.y), min(t1.z, t_max));
+  return near <= far ? near : FLOAT_MAX;
+}
+
+struct SceneIntersection {
+  float t;
+  // the index of the instance that was hit
+  uint object_id;
+  // relative to the start of the index buffer
+  uint triangle_idx;
+};
+
+// the direction is not normalized so distances along the ray are the same in
+// both spaces
+Ray ray_to_object_space(Ray ray, Instance instance) {
+  return Ray((instance.world_to_object * vec4(ray.o, 1.0)).xyz,
+             mat3(instance.world_to_object) * ray.d);
+}
+
+// intersects the `count` triangles of `instance`'s blas starting at `first`,
+// keeping the closest hit
+bool ray_leaf_intersect(Ray ray, Instance instance, uint first, uint count,
+                        inout float t_max, inout uint triangle_idx) {
+  bool hit = false;
+  first += instance.triangle_offset;
+  for (uint i = first; i < first + count; ++i) {
+    LeafTriangle triangle = triangle_buffer.triangles[i];
+    float t = ray_triangle_intersection(ray, triangle.v0_original.xyz,
+                                        triangle.e1_object.xyz,
+                                        triangle.e2.xyz);
+    if (0.0 < t && t < t_max) {
+      triangle_idx = i;
+      t_max = t;
+      hit = true;
+    }
+  }
+
+  return hit;
+}
+
+// whether the ray hits the triangle closer than `t_max`. same test as
+// `ray_triangle_intersection` but the barycentrics and the distance are
+// compared scaled by the determinant instead of dividing by it, only the sign
+// of the determinant matters for an any hit test.
+bool ray_triangle_occludes(Ray ray, vec3 v0, vec3 edge1, vec3 edge2,
+                           float t_max) {
+  const float EPSILON = 1e-7;
+  vec3 h = cross(ray.d, edge2);
+  float a = dot(edge1, h);
+
+  if (-EPSILON < a && a < EPSILON) {
+    return false;
+  }
+
+  float sign_a = sign(a);
+  a *= sign_a;
+  vec3 s = (ray.o - v0) * sign_a;
+  float u = dot(s, h);
+  if (u < 0.0 || u > a) return false;
+
+  vec3 q = cross(s, edge1);
+  float v = dot(ray.d, q);
+  float t = dot(edge2, q);
+  return v >= 0.0 && u + v <= a && t >= EPSILON * a && t < t_max * a;
+}
+
+bool ray_leaf_occluded(Ray ray, Instance instance, uint first, uint count,
+                       float t_max) {
+  first += instance.triangle_offset;
+  for (uint i = first; i < first + count; ++i) {
+    LeafTriangle triangle = triangle_buffer.triangles[i];
+    if (ray_triangle_occludes(ray, triangle.v0_original.xyz,
+                              triangle.e1_object.xyz, triangle.e2.xyz,
+                              t_max)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// decodes the quantized bounds of child `i` of `node`, see `WideBvhNode` in
+// `src/trimesh.h`
+void wide_bvh_child_bounds(WideBvhNode node, uint i, out vec3 aabb_min,
+                           out vec3 aabb_max) {
+  uint meta = floatBitsToUint(node.origin_meta.w);
+  vec3 scale = vec3(uintBitsToFloat((meta & 0xffu) << 23),
+                    uintBitsToFloat(((meta >> 8) & 0xffu) << 23),
+                    uintBitsToFloat(((meta >> 16) & 0xffu) << 23));
+  uvec3 lo = (node.lo.xyz >> (i * 8)) & 0xffu;
+  uvec3 hi = (node.hi.xyz >> (i * 8)) & 0xffu;
+  aabb_min = node.origin_meta.xyz + vec3(lo) * scale;
+  aabb_max = node.origin_meta.xyz + vec3(hi) * scale;
+}
+
+// the blas traversals take the ray in the instance's object space, node
+// indices stored in a blas are relative to `instance.node_offset`.
+//
+// the closest hit traversals test both children of a node before descending,
+// go into the nearer one first and keep the entry distance of the other on the
+// stack so it can be skipped once a closer hit was found.
+//
+// children are always visited by increasing entry distance and then by their
+// position in the node. after finishing a child the traversal can then tell
+// from the parent alone which sibling comes next, which is all it needs to
+// climb the parent links once a stack dropped entries.
+
+// whether the sibling of the finished child of a binary node still has to be
+// visited, ie. it comes after the finished child and the ray enters it before
+// `t_max`. `from_right` is whether the finished child is `right`.
+bool binary_sibling_pending(Ray ray, vec3 inv_d, BvhNode left, BvhNode right,
+                            bool from_right, float t_max) {
+  float t_left =
+      ray_aabb_intersection(ray, inv_d, left.min_l.xyz, left.max_r.xyz,
+                            from_right ? t_max : FLOAT_MAX);
+  float t_right =
+      ray_aabb_intersection(ray, inv_d, right.min_l.xyz, right.max_r.xyz,
+                            from_right ? FLOAT_MAX : t_max);
+  return from_right ? t_left != FLOAT_MAX && t_left > t_right
+                    : t_right != FLOAT_MAX && t_right >= t_left;
+}
+
+// climbs from the finished node `node_idx` to the first ancestor with a child
+// left to visit and sets `node_idx` to that child, false once it is back at
+// the root
+bool blas_binary_backtrack(Ray ray, vec3 inv_d, Instance instance, float t_max,
+                           inout uint node_idx) {
+  while (node_idx != instance.root) {
+    uint parent = parent_buffer.parents[instance.node_offset + node_idx];
+    BvhNode node = bvh.nodes[instance.node_offset + parent];
+    uint l = floatBitsToUint(node.min_l.w);
+    uint r = floatBitsToUint(node.max_r.w);
+    bool from_right = node_idx == r;
+    if (binary_sibling_pending(ray, inv_d, bvh.nodes[instance.node_offset + l],
+                               bvh.nodes[instance.node_offset + r], from_right,
+                               t_max)) {
+      node_idx = from_right ? l : r;
+      return true;
+    }
+    node_idx = parent;
+  }
+
+  return false;
+}
+
+// like `blas_binary_backtrack`, leaves of wide nodes are intersected along
+// with their parent so only internal nodes are climbed back from
+bool blas_wide_backtrack(Ray ray, vec3 inv_d, Instance instance, float t_max,
+                         inout uint node_idx) {
+  while (node_idx != instance.root) {
+    uint parent = parent_buffer.parents[instance.node_offset + node_idx];
+    WideBvhNode node = wide_bvh.nodes[instance.node_offset + parent];
+    uint child_count = floatBitsToUint(node.origin_meta.w) >> 24;
+
+    uint from = 0;
+    while (node.children[from] != node_idx ||
+           ((node.lo.w >> (from * 8)) & 0xffu) != 0) {
+      ++from;
+    }
+    vec3 aabb_min;
+    vec3 aabb_max;
+    wide_bvh_child_bounds(node, from, aabb_min, aabb_max);
+    float from_t =
+        ray_aabb_intersection(ray, inv_d, aabb_min, aabb_max, FLOAT_MAX);
+
+    // the nearest internal child after `from`, 4 if there is none
+    uint next = 4;
+    float next_t = FLOAT_MAX;
+    for (uint i = 0; i < child_count; ++i) {
+      if (i == from || ((node.lo.w >> (i * 8)) & 0xffu) != 0) {
+        continue;
+      }
+      wide_bvh_child_bounds(node, i, aabb_min, aabb_max);
+      float t = ray_aabb_intersection(ray, inv_d, aabb_min, aabb_max, t_max);
+      bool after = t > from_t || (t == from_t && i > from);
+      if (after && t < next_t) {
+        next = i;
+        next_t = t;
+      }
+    }
+
+    if (next != 4) {
+      node_idx = node.children[next];
+      return true;
+    }
+    node_idx = parent;
+  }
+
+  return false;
+}
+
+// the tlas of a scene without instances is a single leaf over none, its
+// bounds are empty but infinite so rays would still enter it.
+bool tlas_is_empty(BvhNode root) {
+  return floatBitsToUint(root.max_r.w) == BVH_LEAF_BIT;
+}
+
+bool tlas_backtrack(Ray ray, vec3 inv_d, float t_max, inout uint node_idx) {
+  while (node_idx != 0) {
+    uint parent =
+        parent_buffer.parents[constants.tlas_parent_offset + node_idx];
+    BvhNode node = tlas.nodes[parent];
+    uint l = floatBitsToUint(node.min_l.w);
+    uint r = floatBitsToUint(node.max_r.w);
+    bool from_right = node_idx == r;
+    if (binary_sibling_pending(ray, inv_d, tlas.nodes[l], tlas.nodes[r],
+                               from_right, t_max)) {
+      node_idx = from_right ? l : r;
+      return true;
+    }
+    node_idx = parent;
+  }
+
+  return false;
+}
+
+bool blas_intersect_binary(Ray ray, Instance instance, inout float t_max,
+                           inout uint triangle_idx) {
+  uint to_visit[TO_VISIT_LEN];
+  float to_visit_t[TO_VISIT_LEN];
+  // the top of the stack is at `(to_visit_top - 1) % TO_VISIT_LEN`
+  uint to_visit_top = 0;
+  uint to_visit_count = 0;
+  bool dropped = false;
+  vec3 inv_d = 1.0 / ray.d;
+
+  uint node_idx = instance.root;
+  BvhNode node = bvh.nodes[instance.node_offset + node_idx];
+  if (ray_aabb_intersection(ray, inv_d, node.min_l.xyz, node.max_r.xyz,
+                            t_max) == FLOAT_MAX) {
+    return false;
+  }
+
+  bool hit = false;
+  while (true) {
+    uint r = floatBitsToUint(node.max_r.w);
+    if ((r & BVH_LEAF_BIT) != 0) {  // leaf node
+      hit = ray_leaf_intersect(ray, instance, floatBitsToUint(node.min_l.w),
+                               r & ~BVH_LEAF_BIT, t_max, triangle_idx) ||
+            hit;
+    } else {
+      uint l = floatBitsToUint(node.min_l.w);
+      BvhNode left = bvh.nodes[instance.node_offset + l];
+      BvhNode right = bvh.nodes[instance.node_offset + r];
+      float t_left = ray_aabb_intersection(ray, inv_d, left.min_l.xyz,
+                                           left.max_r.xyz, t_max);
+      float t_right = ray_aabb_intersection(ray, inv_d, right.min_l.xyz,
+                                            right.max_r.xyz, t_max);
+      if (t_right < t_left) {
+        node_idx = r;
+        node = right;
+        if (t_left != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top % TO_VISIT_LEN] = l;
+          to_visit_t[to_visit_top++ % TO_VISIT_LEN] = t_left;
+        }
+        continue;
+      } else if (t_left != FLOAT_MAX) {
+        node_idx = l;
+        node = left;
+        if (t_right != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top % TO_VISIT_LEN] = r;
+          to_visit_t[to_visit_top++ % TO_VISIT_LEN] = t_right;
+        }
+        continue;
+      }
+    }
+
+    while (to_visit_count != 0 &&
+           to_visit_t[(to_visit_top - 1) % TO_VISIT_LEN] >= t_max) {
+      --to_visit_top;
+      --to_visit_count;
+    }
+    if (to_visit_count != 0) {
+      --to_visit_count;
+      node_idx = to_visit[--to_visit_top % TO_VISIT_LEN];
+    } else if (!dropped || !blas_binary_backtrack(ray, inv_d, instance, t_max,
+                                                  node_idx)) {
+      break;
+    }
+    node = bvh.nodes[instance.node_offset + node_idx];
+  }
+
+  return hit;
+}
+
+bool blas_intersect_wide(Ray ray, Instance instance, inout float t_max,
+                         inout uint triangle_idx) {
+  uint to_visit[TO_VISIT_LEN];
+  float to_visit_t[TO_VISIT_LEN];
+  uint to_visit_top = 0;
+  uint to_visit_count = 0;
+  bool dropped = false;
+  uint node_idx = instance.root;
+  vec3 inv_d = 1.0 / ray.d;
+
+  bool hit = false;
+  while (true) {
+    WideBvhNode node = wide_bvh.nodes[instance.node_offset + node_idx];
+    uint child_count = floatBitsToUint(node.origin_meta.w) >> 24;
+    // the internal children the ray enters, nearest first
+    uint hit_children[4];
+    float hit_t[4];
+    uint hit_count = 0;
+    for (uint i = 0; i < child_count; ++i) {
+      vec3 aabb_min;
+      vec3 aabb_max;
+      wide_bvh_child_bounds(node, i, aabb_min, aabb_max);
+      float t = ray_aabb_intersection(ray, inv_d, aabb_min, aabb_max, t_max);
+      if (t == FLOAT_MAX) {
+        continue;
+      }
+
+      uint triangle_count = (node.lo.w >> (i * 8)) & 0xffu;
+      if (triangle_count != 0) {  // leaf child
+        hit = ray_leaf_intersect(ray, instance, node.children[i],
+                                 triangle_count, t_max, triangle_idx) ||
+              hit;
+      } else {
+        uint j = hit_count++;
+        while (j > 0 && hit_t[j - 1] > t) {
+          hit_children[j] = hit_children[j - 1];
+          hit_t[j] = hit_t[j - 1];
+          --j;
+        }
+        hit_children[j] = node.children[i];
+        hit_t[j] = t;
+      }
+    }
+
+    if (hit_count != 0) {
+      // farthest first so the nearest ends up on top
+      for (uint j = hit_count - 1; j > 0; --j) {
+        dropped = dropped || to_visit_count == TO_VISIT_LEN;
+        to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+        to_visit[to_visit_top % TO_VISIT_LEN] = hit_children[j];
+        to_visit_t[to_visit_top++ % TO_VISIT_LEN] = hit_t[j];
+      }
+      node_idx = hit_children[0];
+      continue;
+    }
+
+    while (to_visit_count != 0 &&
+           to_visit_t[(to_visit_top - 1) % TO_VISIT_LEN] >= t_max) {
+      --to_visit_top;
+      --to_visit_count;
+    }
+    if (to_visit_count != 0) {
+      --to_visit_count;
+      node_idx = to_visit[--to_visit_top % TO_VISIT_LEN];
+    } else if (!dropped || !blas_wide_backtrack(ray, inv_d, instance, t_max,
+                                                node_idx)) {
+      break;
+    }
+  }
+
+  return hit;
+}
+
+// the occlusion traversals only look for any hit closer than `t_max`. they
+// still descend into the nearer child first since occluders are most often
+// close to where the shadow ray starts, but don't keep distances on the stack
+// as `t_max` never shrinks.
+
+bool blas_occluded_binary(Ray ray, Instance instance, float t_max) {
+  uint to_visit[TO_VISIT_LEN];
+  uint to_visit_top = 0;
+  uint to_visit_count = 0;
+  bool dropped = false;
+  vec3 inv_d = 1.0 / ray.d;
+
+  uint node_idx = instance.root;
+  BvhNode node = bvh.nodes[instance.node_offset + node_idx];
+  if (ray_aabb_intersection(ray, inv_d, node.min_l.xyz, node.max_r.xyz,
+                            t_max) == FLOAT_MAX) {
+    return false;
+  }
+
+  while (true) {
+    uint r = floatBitsToUint(node.max_r.w);
+    if ((r & BVH_LEAF_BIT) != 0) {  // leaf node
+      if (ray_leaf_occluded(ray, instance, floatBitsToUint(node.min_l.w),
+                            r & ~BVH_LEAF_BIT, t_max)) {
+        return true;
+      }
+    } else {
+      uint l = floatBitsToUint(node.min_l.w);
+      BvhNode left = bvh.nodes[instance.node_offset + l];
+      BvhNode right = bvh.nodes[instance.node_offset + r];
+      float t_left = ray_aabb_intersection(ray, inv_d, left.min_l.xyz,
+                                           left.max_r.xyz, t_max);
+      float t_right = ray_aabb_intersection(ray, inv_d, right.min_l.xyz,
+                                            right.max_r.xyz, t_max);
+      if (t_right < t_left) {
+        node_idx = r;
+        node = right;
+        if (t_left != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top++ % TO_VISIT_LEN] = l;
+        }
+        continue;
+      } else if (t_left != FLOAT_MAX) {
+        node_idx = l;
+        node = left;
+        if (t_right != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top++ % TO_VISIT_LEN] = r;
+        }
+        continue;
+      }
+    }
+
+    if (to_visit_count != 0) {
+      --to_visit_count;
+      node_idx = to_visit[--to_visit_top % TO_VISIT_LEN];
+    } else if (!dropped || !blas_binary_backtrack(ray, inv_d, instance, t_max,
+                                                  node_idx)) {
+      return false;
+    }
+    node = bvh.nodes[instance.node_offset + node_idx];
+  }
+
+  return false;
+}
+
+bool blas_occluded_wide(Ray ray, Instance instance, float t_max) {
+  uint to_visit[TO_VISIT_LEN];
+  uint to_visit_top = 0;
+  uint to_visit_count = 0;
+  bool dropped = false;
+  uint node_idx = instance.root;
+  vec3 inv_d = 1.0 / ray.d;
+
+  while (true) {
+    WideBvhNode node = wide_bvh.nodes[instance.node_offset + node_idx];
+    uint child_count = floatBitsToUint(node.origin_meta.w) >> 24;
+    // the entry distances are only used to sort the children
+    uint hit_children[4];
+    float hit_t[4];
+    uint hit_count = 0;
+    for (uint i = 0; i < child_count; ++i) {
+      vec3 aabb_min;
+      vec3 aabb_max;
+      wide_bvh_child_bounds(node, i, aabb_min, aabb_max);
+      float t = ray_aabb_intersection(ray, inv_d, aabb_min, aabb_max, t_max);
+      if (t == FLOAT_MAX) {
+        continue;
+      }
+
+      uint triangle_count = (node.lo.w >> (i * 8)) & 0xffu;
+      if (triangle_count != 0) {  // leaf child
+        if (ray_leaf_occluded(ray, instance, node.children[i], triangle_count,
+                              t_max)) {
+          return true;
+        }
+      } else {
+        uint j = hit_count++;
+        while (j > 0 && hit_t[j - 1] > t) {
+          hit_children[j] = hit_children[j - 1];
+          hit_t[j] = hit_t[j - 1];
+          --j;
+        }
+        hit_children[j] = node.children[i];
+        hit_t[j] = t;
+      }
+    }
+
+    if (hit_count != 0) {
+      for (uint j = hit_count - 1; j > 0; --j) {
+        dropped = dropped || to_visit_count == TO_VISIT_LEN;
+        to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+        to_visit[to_visit_top++ % TO_VISIT_LEN] = hit_children[j];
+      }
+      node_idx = hit_children[0];
+      continue;
+    }
+
+    if (to_visit_count != 0) {
+      --to_visit_count;
+      node_idx = to_visit[--to_visit_top % TO_VISIT_LEN];
+    } else if (!dropped || !blas_wide_backtrack(ray, inv_d, instance, t_max,
+                                                node_idx)) {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+// the state of a closest hit traversal of the scene, advanced one tlas node at
+// a time by `scene_traversal_step` so a traversal can be interleaved with
+// others, see `wavefront_extend_persistent.comp`.
+struct SceneTraversal {
+  Ray ray;
+  vec3 inv_d;
+  uint to_visit[TO_VISIT_LEN];
+  float to_visit_t[TO_VISIT_LEN];
+  // the top of the stack is at `(to_visit_top - 1) % TO_VISIT_LEN`
+  uint to_visit_top;
+  uint to_visit_count;
+  bool dropped;
+  // the closest hit so far
+  float t_max;
+  uint triangle_idx;
+  uint object_id;
+  // the node visited by the next step
+  uint node_idx;
+  BvhNode node;
+  bool done;
+};
+
+SceneTraversal scene_traversal_begin(Ray ray) {
+  SceneTraversal traversal;
+  traversal.ray = ray;
+  traversal.inv_d = 1.0 / ray.d;
+  traversal.to_visit_top = 0;
+  traversal.to_visit_count = 0;
+  traversal.dropped = false;
+  traversal.t_max = 100000000.0;
+  traversal.triangle_idx = 0;
+  traversal.object_id = NULL_OBJECT_ID;
+  traversal.node_idx = 0;
+  traversal.node = tlas.nodes[0];
+  traversal.done =
+      tlas_is_empty(traversal.node) ||
+      ray_aabb_intersection(ray, traversal.inv_d, traversal.node.min_l.xyz,
+                            traversal.node.max_r.xyz,
+                            traversal.t_max) == FLOAT_MAX;
+  return traversal;
+}
+
+void scene_traversal_push(inout SceneTraversal traversal, uint node_idx,
+                          float t) {
+  traversal.dropped =
+      traversal.dropped || traversal.to_visit_count == TO_VISIT_LEN;
+  traversal.to_visit_count = min(traversal.to_visit_count + 1, TO_VISIT_LEN);
+  traversal.to_visit[traversal.to_visit_top % TO_VISIT_LEN] = node_idx;
+  traversal.to_visit_t[traversal.to_visit_top++ % TO_VISIT_LEN] = t;
+}
+
+// visits `traversal.node`, the whole blas for a tlas leaf, and moves on to the
+// next node. returns false once the traversal is done.
+bool scene_traversal_step(inout SceneTraversal traversal) {
+  if (traversal.done) {
+    return false;
+  }
+
+  uint r = floatBitsToUint(traversal.node.max_r.w);
+  if ((r & BVH_LEAF_BIT) != 0) {  // leaf node
+    uint instance_idx = floatBitsToUint(traversal.node.min_l.w);
+    Instance instance = instance_buffer.instances[instance_idx];
+    Ray object_ray = ray_to_object_space(traversal.ray, instance);
+    bool hit = constants.wide_bvh != 0
+                   ? blas_intersect_wide(object_ray, instance, traversal.t_max,
+                                         traversal.triangle_idx)
+                   : blas_intersect_binary(object_ray, instance,
+                                           traversal.t_max,
+                                           traversal.triangle_idx);
+    if (hit) {
+      traversal.object_id = instance_idx;
+    }
+  } else {
+    uint l = floatBitsToUint(traversal.node.min_l.w);
+    BvhNode left = tlas.nodes[l];
+    BvhNode right = tlas.nodes[r];
+    float t_left =
+        ray_aabb_intersection(traversal.ray, traversal.inv_d, left.min_l.xyz,
+                              left.max_r.xyz, traversal.t_max);
+    float t_right =
+        ray_aabb_intersection(traversal.ray, traversal.inv_d, right.min_l.xyz,
+                              right.max_r.xyz, traversal.t_max);
+    if (t_right < t_left) {
+      traversal.node_idx = r;
+      traversal.node = right;
+      if (t_left != FLOAT_MAX) {
+        scene_traversal_push(traversal, l, t_left);
+      }
+      return true;
+    } else if (t_left != FLOAT_MAX) {
+      traversal.node_idx = l;
+      traversal.node = left;
+      if (t_right != FLOAT_MAX) {
+        scene_traversal_push(traversal, r, t_right);
+      }
+      return true;
+    }
+  }
+
+  while (traversal.to_visit_count != 0 &&
+         traversal.to_visit_t[(traversal.to_visit_top - 1) % TO_VISIT_LEN] >=
+             traversal.t_max) {
+    --traversal.to_visit_top;
+    --traversal.to_visit_count;
+  }
+  if (traversal.to_visit_count != 0) {
+    --traversal.to_visit_count;
+    traversal.node_idx =
+        traversal.to_visit[--traversal.to_visit_top % TO_VISIT_LEN];
+  } else if (!traversal.dropped ||
+             !tlas_backtrack(traversal.ray, traversal.inv_d, traversal.t_max,
+                             traversal.node_idx)) {
+    traversal.done = true;
+    return false;
+  }
+  traversal.node = tlas.nodes[traversal.node_idx];
+
+  return true;
+}
+
+SceneIntersection scene_traversal_result(SceneTraversal traversal) {
+  if (traversal.object_id == NULL_OBJECT_ID) {
+    return SceneIntersection(-1.0, NULL_OBJECT_ID, traversal.triangle_idx);
+  }
+
+  return SceneIntersection(traversal.t_max, traversal.object_id,
+                           traversal.triangle_idx);
+}
+
+// walks the tlas in world space and every blas it reaches in the object space
+// of the instance, the closest hit distance carries over between instances.
+SceneIntersection ray_scene_intersect(Ray ray) {
+  SceneTraversal traversal = scene_traversal_begin(ray);
+  while (scene_traversal_step(traversal)) {
+  }
+
+  return scene_traversal_result(traversal);
+}
+
+// whether anything blocks the ray before `t_max`, `FLOAT_MAX` for rays towards
+// the environment
+bool ray_scene_occluded(Ray ray, float t_max) {
+  uint to_visit[TO_VISIT_LEN];
+  uint to_visit_top = 0;
+  uint to_visit_count = 0;
+  bool dropped = false;
+  vec3 inv_d = 1.0 / ray.d;
+
+  uint node_idx = 0;
+  BvhNode node = tlas.nodes[node_idx];
+  if (tlas_is_empty(node) ||
+      ray_aabb_intersection(ray, inv_d, node.min_l.xyz, node.max_r.xyz,
+                            t_max) == FLOAT_MAX) {
+    return false;
+  }
+
+  while (true) {
+    uint r = floatBitsToUint(node.max_r.w);
+    if ((r & BVH_LEAF_BIT) != 0) {  // leaf node
+      Instance instance =
+          instance_buffer.instances[floatBitsToUint(node.min_l.w)];
+      Ray object_ray = ray_to_object_space(ray, instance);
+      bool occluded = constants.wide_bvh != 0
+                          ? blas_occluded_wide(object_ray, instance, t_max)
+                          : blas_occluded_binary(object_ray, instance, t_max);
+      if (occluded) {
+        return true;
+      }
+    } else {
+      uint l = floatBitsToUint(node.min_l.w);
+      BvhNode left = tlas.nodes[l];
+      BvhNode right = tlas.nodes[r];
+      float t_left = ray_aabb_intersection(ray, inv_d, left.min_l.xyz,
+                                           left.max_r.xyz, t_max);
+      float t_right = ray_aabb_intersection(ray, inv_d, right.min_l.xyz,
+                                            right.max_r.xyz, t_max);
+      if (t_right < t_left) {
+        node_idx = r;
+        node = right;
+        if (t_left != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top++ % TO_VISIT_LEN] = l;
+        }
+        continue;
+      } else if (t_left != FLOAT_MAX) {
+        node_idx = l;
+        node = left;
+        if (t_right != FLOAT_MAX) {
+          dropped = dropped || to_visit_count == TO_VISIT_LEN;
+          to_visit_count = min(to_visit_count + 1, TO_VISIT_LEN);
+          to_visit[to_visit_top++ % TO_VISIT_LEN] = r;
+        }
+        continue;
+      }
+    }
+
+    if (to_visit_count != 0) {
+      --to_visit_count;
+      node_idx = to_visit[--to_visit_top % TO_VISIT_LEN];
+    } else if (!dropped || !tlas_backtrack(ray, inv_d, t_max, node_idx)) {
+      return false;
+    }
+    node = tlas.nodes[node_idx];
+  }
+
+  return false;
+}
+
+vec3 vertex_normal(Instance instance, uint index) {
+  uint vertex = instance.vertex_offset + index;
+  if (constants.compact_vertices != 0) {
+    return octahedral_decode(
+        unpackSnorm2x16(compact_vertex_buffer.vertices[vertex].normal));
+  }
+  return vertex_buffer.vertices[vertex].normal;
+}
+
+// `p` is in world space, the normal is interpolated in the object space of
+// `instance` and transformed back. the positions come from the triangle buffer
+// so they are exact whatever the vertex format.
+vec3 get_face_normal(Instance instance, uint i, vec3 p) {
+  LeafTriangle triangle = triangle_buffer.triangles[i];
+  vec3 n0 = vertex_normal(instance, index_buffer.indices[i * 3 + 0]);
+  vec3 n1 = vertex_normal(instance, index_buffer.indices[i * 3 + 1]);
+  vec3 n2 = vertex_normal(instance, index_buffer.indices[i * 3 + 2]);
+
+  p = (instance.world_to_object * vec4(p, 1.0)).xyz;
+  vec3 p0 = triangle.v0_original.xyz;
+  vec3 p1 = p0 + triangle.e1_object.xyz;
+  vec3 p2 = p0 + triangle.e2.xyz;
+
+  vec3 f0 = p0 - p;
+  vec3 f1 = p1 - p;
+  vec3 f2 = p2 - p;
+
+  float det = length(cross(p0 - p1, p0 - p2));
+  float b0 = length(cross(f1, f2)) / det;
+  float b1 = length(cross(f2, f0)) / det;
+  float b2 = length(cross(f0, f1)) / det;
+
+  vec3 n = b0 * n0 + b1 * n1 + b2 * n2;
+  return normalize(transpose(mat3(instance.world_to_object)) * n);
+}
+
+vec3 face_forward(vec3 n, vec3 v) { return 0.0 > dot(n, v) ? -n : n; }
+
+vec3 square_to_cosine_hemisphere(vec2 u) {
+  vec2 d = square_to_uniform_disk_concentric(u);
+  float z = sqrt(max(0.0, 1.0 - d.x * d.x - d.y * d.y));
+  return vec3(d, z);
+}
+
+vec3 square_to_uniform_hemisphere(vec2 u) {
+  float z = u[0];
+  float r = sqrt(max(0.0, 1.0 - z * z));
+  float phi = 2 * PI * u[1];
+  return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+struct SufraceInteraction {
+  vec3 position;
+  vec3 normal;
+  vec3 wo_world;
+};
+
+// how far the rasterized first bounce can be below the traced surface, compact
+// vertices are rounded to a step of their object's bounds
+float first_bounce_bias(Instance instance) {
+  if (constants.compact_vertices == 0) {
+    return 0.0;
+  }
+  return length(mat3(instance.object_to_world) * instance.position_scale) /
+         65535.0;
+}
+
+Ray spawn_ray(SufraceInteraction si, vec3 dir) {
+  return Ray(si.position + si.normal * EPSILON,
+             normalize(face_forward(dir, si.normal)));
+}
+
+SufraceInteraction get_surface_interaction(Ray ray,
+                                           SceneIntersection intersection) {
+  vec3 position = ray.o + ray.d * intersection.t;
+  Instance instance = instance_buffer.instances[intersection.object_id];
+  return SufraceInteraction(
+      position, get_face_normal(instance, intersection.triangle_idx, position),
+      -ray.d);
+}
+
+vec3 eval_material(Material material, SufraceInteraction si, vec3 wi_world) {
+  // Frame frame = new_frame(si.normal);
+  // vec3 wo = frame_to_local(frame, si.wo_world);
+  // vec3 wi = frame_to_local(frame, wi_world);
+
+  return material.albedo * INV_PI;
+}
+
+vec3 escaped_ray_color(Ray ray) {
+  vec2 uv = vec2(0.5 + (atan(ray.d.z, ray.d.x) / (PI * 2)),
+                 0.5 - asin(ray.d.y) * INV_PI);
+  return texture(environment_map, uv).xyz;
+}
+
+struct LightSample {
+  vec3 color;
+  vec3 wi;
+  float pdf;
+  // how far the shadow ray has to go to reach the light
+  float dist;
+};
+
+float luminance(vec3 c) {
+  return 0.212671 * c.r + 0.715160 * c.g + 0.072169 * c.b;
+}
+
+LightSample sample_light(SufraceInteraction si) {
+  vec2 random = sample_2d();
+  float v = texture(environment_map_inv_marginal, vec2(0.5, random.y)).r;
+  float u = texture(environment_map_inv_cdf, vec2(random.x, v)).r;
+  float theta = PI * (v);
+  float phi = 2.0 * PI * (0.5 + u);
+  vec3 d = vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+
+  vec3 c = escaped_ray_color(Ray(vec3(0.0), d));
+  if (sin(theta) == 0.0) {
+    return LightSample(vec3(0.0), vec3(0.0), 0.0, 0.0);
+  }
+
+  return LightSample(c, d,
+                     (luminance(c) / constants.environment_map_pdf_scale) /
+                         (2.0 * PI * sin(theta)),
+                     FLOAT_MAX);
+}
+
+vec3 direct_light_sample(SufraceInteraction si, Material material) {
+  vec3 contributed = vec3(0.0);
+
+  for (uint i = 0; i < LIGHT_SAMPLES; ++i) {
+    LightSample light_sample = sample_light(si);
+    float cos_theta = dot(light_sample.wi, si.normal);
+    // the shadow ray is the expensive part, only trace it if the light
+    // would contribute
+    if (cos_theta <= 0.0 || light_sample.pdf <= 0.0) {
+      continue;
+    }
+
+    Ray r = spawn_ray(si, light_sample.wi);
+    if (!ray_scene_occluded(r, light_sample.dist)) {
+      vec3 f = eval_material(material, si, light_sample.wi) * cos_theta;
+      contributed += f * light_sample.color / light_sample.pdf;
+    }
+  }
+
+  return contributed / LIGHT_SAMPLES;
+}
+
+#endif
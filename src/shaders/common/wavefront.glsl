@@ -0,0 +1,86 @@
+#ifndef SHADER_COMMON_WAVEFRONT
+#define SHADER_COMMON_WAVEFRONT
+
+// the wavefront path tracer's buffers, set 1 next to the trace descriptor set.
+// see `src/wavefront.h`, the layouts must match `WavefrontPath` and
+// `WavefrontShadowRay` there.
+
+#include "./scene.glsl"
+
+// the state of a path between kernels. `w` of the first three holds the last
+// hit, see `path_intersection`.
+struct Path {
+  vec4 origin_t;
+  vec4 direction_object;
+  vec4 throughput_triangle;
+  vec4 radiance;
+  uvec4 rng_pcg;
+  uvec4 rng_blue;
+};
+
+layout(set = 1, binding = 0) buffer PathBuffer { Path paths[]; }
+path_buffer;
+
+// the two extension queues followed by the shadow queue, each as long as
+// `path_buffer`. paths are queued by index.
+layout(set = 1, binding = 1) buffer QueueBuffer { uint paths[]; }
+queue_buffer;
+
+// the lengths of the queues in `queue_buffer`, followed by how many paths of
+// the extension queue the persistent threads have taken
+layout(set = 1, binding = 2) buffer CounterBuffer { uint counts[4]; }
+counter_buffer;
+
+// `LIGHT_SAMPLES` per path, `origin_dist.w` is 0 for samples that are not
+// traced
+struct ShadowRay {
+  vec4 origin_dist;
+  vec4 direction;
+  vec4 contribution;
+};
+
+layout(set = 1, binding = 3) buffer ShadowRayBuffer { ShadowRay rays[]; }
+shadow_ray_buffer;
+
+// the averaged samples of every pixel of the frame
+layout(set = 1, binding = 4) buffer FilmBuffer { vec4 pixels[]; }
+film_buffer;
+
+const uint SHADOW_QUEUE = 2u;
+const uint EXTEND_CURSOR = 3u;
+
+uint path_count() { return uint(path_buffer.paths.length()); }
+
+uint queue_slot(uint queue, uint i) { return queue * path_count() + i; }
+
+// the path of the chunk starting at `constants.first_pixel`, each path
+// belongs to a single pixel
+uint path_pixel(uint path_idx) { return constants.first_pixel + path_idx; }
+
+// the coordinates `gl_FragCoord` has for the pixel in `pathtrace.frag`
+vec2 pixel_frag_coord(uint pixel) {
+  return vec2(pixel % constants.width, pixel / constants.width) + 0.5;
+}
+
+void load_random(uint path_idx) {
+  rng_p = ivec2(pixel_frag_coord(path_pixel(path_idx)));
+  rng_seed_pcg = path_buffer.paths[path_idx].rng_pcg;
+  rng_seed_blue = path_buffer.paths[path_idx].rng_blue;
+}
+
+void store_random(uint path_idx) {
+  path_buffer.paths[path_idx].rng_pcg = rng_seed_pcg;
+  path_buffer.paths[path_idx].rng_blue = rng_seed_blue;
+}
+
+Ray path_ray(Path path) {
+  return Ray(path.origin_t.xyz, path.direction_object.xyz);
+}
+
+SceneIntersection path_intersection(Path path) {
+  return SceneIntersection(path.origin_t.w,
+                           floatBitsToUint(path.direction_object.w),
+                           floatBitsToUint(path.throughput_triangle.w));
+}
+
+#endif
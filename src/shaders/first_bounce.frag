@@ -10,7 +10,8 @@ layout(location = 2) out uint object_index;
 
 void main() {
   position = vec4(i_position, 1.0);
-  normal = vec4(i_normal.xyz, 1.0);
+  // instance transforms may scale the normal
+  normal = vec4(normalize(i_normal), 1.0);
   object_index = i_object_index;
   // object_index = gl_PrimitiveID;
 }
\ No newline at end of file
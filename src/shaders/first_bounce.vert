@@ -1,19 +1,42 @@
 #version 450
 
-layout(push_constant) uniform PushConstants { mat4 camera_matrix; }
+#include "./common/compact_vertex.glsl"
+
+layout(push_constant) uniform PushConstants {
+  mat4 camera_matrix;
+  uint compact_vertices;
+}
 constants;
 
-layout(location = 0) in vec4 i_position_object_index;
-layout(location = 1) in vec3 i_normal;
+// either a `Vertex` or a `CompactVertex`, see `src/compact_vertex.h`. the
+// object index in the w of a full vertex's position is unused.
+layout(location = 0) in vec4 i_position;
+layout(location = 1) in vec4 i_normal;
+// per instance, see `GpuInstance` in `src/scene.h`
+layout(location = 2) in mat4 i_object_to_world;
+layout(location = 6) in vec3 i_world_to_object_0;
+layout(location = 7) in vec3 i_world_to_object_1;
+layout(location = 8) in vec3 i_world_to_object_2;
+layout(location = 9) in vec3 i_position_origin;
+layout(location = 10) in vec3 i_position_scale;
 
 layout(location = 0) out vec3 o_position;
 layout(location = 1) out vec3 o_normal;
 layout(location = 2) flat out uint o_object_index;
 
 void main() {
-  gl_Position =
-      constants.camera_matrix * vec4(i_position_object_index.xyz, 1.0);
-  o_position = i_position_object_index.xyz;
-  o_normal = i_normal;
-  o_object_index = floatBitsToUint(i_position_object_index.w);
+  // full vertices have an origin of 0 and a scale of 1
+  vec3 object_position = i_position_origin + i_position.xyz * i_position_scale;
+  vec3 normal = constants.compact_vertices != 0 ? octahedral_decode(i_normal.xy)
+                                                : i_normal.xyz;
+
+  vec4 position = i_object_to_world * vec4(object_position, 1.0);
+  mat3 world_to_object =
+      mat3(i_world_to_object_0, i_world_to_object_1, i_world_to_object_2);
+
+  gl_Position = constants.camera_matrix * position;
+  o_position = position.xyz;
+  o_normal = transpose(world_to_object) * normal;
+  // the path tracer looks the material up through the instance
+  o_object_index = uint(gl_InstanceIndex);
 }
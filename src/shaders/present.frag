@@ -9,6 +9,8 @@ layout(binding = 1) uniform sampler2D sampler_normal;
 layout(binding = 2) uniform usampler2D sampler_object_id;
 layout(binding = 3) uniform sampler2D sampler_color;
 layout(binding = 4) uniform sampler2D sampler_accumulation;
+// the accumulation filtered by `denoise.comp`
+layout(binding = 5) uniform sampler2D sampler_denoised;
 
 layout(location = 0) in vec2 i_uv;
 
@@ -17,6 +19,7 @@ layout(location = 0) out vec4 col;
 layout(push_constant) uniform PushConstants {
   uint present_mode;  // 0 for position, 1 for normal, 2 for color, 3 for
                       // accumulation
+  uint denoised;      // whether to show the accumulation denoised
 }
 constants;
 
@@ -60,7 +63,8 @@ void main() {
       color = texture(sampler_color, i_uv).rgb;
     } break;
     case PRESENT_MODE_ACCUMULATION: {
-      color = texture(sampler_accumulation, i_uv).rgb;
+      color = constants.denoised != 0 ? texture(sampler_denoised, i_uv).rgb
+                                      : texture(sampler_accumulation, i_uv).rgb;
     } break;
   }
 
@@ -0,0 +1,13 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+layout(location = 0) out vec4 col;
+
+#include "./common/wavefront.glsl"
+
+// takes the place of `pathtrace.frag` in the trace render pass so the
+// wavefront film is accumulated and presented like its output
+void main() {
+  uvec2 p = uvec2(gl_FragCoord.xy);
+  col = film_buffer.pixels[p.y * constants.width + p.x];
+}
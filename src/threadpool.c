@@ -0,0 +1,116 @@
+#include <stdlib.h>
+
+#include "SDL_cpuinfo.h"
+#include "SDL_mutex.h"
+#include "SDL_thread.h"
+
+#include "log.h"
+#include "threadpool.h"
+#include "types.h"
+
+u32 threadpool_default_thread_count() {
+  int count = SDL_GetCPUCount();
+  return count > 0 ? (u32)count : 1;
+}
+
+int threadpool_worker(void *data) {
+  ThreadPoolQueue *queue = data;
+
+  SDL_LockMutex(queue->mutex);
+  while (true) {
+    while (!queue->jobs && !queue->shutting_down) {
+      SDL_WaitCondition(queue->job_available, queue->mutex);
+    }
+
+    if (queue->shutting_down) {
+      break;
+    }
+
+    ThreadPoolJob *job = queue->jobs;
+    queue->jobs = job->next;
+    SDL_UnlockMutex(queue->mutex);
+
+    job->fn(job->context);
+    free(job);
+
+    SDL_LockMutex(queue->mutex);
+    if (--queue->pending_count == 0) {
+      SDL_BroadcastCondition(queue->jobs_finished);
+    }
+  }
+  SDL_UnlockMutex(queue->mutex);
+
+  return 0;
+}
+
+ThreadPool threadpool_new(u32 thread_count) {
+  if (thread_count == 0) {
+    thread_count = threadpool_default_thread_count();
+  }
+
+  ThreadPool self = {
+      .thread_count = thread_count,
+      .threads = malloc(sizeof(SDL_Thread *) * thread_count),
+      .queue = malloc(sizeof(ThreadPoolQueue)),
+  };
+
+  *self.queue = (ThreadPoolQueue){
+      .mutex = SDL_CreateMutex(),
+      .job_available = SDL_CreateCondition(),
+      .jobs_finished = SDL_CreateCondition(),
+      .jobs = NULL,
+      .pending_count = 0,
+      .shutting_down = false,
+  };
+
+  for (u32 i = 0; i < thread_count; ++i) {
+    self.threads[i] =
+        SDL_CreateThread(threadpool_worker, "mortimer worker", self.queue);
+    if (!self.threads[i]) {
+      fatalln("could not create worker thread %u", i);
+    }
+  }
+
+  return self;
+}
+
+void threadpool_push(ThreadPool *self, ThreadPoolJobFn fn, void *context) {
+  ThreadPoolJob *job = malloc(sizeof(ThreadPoolJob));
+  job->fn = fn;
+  job->context = context;
+
+  SDL_LockMutex(self->queue->mutex);
+  job->next = self->queue->jobs;
+  self->queue->jobs = job;
+  ++self->queue->pending_count;
+  SDL_SignalCondition(self->queue->job_available);
+  SDL_UnlockMutex(self->queue->mutex);
+}
+
+void threadpool_wait(ThreadPool *self) {
+  SDL_LockMutex(self->queue->mutex);
+  while (self->queue->pending_count > 0) {
+    SDL_WaitCondition(self->queue->jobs_finished, self->queue->mutex);
+  }
+  SDL_UnlockMutex(self->queue->mutex);
+}
+
+void threadpool_destroy(ThreadPool *self) {
+  threadpool_wait(self);
+
+  SDL_LockMutex(self->queue->mutex);
+  self->queue->shutting_down = true;
+  SDL_BroadcastCondition(self->queue->job_available);
+  SDL_UnlockMutex(self->queue->mutex);
+
+  for (u32 i = 0; i < self->thread_count; ++i) {
+    SDL_WaitThread(self->threads[i], NULL);
+  }
+
+  SDL_DestroyCondition(self->queue->jobs_finished);
+  SDL_DestroyCondition(self->queue->job_available);
+  SDL_DestroyMutex(self->queue->mutex);
+
+  free(self->queue);
+  free(self->threads);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "SDL_mutex.h"
+#include "SDL_thread.h"
+
+#include "types.h"
+
+typedef void (*ThreadPoolJobFn)(void *);
+
+typedef struct ThreadPoolJob_t {
+  ThreadPoolJobFn fn;
+  void *context;
+  struct ThreadPoolJob_t *next;
+} ThreadPoolJob;
+
+/// Shared between the workers, this lives on the heap so the `ThreadPool`
+/// itself can be passed around by value.
+typedef struct {
+  SDL_Mutex *mutex;
+  SDL_Condition *job_available;
+  SDL_Condition *jobs_finished;
+  ThreadPoolJob *jobs;
+  // number of jobs that are either queued or currently running
+  u32 pending_count;
+  bool shutting_down;
+} ThreadPoolQueue;
+
+/// A very simple LIFO job pool, jobs are allowed to push more jobs.
+typedef struct {
+  u32 thread_count;
+  SDL_Thread **threads;
+  ThreadPoolQueue *queue;
+} ThreadPool;
+
+/// Number of logical cores available, always at least 1.
+u32 threadpool_default_thread_count();
+
+/// If `thread_count` is 0 then one thread per logical core is used.
+ThreadPool threadpool_new(u32 thread_count);
+void threadpool_push(ThreadPool *self, ThreadPoolJobFn fn, void *context);
+/// Blocks until every job (including any pushed by other jobs) has completed.
+void threadpool_wait(ThreadPool *self);
+void threadpool_destroy(ThreadPool *self);
@@ -0,0 +1,98 @@
+#include <vulkan/vulkan_core.h>
+
+#include "maths.h"
+#include "types.h"
+
+#include "tiles.h"
+
+// how much a new frame time moves the estimate, frame times are noisy
+static const f32 TILE_TIME_SMOOTHING = 0.25f;
+
+TileScheduler tile_scheduler_new(void) {
+  return (TileScheduler){
+      .enabled = true,
+      .budget_ms = 12.0f,
+      .tile_ms = 0.0f,
+      .next_tile = 0,
+      .tiles_per_frame = UINT32_MAX,
+  };
+}
+
+u32 tile_count(VkExtent2D extent) {
+  u32 tiles_x = (extent.width + TILE_SIZE - 1) / TILE_SIZE;
+  u32 tiles_y = (extent.height + TILE_SIZE - 1) / TILE_SIZE;
+  return tiles_x * tiles_y;
+}
+
+VkRect2D tile_rect(VkExtent2D extent, u32 tile) {
+  u32 tiles_x = (extent.width + TILE_SIZE - 1) / TILE_SIZE;
+  u32 x = tile % tiles_x * TILE_SIZE;
+  u32 y = tile / tiles_x * TILE_SIZE;
+  return (VkRect2D){
+      .offset.x = (i32)x,
+      .offset.y = (i32)y,
+      .extent.width = min(TILE_SIZE, extent.width - x),
+      .extent.height = min(TILE_SIZE, extent.height - y),
+  };
+}
+
+TileRange tile_scheduler_next(TileScheduler *self, VkExtent2D extent,
+                              bool tiled) {
+  u32 total = tile_count(extent);
+  // the extent changed mid sweep
+  if (self->next_tile >= total) {
+    self->next_tile = 0;
+  }
+
+  if (!tiled) {
+    self->next_tile = 0;
+    return (TileRange){.first = 0, .count = total, .total = total};
+  }
+
+  TileRange range = {
+      .first = self->next_tile,
+      .count = min(max(self->tiles_per_frame, 1u), total - self->next_tile),
+      .total = total,
+  };
+  self->next_tile = (range.first + range.count) % total;
+
+  return range;
+}
+
+void tile_scheduler_restart(TileScheduler *self) { self->next_tile = 0; }
+
+void tile_scheduler_record_time(TileScheduler *self, u32 traced_tiles,
+                                u32 total_tiles, f64 gpu_ms) {
+  if (traced_tiles == 0) {
+    return;
+  }
+
+  f32 tile_ms = (f32)(gpu_ms / traced_tiles);
+  self->tile_ms = self->tile_ms == 0.0f
+                      ? tile_ms
+                      : self->tile_ms +
+                            (tile_ms - self->tile_ms) * TILE_TIME_SMOOTHING;
+  f32 fitting = self->budget_ms / max(self->tile_ms, 1e-6f);
+  self->tiles_per_frame = (u32)clamp(fitting, 1.0f, (f32)total_tiles);
+}
+
+void tile_draw(VkCommandBuffer cmdbuffer, VkExtent2D extent, TileRange range) {
+  VkRect2D whole = {
+      .offset.x = 0,
+      .offset.y = 0,
+      .extent = extent,
+  };
+
+  if (range.count == range.total) {
+    vkCmdSetScissor(cmdbuffer, 0, 1, &whole);
+    vkCmdDraw(cmdbuffer, 3, 1, 0, 0);
+    return;
+  }
+
+  for (u32 i = 0; i < range.count; ++i) {
+    VkRect2D scissor = tile_rect(extent, range.first + i);
+    vkCmdSetScissor(cmdbuffer, 0, 1, &scissor);
+    vkCmdDraw(cmdbuffer, 3, 1, 0, 0);
+  }
+  vkCmdSetScissor(cmdbuffer, 0, 1, &whole);
+}
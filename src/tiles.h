@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vulkan/vulkan_core.h>
+
+#include "types.h"
+
+/// the side of a square trace tile in pixels
+static const u32 TILE_SIZE = 128;
+
+/// Splits the trace pass into tiles so a frame only traces as many of them as
+/// fit in a gpu time budget, the next frames carry on where it stopped. A
+/// sweep over every tile adds one sample to each pixel, so the accumulation
+/// only advances once a sweep is done.
+typedef struct {
+  bool enabled;
+  /// how long the trace pass of a frame may take on the gpu
+  f32 budget_ms;
+  /// the running estimate of the gpu time of a single tile, 0 until the first
+  /// frame was timed
+  f32 tile_ms;
+  /// where the current sweep continues
+  u32 next_tile;
+  u32 tiles_per_frame;
+} TileScheduler;
+
+/// The tiles a frame traces, `first` to `first + count` in `tile_rect` order.
+typedef struct {
+  u32 first;
+  u32 count;
+  /// the tiles of a whole sweep, the frame traces them all if equal to
+  /// `count`
+  u32 total;
+} TileRange;
+
+TileScheduler tile_scheduler_new(void);
+
+/// How many tiles cover `extent`.
+u32 tile_count(VkExtent2D extent);
+
+/// The pixels of `tile`, in rows from the top left of the framebuffer.
+VkRect2D tile_rect(VkExtent2D extent, u32 tile);
+
+/// Picks the tiles of the next frame and advances the sweep. Every tile is
+/// traced if `tiled` is false.
+TileRange tile_scheduler_next(TileScheduler *self, VkExtent2D extent,
+                              bool tiled);
+
+/// Restarts the sweep, for when the accumulation is reset.
+void tile_scheduler_restart(TileScheduler *self);
+
+/// Updates the estimate with a frame that traced `traced_tiles` of
+/// `total_tiles` in `gpu_ms`.
+void tile_scheduler_record_time(TileScheduler *self, u32 traced_tiles,
+                                u32 total_tiles, f64 gpu_ms);
+
+/// Records a fullscreen triangle clipped to every tile of `range`, a single
+/// unclipped one for a whole sweep. Leaves the scissor at the whole `extent`.
+void tile_draw(VkCommandBuffer cmdbuffer, VkExtent2D extent, TileRange range);
@@ -3,196 +3,153 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "SDL_timer.h"
+#include "bvh_binning.h"
+#include "bvh_cache.h"
+#include "bvh_optimize.h"
 #include "ccVector.h"
 #include "log.h"
 #include "maths.h"
+#include "sbvh.h"
+#include "threadpool.h"
 #include "types.h"
+#include "wide_bvh.h"
 
 #include "trimesh.h"
 
-typedef struct {
-  Aabb bounds;
-  vec3 centroid;
-  u32 index;
-} TriangleInfo;
-
-usize partition(void *arr, usize count, usize stride, void *context,
-                bool (*compare)(void *, const void *)) {
-  void *first = arr;
-  for (usize i = 0; i < count; i++) {
-    if (!compare(context, arr + i * stride)) {
-      first = arr + i * stride;
-      break;
-    }
-  }
-  void *last = arr + stride * count;
-  void *temp = malloc(stride);
-  for (void *item = first + stride; item != last; item += stride) {
-    if (compare(context, item)) {
-      memmove(temp, item, stride);
-      memmove(item, first, stride);
-      memmove(first, temp, stride);
-      first += stride;
-    }
-  }
-
-  free(temp);
-  return (first - arr) / stride;
-}
-
 typedef enum {
   SPLIT_METHOD_EQUAL_COUNTS,
   SPLIT_METHOD_SAH,
 } SplitMethod;
 
 typedef struct {
-  u32 dim;
-  f32 mid;
-} PartitionTriangleInfoByCentroidContext;
+  TriangleInfos triangle_infos;
+  BvhNode *nodes;
+  ThreadPool *pool;
+  u32 max_leaf_triangles;
+} BvhBuildContext;
 
-bool partition_triangle_infos_by_centroid_fn(void *ctx, const void *data) {
-  PartitionTriangleInfoByCentroidContext *info = ctx;
-  const TriangleInfo *triangle_info = data;
+/// Subtrees with at least this many triangles are split off into their own job
+/// when building in parallel.
+static const u32 PARALLEL_SPLIT_THRESHOLD = 4096;
 
-  return triangle_info->centroid.v[info->dim] < info->mid;
-}
-
-typedef struct {
-  u32 dim;
-  u32 min_idx;
-  Aabb centroid_bounds;
-} PartitionTriangleInfoByBucketContext;
-
-const u32 BUCKET_COUNT = 12;
 typedef struct {
-  u32 cost;
-  Aabb bounds;
-} Bucket;
-
-u32 get_bucket(Aabb centroid_bounds, const TriangleInfo *info, u32 dim) {
-  return min(BUCKET_COUNT - 1,
-      (u32)(((f32)BUCKET_COUNT *
-             aabb_offset(centroid_bounds, info->centroid).v[dim]))));
-}
-
-bool partition_triangle_infos_by_bucket_fn(void *ctx, const void *data) {
-  PartitionTriangleInfoByBucketContext *info = ctx;
-  const TriangleInfo *triangle_info = data;
-  u32 b = get_bucket(info->centroid_bounds, triangle_info, info->dim);
-  assert(b < BUCKET_COUNT);
-  return b <= info->min_idx;
-}
-
-u32 recursive_split(u32 triangle_count, TriangleInfo *triangle_infos,
-                    u32 node_count, u32 *node_idx, BvhNode *nodes,
-                    const u32 start, const u32 end) {
+  BvhBuildContext *ctx;
+  u32 start;
+  u32 end;
+  u32 node_offset;
+} SplitJob;
+
+void recursive_split_job(void *data);
+
+/// Builds the subtree over `triangle_infos[start..end]` into the nodes starting
+/// at `node_offset`. A subtree over `n` triangles takes at most `2n - 1` nodes
+/// (exactly that many if every leaf holds a single triangle), so each subtree
+/// reserves that many and can be built independently of (and in parallel with)
+/// its siblings. Nodes are laid out in post order so the root of the subtree is
+/// the last node, the unused slots left by bigger leaves are removed afterwards
+/// by `compact_nodes`.
+u32 recursive_split(BvhBuildContext *ctx, const u32 start, const u32 end,
+                    const u32 node_offset) {
   assert(start < end);
-
-  Aabb bounds = triangle_infos[start].bounds;
-  for (u32 i = start + 1; i < end; i++) {
-    bounds = aabb_union(bounds, triangle_infos[i].bounds);
-  }
+  TriangleInfos *triangle_infos = &ctx->triangle_infos;
 
   u32 n_primitives = end - start;
-
-  if (n_primitives == 1) {
-    nodes[(*node_idx)++] = (BvhNode){
-        .min = triangle_infos[start].bounds.min,
-        .l = triangle_infos[start].index,
-        .max = triangle_infos[start].bounds.max,
-        .r = triangle_infos[start].index,
-    };
-  } else {
-    Aabb centroid_bounds = aabb_from_vec3(triangle_infos[start].centroid);
-    for (u32 i = start + 1; i < end; i++) {
-      centroid_bounds =
-          aabb_expand(centroid_bounds, triangle_infos[i].centroid);
-    }
-    u32 dim = aabb_max_extent_idx(centroid_bounds);
-
-    u32 middle;
-    SplitMethod split_method = SPLIT_METHOD_SAH;
-    if (n_primitives == 2) {
-      split_method = SPLIT_METHOD_EQUAL_COUNTS;
-    }
+  u32 node_idx = node_offset + 2 * n_primitives - 2;
+
+  RangeBounds range = triangle_infos_range_bounds(triangle_infos, start, end);
+  Aabb bounds = range.bounds;
+  Aabb centroid_bounds = range.centroid_bounds;
+  u32 dim = aabb_max_extent_idx(centroid_bounds);
+  f32 centroid_extent = centroid_bounds.max.v[dim] - centroid_bounds.min.v[dim];
+
+  bool can_be_leaf = n_primitives <= ctx->max_leaf_triangles;
+  // nothing to gain from splitting two triangles, or triangles that can't be
+  // told apart by their centroids
+  bool make_leaf =
+      n_primitives == 1 ||
+      (can_be_leaf && (n_primitives == 2 || centroid_extent <= 0.0f));
+
+  u32 middle;
+  SplitMethod split_method = SPLIT_METHOD_SAH;
+  if (n_primitives == 2 || centroid_extent <= 0.0f) {
+    split_method = SPLIT_METHOD_EQUAL_COUNTS;
+  }
+  if (!make_leaf) {
     switch (split_method) {
     case SPLIT_METHOD_SAH: {
-      Bucket buckets[BUCKET_COUNT] = {0};
+      f32 scale = (f32)BUCKET_COUNT / centroid_extent;
 
-      for (u32 i = start; i < end; ++i) {
-        u32 b = get_bucket(centroid_bounds, &triangle_infos[i], dim);
-        buckets[b].bounds =
-            aabb_union(buckets[b].bounds, triangle_infos[i].bounds);
-        ++buckets[b].cost;
-      }
+      Bins bins;
+      triangle_infos_bin(triangle_infos, start, end, dim,
+                         centroid_bounds.min.v[dim], scale, &bins);
 
-      f32 costs[BUCKET_COUNT - 1] = {0};
+      f32 min_cost;
+      u32 min_idx = bins_find_best_split(&bins, bounds, &min_cost);
 
-      for (u32 i = 0; i < BUCKET_COUNT - 1; ++i) {
-        Aabb b0 = buckets[0].bounds;
-        Aabb b1 = buckets[i + 1].bounds;
-        u32 c0 = buckets[0].cost;
-        u32 c1 = buckets[i + 1].cost;
-
-        for (u32 j = 1; j < i + 1; j++) {
-          b0 = aabb_union(b0, buckets[j].bounds);
-          c0 += buckets[j].cost;
-        }
-
-        for (u32 j = i + 1 + 1; j < BUCKET_COUNT; j++) {
-          b1 = aabb_union(b1, buckets[j].bounds);
-          c1 += buckets[j].cost;
-        }
-
-        costs[i] = 1.0 + ((f32)c0 * aabb_surface_area(b0) +
-                          (f32)c1 * aabb_surface_area(b1)) /
-                             aabb_surface_area(bounds);
-      }
-
-      f32 min_cost = costs[0];
-      u32 min_idx = 0;
-      for (u32 i = 1; i < BUCKET_COUNT - 1; ++i) {
-        if (min_cost > costs[i]) {
-          min_cost = costs[i];
-          min_idx = i;
-        }
+      // the split cost is relative to intersecting one triangle, so the cost
+      // of a leaf is just its triangle count
+      if (can_be_leaf && (f32)n_primitives <= min_cost) {
+        make_leaf = true;
+        break;
       }
 
-      PartitionTriangleInfoByBucketContext ctx = {
-          .centroid_bounds = centroid_bounds,
+      PartitionByBucketContext ctx = {
           .dim = dim,
           .min_idx = min_idx,
+          .centroid_min = centroid_bounds.min.v[dim],
+          .scale = scale,
       };
-      middle = start + partition(triangle_infos + start, n_primitives,
-                                 sizeof(TriangleInfo), &ctx,
-                                 partition_triangle_infos_by_bucket_fn);
-      if (middle != start) {
+      middle = triangle_infos_partition(triangle_infos, start, end, &ctx,
+                                        partition_by_bucket_fn);
+      if (middle != start && middle != end) {
         break;
       }
     }
     case SPLIT_METHOD_EQUAL_COUNTS: {
-      PartitionTriangleInfoByCentroidContext ctx = {
+      PartitionByCentroidContext ctx = {
           .dim = dim,
-          .mid = (centroid_bounds.min.v[ctx.dim] +
-                  centroid_bounds.max.v[ctx.dim]) *
+          .mid = (centroid_bounds.min.v[dim] + centroid_bounds.max.v[dim]) *
                  0.5,
       };
 
       middle = start + n_primitives / 2;
-      partition(triangle_infos + start, n_primitives, sizeof(TriangleInfo),
-                &ctx, partition_triangle_infos_by_centroid_fn);
+      triangle_infos_partition(triangle_infos, start, end, &ctx,
+                               partition_by_centroid_fn);
     } break;
     default: {
       fatalln("something has gone terribly wrong");
     }
     }
+  }
 
-    u32 a = recursive_split(triangle_count, triangle_infos, node_count,
-                            node_idx, nodes, start, middle);
-    u32 b = recursive_split(triangle_count, triangle_infos, node_count,
-                            node_idx, nodes, middle, end);
+  if (make_leaf) {
+    ctx->nodes[node_idx] = (BvhNode){
+        .min = bounds.min,
+        .l = start,
+        .max = bounds.max,
+        .r = BVH_LEAF_BIT | n_primitives,
+    };
+  } else {
+    u32 left_offset = node_offset;
+    u32 right_offset = node_offset + 2 * (middle - start) - 1;
+
+    u32 a = left_offset + 2 * (middle - start) - 2;
+    if (ctx->pool && middle - start >= PARALLEL_SPLIT_THRESHOLD) {
+      SplitJob *job = malloc(sizeof(SplitJob));
+      *job = (SplitJob){
+          .ctx = ctx,
+          .start = start,
+          .end = middle,
+          .node_offset = left_offset,
+      };
+      threadpool_push(ctx->pool, recursive_split_job, job);
+    } else {
+      recursive_split(ctx, start, middle, left_offset);
+    }
+    u32 b = recursive_split(ctx, middle, end, right_offset);
 
-    nodes[(*node_idx)++] = (BvhNode){
+    ctx->nodes[node_idx] = (BvhNode){
         .max = bounds.max,
         .min = bounds.min,
         .l = a,
@@ -200,54 +157,386 @@ u32 recursive_split(u32 triangle_count, TriangleInfo *triangle_infos,
     };
   }
 
-  return *node_idx - 1;
+  return node_idx;
+}
+
+void recursive_split_job(void *data) {
+  SplitJob *job = data;
+  recursive_split(job->ctx, job->start, job->end, job->node_offset);
+  free(job);
+}
+
+/// Moves the subtree rooted at `node_idx` to the front of `nodes` in post
+/// order, dropping the slots `recursive_split` reserved but didn't use. Post
+/// order visits nodes in increasing index order so this can be done in place.
+/// Returns the new index of `node_idx`.
+u32 compact_nodes(BvhNode *nodes, u32 node_idx, u32 *node_count) {
+  BvhNode node = nodes[node_idx];
+  if (!bvh_node_is_leaf(node)) {
+    node.l = compact_nodes(nodes, node.l, node_count);
+    node.r = compact_nodes(nodes, node.r, node_count);
+  }
+  nodes[*node_count] = node;
+
+  return (*node_count)++;
+}
+
+static f32 node_surface_area(BvhNode node) {
+  return aabb_surface_area(aabb_new(node.min, node.max));
+}
+
+/// Reorders the post order bvh in `nodes` depth first: the root becomes node 0
+/// and the left child of every internal node is the node right after it, so a
+/// ray that keeps descending reads consecutive nodes and mostly stays in the
+/// cache lines it already touched. The child with the bigger surface area is
+/// made the left child since it is the more likely one to be hit.
+void layout_depth_first(BvhNode *nodes, u32 node_count) {
+  BvhNode *ordered = malloc(sizeof(BvhNode) * node_count);
+  // (old node index, slot in `ordered` of the parent's `r`) pairs, the left
+  // child is always popped right after its parent so only `r` needs patching
+  u32 *stack = malloc(sizeof(u32) * 2 * node_count);
+  u32 stack_size = 0;
+  u32 ordered_count = 0;
+
+  stack[stack_size++] = node_count - 1;
+  stack[stack_size++] = UINT32_MAX;
+  while (stack_size > 0) {
+    u32 parent_slot = stack[--stack_size];
+    u32 node_idx = stack[--stack_size];
+
+    u32 ordered_idx = ordered_count++;
+    if (parent_slot != UINT32_MAX) {
+      ordered[parent_slot].r = ordered_idx;
+    }
+
+    BvhNode node = nodes[node_idx];
+    ordered[ordered_idx] = node;
+    if (bvh_node_is_leaf(node)) {
+      continue;
+    }
+
+    u32 l = node.l;
+    u32 r = node.r;
+    if (node_surface_area(nodes[r]) > node_surface_area(nodes[l])) {
+      l = node.r;
+      r = node.l;
+    }
+    ordered[ordered_idx].l = ordered_idx + 1;
+
+    // pushed first so it is popped after the whole left subtree
+    stack[stack_size++] = r;
+    stack[stack_size++] = ordered_idx;
+    stack[stack_size++] = l;
+    stack[stack_size++] = UINT32_MAX;
+  }
+
+  memcpy(nodes, ordered, sizeof(BvhNode) * node_count);
+  free(stack);
+  free(ordered);
+}
+
+BvhNode *bvh_build_over_bounds(const Aabb *bounds, u32 count,
+                               u32 *node_count) {
+  if (count == 0) {
+    // a leaf over no boxes, the traversals check for it explicitly since rays
+    // still enter its infinite empty bounds
+    Aabb empty = aabb_empty();
+    BvhNode *nodes = malloc(sizeof(BvhNode));
+    nodes[0] = (BvhNode){
+        .min = empty.min,
+        .l = 0,
+        .max = empty.max,
+        .r = BVH_LEAF_BIT,
+    };
+    *node_count = 1;
+    return nodes;
+  }
+
+  TriangleInfos infos = triangle_infos_new(count);
+  for (u32 i = 0; i < count; ++i) {
+    triangle_infos_set(&infos, i, bounds[i], i);
+  }
+
+  BvhBuildContext ctx = {
+      .triangle_infos = infos,
+      .nodes = malloc(sizeof(BvhNode) * (count * 2 - 1)),
+      .pool = NULL,
+      .max_leaf_triangles = 1,
+  };
+  u32 root = recursive_split(&ctx, 0, count, 0);
+
+  *node_count = 0;
+  compact_nodes(ctx.nodes, root, node_count);
+  for (u32 i = 0; i < *node_count; ++i) {
+    if (bvh_node_is_leaf(ctx.nodes[i])) {
+      ctx.nodes[i].l = infos.index[ctx.nodes[i].l];
+    }
+  }
+  layout_depth_first(ctx.nodes, *node_count);
+
+  triangle_infos_destroy(&infos);
+
+  return realloc(ctx.nodes, sizeof(BvhNode) * *node_count);
+}
+
+typedef struct {
+  const Vertex *vertices;
+  const u32 *indices;
+  TriangleInfos *triangle_infos;
+  u32 start;
+  u32 end;
+} TriangleInfoJob;
+
+void init_triangle_infos_job(void *data) {
+  TriangleInfoJob *job = data;
+
+  for (u32 i = job->start; i < job->end; ++i) {
+    Vertex v0 = job->vertices[job->indices[(i * 3) + 0]];
+    Vertex v1 = job->vertices[job->indices[(i * 3) + 1]];
+    Vertex v2 = job->vertices[job->indices[(i * 3) + 2]];
+
+    Aabb bounds = aabb_new(
+        vec3Subtract(vec3Min(v0.position, vec3Min(v1.position, v2.position)),
+                     vec3New(1e-5, 1e-5, 1e-5)),
+        vec3Add(vec3Max(v0.position, vec3Max(v1.position, v2.position)),
+                vec3New(1e-5, 1e-5, 1e-5)));
+
+    triangle_infos_set(job->triangle_infos, i, bounds, i);
+  }
 }
 
 TriangleMesh trimesh_new(Vertex *vertices, usize vertex_count, u32 *indices,
-                         u32 index_count) {
+                         u32 index_count, BvhBuildSettings settings) {
+  u64 build_start = SDL_GetPerformanceCounter();
+
   usize triangle_count = index_count / 3;
   u32 bvh_node_count = (triangle_count * 2 - 1);
 
   TriangleMesh self = {
       .index_count = index_count,
       .indices = indices,
+      .triangles = NULL,
       .vertex_count = vertex_count,
       .vertices = vertices,
       .bvh_node_count = bvh_node_count,
-      .bvh_nodes = malloc(sizeof(BvhNode) * bvh_node_count),
+      .bvh_nodes = NULL,
+      .wide_bvh_node_count = 0,
+      .wide_bvh_nodes = NULL,
   };
 
-  TriangleInfo *triangle_infos = malloc(sizeof(TriangleInfo) * triangle_count);
+  if (settings.builder == BVH_BUILDER_GPU_LBVH) {
+    // the node count is still known up front, the renderer builds the nodes.
+    // the index buffer isn't reordered so neither are the triangles.
+    self.triangles = malloc(sizeof(LeafTriangle) * triangle_count);
+    for (u32 i = 0; i < triangle_count; ++i) {
+      self.triangles[i].original_index = i;
+    }
+    trimesh_update_triangles(&self);
+    return self;
+  }
+
+  // the optimizer stops on wall time, so how far it gets depends on the
+  // machine and the thread count and the same key could name different trees
+  bool cached =
+      settings.cache_directory && settings.optimization_budget_ms == 0;
+  u64 cache_key = 0;
+  if (cached) {
+    cache_key =
+        bvh_cache_key(vertices, vertex_count, indices, index_count, settings);
+    if (bvh_cache_load(settings.cache_directory, cache_key, &self)) {
+      free(vertices);
+      free(indices);
+
+      f64 load_ms = (f64)(SDL_GetPerformanceCounter() - build_start) *
+                    1000.0 / (f64)SDL_GetPerformanceFrequency();
+      infoln("loaded cached bvh over %zu triangles (%u nodes) in %.2fms",
+             triangle_count, self.bvh_node_count, load_ms);
+      return self;
+    }
+  }
 
-  for (u32 i = 0; i < triangle_count; ++i) {
-    Vertex v0 = vertices[indices[(i * 3) + 0]];
-    Vertex v1 = vertices[indices[(i * 3) + 1]];
-    Vertex v2 = vertices[indices[(i * 3) + 2]];
+  self.bvh_nodes = malloc(sizeof(BvhNode) * bvh_node_count);
 
-    Aabb bounds = aabb_new(
-        vec3Subtract(vec3Min(v0.position, vec3Min(v1.position, v2.position)),
-                     vec3New(1e-5, 1e-5, 1e-5)),
-        vec3Add(vec3Max(v0.position, vec3Max(v1.position, v2.position)),
-                vec3New(1e-5, 1e-5, 1e-5)));
+  TriangleInfos triangle_infos = triangle_infos_new(triangle_count);
 
-    triangle_infos[i] = (TriangleInfo){
-        .index = i,
-        .centroid = aabb_centroid(bounds),
-        .bounds = bounds,
+  u32 thread_count = settings.thread_count;
+  if (thread_count == 0) {
+    thread_count = threadpool_default_thread_count();
+  }
+
+  BvhBuildContext ctx = {
+      .triangle_infos = triangle_infos,
+      .nodes = self.bvh_nodes,
+      .pool = NULL,
+      .max_leaf_triangles = bvh_settings_max_leaf_triangles(settings),
+  };
+
+  ThreadPool pool;
+  if (thread_count > 1) {
+    pool = threadpool_new(thread_count);
+    ctx.pool = &pool;
+
+    const u32 triangles_per_job = PARALLEL_SPLIT_THRESHOLD * 4;
+    u32 job_count =
+        (triangle_count + triangles_per_job - 1) / triangles_per_job;
+    TriangleInfoJob *jobs = malloc(sizeof(TriangleInfoJob) * job_count);
+    for (u32 i = 0; i < job_count; ++i) {
+      jobs[i] = (TriangleInfoJob){
+          .vertices = vertices,
+          .indices = indices,
+          .triangle_infos = &triangle_infos,
+          .start = i * triangles_per_job,
+          .end = min((i + 1) * triangles_per_job, (u32)triangle_count),
+      };
+      threadpool_push(&pool, init_triangle_infos_job, &jobs[i]);
+    }
+    threadpool_wait(&pool);
+    free(jobs);
+  } else {
+    TriangleInfoJob job = {
+        .vertices = vertices,
+        .indices = indices,
+        .triangle_infos = &triangle_infos,
+        .start = 0,
+        .end = triangle_count,
     };
+    init_triangle_infos_job(&job);
+  }
+
+  // triangle index of every leaf entry in leaf order
+  u32 *leaf_triangles = triangle_infos.index;
+  u32 leaf_triangle_count = triangle_count;
+  Sbvh sbvh = {0};
+  if (settings.builder == BVH_BUILDER_CPU_SBVH) {
+    // the sbvh build is serial, the pool only helps computing the bounds
+    free(self.bvh_nodes);
+    sbvh = sbvh_build(vertices, indices, &triangle_infos, triangle_count,
+                      settings);
+    self.bvh_nodes = sbvh.nodes;
+    self.bvh_node_count = sbvh.node_count;
+    leaf_triangles = sbvh.references;
+    leaf_triangle_count = sbvh.reference_count;
+  } else {
+    u32 root = recursive_split(&ctx, 0, triangle_count, 0);
+    if (ctx.pool) {
+      threadpool_wait(ctx.pool);
+    }
+
+    self.bvh_node_count = 0;
+    compact_nodes(self.bvh_nodes, root, &self.bvh_node_count);
+    self.bvh_nodes =
+        realloc(self.bvh_nodes, sizeof(BvhNode) * self.bvh_node_count);
   }
 
-  u32 node_idx = 0;
-  recursive_split(triangle_count, triangle_infos, bvh_node_count, &node_idx,
-                  self.bvh_nodes, 0, triangle_count);
+  if (settings.optimization_budget_ms > 0) {
+    bvh_optimize(self.bvh_nodes, self.bvh_node_count, ctx.pool,
+                 settings.optimization_budget_ms);
+  }
 
-  free(triangle_infos);
+  if (ctx.pool) {
+    threadpool_destroy(ctx.pool);
+  }
+
+  layout_depth_first(self.bvh_nodes, self.bvh_node_count);
+
+  u32 *ordered_indices = malloc(sizeof(u32) * leaf_triangle_count * 3);
+  self.triangles = malloc(sizeof(LeafTriangle) * leaf_triangle_count);
+  for (u32 i = 0; i < leaf_triangle_count; ++i) {
+    u32 triangle = leaf_triangles[i];
+    for (u32 k = 0; k < 3; ++k) {
+      ordered_indices[i * 3 + k] = indices[triangle * 3 + k];
+    }
+    self.triangles[i].original_index = triangle;
+  }
+  free(indices);
+  self.indices = ordered_indices;
+  self.index_count = leaf_triangle_count * 3;
+  free(sbvh.references);
+  trimesh_update_triangles(&self);
+
+  triangle_infos_destroy(&triangle_infos);
+
+  if (settings.wide) {
+    self.wide_bvh_nodes = wide_bvh_collapse(
+        self.bvh_nodes, self.bvh_node_count, &self.wide_bvh_node_count);
+  }
+
+  f64 build_ms = (f64)(SDL_GetPerformanceCounter() - build_start) * 1000.0 /
+                 (f64)SDL_GetPerformanceFrequency();
+  infoln("built bvh over %zu triangles (%u references, %u nodes, %u wide "
+         "nodes) in %.2fms using %u threads",
+         triangle_count, leaf_triangle_count, self.bvh_node_count,
+         self.wide_bvh_node_count, build_ms, thread_count);
+
+  if (cached) {
+    bvh_cache_store(settings.cache_directory, cache_key, &self);
+  }
 
   return self;
 }
 
+/// Copy of `count` elements of `size` bytes, NULL stays NULL.
+static void *duplicate_array(const void *data, usize count, usize size) {
+  if (!data) {
+    return NULL;
+  }
+
+  void *copy = malloc(count * size);
+  memcpy(copy, data, count * size);
+  return copy;
+}
+
+void trimesh_make_owned(TriangleMesh *self) {
+  if (!self->mapping) {
+    return;
+  }
+
+  self->vertices =
+      duplicate_array(self->vertices, self->vertex_count, sizeof(Vertex));
+  self->indices =
+      duplicate_array(self->indices, self->index_count, sizeof(u32));
+  self->triangles = duplicate_array(self->triangles, self->index_count / 3,
+                                    sizeof(LeafTriangle));
+  self->bvh_nodes =
+      duplicate_array(self->bvh_nodes, self->bvh_node_count, sizeof(BvhNode));
+  self->wide_bvh_nodes = duplicate_array(
+      self->wide_bvh_nodes, self->wide_bvh_node_count, sizeof(WideBvhNode));
+  bvh_cache_unmap(self);
+}
+
 void trimesh_destroy(TriangleMesh self) {
+  if (self.mapping) {
+    bvh_cache_unmap(&self);
+    return;
+  }
+
   free(self.bvh_nodes);
+  free(self.wide_bvh_nodes);
   free(self.vertices);
   free(self.indices);
-}
\ No newline at end of file
+  free(self.triangles);
+}
+
+void trimesh_update_triangles(TriangleMesh *self) {
+  for (u32 i = 0; i < self->index_count / 3; ++i) {
+    Vertex v0 = self->vertices[self->indices[i * 3 + 0]];
+    Vertex v1 = self->vertices[self->indices[i * 3 + 1]];
+    Vertex v2 = self->vertices[self->indices[i * 3 + 2]];
+
+    LeafTriangle *triangle = &self->triangles[i];
+    triangle->v0 = v0.position;
+    triangle->e1 = vec3Subtract(v1.position, v0.position);
+    triangle->e2 = vec3Subtract(v2.position, v0.position);
+    triangle->object_index = v0.object_index;
+    triangle->_pad0 = 0;
+  }
+}
+
+void bvh_parents(const BvhNode *nodes, u32 node_count, u32 *parents) {
+  for (u32 i = 0; i < node_count; ++i) {
+    if (!bvh_node_is_leaf(nodes[i])) {
+      parents[nodes[i].l] = i;
+      parents[nodes[i].r] = i;
+    }
+  }
+}
@@ -13,9 +13,9 @@ typedef struct {
 
 /// This is a weird encoding for sending to the gpu, this becomes a tightly
 /// packed 256 bit bvh node. `min` and `max` are aabb points, `l` and `r` are
-/// indicies into the child nodes, unless `l` and `r` are equal, then the node
-/// is a leaf and `l` and `r` is an index into the index buffer that corresponds
-/// to the triangle bounded by this aabb.
+/// indicies into the child nodes, unless `r` has `BVH_LEAF_BIT` set, then the
+/// node is a leaf over the `r & ~BVH_LEAF_BIT` consecutive triangles in the
+/// index buffer starting at triangle `l`.
 typedef struct {
   vec3 min;
   u32 l;
@@ -23,15 +23,145 @@ typedef struct {
   u32 r;
 } BvhNode;
 
+static const u32 BVH_LEAF_BIT = 0x80000000;
+
+static inline bool bvh_node_is_leaf(BvhNode node) {
+  return node.r & BVH_LEAF_BIT;
+}
+
+static inline u32 bvh_node_triangle_count(BvhNode node) {
+  return node.r & ~BVH_LEAF_BIT;
+}
+
+/// A triangle as the traversal intersects it, a leaf fetches these one after
+/// the other instead of going through the index and vertex buffers for every
+/// vertex. Triangle `i` of a mesh is the one at `indices[i * 3]`, so the
+/// triangles are in leaf order like the index buffer.
+typedef struct {
+  vec3 v0;
+  /// index of the triangle in the index buffer the mesh was built from, before
+  /// the builders reordered it
+  u32 original_index;
+  /// `v1 - v0`
+  vec3 e1;
+  u32 object_index;
+  /// `v2 - v0`
+  vec3 e2;
+  u32 _pad0;
+} LeafTriangle;
+
+static const u32 WIDE_BVH_WIDTH = 4;
+/// `WideBvhNode.triangle_count` is a byte
+static const u32 WIDE_BVH_MAX_LEAF_TRIANGLES = 255;
+
+/// A 4 wide bvh node, which is exactly one 64 byte cache line. Child bounds are
+/// quantized to 8 bits per axis relative to the node: child `i` spans
+/// `origin + lo[k][i] * 2^(exponent[k] - 127)` to
+/// `origin + hi[k][i] * 2^(exponent[k] - 127)` along axis `k`, rounded outwards
+/// so the decoded bounds are conservative. Only the first `child_count`
+/// children are valid, a child with a non zero `triangle_count` is a leaf over
+/// that many triangles starting at triangle `children[i]`, otherwise
+/// `children[i]` is the index of a wide node.
+typedef struct {
+  vec3 origin;
+  u8 exponent[3];
+  u8 child_count;
+  u8 lo[3][WIDE_BVH_WIDTH];
+  u8 triangle_count[WIDE_BVH_WIDTH];
+  u8 hi[3][WIDE_BVH_WIDTH];
+  u8 _pad0[WIDE_BVH_WIDTH];
+  u32 children[WIDE_BVH_WIDTH];
+} WideBvhNode;
+
+typedef enum : u32 {
+  /// binned sah on the cpu, see `trimesh.c`
+  BVH_BUILDER_CPU_SAH = 0,
+  /// morton code lbvh built with compute shaders straight into the bvh
+  /// buffer, see `gpu_bvh.c`. builds much faster but the tree is lower quality.
+  BVH_BUILDER_GPU_LBVH = 1,
+  /// binned sah with spatial splits on the cpu, see `sbvh.c`. builds slower
+  /// and duplicates some triangles in the index buffer, but nodes overlap much
+  /// less around big or long triangles.
+  BVH_BUILDER_CPU_SBVH = 2,
+} BvhBuilder;
+
+typedef struct {
+  BvhBuilder builder;
+  /// number of threads used to build the bvh, 0 uses one per logical core and
+  /// 1 builds on the calling thread.
+  u32 thread_count;
+  /// upper bound on the triangles in a leaf, below it the sah decides whether
+  /// to split or not. 1 gives one triangle per leaf. only used by the cpu
+  /// builder, lbvh leaves always hold a single triangle. Clamped to
+  /// `WIDE_BVH_MAX_LEAF_TRIANGLES` when `wide` is set.
+  u32 max_leaf_triangles;
+  /// extra triangle references the sbvh builder may create by splitting
+  /// triangles, as a fraction of the triangle count.
+  f32 spatial_split_budget;
+  /// time the cpu builders may spend restructuring the finished tree to lower
+  /// its sah cost (see `bvh_optimize.h`), 0 skips it.
+  u32 optimization_budget_ms;
+  /// collapse the binary bvh into `WideBvhNode`s which is what gets traced,
+  /// only used by the cpu builder.
+  bool wide;
+  /// directory cpu built meshes are cached in (see `bvh_cache.h`), NULL
+  /// disables the cache. Optimized meshes are never cached since how far the
+  /// optimizer gets in its budget depends on the machine.
+  const char *cache_directory;
+} BvhBuildSettings;
+
+/// `BvhBuildSettings.max_leaf_triangles` as the cpu builders apply it.
+static inline u32 bvh_settings_max_leaf_triangles(BvhBuildSettings settings) {
+  u32 max_leaf_triangles = max(settings.max_leaf_triangles, 1u);
+  if (settings.wide) {
+    max_leaf_triangles = min(max_leaf_triangles, WIDE_BVH_MAX_LEAF_TRIANGLES);
+  }
+
+  return max_leaf_triangles;
+}
+
 typedef struct {
   u32 vertex_count;
   Vertex *vertices;
   u32 index_count;
+  /// reordered by the cpu builders so every leaf covers a contiguous range of
+  /// triangles, the sbvh builder also duplicates triangles that it split.
   u32 *indices;
+  /// `index_count / 3` of them, see `LeafTriangle`
+  LeafTriangle *triangles;
   u32 bvh_node_count;
+  /// NULL if the bvh is built on the gpu. Laid out depth first, the root is
+  /// node 0 and the left child of an internal node is the node after it.
   BvhNode *bvh_nodes;
+  u32 wide_bvh_node_count;
+  /// NULL unless `BvhBuildSettings.wide` is set, laid out depth first like
+  /// `bvh_nodes`
+  WideBvhNode *wide_bvh_nodes;
+  /// non NULL if the arrays above point into a memory mapped bvh cache file
+  /// instead of being owned by the mesh
+  void *mapping;
+  usize mapping_size;
 } TriangleMesh;
 
 TriangleMesh trimesh_new(Vertex *vertices, usize vertex_count, u32 *indices,
-                         u32 index_count);
-void trimesh_destroy(TriangleMesh self);
\ No newline at end of file
+                         u32 index_count, BvhBuildSettings settings);
+void trimesh_destroy(TriangleMesh self);
+/// Recomputes the vertex data of `self->triangles` from the vertices, eg. after
+/// they moved.
+void trimesh_update_triangles(TriangleMesh *self);
+/// Copies the arrays out of the bvh cache file if they are memory mapped, so
+/// the mesh can be modified (eg. refit).
+void trimesh_make_owned(TriangleMesh *self);
+
+/// Builds a binary sah bvh with a single box per leaf over arbitrary boxes, the
+/// `l` of a leaf is the index of its box in `bounds`. Laid out depth first like
+/// `TriangleMesh.bvh_nodes`. Used for the top level of the scene, see
+/// `scene_build_geometry`. Without any boxes it is a single leaf over none with
+/// `aabb_empty` bounds, rays still enter those so the traversals have to check
+/// for the empty leaf themselves.
+BvhNode *bvh_build_over_bounds(const Aabb *bounds, u32 count, u32 *node_count);
+
+/// Writes the index of the parent of every node of a binary bvh to `parents`,
+/// which holds `node_count` entries. The root has no parent and its entry is
+/// left as is, the traversals stop once they climb back to the root.
+void bvh_parents(const BvhNode *nodes, u32 node_count, u32 *parents);
\ No newline at end of file
@@ -0,0 +1,547 @@
+#include <stdlib.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "log.h"
+#include "maths.h"
+#include "renderer.h"
+#include "types.h"
+
+#include "wavefront.h"
+
+#include "shaders/embed/fullscreen_quad_vert_spv.h"
+#include "shaders/embed/wavefront_extend_comp_spv.h"
+#include "shaders/embed/wavefront_extend_persistent_comp_spv.h"
+#include "shaders/embed/wavefront_film_comp_spv.h"
+#include "shaders/embed/wavefront_generate_comp_spv.h"
+#include "shaders/embed/wavefront_resolve_frag_spv.h"
+#include "shaders/embed/wavefront_shade_comp_spv.h"
+#include "shaders/embed/wavefront_shadow_comp_spv.h"
+
+static const u32 WAVEFRONT_BINDING_COUNT = 5;
+// must match `local_size_x` of the kernels
+static const u32 WAVEFRONT_GROUP_SIZE = 64;
+// the paths of a frame are traced in chunks of at most this many pixels,
+// which bounds the size of the path state to a few tens of MiB
+static const u32 WAVEFRONT_CHUNK_PIXELS = 1 << 18;
+// offsets into the counter buffer, must match `common/wavefront.glsl`
+static const u32 WAVEFRONT_SHADOW_QUEUE = 2;
+static const u32 WAVEFRONT_QUEUE_COUNT = 3;
+static const u32 WAVEFRONT_EXTEND_CURSOR = 3;
+static const u32 WAVEFRONT_COUNTER_COUNT = 4;
+// enough workgroups of the persistent kernel to fill the largest gpus, they
+// take paths off the queue until it is empty
+static const u32 WAVEFRONT_PERSISTENT_GROUPS = 1024;
+
+/// Whether the device can run `wavefront_extend_persistent.comp`.
+bool wavefront_supports_persistent_threads(Renderer *renderer) {
+  VkPhysicalDeviceSubgroupProperties subgroup_props = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+  };
+  VkPhysicalDeviceProperties2 device_props = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &subgroup_props,
+  };
+  vkGetPhysicalDeviceProperties2(renderer->physical_device_info.device,
+                                 &device_props);
+
+  VkSubgroupFeatureFlags required_operations =
+      VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_VOTE_BIT |
+      VK_SUBGROUP_FEATURE_BALLOT_BIT | VK_SUBGROUP_FEATURE_SHUFFLE_BIT;
+  return (subgroup_props.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+         (subgroup_props.supportedOperations & required_operations) ==
+             required_operations;
+}
+
+/// `stack_length` specializes `TO_VISIT_LEN`, 0 for kernels that don't trace.
+VkPipeline create_wavefront_pipeline(Renderer *renderer, Wavefront *self,
+                                     const unsigned char *spv, usize spv_len,
+                                     u32 stack_length) {
+  VkShaderModule shader = create_shader_module(renderer->device, spv, spv_len);
+
+  VkSpecializationMapEntry specialization_entry = {
+      .constantID = 0,
+      .offset = 0,
+      .size = sizeof(u32),
+  };
+  VkSpecializationInfo specialization_info = {
+      .mapEntryCount = 1,
+      .pMapEntries = &specialization_entry,
+      .dataSize = sizeof(u32),
+      .pData = &stack_length,
+  };
+
+  VkComputePipelineCreateInfo pipeline_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage =
+          (VkPipelineShaderStageCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+              .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+              .module = shader,
+              .pName = "main",
+              .pSpecializationInfo =
+                  stack_length != 0 ? &specialization_info : NULL,
+          },
+      .layout = self->pipeline_layout,
+  };
+
+  VkPipeline pipeline;
+  ASSURE_VK(vkCreateComputePipelines(renderer->device, VK_NULL_HANDLE, 1,
+                                     &pipeline_create_info, NULL, &pipeline));
+
+  vkDestroyShaderModule(renderer->device, shader, NULL);
+
+  return pipeline;
+}
+
+/// A fullscreen triangle in subpass 1 of the trace render pass, set up like
+/// the trace pipeline.
+VkPipeline create_wavefront_resolve_pipeline(Renderer *renderer,
+                                             Wavefront *self) {
+  VkShaderModule vert_shader =
+      create_shader_module(renderer->device, fullscreen_quad_vert_spv_data,
+                           fullscreen_quad_vert_spv_size);
+  VkShaderModule frag_shader =
+      create_shader_module(renderer->device, wavefront_resolve_frag_spv_data,
+                           wavefront_resolve_frag_spv_size);
+
+  VkPipelineShaderStageCreateInfo shader_stage_create_infos[] = {
+      (VkPipelineShaderStageCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .stage = VK_SHADER_STAGE_VERTEX_BIT,
+          .module = vert_shader,
+          .pName = "main",
+      },
+      (VkPipelineShaderStageCreateInfo){
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = frag_shader,
+          .pName = "main",
+      },
+  };
+
+  const u32 dynamic_state_count = 2;
+  const VkDynamicState dynamic_states[dynamic_state_count] = {
+      VK_DYNAMIC_STATE_VIEWPORT,
+      VK_DYNAMIC_STATE_SCISSOR,
+  };
+
+  VkGraphicsPipelineCreateInfo pipeline_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .stageCount = 2,
+      .pStages = shader_stage_create_infos,
+      .layout = self->pipeline_layout,
+      .renderPass = renderer->trace_render_pass,
+      .subpass = 1,
+      .pVertexInputState =
+          &(VkPipelineVertexInputStateCreateInfo){
+              .sType =
+                  VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+          },
+      .pInputAssemblyState =
+          &(VkPipelineInputAssemblyStateCreateInfo){
+              .sType =
+                  VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+              .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+              .primitiveRestartEnable = VK_FALSE,
+          },
+      .pViewportState =
+          &(VkPipelineViewportStateCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+              .viewportCount = 1,
+              .scissorCount = 1,
+          },
+      .pRasterizationState =
+          &(VkPipelineRasterizationStateCreateInfo){
+              .sType =
+                  VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+              .polygonMode = VK_POLYGON_MODE_FILL,
+              .cullMode = VK_CULL_MODE_FRONT_BIT,
+              .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+              .lineWidth = 1.0,
+          },
+      .pMultisampleState =
+          &(VkPipelineMultisampleStateCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+              .sampleShadingEnable = VK_FALSE,
+              .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+          },
+      .pColorBlendState =
+          &(VkPipelineColorBlendStateCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+              .logicOpEnable = VK_FALSE,
+              .attachmentCount = 1,
+              .pAttachments =
+                  &(VkPipelineColorBlendAttachmentState){
+                      .colorWriteMask =
+                          VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                          VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+                      .blendEnable = VK_FALSE,
+                  },
+          },
+      .pDynamicState =
+          &(VkPipelineDynamicStateCreateInfo){
+              .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+              .dynamicStateCount = dynamic_state_count,
+              .pDynamicStates = dynamic_states,
+          },
+  };
+
+  VkPipeline pipeline;
+  ASSURE_VK(vkCreateGraphicsPipelines(renderer->device, VK_NULL_HANDLE, 1,
+                                      &pipeline_create_info, NULL, &pipeline));
+
+  vkDestroyShaderModule(renderer->device, frag_shader, NULL);
+  vkDestroyShaderModule(renderer->device, vert_shader, NULL);
+
+  return pipeline;
+}
+
+Wavefront *wavefront_new(Renderer *renderer) {
+  Wavefront *self = calloc(1, sizeof(Wavefront));
+
+  VkDescriptorSetLayoutBinding bindings[WAVEFRONT_BINDING_COUNT];
+  for (u32 i = 0; i < WAVEFRONT_BINDING_COUNT; ++i) {
+    bindings[i] = (VkDescriptorSetLayoutBinding){
+        .binding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags =
+            VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+    };
+  }
+  VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = WAVEFRONT_BINDING_COUNT,
+      .pBindings = bindings,
+  };
+  ASSURE_VK(vkCreateDescriptorSetLayout(renderer->device,
+                                        &descriptor_set_layout_create_info,
+                                        NULL, &self->descriptor_set_layout));
+
+  VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = 1,
+      .poolSizeCount = 1,
+      .pPoolSizes =
+          &(VkDescriptorPoolSize){
+              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+              WAVEFRONT_BINDING_COUNT,
+          },
+  };
+  ASSURE_VK(vkCreateDescriptorPool(renderer->device,
+                                   &descriptor_pool_create_info, NULL,
+                                   &self->descriptor_pool));
+
+  VkDescriptorSetAllocateInfo descriptor_set_alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = self->descriptor_pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = &self->descriptor_set_layout,
+  };
+  ASSURE_VK(vkAllocateDescriptorSets(
+      renderer->device, &descriptor_set_alloc_info, &self->descriptor_set));
+
+  VkDescriptorSetLayout set_layouts[] = {
+      renderer->trace_descriptor_set_layout,
+      self->descriptor_set_layout,
+  };
+  VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 2,
+      .pSetLayouts = set_layouts,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges =
+          &(VkPushConstantRange){
+              .stageFlags =
+                  VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+              .offset = 0,
+              .size = sizeof(PathTracePushConstants),
+          },
+  };
+  ASSURE_VK(vkCreatePipelineLayout(renderer->device,
+                                   &pipeline_layout_create_info, NULL,
+                                   &self->pipeline_layout));
+
+  self->generate_pipeline = create_wavefront_pipeline(
+      renderer, self, wavefront_generate_comp_spv_data,
+      wavefront_generate_comp_spv_size, 0);
+  self->shade_pipeline =
+      create_wavefront_pipeline(renderer, self, wavefront_shade_comp_spv_data,
+                                wavefront_shade_comp_spv_size, 0);
+  self->film_pipeline =
+      create_wavefront_pipeline(renderer, self, wavefront_film_comp_spv_data,
+                                wavefront_film_comp_spv_size, 0);
+  for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; ++i) {
+    self->extend_pipelines[i] = create_wavefront_pipeline(
+        renderer, self, wavefront_extend_comp_spv_data,
+        wavefront_extend_comp_spv_size, BVH_TRAVERSAL_STACK_LENGTHS[i]);
+    self->shadow_pipelines[i] = create_wavefront_pipeline(
+        renderer, self, wavefront_shadow_comp_spv_data,
+        wavefront_shadow_comp_spv_size, BVH_TRAVERSAL_STACK_LENGTHS[i]);
+  }
+  self->persistent_threads = wavefront_supports_persistent_threads(renderer);
+  if (self->persistent_threads) {
+    for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; ++i) {
+      self->extend_persistent_pipelines[i] = create_wavefront_pipeline(
+          renderer, self, wavefront_extend_persistent_comp_spv_data,
+          wavefront_extend_persistent_comp_spv_size,
+          BVH_TRAVERSAL_STACK_LENGTHS[i]);
+    }
+  } else {
+    warnln("no subgroup ballot and shuffle in compute shaders, persistent "
+           "threads fall back to the wavefront kernels");
+  }
+  self->resolve_pipeline = create_wavefront_resolve_pipeline(renderer, self);
+
+  return self;
+}
+
+void wavefront_destroy_buffers(Renderer *renderer, Wavefront *self) {
+  destroy_buffer(renderer, &self->path_buffer);
+  destroy_buffer(renderer, &self->queue_buffer);
+  destroy_buffer(renderer, &self->counter_buffer);
+  destroy_buffer(renderer, &self->shadow_ray_buffer);
+  destroy_buffer(renderer, &self->film_buffer);
+}
+
+void wavefront_destroy(Renderer *renderer, Wavefront *self) {
+  if (!self) {
+    return;
+  }
+
+  wavefront_destroy_buffers(renderer, self);
+
+  vkDestroyPipeline(renderer->device, self->generate_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->shade_pipeline, NULL);
+  vkDestroyPipeline(renderer->device, self->film_pipeline, NULL);
+  for (u32 i = 0; i < BVH_TRAVERSAL_COUNT; ++i) {
+    vkDestroyPipeline(renderer->device, self->extend_pipelines[i], NULL);
+    vkDestroyPipeline(renderer->device, self->shadow_pipelines[i], NULL);
+    if (self->persistent_threads) {
+      vkDestroyPipeline(renderer->device,
+                        self->extend_persistent_pipelines[i], NULL);
+    }
+  }
+  vkDestroyPipeline(renderer->device, self->resolve_pipeline, NULL);
+  vkDestroyPipelineLayout(renderer->device, self->pipeline_layout, NULL);
+  vkDestroyDescriptorPool(renderer->device, self->descriptor_pool, NULL);
+  vkDestroyDescriptorSetLayout(renderer->device, self->descriptor_set_layout,
+                               NULL);
+
+  free(self);
+}
+
+/// Sizes the buffers for a `width` by `height` frame and points the
+/// descriptor set at them.
+void wavefront_resize(Renderer *renderer, Wavefront *self, u32 width,
+                      u32 height) {
+  vkDeviceWaitIdle(renderer->device);
+  wavefront_destroy_buffers(renderer, self);
+
+  self->width = width;
+  self->height = height;
+  self->path_count = max(min(width * height, WAVEFRONT_CHUNK_PIXELS), 1u);
+
+  self->path_buffer = create_device_buffer(
+      renderer, self->path_count * sizeof(WavefrontPath),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  self->queue_buffer = create_device_buffer(
+      renderer, WAVEFRONT_QUEUE_COUNT * self->path_count * sizeof(u32),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  self->counter_buffer = create_device_buffer(
+      renderer, WAVEFRONT_COUNTER_COUNT * sizeof(u32),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+  self->shadow_ray_buffer = create_device_buffer(
+      renderer,
+      self->path_count * WAVEFRONT_LIGHT_SAMPLES * sizeof(WavefrontShadowRay),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  self->film_buffer = create_device_buffer(
+      renderer, max(width * height, 1u) * sizeof(vec4),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+  VkBuffer buffers[WAVEFRONT_BINDING_COUNT] = {
+      self->path_buffer.handle,       self->queue_buffer.handle,
+      self->counter_buffer.handle,    self->shadow_ray_buffer.handle,
+      self->film_buffer.handle,
+  };
+  VkDescriptorBufferInfo buffer_infos[WAVEFRONT_BINDING_COUNT];
+  VkWriteDescriptorSet writes[WAVEFRONT_BINDING_COUNT];
+  for (u32 i = 0; i < WAVEFRONT_BINDING_COUNT; ++i) {
+    buffer_infos[i] = (VkDescriptorBufferInfo){
+        .buffer = buffers[i],
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+    writes[i] = (VkWriteDescriptorSet){
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = self->descriptor_set,
+        .dstBinding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .pBufferInfo = &buffer_infos[i],
+    };
+  }
+  vkUpdateDescriptorSets(renderer->device, WAVEFRONT_BINDING_COUNT, writes, 0,
+                         NULL);
+
+  usize path_size = sizeof(WavefrontPath) +
+                    WAVEFRONT_QUEUE_COUNT * sizeof(u32) +
+                    WAVEFRONT_LIGHT_SAMPLES * sizeof(WavefrontShadowRay);
+  usize size = self->path_count * path_size + width * height * sizeof(vec4);
+  infoln("wavefront buffers for %ux%u in chunks of %u paths (%.2f MiB)", width,
+         height, self->path_count, (f64)size / (1024.0 * 1024.0));
+}
+
+/// Makes the writes of every kernel and counter reset visible to the next.
+void wavefront_barrier(VkCommandBuffer cmdbuffer) {
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask =
+          VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                       VK_ACCESS_TRANSFER_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(
+      cmdbuffer,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+      1, &barrier, 0, NULL, 0, NULL);
+}
+
+/// One invocation per path of the chunk, the kernels that work off a queue
+/// return early past its length.
+void wavefront_dispatch(VkCommandBuffer cmdbuffer, Wavefront *self,
+                        VkPipeline pipeline) {
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  vkCmdDispatch(cmdbuffer,
+                (self->path_count + WAVEFRONT_GROUP_SIZE - 1) /
+                    WAVEFRONT_GROUP_SIZE,
+                1, 1);
+  wavefront_barrier(cmdbuffer);
+}
+
+/// A fixed number of workgroups that loop over the queue, but never more than
+/// there are paths.
+void wavefront_dispatch_persistent(VkCommandBuffer cmdbuffer, Wavefront *self,
+                                   VkPipeline pipeline) {
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  vkCmdDispatch(cmdbuffer,
+                min((self->path_count + WAVEFRONT_GROUP_SIZE - 1) /
+                        WAVEFRONT_GROUP_SIZE,
+                    WAVEFRONT_PERSISTENT_GROUPS),
+                1, 1);
+  wavefront_barrier(cmdbuffer);
+}
+
+void wavefront_push_constants(VkCommandBuffer cmdbuffer, Wavefront *self,
+                              const PathTracePushConstants *push_constants) {
+  vkCmdPushConstants(cmdbuffer, self->pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+                     0, sizeof(PathTracePushConstants), push_constants);
+}
+
+void wavefront_record(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                      Wavefront *self, PathTracePushConstants push_constants) {
+  VkExtent2D extent = renderer->physical_device_info.swapchain_extent;
+  if (self->width != extent.width || self->height != extent.height) {
+    wavefront_resize(renderer, self, extent.width, extent.height);
+  }
+  u32 pixel_count = extent.width * extent.height;
+  bool persistent_threads =
+      renderer->trace_mode == TRACE_MODE_PERSISTENT && self->persistent_threads;
+
+  // the previous frame may still be resolving the film
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       0, 0, NULL, 0, NULL, 0, NULL);
+
+  VkDescriptorSet descriptor_sets[] = {
+      renderer->trace_descriptor_set,
+      self->descriptor_set,
+  };
+  vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                          self->pipeline_layout, 0, 2, descriptor_sets, 0,
+                          NULL);
+
+  push_constants.width = extent.width;
+  push_constants.height = extent.height;
+  for (u32 sample = 0; sample < WAVEFRONT_RAY_SAMPLES; ++sample) {
+    for (u32 first_pixel = 0; first_pixel < pixel_count;
+         first_pixel += self->path_count) {
+      push_constants.sample_idx = sample;
+      push_constants.first_pixel = first_pixel;
+      push_constants.bounce = 0;
+      wavefront_push_constants(cmdbuffer, self, &push_constants);
+
+      // every path of the chunk starts in the first extension queue
+      u32 counts[WAVEFRONT_COUNTER_COUNT] = {
+          min(self->path_count, pixel_count - first_pixel), 0, 0, 0};
+      vkCmdUpdateBuffer(cmdbuffer, self->counter_buffer.handle, 0,
+                        sizeof(counts), counts);
+      wavefront_dispatch(cmdbuffer, self, self->generate_pipeline);
+
+      for (u32 bounce = 0; bounce < WAVEFRONT_MAX_BOUNCES; ++bounce) {
+        push_constants.bounce = bounce;
+        wavefront_push_constants(cmdbuffer, self, &push_constants);
+
+        // empty the queues this bounce fills
+        u32 next_queue = (bounce + 1) % 2;
+        vkCmdFillBuffer(cmdbuffer, self->counter_buffer.handle,
+                        next_queue * sizeof(u32), sizeof(u32), 0);
+        vkCmdFillBuffer(cmdbuffer, self->counter_buffer.handle,
+                        WAVEFRONT_SHADOW_QUEUE * sizeof(u32), sizeof(u32), 0);
+
+        if (persistent_threads) {
+          vkCmdFillBuffer(cmdbuffer, self->counter_buffer.handle,
+                          WAVEFRONT_EXTEND_CURSOR * sizeof(u32), sizeof(u32),
+                          0);
+          wavefront_barrier(cmdbuffer);
+          wavefront_dispatch_persistent(
+              cmdbuffer, self,
+              self->extend_persistent_pipelines[renderer->bvh_traversal]);
+        } else {
+          wavefront_dispatch(
+              cmdbuffer, self,
+              self->extend_pipelines[renderer->bvh_traversal]);
+        }
+        wavefront_dispatch(cmdbuffer, self, self->shade_pipeline);
+        wavefront_dispatch(
+            cmdbuffer, self,
+            self->shadow_pipelines[renderer->bvh_traversal]);
+      }
+
+      wavefront_dispatch(cmdbuffer, self, self->film_pipeline);
+    }
+  }
+
+  VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(cmdbuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0,
+                       NULL, 0, NULL);
+}
+
+void wavefront_record_resolve(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                              Wavefront *self,
+                              PathTracePushConstants push_constants) {
+  VkDescriptorSet descriptor_sets[] = {
+      renderer->trace_descriptor_set,
+      self->descriptor_set,
+  };
+  vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          self->pipeline_layout, 0, 2, descriptor_sets, 0,
+                          NULL);
+  vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                    self->resolve_pipeline);
+
+  push_constants.width = self->width;
+  push_constants.height = self->height;
+  wavefront_push_constants(cmdbuffer, self, &push_constants);
+
+  vkCmdDraw(cmdbuffer, 3, 1, 0, 0);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vulkan/vulkan_core.h>
+
+#include "renderer.h"
+#include "types.h"
+
+// must match `src/shaders/common/constants.glsl`, the kernels are recorded
+// once per sample and bounce
+static const u32 WAVEFRONT_RAY_SAMPLES = 1;
+static const u32 WAVEFRONT_MAX_BOUNCES = 5;
+static const u32 WAVEFRONT_LIGHT_SAMPLES = 1;
+
+/// gpu layout of a path between kernels, must match `Path` in
+/// `common/wavefront.glsl`
+typedef struct {
+  vec4 origin_t;
+  vec4 direction_object;
+  vec4 throughput_triangle;
+  vec4 radiance;
+  u32 rng_pcg[4];
+  u32 rng_blue[4];
+} WavefrontPath;
+
+/// must match `ShadowRay` in `common/wavefront.glsl`
+typedef struct {
+  vec4 origin_dist;
+  vec4 direction;
+  vec4 contribution;
+} WavefrontShadowRay;
+
+/// A wavefront path tracer. Rather than following a path to its end in one
+/// fragment shader invocation, the paths of a chunk of pixels advance a bounce
+/// at a time through small compute kernels: generation, extension (closest
+/// hit), shading and shadow rays, connected by queues of path indices. Each
+/// kernel only runs over the paths that are still alive so its invocations
+/// stay coherent. The finished chunks are averaged into a film buffer which
+/// `wavefront_resolve.frag` writes to the trace output in place of
+/// `pathtrace.frag`, so accumulation and the present modes are unchanged.
+typedef struct Wavefront_t {
+  VkDescriptorSetLayout descriptor_set_layout;
+  VkDescriptorPool descriptor_pool;
+  VkDescriptorSet descriptor_set;
+  /// set 0 is the renderer's trace descriptor set, set 1 the buffers below
+  VkPipelineLayout pipeline_layout;
+  VkPipeline generate_pipeline;
+  /// the kernels that trace rays come in one per `BvhTraversal`
+  VkPipeline extend_pipelines[BVH_TRAVERSAL_COUNT];
+  /// whether the device has the subgroup operations the persistent threads
+  /// kernels need, see `TRACE_MODE_PERSISTENT`
+  bool persistent_threads;
+  /// only created with `persistent_threads`
+  VkPipeline extend_persistent_pipelines[BVH_TRAVERSAL_COUNT];
+  VkPipeline shade_pipeline;
+  VkPipeline shadow_pipelines[BVH_TRAVERSAL_COUNT];
+  VkPipeline film_pipeline;
+  /// subpass 1 of the trace render pass
+  VkPipeline resolve_pipeline;
+
+  /// the extent the buffers are sized for
+  u32 width;
+  u32 height;
+  /// paths per chunk, one per pixel
+  u32 path_count;
+  Buffer path_buffer;
+  /// the two extension queues and the shadow queue, `path_count` each
+  Buffer queue_buffer;
+  /// the length of each queue
+  Buffer counter_buffer;
+  Buffer shadow_ray_buffer;
+  /// a vec4 per pixel
+  Buffer film_buffer;
+} Wavefront;
+
+Wavefront *wavefront_new(Renderer *renderer);
+void wavefront_destroy(Renderer *renderer, Wavefront *self);
+
+/// Traces a frame, recorded before the trace render pass. `push_constants`
+/// are the ones of the trace pipeline, the wavefront fields are filled in.
+/// (Re)creates the buffers if the swapchain extent changed, which waits for
+/// the device to go idle.
+void wavefront_record(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                      Wavefront *self, PathTracePushConstants push_constants);
+
+/// Writes the film to the trace output, recorded in subpass 1 of the trace
+/// render pass instead of the trace pipeline.
+void wavefront_record_resolve(VkCommandBuffer cmdbuffer, Renderer *renderer,
+                              Wavefront *self,
+                              PathTracePushConstants push_constants);
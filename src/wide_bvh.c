@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "maths.h"
+#include "types.h"
+
+#include "wide_bvh.h"
+
+typedef struct {
+  const BvhNode *nodes;
+  WideBvhNode *wide_nodes;
+  u32 wide_node_count;
+} CollapseContext;
+
+static f32 node_surface_area(BvhNode node) {
+  return aabb_surface_area(aabb_new(node.min, node.max));
+}
+
+/// Smallest power of two exponent such that `min` plus 255 steps reaches
+/// `max`.
+static i32 quantization_exponent(f32 min, f32 max) {
+  f32 extent = max - min;
+  i32 e = extent > 0.0f ? (i32)ceilf(log2f(extent / 255.0f)) : -126;
+  e = clamp(e, -126, 127);
+  // log2f and the addition aren't exact, make sure the top of the node still
+  // fits once decoded
+  while (e < 127 && (ceilf(extent * ldexpf(1.0f, -e)) > 255.0f ||
+                     min + 255.0f * ldexpf(1.0f, e) < max)) {
+    ++e;
+  }
+
+  return e;
+}
+
+/// What the traversal decodes a quantized bound to.
+static inline f32 dequantize(f32 origin, u8 q, f32 scale) {
+  return origin + (f32)q * scale;
+}
+
+void wide_bvh_node_quantize(WideBvhNode *node, Aabb bounds,
+                            const Aabb *child_bounds) {
+  node->origin = bounds.min;
+
+  f32 scale[3];
+  f32 inv_scale[3];
+  for (u32 k = 0; k < 3; ++k) {
+    i32 e = quantization_exponent(bounds.min.v[k], bounds.max.v[k]);
+    node->exponent[k] = (u8)(e + 127);
+    scale[k] = ldexpf(1.0f, e);
+    inv_scale[k] = ldexpf(1.0f, -e);
+  }
+
+  for (u32 i = 0; i < node->child_count; ++i) {
+    for (u32 k = 0; k < 3; ++k) {
+      f32 origin = node->origin.v[k];
+      f32 lo = floorf((child_bounds[i].min.v[k] - origin) * inv_scale[k]);
+      f32 hi = ceilf((child_bounds[i].max.v[k] - origin) * inv_scale[k]);
+      node->lo[k][i] = (u8)clamp(lo, 0.0f, 255.0f);
+      node->hi[k][i] = (u8)clamp(hi, 0.0f, 255.0f);
+
+      // the subtraction above can round inwards, step out until the decoded
+      // bounds contain the child
+      while (node->lo[k][i] > 0 &&
+             dequantize(origin, node->lo[k][i], scale[k]) >
+                 child_bounds[i].min.v[k]) {
+        --node->lo[k][i];
+      }
+      while (node->hi[k][i] < 255 &&
+             dequantize(origin, node->hi[k][i], scale[k]) <
+                 child_bounds[i].max.v[k]) {
+        ++node->hi[k][i];
+      }
+    }
+  }
+}
+
+static u32 collapse(CollapseContext *ctx, u32 node_idx) {
+  BvhNode node = ctx->nodes[node_idx];
+  // claimed before the children so the wide nodes come out depth first
+  u32 wide_idx = ctx->wide_node_count++;
+
+  u32 children[WIDE_BVH_WIDTH];
+  u32 child_count = 0;
+  if (bvh_node_is_leaf(node)) {
+    // only happens for the root of a tree with a single leaf
+    children[child_count++] = node_idx;
+  } else {
+    children[child_count++] = node.l;
+    children[child_count++] = node.r;
+    // pull up the grandchildren of the biggest internal child until the node
+    // is full, bigger nodes are hit by more rays so they benefit the most
+    while (child_count < WIDE_BVH_WIDTH) {
+      u32 best = WIDE_BVH_WIDTH;
+      f32 best_area = -INFINITY;
+      for (u32 i = 0; i < child_count; ++i) {
+        BvhNode child = ctx->nodes[children[i]];
+        if (!bvh_node_is_leaf(child) && node_surface_area(child) > best_area) {
+          best = i;
+          best_area = node_surface_area(child);
+        }
+      }
+      if (best == WIDE_BVH_WIDTH) {
+        break;
+      }
+
+      BvhNode child = ctx->nodes[children[best]];
+      children[best] = child.l;
+      children[child_count++] = child.r;
+    }
+  }
+
+  WideBvhNode wide = {
+      .child_count = child_count,
+  };
+
+  Aabb child_bounds[WIDE_BVH_WIDTH];
+  for (u32 i = 0; i < child_count; ++i) {
+    BvhNode child = ctx->nodes[children[i]];
+    child_bounds[i] = (Aabb){.min = child.min, .max = child.max};
+  }
+  wide_bvh_node_quantize(&wide, (Aabb){.min = node.min, .max = node.max},
+                         child_bounds);
+
+  for (u32 i = 0; i < child_count; ++i) {
+    BvhNode child = ctx->nodes[children[i]];
+    if (bvh_node_is_leaf(child)) {
+      assert(bvh_node_triangle_count(child) <= WIDE_BVH_MAX_LEAF_TRIANGLES);
+      wide.triangle_count[i] = bvh_node_triangle_count(child);
+      wide.children[i] = child.l;
+    } else {
+      wide.children[i] = collapse(ctx, children[i]);
+    }
+  }
+
+  ctx->wide_nodes[wide_idx] = wide;
+  return wide_idx;
+}
+
+WideBvhNode *wide_bvh_collapse(const BvhNode *nodes, u32 node_count,
+                               u32 *wide_node_count) {
+  // every wide node but a lone leaf root absorbs at least one internal node
+  CollapseContext ctx = {
+      .nodes = nodes,
+      .wide_nodes = malloc(sizeof(WideBvhNode) * node_count),
+      .wide_node_count = 0,
+  };
+
+  collapse(&ctx, 0);
+
+  *wide_node_count = ctx.wide_node_count;
+  return realloc(ctx.wide_nodes, sizeof(WideBvhNode) * ctx.wide_node_count);
+}
+
+void wide_bvh_parents(const WideBvhNode *nodes, u32 node_count, u32 *parents) {
+  for (u32 i = 0; i < node_count; ++i) {
+    for (u32 j = 0; j < nodes[i].child_count; ++j) {
+      if (nodes[i].triangle_count[j] == 0) {
+        parents[nodes[i].children[j]] = i;
+      }
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "trimesh.h"
+#include "types.h"
+
+/// Collapses the binary depth first bvh in `nodes` into `WideBvhNode`s, also
+/// laid out depth first so the root is the first node and the first internal
+/// child of a node directly follows it. Writes the number of wide nodes to
+/// `wide_node_count`. Leaves can't hold more than `WIDE_BVH_MAX_LEAF_TRIANGLES`
+/// triangles, see `bvh_settings_max_leaf_triangles`.
+WideBvhNode *wide_bvh_collapse(const BvhNode *nodes, u32 node_count,
+                               u32 *wide_node_count);
+
+/// Sets the origin, exponents and quantized child bounds of `node` from the
+/// exact `bounds` of the node and of its first `child_count` children.
+void wide_bvh_node_quantize(WideBvhNode *node, Aabb bounds,
+                            const Aabb *child_bounds);
+
+/// Like `bvh_parents` for a wide bvh, only the parents of the internal nodes
+/// are meaningful since leaves are not nodes of their own.
+void wide_bvh_parents(const WideBvhNode *nodes, u32 node_count, u32 *parents);